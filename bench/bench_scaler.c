@@ -0,0 +1,260 @@
+﻿/* ***************************************************************************
+ * bench_scaler.c -- image scaler benchmark
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * bench_scaler.c -- 图像缩放基准测试
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "image_scaler.h"
+
+/** 基准测试参数 */
+typedef struct BenchOptionsRec_ {
+	int width;			/**< 源图像宽度 */
+	int height;			/**< 源图像高度 */
+	int size;			/**< 目标尺寸，结果不超出 size x size */
+	int rounds;			/**< 每种实现重复缩放的次数 */
+} BenchOptionsRec, *BenchOptions;
+
+static const char *bench_kernels[] = { "scalar", "sse2", "avx2" };
+
+static double GetTime( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** 生成随机内容的图像，用固定的种子，每次运行的结果相同 */
+static int CreateRandomImage( LCUI_Graph *graph, int color_type,
+			      int width, int height )
+{
+	size_t i;
+
+	Graph_Init( graph );
+	graph->color_type = color_type;
+	if( Graph_Create( graph, width, height ) != 0 ) {
+		return -1;
+	}
+	srand( 20170101 );
+	for( i = 0; i < graph->mem_size; ++i ) {
+		graph->bytes[i] = (uchar_t)(rand() & 0xff);
+	}
+	return 0;
+}
+
+/**
+ * 比较两张图像
+ * @returns 尺寸不同时返回 -1，否则返回最大的字节差值
+ */
+static int CompareImages( const LCUI_Graph *a, const LCUI_Graph *b,
+			  double *mean )
+{
+	size_t i;
+	int diff, max_diff = 0;
+	double sum = 0;
+
+	*mean = 0;
+	if( a->width != b->width || a->height != b->height ||
+	    a->bytes_per_pixel != b->bytes_per_pixel ) {
+		return -1;
+	}
+	for( i = 0; i < a->mem_size; ++i ) {
+		diff = abs( a->bytes[i] - b->bytes[i] );
+		sum += diff;
+		if( diff > max_diff ) {
+			max_diff = diff;
+		}
+	}
+	*mean = sum / a->mem_size;
+	return max_diff;
+}
+
+static void PrintResult( const char *name, BenchOptions opts,
+			 double seconds, const LCUI_Graph *result )
+{
+	double ms = seconds * 1000 / opts->rounds;
+	double mpix = 1.0 * opts->width * opts->height / 1e6;
+
+	printf( "  %-12s %9.3f ms  %8.1f MPix/s  -> %ux%u\n", name, ms,
+		mpix * opts->rounds / seconds, result->width, result->height );
+}
+
+/** 输出与普通实现的差异，结果不同时返回 -1 */
+static int PrintDiff( const char *name, const LCUI_Graph *result,
+		      const LCUI_Graph *expected )
+{
+	double mean;
+	int max_diff = CompareImages( result, expected, &mean );
+
+	if( max_diff < 0 ) {
+		printf( "  %-12s size differs from scalar\n", name );
+	} else if( max_diff == 0 ) {
+		printf( "  %-12s identical to scalar\n", name );
+		return 0;
+	} else {
+		printf( "  %-12s differs from scalar: max %d, mean %.3f\n",
+			name, max_diff, mean );
+	}
+	return -1;
+}
+
+/** 用各个实现缩放同一张图像，输出耗时并与普通实现的结果对比 */
+static int RunBench( BenchOptions opts, int color_type, const char *name )
+{
+	int i, k, ret = 0;
+	double start;
+	LCUI_Graph src, dst, expected;
+
+	if( CreateRandomImage( &src, color_type, opts->width,
+			       opts->height ) != 0 ) {
+		fprintf( stderr, "cannot create %dx%d image\n", opts->width,
+			 opts->height );
+		return -1;
+	}
+	printf( "%s %dx%d -> %dx%d box, %d rounds\n", name, opts->width,
+		opts->height, opts->size, opts->size, opts->rounds );
+	Graph_Init( &expected );
+	for( k = 0; k < (int)(sizeof( bench_kernels ) /
+			      sizeof( bench_kernels[0] )); ++k ) {
+		if( ImageScaler_SetKernel( bench_kernels[k] ) != 0 ) {
+			printf( "  %-12s not supported\n", bench_kernels[k] );
+			continue;
+		}
+		Graph_Init( &dst );
+		start = GetTime();
+		for( i = 0; i < opts->rounds; ++i ) {
+			Graph_Free( &dst );
+			if( ImageScaler_Zoom( &src, &dst, TRUE, opts->size,
+					      opts->size ) != 0 ) {
+				fprintf( stderr, "%s: zoom failed\n",
+					 bench_kernels[k] );
+				ret = -1;
+				break;
+			}
+		}
+		if( i < opts->rounds ) {
+			Graph_Free( &dst );
+			break;
+		}
+		PrintResult( bench_kernels[k], opts, GetTime() - start, &dst );
+		/* SIMD 实现的结果必须与普通实现完全相同 */
+		if( Graph_IsValid( &expected ) ) {
+			if( PrintDiff( bench_kernels[k], &dst,
+				       &expected ) != 0 ) {
+				ret = -1;
+			}
+			Graph_Free( &dst );
+		} else {
+			expected = dst;
+		}
+	}
+	ImageScaler_SetKernel( NULL );
+	Graph_Init( &dst );
+	start = GetTime();
+	for( i = 0; i < opts->rounds; ++i ) {
+		Graph_Free( &dst );
+		if( Graph_Zoom( &src, &dst, TRUE, opts->size,
+				opts->size ) != 0 ) {
+			fprintf( stderr, "Graph_Zoom failed\n" );
+			ret = -1;
+			break;
+		}
+	}
+	if( i == opts->rounds ) {
+		PrintResult( "Graph_Zoom", opts, GetTime() - start, &dst );
+		if( Graph_IsValid( &expected ) ) {
+			PrintDiff( "Graph_Zoom", &dst, &expected );
+		}
+	}
+	printf( "\n" );
+	Graph_Free( &dst );
+	Graph_Free( &expected );
+	Graph_Free( &src );
+	return ret;
+}
+
+static void PrintUsage( const char *name )
+{
+	printf( "usage: %s [options]\n\n"
+		"  -s <w>x<h>    size of the source images "
+		"(default: 4032x3024)\n"
+		"  -t <size>     fit the result into a size x size box "
+		"(default: 512)\n"
+		"  -n <rounds>   rounds per implementation (default: 10)\n"
+		"  -h            show this help\n", name );
+}
+
+int main( int argc, char **argv )
+{
+	int opt, ret = 0;
+	BenchOptionsRec opts = { 4032, 3024, 512, 10 };
+
+	while( (opt = getopt( argc, argv, "s:t:n:h" )) != -1 ) {
+		switch( opt ) {
+		case 's':
+			if( sscanf( optarg, "%dx%d", &opts.width,
+				    &opts.height ) != 2 ) {
+				PrintUsage( argv[0] );
+				return 1;
+			}
+			break;
+		case 't': opts.size = atoi( optarg ); break;
+		case 'n': opts.rounds = atoi( optarg ); break;
+		default:
+			PrintUsage( argv[0] );
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if( opts.width < 1 || opts.height < 1 || opts.size < 1 ||
+	    opts.rounds < 1 ) {
+		PrintUsage( argv[0] );
+		return 1;
+	}
+	printf( "default kernel: %s\n\n", ImageScaler_GetKernelName() );
+	if( RunBench( &opts, COLOR_TYPE_RGB, "RGB" ) != 0 ) {
+		ret = 1;
+	}
+	if( RunBench( &opts, COLOR_TYPE_ARGB, "ARGB" ) != 0 ) {
+		ret = 1;
+	}
+	return ret;
+}
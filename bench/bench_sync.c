@@ -0,0 +1,516 @@
+﻿/* ***************************************************************************
+ * bench_sync.c -- file sync benchmark
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * bench_sync.c -- 文件同步基准测试
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "finder.h"
+#include <LCUI/font/charset.h>
+
+#define BENCH_PATH_LEN	1024
+
+/** 基准测试参数 */
+typedef struct BenchOptionsRec_ {
+	const char *workdir;		/**< 工作目录，存放生成的目录树和数据文件 */
+	int depth;			/**< 目录树的深度 */
+	int fanout;			/**< 每个目录中的子目录数量 */
+	int files;			/**< 每个目录中的文件数量 */
+	int image_ratio;		/**< 图片文件所占的百分比 */
+	double churn;			/**< 每次变动的图片文件所占的百分比 */
+} BenchOptionsRec, *BenchOptions;
+
+/** 生成的目录树 */
+typedef struct BenchTreeRec_ {
+	char **images;			/**< 图片文件路径列表 */
+	size_t n_images;		/**< 图片文件数量 */
+	size_t max_images;		/**< 图片文件路径列表的容量 */
+	size_t n_files;			/**< 文件总数，包括非图片文件 */
+	size_t n_dirs;			/**< 目录总数 */
+} BenchTreeRec, *BenchTree;
+
+/** 从 /proc/self/io 中读取的 I/O 统计信息 */
+typedef struct BenchIOStatsRec_ {
+	unsigned long long rchar;
+	unsigned long long wchar;
+	unsigned long long syscr;
+	unsigned long long syscw;
+	unsigned long long read_bytes;
+	unsigned long long write_bytes;
+} BenchIOStatsRec, *BenchIOStats;
+
+/** 某一时刻的资源使用情况 */
+typedef struct BenchSampleRec_ {
+	double time;
+	struct rusage usage;
+	BenchIOStatsRec io;
+} BenchSampleRec, *BenchSample;
+
+/** 同步任务的完成状态 */
+typedef struct BenchSyncRec_ {
+	LCUI_BOOL done;
+	LCUI_Cond cond;
+	LCUI_Mutex mutex;
+} BenchSyncRec, *BenchSync;
+
+/** 1x1 像素的 PNG 图片 */
+static const unsigned char bench_png[] = {
+	0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+	0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+	0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+	0x08, 0x02, 0x00, 0x00, 0x00, 0x90, 0x77, 0x53,
+	0xde, 0x00, 0x00, 0x00, 0x0c, 0x49, 0x44, 0x41,
+	0x54, 0x78, 0xda, 0x63, 0x68, 0x68, 0x68, 0x00,
+	0x00, 0x03, 0x04, 0x01, 0x81, 0x75, 0x2e, 0x01,
+	0xbc, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e,
+	0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+/** 8x8 像素的灰度 JPEG 图片 */
+static const unsigned char bench_jpeg[] = {
+	0xff, 0xd8, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xff,
+	0xc0, 0x00, 0x0b, 0x08, 0x00, 0x08, 0x00, 0x08,
+	0x01, 0x01, 0x11, 0x00, 0xff, 0xc4, 0x00, 0x14,
+	0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xff, 0xc4, 0x00, 0x14, 0x10, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00,
+	0x3f, 0x00, 0x3f, 0xff, 0xd9
+};
+
+static const char bench_text[] = "LC-Finder sync benchmark\n";
+
+static int WriteFile( const char *path, const void *data, size_t size )
+{
+	FILE *fp = fopen( path, "wb" );
+	if( !fp ) {
+		return -errno;
+	}
+	if( fwrite( data, 1, size, fp ) != size ) {
+		fclose( fp );
+		return -EIO;
+	}
+	return fclose( fp ) == 0 ? 0 : -EIO;
+}
+
+/** 写入图片文件，根据扩展名选择 PNG 或 JPEG 格式 */
+static int WriteImageFile( const char *path )
+{
+	const char *ext = strrchr( path, '.' );
+	if( ext && strcmp( ext, ".png" ) == 0 ) {
+		return WriteFile( path, bench_png, sizeof( bench_png ) );
+	}
+	return WriteFile( path, bench_jpeg, sizeof( bench_jpeg ) );
+}
+
+static int BenchTree_AddImage( BenchTree tree, const char *path )
+{
+	char **images;
+	if( tree->n_images >= tree->max_images ) {
+		size_t n = tree->max_images > 0 ? tree->max_images * 2 : 1024;
+		images = realloc( tree->images, n * sizeof( char* ) );
+		if( !images ) {
+			return -ENOMEM;
+		}
+		tree->images = images;
+		tree->max_images = n;
+	}
+	tree->images[tree->n_images] = strdup( path );
+	if( !tree->images[tree->n_images] ) {
+		return -ENOMEM;
+	}
+	tree->n_images += 1;
+	return 0;
+}
+
+static void BenchTree_Destroy( BenchTree tree )
+{
+	size_t i;
+	for( i = 0; i < tree->n_images; ++i ) {
+		free( tree->images[i] );
+	}
+	free( tree->images );
+	memset( tree, 0, sizeof( BenchTreeRec ) );
+}
+
+/** 生成目录树，图片文件均匀地散布在非图片文件之间 */
+static int BenchTree_Generate( BenchTree tree, BenchOptions opts,
+			       const char *dirpath, int level )
+{
+	int i, ret;
+	char path[BENCH_PATH_LEN];
+
+	if( mkdir( dirpath, 0755 ) != 0 && errno != EEXIST ) {
+		return -errno;
+	}
+	tree->n_dirs += 1;
+	for( i = 0; i < opts->files; ++i ) {
+		if( (i * 37) % 100 < opts->image_ratio ) {
+			snprintf( path, BENCH_PATH_LEN, "%s/IMG_%04d.%s",
+				  dirpath, i, i % 2 ? "png" : "jpg" );
+			ret = WriteImageFile( path );
+			if( ret == 0 ) {
+				ret = BenchTree_AddImage( tree, path );
+			}
+		} else {
+			snprintf( path, BENCH_PATH_LEN, "%s/doc_%04d.txt",
+				  dirpath, i );
+			ret = WriteFile( path, bench_text,
+					 sizeof( bench_text ) - 1 );
+		}
+		if( ret != 0 ) {
+			return ret;
+		}
+		tree->n_files += 1;
+	}
+	if( level >= opts->depth ) {
+		return 0;
+	}
+	for( i = 0; i < opts->fanout; ++i ) {
+		snprintf( path, BENCH_PATH_LEN, "%s/dir_%02d", dirpath, i );
+		ret = BenchTree_Generate( tree, opts, path, level + 1 );
+		if( ret != 0 ) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * 变动部分图片文件
+ * 选中的文件依次被修改、删除、在旁边新增一个文件，三种变动的数量大致相同。
+ */
+static size_t BenchTree_Churn( BenchTree tree, double percent, int round )
+{
+	char *p, path[BENCH_PATH_LEN];
+	size_t i, n, step, count = 0;
+	struct timeval times[2];
+
+	n = (size_t)(tree->n_images * percent / 100.0);
+	if( n < 1 || tree->n_images < 1 ) {
+		return 0;
+	}
+	step = tree->n_images / n;
+	gettimeofday( &times[0], NULL );
+	/* 将修改时间往后推，以免与上次扫描处于同一秒而无法识别 */
+	times[0].tv_sec += 10 * round;
+	times[1] = times[0];
+	for( i = 0; i < n; ++i ) {
+		char *file = tree->images[i * step];
+		switch( i % 3 ) {
+		case 0:
+			if( WriteImageFile( file ) == 0 &&
+			    utimes( file, times ) == 0 ) {
+				++count;
+			}
+			break;
+		case 1:
+			if( remove( file ) == 0 ) {
+				++count;
+			}
+			break;
+		default:
+			strncpy( path, file, BENCH_PATH_LEN - 1 );
+			path[BENCH_PATH_LEN - 1] = 0;
+			p = strrchr( path, '/' );
+			if( !p ) {
+				break;
+			}
+			snprintf( p + 1, BENCH_PATH_LEN - (p + 1 - path),
+				  "NEW_%d_%06lu.png", round, (unsigned long)i );
+			if( WriteImageFile( path ) == 0 ) {
+				++count;
+			}
+			break;
+		}
+	}
+	return count;
+}
+
+static int RemoveEntry( const char *path, const struct stat *buf,
+			int flag, struct FTW *ftw )
+{
+	return remove( path );
+}
+
+static int RemoveTree( const char *path )
+{
+	struct stat buf;
+	if( stat( path, &buf ) != 0 ) {
+		return 0;
+	}
+	return nftw( path, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+static void ReadIOStats( BenchIOStats io )
+{
+	FILE *fp;
+	char name[32];
+	unsigned long long value;
+
+	memset( io, 0, sizeof( BenchIOStatsRec ) );
+	fp = fopen( "/proc/self/io", "r" );
+	if( !fp ) {
+		return;
+	}
+	while( fscanf( fp, "%31[^:]: %llu\n", name, &value ) == 2 ) {
+		if( strcmp( name, "rchar" ) == 0 ) {
+			io->rchar = value;
+		} else if( strcmp( name, "wchar" ) == 0 ) {
+			io->wchar = value;
+		} else if( strcmp( name, "syscr" ) == 0 ) {
+			io->syscr = value;
+		} else if( strcmp( name, "syscw" ) == 0 ) {
+			io->syscw = value;
+		} else if( strcmp( name, "read_bytes" ) == 0 ) {
+			io->read_bytes = value;
+		} else if( strcmp( name, "write_bytes" ) == 0 ) {
+			io->write_bytes = value;
+		}
+	}
+	fclose( fp );
+}
+
+/** 重置进程的内存使用峰值，需要 Linux 4.0 以上的内核 */
+static LCUI_BOOL ResetPeakRSS( void )
+{
+	FILE *fp = fopen( "/proc/self/clear_refs", "w" );
+	if( !fp ) {
+		return FALSE;
+	}
+	fputs( "5", fp );
+	return fclose( fp ) == 0;
+}
+
+/** 获取内存使用峰值，单位为 KB */
+static long GetPeakRSS( void )
+{
+	FILE *fp;
+	long value = -1;
+	char line[128];
+
+	fp = fopen( "/proc/self/status", "r" );
+	if( !fp ) {
+		return -1;
+	}
+	while( fgets( line, sizeof( line ), fp ) ) {
+		if( sscanf( line, "VmHWM: %ld", &value ) == 1 ) {
+			break;
+		}
+	}
+	fclose( fp );
+	return value;
+}
+
+static void BenchSample_Read( BenchSample sample )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	sample->time = ts.tv_sec + ts.tv_nsec / 1e9;
+	getrusage( RUSAGE_SELF, &sample->usage );
+	ReadIOStats( &sample->io );
+}
+
+static double GetTimeDiff( const struct timeval *a, const struct timeval *b )
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void OnSyncDone( void *data )
+{
+	BenchSync sync = data;
+	LCUIMutex_Lock( &sync->mutex );
+	sync->done = TRUE;
+	LCUICond_Signal( &sync->cond );
+	LCUIMutex_Unlock( &sync->mutex );
+}
+
+/** 执行一次同步并输出资源使用情况 */
+static void RunPhase( const char *name )
+{
+	long peak_rss;
+	double wall;
+	BenchSyncRec sync;
+	FileSyncStatusRec status;
+	BenchSampleRec start, end;
+	struct rusage *u1 = &start.usage, *u2 = &end.usage;
+	LCUI_BOOL peak_reset = ResetPeakRSS();
+
+	sync.done = FALSE;
+	LCUICond_Init( &sync.cond );
+	LCUIMutex_Init( &sync.mutex );
+	memset( &status, 0, sizeof( status ) );
+	status.data = &sync;
+	status.callback = OnSyncDone;
+	BenchSample_Read( &start );
+	LCFinder_SyncFilesAsync( &status );
+	LCUIMutex_Lock( &sync.mutex );
+	while( !sync.done ) {
+		LCUICond_Wait( &sync.cond, &sync.mutex );
+	}
+	LCUIMutex_Unlock( &sync.mutex );
+	BenchSample_Read( &end );
+	LCUICond_Destroy( &sync.cond );
+	LCUIMutex_Destroy( &sync.mutex );
+
+	wall = end.time - start.time;
+	peak_rss = peak_reset ? GetPeakRSS() : -1;
+	if( peak_rss < 0 ) {
+		peak_rss = u2->ru_maxrss;
+	}
+	printf( "[%s] files: %lu, dirs: %lu, added: %lu, changed: %lu, "
+		"deleted: %lu\n", name, (unsigned long)status.scaned_files,
+		(unsigned long)status.scaned_dirs,
+		(unsigned long)status.added_files,
+		(unsigned long)status.changed_files,
+		(unsigned long)status.deleted_files );
+	printf( "[%s] wall: %.3f s, %.0f files/s, user: %.3f s, sys: %.3f s\n",
+		name, wall, wall > 0 ? status.scaned_files / wall : 0,
+		GetTimeDiff( &u1->ru_utime, &u2->ru_utime ),
+		GetTimeDiff( &u1->ru_stime, &u2->ru_stime ) );
+	printf( "[%s] syscalls: read %llu, write %llu; "
+		"bytes: rchar %llu, wchar %llu, disk read %llu, "
+		"disk write %llu\n", name,
+		end.io.syscr - start.io.syscr, end.io.syscw - start.io.syscw,
+		end.io.rchar - start.io.rchar, end.io.wchar - start.io.wchar,
+		end.io.read_bytes - start.io.read_bytes,
+		end.io.write_bytes - start.io.write_bytes );
+	printf( "[%s] rusage: inblock %ld, oublock %ld, minflt %ld, "
+		"majflt %ld, nvcsw %ld, nivcsw %ld\n", name,
+		u2->ru_inblock - u1->ru_inblock,
+		u2->ru_oublock - u1->ru_oublock,
+		u2->ru_minflt - u1->ru_minflt,
+		u2->ru_majflt - u1->ru_majflt,
+		u2->ru_nvcsw - u1->ru_nvcsw,
+		u2->ru_nivcsw - u1->ru_nivcsw );
+	printf( "[%s] peak RSS: %ld KB%s\n\n", name, peak_rss,
+		peak_reset ? "" : " (process lifetime)" );
+}
+
+static void PrintUsage( const char *name )
+{
+	printf( "usage: %s [options]\n\n"
+		"  -w <dir>      work directory, will be removed first "
+		"(default: bench-sync)\n"
+		"  -d <depth>    depth of the generated tree (default: 3)\n"
+		"  -f <fanout>   sub directories per directory (default: 4)\n"
+		"  -n <files>    files per directory (default: 100)\n"
+		"  -i <percent>  percentage of image files (default: 90)\n"
+		"  -c <percent>  percentage of image files changed in the "
+		"churn phase (default: 1)\n"
+		"  -h            show this help\n", name );
+}
+
+int main( int argc, char **argv )
+{
+	int opt, ret;
+	size_t changed;
+	BenchTreeRec tree = { 0 };
+	BenchOptionsRec opts = { "bench-sync", 3, 4, 100, 90, 1.0 };
+	char path[BENCH_PATH_LEN], tree_dir[BENCH_PATH_LEN];
+	wchar_t data_dir[BENCH_PATH_LEN];
+
+	while( (opt = getopt( argc, argv, "w:d:f:n:i:c:h" )) != -1 ) {
+		switch( opt ) {
+		case 'w': opts.workdir = optarg; break;
+		case 'd': opts.depth = atoi( optarg ); break;
+		case 'f': opts.fanout = atoi( optarg ); break;
+		case 'n': opts.files = atoi( optarg ); break;
+		case 'i': opts.image_ratio = atoi( optarg ); break;
+		case 'c': opts.churn = atof( optarg ); break;
+		default:
+			PrintUsage( argv[0] );
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if( RemoveTree( opts.workdir ) != 0 ||
+	    mkdir( opts.workdir, 0755 ) != 0 ) {
+		fprintf( stderr, "cannot create work directory: %s\n",
+			 opts.workdir );
+		return 1;
+	}
+	if( !realpath( opts.workdir, path ) ) {
+		return 1;
+	}
+	snprintf( tree_dir, BENCH_PATH_LEN, "%s/tree", path );
+	strncat( path, "/data", BENCH_PATH_LEN - strlen( path ) - 1 );
+	mkdir( path, 0755 );
+	LCUI_DecodeString( data_dir, path, BENCH_PATH_LEN - 1, ENCODING_UTF8 );
+	data_dir[BENCH_PATH_LEN - 1] = 0;
+
+	printf( "generating tree: depth %d, fanout %d, %d files per dir, "
+		"%d%% images\n", opts.depth, opts.fanout, opts.files,
+		opts.image_ratio );
+	ret = BenchTree_Generate( &tree, &opts, tree_dir, 0 );
+	if( ret != 0 ) {
+		fprintf( stderr, "cannot generate tree: %s\n", strerror( -ret ) );
+		return 1;
+	}
+	printf( "generated %lu dirs, %lu files, %lu images\n\n",
+		(unsigned long)tree.n_dirs, (unsigned long)tree.n_files,
+		(unsigned long)tree.n_images );
+
+	if( LCFinder_InitCore( data_dir ) != 0 ||
+	    !LCFinder_AddDir( tree_dir, NULL, TRUE ) ) {
+		fprintf( stderr, "cannot initialize\n" );
+		return 1;
+	}
+	RunPhase( "cold" );
+	RunPhase( "no-change" );
+	changed = BenchTree_Churn( &tree, opts.churn, 1 );
+	printf( "churned %lu files\n", (unsigned long)changed );
+	RunPhase( "churn" );
+	LCFinder_ExitCore();
+	BenchTree_Destroy( &tree );
+	return 0;
+}
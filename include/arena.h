@@ -0,0 +1,62 @@
+﻿/* ***************************************************************************
+ * arena.h -- bump-pointer memory arena
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * arena.h -- 以指针递增方式分配内存的内存池
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_ARENA_H
+#define LCFINDER_ARENA_H
+
+#ifndef LCFINDER_ARENA_C
+typedef void* Arena;
+#endif
+
+/** 新建一个内存池，block_size 为每次向系统申请的内存块大小 */
+Arena Arena_Create( size_t block_size );
+
+/** 销毁内存池，一次性释放所有从中分配的内存 */
+void Arena_Destroy( Arena arena );
+
+/** 从内存池中分配内存，分配的内存只能随内存池一起释放 */
+void *Arena_Alloc( Arena arena, size_t size );
+
+/** 复制字符串到内存池中 */
+char *Arena_StrDup( Arena arena, const char *str, size_t len );
+
+/** 复制宽字符串到内存池中 */
+wchar_t *Arena_WcsDup( Arena arena, const wchar_t *str, size_t len );
+
+/** 获取内存池已向系统申请的内存总量 */
+size_t Arena_GetSize( Arena arena );
+
+#endif
@@ -47,6 +47,7 @@
 #define PATH_SEP '/'
 #endif
 
+#include <stdio.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -56,6 +57,12 @@
 
 LCUI_BEGIN_HEADER
 
+/** 文件指纹，由文件大小和文件首尾数据块的哈希值组成 */
+typedef struct FileFingerprintRec_ {
+	int64_t size;		/**< 文件大小 */
+	uint64_t hash;		/**< 首尾数据块的哈希值 */
+} FileFingerprintRec, *FileFingerprint;
+
 char *EncodeUTF8( const wchar_t *wstr );
 
 char *EncodeANSI( const wchar_t *wstr );
@@ -80,6 +87,12 @@ const wchar_t *wgetfilename( const wchar_t *path );
 
 int wgetfilestat( const wchar_t *wpath, struct stat *buf );
 
+/**
+ * 计算文件指纹
+ * 只读取文件首尾的数据块，用于快速识别被移动或重命名的文件。
+ */
+int wgetfilefingerprint( const wchar_t *wpath, FileFingerprint fp );
+
 size_t pathjoin( char *path, const char *path1, const char *path2 );
 
 size_t wpathjoin( wchar_t *path, const wchar_t *path1, const wchar_t *path2 );
@@ -91,6 +104,25 @@ int wmkdir( wchar_t *wpath );
 
 int wchdir( wchar_t *wpath );
 
+/** 打开文件，用法与 fopen() 一致 */
+FILE *wfopen( const wchar_t *wpath, const char *mode );
+
+/** 删除文件 */
+int wremove( const wchar_t *wpath );
+
+/** 重命名文件，若新文件已存在则覆盖它 */
+int wrename( const wchar_t *oldpath, const wchar_t *newpath );
+
+/** 获取处理器核心数量 */
+int getcpucount( void );
+
+/**
+ * 将当前线程切换为后台模式
+ * 降低线程的处理器和磁盘读写的优先级，用于不急于完成的后台任务，仅在
+ * Windows 和 Linux 上有效。
+ */
+int setthreadbackground( void );
+
 Dict *StrDict_Create( void *(*val_dup)(void*, const void*),
 		      void (*val_del)(void*, void*) );
 
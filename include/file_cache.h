@@ -44,6 +44,14 @@ typedef enum {
 	STATE_FINISHED
 } SyncTaskState;
 
+/** 同步日志的状态 */
+typedef enum {
+	SYNC_JOURNAL_NONE,		/**< 无日志，需要从头开始同步 */
+	SYNC_JOURNAL_SCANNING,		/**< 正在扫描，可从待扫描目录继续 */
+	SYNC_JOURNAL_SCANNED,		/**< 已扫描完，等待提交 */
+	SYNC_JOURNAL_COMMITTING		/**< 正在提交至文件数据库 */
+} SyncJournalState;
+
 typedef struct FileInfoRec_ {
 	wchar_t *path;		/**< 文件路径 */
 	unsigned int ctime;	/**< 创建时间 */
@@ -54,9 +62,14 @@ typedef struct FileInfoRec_ {
 typedef struct SyncTaskRec_ {
 	wchar_t *file;				/**< 数据文件 */
 	wchar_t *tmpfile;			/**< 临时数据文件 */
+	wchar_t *logfile;			/**< 扫描记录文件 */
 	wchar_t *scan_dir;			/**< 需扫描的目录 */
 	wchar_t *data_dir;			/**< 数据存放目录 */
+	wchar_t *journal;			/**< 同步日志文件 */
 	SyncTaskState state;			/**< 任务状态 */
+	SyncJournalState journal_state;		/**< 同步日志的状态 */
+	unsigned int generation;		/**< 提交时使用的代号 */
+	int resumed;				/**< 是否从上次中断处恢复 */
 	unsigned long int total_files;		/**< 当前缓存的总文件数量 */
 	unsigned long int added_files;		/**< 当前缓存的新增的文件数量 */
 	unsigned long int changed_files;	/**< 当前缓存的已修改的文件数量 */
@@ -64,6 +77,7 @@ typedef struct SyncTaskRec_ {
 } SyncTaskRec, *SyncTask;
 
 typedef void(*FileInfoHanlder)(void*, const FileInfo);
+typedef void(*DirPathHandler)(void*, const wchar_t*);
 
 SyncTask SyncTask_New( const char *data_dir, const char *scan_dir );
 
@@ -104,6 +118,36 @@ int SyncTask_Start( SyncTask t );
 /** 结束同步文件列表 */
 void SyncTask_Finish( SyncTask t );
 
+/**
+ * 恢复上次中断的提交
+ * 如果上次同步在文件数据库提交之后、缓存文件替换之前中断，则直接完成缓存文件的
+ * 替换。
+ * @param[in] generation 文件数据库中已提交的代号
+ * @returns 如果完成了上次中断的提交则返回 1，否则返回 0
+ */
+int SyncTask_Recover( SyncTask t, unsigned int generation );
+
+/**
+ * 添加待扫描的目录
+ * @returns 如果目录已扫描完或已在待扫描列表中则返回 0，否则返回 1
+ */
+int SyncTask_AddDirW( SyncTask t, const wchar_t *dirpath );
+
+/** 标记目录已扫描完，目录内的文件都已添加至缓存 */
+void SyncTask_FinishDirW( SyncTask t, const wchar_t *dirpath );
+
+/** 遍历每个待扫描的目录 */
+int SyncTask_InPendingDirs( SyncTask t, DirPathHandler func, void *func_data );
+
+/** 保存检查点，以便在中断后能够从此处继续同步 */
+int SyncTask_Checkpoint( SyncTask t );
+
+/**
+ * 准备提交
+ * 在更新文件数据库前调用，记录本次提交的代号，该代号应与文件数据库一同提交。
+ */
+int SyncTask_PrepareCommit( SyncTask t, unsigned int generation );
+
 /** 提交变更后文件列表至缓存数据库中 */
 void SyncTask_Commit( SyncTask t );
 
@@ -0,0 +1,140 @@
+﻿/* ***************************************************************************
+ * file_metrics.h -- file service metrics.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_metrics.h -- 文件服务的统计数据。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_FILE_METRICS_H
+#define LCFINDER_FILE_METRICS_H
+
+LCFINDER_BEGIN_HEADER
+
+#ifdef LCFINDER_FILE_METRICS_C
+typedef struct FileMetricsRec_* FileMetrics;
+#else
+typedef void* FileMetrics;
+#endif
+
+/** 指定统计数据输出文件的环境变量，设置后会定时将统计数据以 JSON 格式写入 */
+#define FILE_METRICS_ENV "LCFINDER_FILE_METRICS"
+
+/** 统计数据的默认输出间隔（毫秒） */
+#define FILE_METRICS_DUMP_INTERVAL 5000
+
+/**
+ * 耗时直方图的桶数量
+ * 第 0 个桶统计不足 1 微秒的样本，第 i 个桶统计 [2^(i-1), 2^i) 微秒内的样本，
+ * 最后一个桶不设上限。
+ */
+#define FILE_METRICS_BUCKETS 28
+
+/** 请求处理的各个阶段 */
+enum FileMetricsStage {
+	FILE_STAGE_QUEUE,	/**< 在任务队列中等待 */
+	FILE_STAGE_STAT,	/**< 获取文件状态 */
+	FILE_STAGE_DECODE,	/**< 解码图片 */
+	FILE_STAGE_ZOOM,	/**< 缩放图片 */
+	FILE_STAGE_TRANSFER,	/**< 从发出响应到客户端处理完响应 */
+	FILE_STAGE_TOTAL
+};
+
+/** 耗时直方图 */
+typedef struct FileLatencyHistogram_ {
+	uint64_t count;				/**< 样本数量 */
+	uint64_t sum_us;			/**< 总耗时（微秒） */
+	uint64_t max_us;			/**< 最大耗时（微秒） */
+	uint64_t buckets[FILE_METRICS_BUCKETS];	/**< 各个桶的样本数量 */
+} FileLatencyHistogram;
+
+/** 单种请求方式的统计数据 */
+typedef struct FileMethodMetrics_ {
+	uint64_t requests;	/**< 收到响应的请求数量 */
+	uint64_t errors;	/**< 以错误状态结束的请求数量 */
+	uint64_t canceled;	/**< 被取消的请求数量 */
+	FileLatencyHistogram stages[FILE_STAGE_TOTAL];
+} FileMethodMetrics;
+
+/** 单个连接的统计数据 */
+typedef struct FileConnectionMetrics_ {
+	unsigned int id;		/**< 连接标识号 */
+	char name[32];			/**< 连接名称 */
+	uint64_t bytes_read;		/**< 解码图片时从文件中实际读取的总字节数 */
+	uint64_t decoded_pixels;	/**< 解码出的像素总数 */
+	FileMethodMetrics methods[REQUEST_METHOD_TOTAL];
+} FileConnectionMetrics;
+
+/** 初始化统计模块，由文件服务在初始化时调用 */
+void FileMetrics_Init( void );
+
+/** 获取计时器读数，单位为微秒，只用于计算时间间隔 */
+int64_t FileMetrics_GetTime( void );
+
+/** 为连接新建统计数据，它会一直保留到程序退出 */
+FileMetrics FileMetrics_Create( unsigned int id );
+
+/** 设置连接名称，用于区分各个连接的统计数据 */
+void FileMetrics_SetName( FileMetrics metrics, const char *name );
+
+/** 记录一个请求的处理结果 */
+void FileMetrics_AddRequest( FileMetrics metrics, int method, int status );
+
+/** 记录请求在某个阶段的耗时 */
+void FileMetrics_AddTime( FileMetrics metrics, int method,
+			  int stage, int64_t usec );
+
+/** 记录一次图片解码所读取的字节数和解码出的像素数量 */
+void FileMetrics_AddImage( FileMetrics metrics, uint64_t bytes,
+			   uint64_t pixels );
+
+/**
+ * 获取所有连接的统计数据的快照
+ * @param[out] outlist 快照列表，需要由调用者用 free() 释放
+ * @returns 连接数量
+ */
+size_t FileMetrics_GetSnapshot( FileConnectionMetrics **outlist );
+
+/** 将统计数据以 JSON 格式写入文件 */
+int FileMetrics_Dump( const char *path );
+
+/** 定时将统计数据写入文件 */
+int FileMetrics_StartDump( const char *path, int interval );
+
+/** 根据环境变量开始定时输出统计数据 */
+int FileMetrics_StartDumpFromEnv( void );
+
+/** 停止定时输出，停止前会再输出一次 */
+void FileMetrics_StopDump( void );
+
+LCFINDER_END_HEADER
+
+#endif
@@ -102,6 +102,12 @@ void DB_DeleteDir( DB_Dir dir );
 /** 释放文件夹信息占用的资源 */
 void DBDir_Release( DB_Dir dir );
 
+/** 获取文件夹的同步代号，每次成功提交同步结果后递增 */
+unsigned int DB_GetDirSyncGeneration( DB_Dir dir );
+
+/** 设置文件夹的同步代号 */
+int DB_SetDirSyncGeneration( DB_Dir dir, unsigned int generation );
+
 /** 获取所有文件夹 */
 int DB_GetDirs( DB_Dir **outlist );
 
@@ -118,6 +124,21 @@ void DB_UpdateFileTime( DB_Dir dir, const char *filepath,
 /** 删除一个文件记录 */
 void DB_DeleteFile( const char *filepath );
 
+/** 移动文件记录，文件的标签和评分等信息会被保留 */
+int DB_MoveFile( DB_Dir dir, const char *oldpath, const char *newpath,
+		 int ctime, int mtime );
+
+/** 获取文件指纹，包括文件大小和首尾数据块的哈希值 */
+int DB_GetFileFingerprint( const char *filepath,
+			   int64_t *size, uint64_t *hash );
+
+/** 设置文件指纹 */
+int DB_SetFileFingerprint( const char *filepath,
+			   int64_t size, uint64_t hash );
+
+/** 获取尚未计算文件指纹的文件路径列表 */
+int DB_GetFilesWithoutFingerprint( char ***outlist, int limit );
+
 /** 获取一个文件记录 */
 DB_File DB_GetFile( const char *filepath );
 
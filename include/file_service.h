@@ -43,18 +43,35 @@ LCFINDER_BEGIN_HEADER
 typedef struct FileClientRec_* FileClient;
 typedef struct FileStreamRec_* FileStream;
 typedef struct ConnectionRec_* Connection;
+typedef struct FileImageRec_* FileImage;
 #else
 typedef void* FileClient;
 typedef void* FileStream;
 typedef void* Connection;
+typedef void* FileImage;
 #endif
 
+/** 每个连接上最多同时等待响应的请求数量 */
+#define FILE_CLIENT_MAX_REQUESTS 8
+
 enum FileRequestMethod {
 	REQUEST_METHOD_HEAD,
 	REQUEST_METHOD_GET,
 	REQUEST_METHOD_POST,
 	REQUEST_METHOD_PUT,
-	REQUEST_METHOD_DELETE
+	REQUEST_METHOD_DELETE,
+	REQUEST_METHOD_HEAD_BATCH,	/**< 批量获取 params.paths 中各个文件的状态 */
+	REQUEST_METHOD_TOTAL
+};
+
+/** 请求的优先级，值越小越优先处理 */
+enum FileRequestPriority {
+	FILE_PRIORITY_THUMB,	/**< 可见区域内的缩略图 */
+	FILE_PRIORITY_PICTURE,	/**< 当前查看的图片 */
+	FILE_PRIORITY_PRELOAD,	/**< 预加载的图片 */
+	FILE_PRIORITY_SCAN,	/**< 后台扫描 */
+	FILE_PRIORITY_IDLE,	/**< 由后台模式的线程单独处理，不会被提升 */
+	FILE_PRIORITY_TOTAL
 };
 
 enum FileResponseStatus {
@@ -63,6 +80,7 @@ enum FileResponseStatus {
 	RESPONSE_STATUS_FORBIDDEN = 403,
 	RESPONSE_STATUS_NOT_FOUND = 404,
 	RESPONSE_STATUS_NOT_ACCEPTABLE = 406,
+	RESPONSE_STATUS_CANCELED = 499,
 	RESPONSE_STATUS_ERROR = 500,
 	RESPONSE_STATUS_NOT_IMPLEMENTED = 501
 };
@@ -85,26 +103,54 @@ typedef struct FileStatus_ {
 	FileImageStatus *image;
 } FileStatus;
 
+/** 批量获取文件状态时，单个文件的结果 */
+typedef struct FileStatusItem_ {
+	int status;			/**< 状态，取值与响应状态相同 */
+	FileStatus file;		/**< 文件状态，file.image 指向 image 或为 NULL */
+	FileImageStatus image;		/**< 图片尺寸 */
+} FileStatusItem;
+
 enum FileFilter {
 	FILE_FILTER_NONE,	/**< 不过滤 */
 	FILE_FILTER_FILE,	/**< 仅保留文件 */
 	FILE_FILTER_FOLDER	/**< 仅保留文件夹 */
 };
 
+/**
+ * 文件列表项
+ * 文件列表以二进制记录的形式传输，读取到的列表项直接指向文件流中的数据，在读取
+ * 下一项或释放文件流之前有效。
+ */
+typedef struct FileDirEntry_ {
+	int type;			/**< 文件类型 */
+	size_t name_len;		/**< 文件名的字节数 */
+	const char *name;		/**< 文件名，UTF-8 编码，以 0 结尾 */
+	LCUI_BOOL with_status;		/**< 是否附带文件状态 */
+	uint64_t size;			/**< 文件大小 */
+	int64_t ctime;			/**< 创建时间 */
+	int64_t mtime;			/**< 修改时间 */
+} FileDirEntry;
+
 /** 文件请求参数 */
 typedef struct FileRequestParams_ {
 	int filter;				/**< 过滤条件 */
+	LCUI_BOOL with_file_status;		/**< 文件列表项是否附带文件状态 */
 	LCUI_BOOL get_thumbnail;		/**< 是否仅获取缩略图 */
 	LCUI_BOOL with_image_status;		/**< 是否附带获取图片文件状态信息 */
 	void( *progress )(void*, float);	/**< 回调函数，用于接收文件读取进度 */
 	void *progress_arg;			/**< 接收文件读取进度时的附加参数 */
 	unsigned int width;			/**< 缩略图的宽度 */
 	unsigned int height;			/**< 缩略图的高度 */
+	wchar_t **paths;			/**< 批量请求的路径列表，由发送方保留到收到响应 */
+	FileImage target;			/**< 预先分配的图像，解码或缩放的结果直接写入其中，由发送方保留到收到响应 */
+	size_t n_paths;				/**< 路径数量 */
 } FileRequestParams;
 
 /** 文件请求 */
 typedef struct FileRequest_ {
+	unsigned int id;		/**< 请求标识号，由客户端分配 */
 	int method;			/**< 请求方式 */
+	int priority;			/**< 优先级 */
 	wchar_t path[256];		/**< 资源路径 */
 	FileStatus file;		/**< 文件状态参数 */
 	FileRequestParams params;	/**< 请求参数 */
@@ -113,9 +159,10 @@ typedef struct FileRequest_ {
 
 /** 文件响应 */
 typedef struct FileResponse_ {
+	unsigned int id;	/**< 对应的请求的标识号 */
 	int status;		/**< 状态 */
 	FileStatus file;	/**< 文件状态 */
-	FileStream stream;	/**< 文件流 */
+	FileStream stream;	/**< 文件流，每个响应独占一个 */
 } FileResponse;
 
 typedef struct FileRequestHandler_ {
@@ -123,6 +170,20 @@ typedef struct FileRequestHandler_ {
 	void *data;
 } FileRequestHandler;
 
+/** 请求转发器，设置后文件服务收到的请求会先交给它处理 */
+typedef struct FileServiceForwarderRec_ {
+	/**
+	 * 转发请求，成功时返回 0，此后由转发器通过 Connection_SendResponse()
+	 * 回应；返回 -1 时请求仍由本进程的工作线程处理
+	 */
+	int( *forward )(Connection, const FileRequest*, void*);
+	/** 取消已转发的请求 */
+	void( *cancel )(Connection, unsigned int, void*);
+	/** 连接已关闭，转发器应释放为它保存的数据 */
+	void( *close )(Connection, void*);
+	void *arg;
+} FileServiceForwarderRec, *FileServiceForwarder;
+
 enum FileStreamChunkType {
 	DATA_CHUNK_REQUEST,
 	DATA_CHUNK_RESPONSE,
@@ -130,7 +191,8 @@ enum FileStreamChunkType {
 	DATA_CHUNK_THUMB,
 	DATA_CHUNK_IMAGE,
 	DATA_CHUNK_FILE,
-	DATA_CHUNK_END
+	DATA_CHUNK_END,
+	DATA_CHUNK_CANCEL	/**< 取消请求，request.id 为要取消的请求 */
 };
 
 /** 文件流中的数据块 */
@@ -139,8 +201,8 @@ typedef struct FileStreamChunk_ {
 	union {
 		FileRequest request;	/**< 文件请求 */
 		FileResponse response;	/**< 文件请求的响应结果 */
-		LCUI_Graph thumb;	/**< 缩略图 */
-		LCUI_Graph image;	/**< 图像 */
+		FileImage thumb;	/**< 缩略图，数据块持有一个引用 */
+		FileImage image;	/**< 图像，数据块持有一个引用 */
 		FILE *file;		/**< C 标准库的文件流 */
 		char *data;		/**< 数据块 */
 	};
@@ -150,11 +212,38 @@ typedef struct FileStreamChunk_ {
 
 void FileStreamChunk_Destroy( FileStreamChunk *chunk );
 
+/**
+ * 新建图像
+ * 图像由引用计数管理，在服务和客户端之间传递时只传递引用，不复制像素数据。数据
+ * 块被写入文件流后，它持有的引用就归文件流所有，读取后归读取方所有。
+ */
+FileImage FileImage_Create( void );
+
+/** 新建图像，并预先分配能容纳指定尺寸的像素数据的内存 */
+FileImage FileImage_CreateWithSize( unsigned int width, unsigned int height );
+
+void FileImage_AddRef( FileImage image );
+
+void FileImage_Release( FileImage image );
+
+/** 获取图像数据，在持有引用期间有效 */
+LCUI_Graph *FileImage_GetGraph( FileImage image );
+
+/**
+ * 取出图像数据并释放引用
+ * 如果只有调用者持有该图像，像素数据会直接转交给调用者，否则复制一份。
+ */
+int FileImage_Take( FileImage image, LCUI_Graph *graph );
+
 FileStream FileStream_Create( void );
 
+/** 增加文件流的引用计数 */
+void FileStream_AddRef( FileStream stream );
+
 void FileStream_Close( FileStream stream );
 
-void FileStream_Destroy( FileStream stream );
+/** 释放文件流，在引用计数为 0 时销毁它 */
+void FileStream_Release( FileStream stream );
 
 int FileStream_ReadChunk( FileStream stream, FileStreamChunk *chunk );
 
@@ -168,6 +257,19 @@ size_t FileStream_Write( FileStream stream, char *buf,
 
 char *FileStream_ReadLine( FileStream stream, char *buf, size_t size );
 
+/** 读取文件列表中的下一项，没有更多项时返回 0 */
+int FileStream_ReadDirEntry( FileStream stream, FileDirEntry *entry );
+
+/** 为文件流启用文件列表的传输，需要在文件流交给读取方之前调用 */
+int FileStream_InitDirList( FileStream stream );
+
+/** 写入一项文件列表，用于转发从其它文件流中读取到的列表项 */
+int FileStream_CopyDirEntry( FileStream stream, const FileDirEntry *entry );
+
+/** 与 FileStream_CopyDirEntry() 相同，但缓冲区已满时不等待，返回 -EAGAIN */
+int FileStream_TryCopyDirEntry( FileStream stream,
+				const FileDirEntry *entry );
+
 Connection Connection_Create( void );
 
 size_t Connection_Read( Connection conn, char *buf,
@@ -192,6 +294,12 @@ void FileService_Close( void );
 
 void FileService_Init( void );
 
+/** 获取各优先级的任务队列中等待处理的请求数量 */
+void FileService_GetQueueDepths( size_t depths[FILE_PRIORITY_TOTAL] );
+
+/** 设置请求转发器，传入 NULL 则取消转发，需要在客户端连接前调用 */
+void FileService_SetForwarder( FileServiceForwarder forwarder );
+
 int Connection_SendRequest( Connection conn,
 			    const FileRequest *request );
 
@@ -216,9 +324,24 @@ void FileClient_Close( FileClient client );
 
 void FileClient_RunAsync( FileClient client );
 
-void FileClient_SendRequest( FileClient client,
-			     const FileRequest *request,
-			     const FileRequestHandler *handler );
+/** 设置客户端名称，文件服务的统计数据按该名称区分各个连接 */
+void FileClient_SetName( FileClient client, const char *name );
+
+/** 设置最多同时等待响应的请求数量，默认为 FILE_CLIENT_MAX_REQUESTS */
+void FileClient_SetMaxRequests( FileClient client, size_t n );
+
+/** 发送请求，返回请求标识号，可用于取消请求 */
+unsigned int FileClient_SendRequest( FileClient client,
+				     const FileRequest *request,
+				     const FileRequestHandler *handler );
+
+/**
+ * 取消请求
+ * 尚未处理的请求会被直接移除，正在读取的图片会中止读取，回调函数仍会被调用，
+ * 响应状态为 RESPONSE_STATUS_CANCELED。如果请求在取消前已经处理完，则照常
+ * 收到处理结果。
+ */
+void FileClient_CancelRequest( FileClient client, unsigned int id );
 
 LCFINDER_END_HEADER
 
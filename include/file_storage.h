@@ -43,6 +43,7 @@
 typedef void( *HandlerOnGetProgress )(float, void*);
 typedef void( *HandlerOnGetImage )(LCUI_Graph*, void*);
 typedef void( *HandlerOnGetStatus )(FileStatus*, void*);
+typedef void( *HandlerOnGetStatusList )(FileStatusItem*, size_t, void*);
 typedef void( *HandlerOnGetFile )(FileStatus*, FileStream, void*);
 typedef void( *HandlerOnGetThumbnail )(FileStatus*, LCUI_Graph*, void*);
 
@@ -50,12 +51,28 @@ void FileStorage_Init( void );
 
 int FileStorage_Connect( void );
 
+/** 设置连接上的请求的优先级，默认为 FILE_PRIORITY_PICTURE */
+void FileStorage_SetPriority( int conn_id, int priority );
+
+/** 设置连接名称，文件服务的统计数据按名称区分各个连接 */
+void FileStorage_SetName( int conn_id, const char *name );
+
+/** 设置连接上最多同时等待响应的请求数量 */
+void FileStorage_SetMaxRequests( int conn_id, size_t n );
+
 void FileStorage_Close( int id );
 
 void FileStorage_Exit( void );
 
 static void OnResponse( FileResponse *response, void *data );
 
+/**
+ * 取消请求
+ * 以下获取文件数据的函数在成功时都会返回请求标识号，失败时返回 -1。请求被取消
+ * 后，回调函数仍会被调用，但不会带有数据。
+ */
+void FileStorage_Cancel( int conn_id, int request_id );
+
 int FileStorage_GetFile( int conn_id, const wchar_t *filename,
 			 HandlerOnGetFile callback, void *data );
 
@@ -65,6 +82,10 @@ int FileStorage_GetFiles( int conn_id, const wchar_t *filename,
 int FileStorage_GetFolders( int conn_id, const wchar_t *filename,
 			    HandlerOnGetFile callback, void *data );
 
+/** 获取目录下的文件和文件夹列表，列表项附带文件状态，供扫描目录时使用 */
+int FileStorage_ScanDir( int conn_id, const wchar_t *dirpath,
+			 HandlerOnGetFile callback, void *data );
+
 int FileStorage_GetImage( int conn_id, const wchar_t *filename,
 			  HandlerOnGetImage callback,
 			  HandlerOnGetProgress progress,
@@ -78,4 +99,13 @@ int FileStorage_GetStatus( int conn_id, const wchar_t *filename,
 			   LCUI_BOOL with_extra,
 			   HandlerOnGetStatus callback, void *data );
 
+/**
+ * 批量获取文件状态
+ * 所有文件的状态在同一个响应中返回，结果的顺序与路径列表一致，各文件是否获取
+ * 成功需要看结果中的 status 字段。
+ */
+int FileStorage_GetStatusList( int conn_id, wchar_t *const *filenames,
+			       size_t count, LCUI_BOOL with_extra,
+			       HandlerOnGetStatusList callback, void *data );
+
 #endif
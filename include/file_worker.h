@@ -0,0 +1,68 @@
+﻿/* ***************************************************************************
+ * file_worker.h -- file service worker processes.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_worker.h -- 文件服务的工作进程
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_FILE_WORKER_H
+#define LCFINDER_FILE_WORKER_H
+
+LCFINDER_BEGIN_HEADER
+
+/** 以工作进程身份启动时使用的命令行参数，后跟套接字的文件描述符 */
+#define FILE_WORKER_ARG "--file-worker"
+
+/** 指定工作进程数量的环境变量，未设置时文件服务在本进程内运行 */
+#define FILE_WORKER_ENV "LCFINDER_FILE_WORKERS"
+
+/**
+ * 启动工作进程
+ * 之后文件服务收到的请求会转发给负载最小的工作进程处理，工作进程崩溃时，它正在
+ * 处理的请求会以 RESPONSE_STATUS_ERROR 结束，并重新启动一个工作进程。需要在
+ * 文件服务初始化之后、客户端连接之前调用。
+ * @returns 成功启动的工作进程数量，不支持时返回 -1
+ */
+int FileWorker_Launch( int count );
+
+/** 根据环境变量启动工作进程 */
+int FileWorker_LaunchFromEnv( void );
+
+/** 关闭所有工作进程，之后请求回到本进程内处理 */
+void FileWorker_Shutdown( void );
+
+/** 作为工作进程运行，fd 为与主进程通信的套接字，主进程断开后返回 */
+int FileWorker_Run( int fd );
+
+LCFINDER_END_HEADER
+
+#endif
@@ -40,6 +40,7 @@
 
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
 #include "build.h"
 #include "bridge.h"
 #include "common.h"
@@ -102,17 +103,18 @@ typedef struct Finder_ {
 	wchar_t *data_dir;		/**< 数据文件夹 */
 	wchar_t *fileset_dir;		/**< 文件列表缓存所在文件夹 */
 	wchar_t *thumbs_dir;		/**< 缩略图数据库所在文件夹 */
-	wchar_t **thumb_paths;		/**< 缩略图数据库路径列表 */
+	ThumbDB thumb_db;		/**< 缩略图数据库 */
 	ThumbCache thumb_cache;		/**< 缩略图数据缓存 */
-	Dict *thumb_dbs;		/**< 缩略图数据库记录，以源文件夹路径作为索引 */
 	LCUI_EventTrigger trigger;	/**< 事件触发器 */
 	FinderConfigRec config;		/**< 当前配置 */
 	FinderLicenseRec license;	/**< 当前许可证状态信息 */
 	int open_private_space;		/**< 是否打开了私人空间 */
 	int storage;			/**< 文件服务连接标识符，主要用于获取文件基本信息 */
 	int storage_for_image;		/**< 文件服务连接标识符，主要用于读取图片内容 */
+	int storage_for_preload;	/**< 文件服务连接标识符，主要用于预加载图片内容 */
 	int storage_for_thumb;		/**< 文件服务连接标识符，主要用于获取图片缩略图 */
 	int storage_for_scan;		/**< 文件服务连接标识符，主要用于扫描文件列表 */
+	int storage_for_idle;		/**< 文件服务连接标识符，主要用于在空闲时生成缩略图 */
 } Finder;
 
 typedef void( *LCFinder_EventHandler )(void*, void*);
@@ -131,6 +133,7 @@ typedef struct FileSyncStatusRec_ {
 	size_t scaned_dirs;	/**< 已扫描的目录数量 */
 	SyncTask task;		/**< 当前正执行的任务 */
 	SyncTask *tasks;	/**< 所有任务 */
+	LCUI_Mutex mutex;	/**< 互斥锁，保护扫描计数 */
 	void *data;
 	void( *callback )(void*);
 } FileSyncStatusRec, *FileSyncStatus;
@@ -198,6 +201,15 @@ void LCFinder_ClosePrivateSpace( void );
 
 int LCFinder_Init( int argc, char *argv[] );
 
+/**
+ * 初始化核心功能，不包括语言、配置和用户界面
+ * 供基准测试等无界面的程序使用，数据文件都存放在 data_dir 目录中
+ */
+int LCFinder_InitCore( const wchar_t *data_dir );
+
+/** 退出核心功能 */
+void LCFinder_ExitCore( void );
+
 int LCFinder_Run( void );
 
 void LCFinder_Exit( void );
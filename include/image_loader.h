@@ -0,0 +1,77 @@
+﻿/* ***************************************************************************
+ * image_loader.h -- reduced-size image decoding.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_loader.h -- 以缩小的尺寸解码图片。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_IMAGE_LOADER_H
+#define LCFINDER_IMAGE_LOADER_H
+
+LCFINDER_BEGIN_HEADER
+
+/** 以缩小的尺寸读取图片时使用的参数 */
+typedef struct ImageLoaderRec_ {
+	FILE *fp;			/**< 图片文件 */
+	unsigned int width;		/**< 结果的最小宽度，为 0 时不限制 */
+	unsigned int height;		/**< 结果的最小高度，为 0 时不限制 */
+	unsigned int src_width;		/**< 读取到的原图宽度，已按 EXIF 方向转正 */
+	unsigned int src_height;	/**< 读取到的原图高度，已按 EXIF 方向转正 */
+	uint64_t bytes_read;		/**< 实际从文件中读取的字节数，只用了预览图时不包括主图像 */
+	LCUI_BOOL( *progress )(void*, float);	/**< 进度回调，返回 FALSE 时中止读取 */
+	void *progress_arg;		/**< 进度回调的附加参数 */
+} ImageLoaderRec, *ImageLoader;
+
+/**
+ * 以缩小的尺寸读取图片
+ * JPEG 图片优先使用 EXIF 缩略图或 MPF 预览图中不小于要求尺寸的一个，只需读取
+ * 文件头和预览图的数据，没有合适的预览图时在解码时按 1/2、1/4 或 1/8 缩小，
+ * 结果会按 EXIF 方向标记转正。非隔行扫描的 PNG 图片逐行读取并按整数倍缩小。
+ * 都不需要分配原尺寸的图像。结果的尺寸不小于要求的尺寸，调用者仍需将它缩放到
+ * 最终尺寸。
+ * @returns 成功返回 0；图片格式不支持或不需要缩小时返回 -ENOTSUP，此时文件的
+ *  读取位置不确定；读取被中止时返回 -ECANCELED；其它错误返回 -1
+ */
+int ImageLoader_ReadScaled( ImageLoader loader, LCUI_Graph *out );
+
+/**
+ * 读取 JPEG 图片的 EXIF 方向标记，读取后文件位置回到开头
+ * @returns 方向标记，取值范围为 1 ~ 8，不是 JPEG 图片或没有该标记时返回 1
+ */
+int ImageLoader_GetOrientation( FILE *fp );
+
+/** 按 EXIF 方向标记把图像转换成正常的方向，5 ~ 8 会交换宽高 */
+int ImageLoader_Orient( LCUI_Graph *graph, int orientation );
+
+LCFINDER_END_HEADER
+
+#endif
@@ -0,0 +1,67 @@
+﻿/* ***************************************************************************
+ * image_scaler.h -- image downscaling kernels.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_scaler.h -- 图像缩放。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_IMAGE_SCALER_H
+#define LCFINDER_IMAGE_SCALER_H
+
+LCFINDER_BEGIN_HEADER
+
+/**
+ * 缩放图像
+ * 缩小时先按整数倍的区域取平均值，再用双线性插值完成剩下的不到 2 倍的缩放，
+ * 放大时只用双线性插值。支持 RGB 和 ARGB 格式，其它格式交给 Graph_Zoom()
+ * 处理。主要的计算会根据 CPU 支持的指令集选用 AVX2、SSE2 或普通的实现。
+ * @param[in] keep_scale 是否保持宽高比，为 TRUE 时结果不超出 width 和 height
+ * @param[in] width 目标宽度，为 0 时按高度等比例计算
+ * @param[in] height 目标高度，为 0 时按宽度等比例计算
+ */
+int ImageScaler_Zoom( const LCUI_Graph *src, LCUI_Graph *dst,
+		      LCUI_BOOL keep_scale, int width, int height );
+
+/** 获取当前使用的实现的名称 */
+const char *ImageScaler_GetKernelName( void );
+
+/**
+ * 指定使用的实现，用于测试和基准测试
+ * 需要在没有其它线程缩放图像时调用。
+ * @param[in] name 实现的名称：scalar、sse2 或 avx2，为 NULL 时恢复自动选择
+ * @returns 成功时返回 0，名称无效或 CPU 不支持时返回 -1
+ */
+int ImageScaler_SetKernel( const char *name );
+
+LCFINDER_END_HEADER
+
+#endif
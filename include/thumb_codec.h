@@ -0,0 +1,75 @@
+﻿/* ***************************************************************************
+ * thumb_codec.h -- thumbnail data codecs.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_codec.h -- 缩略图数据的编解码器。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_THUMB_CODEC_H
+#define LCFINDER_THUMB_CODEC_H
+
+LCFINDER_BEGIN_HEADER
+
+/** 缩略图数据的编码方式，数值会写入缩略图数据库，不能改动已有的值 */
+enum ThumbCodecType {
+	THUMB_CODEC_RAW,	/**< 不压缩，直接保存像素数据 */
+	THUMB_CODEC_QOI,	/**< QOI 无损压缩 */
+	THUMB_CODEC_JPEG,	/**< JPEG 有损压缩，只支持 RGB 格式 */
+	THUMB_CODEC_TOTAL
+};
+
+/** 缩略图编解码器 */
+typedef struct ThumbCodecRec_ {
+	const char *name;
+
+	/**
+	 * 编码图像
+	 * @param[in] quality 压缩质量，取值范围为 1 ~ 100，无损编码器会忽略它
+	 * @param[out] data 编码后的数据，需要调用者用 free() 释放
+	 * @returns 成功返回 0，不支持该图像的格式时返回 -ENOTSUP
+	 */
+	int( *encode )(const LCUI_Graph *graph, int quality,
+		       uchar_t **data, size_t *size);
+
+	/** 解码数据，graph 需已按原图像的尺寸和颜色类型创建好 */
+	int( *decode )(const uchar_t *data, size_t size, LCUI_Graph *graph);
+} ThumbCodecRec, *ThumbCodec;
+
+/** 获取编解码器，不存在或当前构建不支持时返回 NULL */
+ThumbCodec ThumbCodec_Get( int type );
+
+/** 按名称获取编码方式，找不到时返回 -1 */
+int ThumbCodec_GetType( const char *name );
+
+LCFINDER_END_HEADER
+
+#endif
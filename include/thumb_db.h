@@ -50,16 +50,126 @@ typedef struct ThumbDatakRec_ {
 	LCUI_Graph graph;		/**< 缩略图数据 */
 } ThumbDataRec, *ThumbData;
 
-/** 新建一个缩略图数据库实例 */
-ThumbDB ThumbDB_Open( const char *filepath );
+/**
+ * 指定缩略图编码方式的环境变量，格式为“编码方式[:压缩质量]”，例如 jpeg:85、
+ * qoi、raw，未设置时默认使用 JPEG 编码，带透明度的缩略图使用 QOI 编码。
+ */
+#define THUMB_DB_CODEC_ENV "LCFINDER_THUMB_CODEC"
 
-/** 销毁缩略图数据库实例 */
+/**
+ * 设置保存缩略图时使用的编码方式，对所有缩略图数据库生效
+ * 读取时按数据块中记录的编码方式解码，改变设置不影响已保存的缩略图。
+ * @param[in] codec 编码方式，取值见 ThumbCodecType
+ * @param[in] quality 有损编码的压缩质量，取值范围为 1 ~ 100
+ */
+int ThumbDB_SetCodec( int codec, int quality );
+
+/** 按环境变量设置编码方式 */
+int ThumbDB_SetCodecFromEnv( void );
+
+/**
+ * 缩略图的键
+ * 缩略图按文件内容而不是文件路径存储，文件被移动、重命名或复制后仍然可以复用
+ * 已有的缩略图。
+ */
+typedef struct ThumbKeyRec_ {
+	int64_t size;			/**< 文件大小 */
+	uint64_t hash;			/**< 文件指纹中的哈希值 */
+	uint32_t size_class;		/**< 尺寸规格，见 THUMB_SIZE_CLASS() */
+	uint32_t reserved;
+} ThumbKeyRec, *ThumbKey;
+
+/** 由缩略图的最大宽高生成尺寸规格，宽高为 0 时表示不限制 */
+#define THUMB_SIZE_CLASS(W, H) (((uint32_t)(W) << 16) | (uint32_t)(H))
+
+/** 由文件指纹和缩略图的最大宽高初始化键 */
+void ThumbKey_Init( ThumbKey key, const FileFingerprint fp,
+		    int width, int height );
+
+/**
+ * 打开缩略图数据库
+ * 所有缩略图都追加写入到目录下的同一个包文件中，另有一个可以由包文件重建的
+ * 哈希索引文件。读取时只需查找一次索引，然后从包文件的内存映射中解码。
+ * @param[in] dirpath 存放数据库文件的目录
+ */
+ThumbDB ThumbDB_Open( const wchar_t *dirpath );
+
+/** 关闭缩略图数据库 */
 void ThumbDB_Close( ThumbDB tdb );
 
-/** 从数据库中载入指定文件路径的缩略图数据 */
-int ThumbDB_Load( ThumbDB tdb, const char *filepath, ThumbData data );
+/** 删除目录下的缩略图数据库文件，调用前需要先关闭数据库 */
+int ThumbDB_Remove( const wchar_t *dirpath );
+
+/** 从数据库中载入缩略图数据，解码在调用者的线程中进行 */
+int ThumbDB_Load( ThumbDB tdb, const ThumbKey key, ThumbData data );
+
+/**
+ * 将缩略图数据保存至数据库中
+ * 编码后的数据先放入写入队列，由写入线程按批次追加到包文件中，在这之前也能
+ * 通过 ThumbDB_Load() 读取到。已有相同键的缩略图时，旧的数据会成为无效数据，
+ * 在无效数据过多时由后台线程压缩包文件。
+ */
+int ThumbDB_Save( ThumbDB tdb, const ThumbKey key, ThumbData data );
+
+/**
+ * 更新缩略图记录的修改时间
+ * 文件的修改时间变了但内容没变时使用，编码后的数据原样写回，不需要重新解码
+ * 和编码。
+ */
+int ThumbDB_SetModifyTime( ThumbDB tdb, const ThumbKey key,
+			   uint32_t modify_time );
+
+/** 缩略图金字塔的级数，各级的最大边长依次为 128、256、512 */
+#define THUMB_LEVEL_COUNT	3
+/** 缩略图金字塔中最大一级的边长 */
+#define THUMB_LEVEL_MAX_SIZE	512
+
+/**
+ * 保存缩略图金字塔
+ * 以 data 中的缩略图作为最大的一级，较小的各级由它依次缩小生成，一次解码的
+ * 结果可供文件列表、文件夹封面和标签封面等不同尺寸的缩略图使用。
+ * @param[in] data 缩略图数据，尺寸应不超过 THUMB_LEVEL_MAX_SIZE
+ */
+int ThumbDB_SaveLevels( ThumbDB tdb, const FileFingerprint fp,
+			ThumbData data );
+
+/**
+ * 在写入线程中保存缩略图金字塔
+ * 复制 data 中的缩略图后立即返回，缩小和编码由写入线程完成，适合在需要尽快
+ * 返回的回调函数中调用。
+ */
+int ThumbDB_SaveLevelsAsync( ThumbDB tdb, const FileFingerprint fp,
+			     ThumbData data );
+
+/** 更新缩略图金字塔中各级的修改时间 */
+int ThumbDB_SetLevelsModifyTime( ThumbDB tdb, const FileFingerprint fp,
+				 uint32_t modify_time );
+
+/**
+ * 从缩略图金字塔中载入满足尺寸要求的缩略图
+ * 从能满足要求的最小一级开始查找，找到后缩小到 width 和 height 限定的尺寸。
+ * @param[in] width 最大宽度，为 0 时不限制
+ * @param[in] height 最大高度，为 0 时不限制
+ * @returns 成功时返回 0，找到的各级尺寸都不够时返回 -ERANGE，此时需要
+ *  单独生成指定尺寸的缩略图
+ */
+int ThumbDB_LoadLevel( ThumbDB tdb, const FileFingerprint fp,
+		       int width, int height, ThumbData data );
+
+/**
+ * 判断缩略图金字塔能否满足尺寸要求
+ * 按原图尺寸推算最大一级的尺寸，很宽的全景图或者很高的长图满足不了时，需要
+ * 直接生成指定尺寸的缩略图，不必先生成金字塔。
+ * @param[in] origin_width 原图宽度，原图尺寸未知时为 0
+ * @param[in] origin_height 原图高度，原图尺寸未知时为 0
+ */
+LCUI_BOOL ThumbDB_LevelsFit( int origin_width, int origin_height,
+			     int width, int height );
+
+/** 判断是否已有文件的缩略图金字塔，只查找索引，不读取缩略图数据 */
+LCUI_BOOL ThumbDB_HasLevels( ThumbDB tdb, const FileFingerprint fp );
 
-/** 将缩略图数据保存至缓存中 */
-int ThumbDB_Save( ThumbDB tdb, const char *filepath, ThumbData data );
+/** 获取数据库文件占用的空间大小 */
+int64_t ThumbDB_GetSize( ThumbDB tdb );
 
 #endif
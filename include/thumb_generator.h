@@ -0,0 +1,95 @@
+﻿/* ***************************************************************************
+ * thumb_generator.h -- background thumbnail generation.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_generator.h -- 在空闲时预先生成缩略图。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#ifndef LCFINDER_THUMB_GENERATOR_H
+#define LCFINDER_THUMB_GENERATOR_H
+
+LCFINDER_BEGIN_HEADER
+
+/** 用户操作后，需要等待多久才继续生成缩略图（毫秒） */
+#define THUMB_GENERATOR_IDLE_TIME	3000
+
+/** 缩略图生成器的状态 */
+enum ThumbGeneratorState {
+	THUMB_GENERATOR_STOPPED,	/**< 未运行 */
+	THUMB_GENERATOR_RUNNING,	/**< 正在生成 */
+	THUMB_GENERATOR_PAUSED,		/**< 用户正在操作，暂停生成 */
+	THUMB_GENERATOR_FINISHED	/**< 全部文件都已处理完 */
+};
+
+typedef struct ThumbGeneratorStatusRec_ {
+	int state;		/**< 当前状态 */
+	size_t total;		/**< 文件总数 */
+	size_t count;		/**< 已处理的文件数量 */
+	size_t generated;	/**< 本次新生成缩略图的文件数量 */
+} ThumbGeneratorStatusRec, *ThumbGeneratorStatus;
+
+/**
+ * 初始化缩略图生成器
+ * 生成器在空闲时按时间线的顺序为文件预先生成缩略图金字塔，处理进度保存在
+ * 缩略图数据库所在的目录中，程序重启后可以继续处理。
+ * @param[in] db 缩略图数据库，数据库重新打开后仍然有效
+ * @param[in] storage 用于获取缩略图的文件服务连接
+ * @param[in] dirpath 存放进度文件的目录
+ */
+int ThumbGenerator_Init( ThumbDB *db, int storage, const wchar_t *dirpath );
+
+/**
+ * 开始生成缩略图
+ * @param[in] dirs 需要处理的源文件夹列表，生成器会保存一份副本
+ * @param[in] restart 是否从头开始，有新增文件时应该从头开始，已有缩略图的
+ *  文件会被很快跳过
+ */
+void ThumbGenerator_Start( DB_Dir *dirs, size_t n_dirs, LCUI_BOOL restart );
+
+/**
+ * 停止生成缩略图
+ * @param[in] reset 是否清除处理进度，在缩略图数据库被清除时使用
+ */
+void ThumbGenerator_Stop( LCUI_BOOL reset );
+
+/** 通知生成器用户正在操作，生成器会暂停一段时间 */
+void ThumbGenerator_Touch( void );
+
+/** 获取当前状态 */
+void ThumbGenerator_GetStatus( ThumbGeneratorStatus status );
+
+/** 停止生成并保存处理进度 */
+void ThumbGenerator_Exit( void );
+
+LCFINDER_END_HEADER
+
+#endif
@@ -67,6 +67,12 @@ void ThumbView_SetCache( LCUI_Widget w, ThumbCache cache );
 /** 设置文件存储服务的连接标识符 */
 void ThumbView_SetStorage( LCUI_Widget w, int storage );
 
+/**
+ * 设置最多同时运行多少个缩略图加载器
+ * 默认与处理器核心数量相同，多个加载器的请求可以由文件服务并行处理。
+ */
+void ThumbView_SetMaxLoaders( LCUI_Widget w, size_t n );
+
 /** 启用缩略图滚动加载功能 */
 void ThumbView_EnableScrollLoading( LCUI_Widget w );
 
@@ -69,6 +69,28 @@ int SelectFolder( char *dirpath, int max_len )
 	return LCUI_EncodeString( dirpath, wdirpath, max_len, ENCODING_UTF8 );
 }
 
+void LCFinder_InitLicense( void )
+{
+	finder.license.is_active = TRUE;
+	finder.license.is_trial = FALSE;
+}
+
+void SelectFolderAsyncW( void( *callback )(const wchar_t*, const wchar_t*) )
+{
+	wchar_t wdirpath[MAX_DIRPATH_LEN];
+	LCUI_Widget window = LCUIWidget_GetById( ID_WINDOW_MAIN );
+	if( 0 == LCUIDialog_Prompt( window, DIALOG_TITLE_ADD_DIR,
+				    DIALOG_PLACEHOLDER_ADD_DIR, NULL,
+				    wdirpath, MAX_DIRPATH_LEN, CheckDir ) ) {
+		callback( wdirpath, NULL );
+	}
+}
+
+void RemoveFolderAccessW( const wchar_t *token )
+{
+
+}
+
 int GetAppDataFolderW( wchar_t *buf, int max_len )
 {
 	return -1;
@@ -45,6 +45,8 @@
 #include "i18n.h"
 #include "ui.h"
 #include "file_storage.h"
+#include "file_worker.h"
+#include "thumb_generator.h"
 #include <LCUI/font/charset.h>
 
 #define DEBUG
@@ -54,6 +56,8 @@
 #define STORAGE_FILE	L"storage.db"
 
 #define THUMB_CACHE_SIZE (64*1024*1024)
+/** 每次同步时最多为多少个旧文件补算文件指纹 */
+#define FINGERPRINT_BACKFILL_LIMIT 512
 
 #ifdef ASSERT
 #undef ASSERT
@@ -63,9 +67,17 @@
 
 Finder finder;
 
+/** 已删除的文件，用于识别被移动或重命名的文件 */
+typedef struct DeletedFileRec_ {
+	DB_Dir dir;		/**< 所属源文件夹 */
+	char *path;		/**< 文件路径 */
+} DeletedFileRec, *DeletedFile;
+
 typedef struct DirStatusDataPackRec_ {
 	FileSyncStatus status;
 	DB_Dir dir;
+	Dict *deleted_files;	/**< 已删除的文件，以文件指纹作为索引 */
+	Dict *moved_files;	/**< 已被移动的文件，以原文件路径作为索引 */
 } DirStatusDataPackRec, *DirStatusDataPack;
 
 typedef struct EventPackRec_ {
@@ -73,8 +85,15 @@ typedef struct EventPackRec_ {
 	void *data;
 } EventPackRec, *EventPack;
 
+/** 正在扫描的目录 */
+typedef struct FileSyncDirRec_ {
+	wchar_t *path;		/**< 目录路径 */
+	size_t refs;		/**< 引用计数，为 0 时说明该目录已扫描完 */
+} FileSyncDirRec, *FileSyncDir;
+
 typedef struct FileSyncDataPackRec_ {
 	FileSyncStatus status;
+	FileSyncDir dir;
 	wchar_t *path;
 	size_t path_len;
 } FileSyncDataPackRec, *FileSyncDataPack;
@@ -111,30 +130,22 @@ DB_Dir LCFinder_GetDir( const char *dirpath )
 	return NULL;
 }
 
-static wchar_t *LCFinder_CreateThumbDB( const char *dirpath )
+/** 删除旧版本中按源文件夹划分的缩略图数据库 */
+static void LCFinder_RemoveLegacyThumbDB( const char *dirpath )
 {
-	int len;
-	ThumbDB db;
-	char dbpath[PATH_LEN], path[PATH_LEN], name[44];
+	char name[44];
+	wchar_t wname[44], wpath[PATH_LEN];
 
-	strcpy( path, dirpath );
-	EncodeSHA1( name, path, strlen(path) );
-	LCUI_EncodeString( dbpath, finder.thumbs_dir,
-			   PATH_LEN - 1, ENCODING_UTF8 );
-	len = pathjoin( dbpath, dbpath, name ) + 1;
-	db = ThumbDB_Open( dbpath );
-	if( !db ) {
-		return NULL;
-	}
-	Dict_Add( finder.thumb_dbs, path, db );
-	return DecodeUTF8( dbpath );
+	EncodeSHA1( name, dirpath, strlen( dirpath ) );
+	LCUI_DecodeString( wname, name, 44, ENCODING_UTF8 );
+	wpathjoin( wpath, finder.thumbs_dir, wname );
+	wremove( wpath );
 }
 
 DB_Dir LCFinder_AddDir( const char *dirpath, const char *token, int visible )
 {
 	char *path;
 	size_t i, len;
-	wchar_t **paths;
 	DB_Dir dir, *dirs;
 	len = strlen( dirpath );
 	path = malloc( (len + 2) * sizeof( char ) );
@@ -162,16 +173,8 @@ DB_Dir LCFinder_AddDir( const char *dirpath, const char *token, int visible )
 		finder.n_dirs -= 1;
 		return NULL;
 	}
-	paths = realloc( finder.thumb_paths,
-			 sizeof( wchar_t* )*finder.n_dirs );
-	if( !path ) {
-		finder.n_dirs -= 1;
-		return NULL;
-	}
 	dirs[i] = dir;
-	paths[i] = LCFinder_CreateThumbDB( dir->path );
 	finder.dirs = dirs;
-	finder.thumb_paths = paths;
 	return dir;
 }
 
@@ -200,13 +203,6 @@ void LCFinder_DeleteDir( DB_Dir dir )
 		free( wtoken );
 	}
 	free( wpath );
-	/* 准备清除缩略图数据库 */
-	wpath = finder.thumb_paths[i];
-	finder.thumb_paths[i] = NULL;
-	Dict_Delete( finder.thumb_dbs, dir->path );
-#ifdef _WIN32
-	_wremove( wpath );
-#endif
 	/* 删除数据库中的源文件夹记录 */
 	DB_DeleteDir( dir );
 	free( dir->path );
@@ -260,27 +256,90 @@ size_t LCFinder_DeleteFiles( const char **files, size_t nfiles,
 	return i;
 }
 
+static void GetFingerprintKey( char *key, const FileFingerprint fp )
+{
+	sprintf( key, "%lld:%016llx", (long long)fp->size,
+		 (unsigned long long)fp->hash );
+}
+
+static void OnDeleteDeletedFile( void *privdata, void *data )
+{
+	DeletedFile file = data;
+	free( file->path );
+	free( file );
+}
+
+/** 收集已删除的文件的指纹，以便在新增文件中找出被移动的文件 */
+static void CollectDeletedFile( void *data, const FileInfo info )
+{
+	char key[48];
+	char path[PATH_LEN];
+	DeletedFile file;
+	FileFingerprintRec fp;
+	DirStatusDataPack pack = data;
+	LCUI_EncodeString( path, info->path, PATH_LEN, ENCODING_UTF8 );
+	if( DB_GetFileFingerprint( path, &fp.size, &fp.hash ) != 0 ||
+	    fp.size < 0 ) {
+		return;
+	}
+	GetFingerprintKey( key, &fp );
+	/* 内容相同的文件有多个时无法确定对应关系，只取第一个 */
+	if( Dict_FetchValue( pack->deleted_files, key ) ) {
+		return;
+	}
+	file = NEW( DeletedFileRec, 1 );
+	file->dir = pack->dir;
+	file->path = strdup( path );
+	Dict_Add( pack->deleted_files, key, file );
+}
+
 static void SyncAddedFile( void *data, const FileInfo info )
 {
+	char key[48];
 	char path[PATH_LEN];
+	DeletedFile file = NULL;
+	FileFingerprintRec fp;
 	DirStatusDataPack pack = data;
 	int ctime = (int)info->ctime;
 	int mtime = (int)info->mtime;
 	pack->status->synced_files += 1;
 	LCUI_EncodeString( path, info->path, PATH_LEN, ENCODING_UTF8 );
+	/* 没有可以匹配的已删除文件时不必读取文件，留给 SyncFingerprints() 补算 */
+	if( Dict_Size( pack->deleted_files ) < 1 ||
+	    wgetfilefingerprint( info->path, &fp ) != 0 ) {
+		DB_AddFile( pack->dir, path, ctime, mtime );
+		return;
+	}
+	GetFingerprintKey( key, &fp );
+	file = Dict_FetchValue( pack->deleted_files, key );
+	if( file && !Dict_FetchValue( pack->moved_files, file->path ) ) {
+		/* 内容与已删除的文件相同，视为移动，保留标签和评分，
+		 * 缩略图按文件内容存储，无需移动 */
+		DB_MoveFile( pack->dir, file->path, path, ctime, mtime );
+		Dict_Add( pack->moved_files, file->path, file );
+		return;
+	}
 	DB_AddFile( pack->dir, path, ctime, mtime );
+	DB_SetFileFingerprint( path, fp.size, fp.hash );
 	//wprintf(L"sync: add file: %s, ctime: %d\n", wpath, ctime);
 }
 
 static void SyncChangedFile( void *data, const FileInfo info )
 {
 	char path[PATH_LEN];
+	FileFingerprintRec fp;
 	int ctime = (int)info->ctime;
 	int mtime = (int)info->mtime;
 	DirStatusDataPack pack = data;
 	pack->status->synced_files += 1;
 	LCUI_EncodeString( path, info->path, PATH_LEN, ENCODING_UTF8 );
 	DB_UpdateFileTime( pack->dir, path, ctime, mtime );
+	/* 文件内容可能已改变，需更新文件指纹 */
+	if( wgetfilefingerprint( info->path, &fp ) != 0 ) {
+		fp.size = -1;
+		fp.hash = 0;
+	}
+	DB_SetFileFingerprint( path, fp.size, fp.hash );
 }
 
 static void SyncDeletedFile( void *data, const FileInfo info )
@@ -289,10 +348,42 @@ static void SyncDeletedFile( void *data, const FileInfo info )
 	DirStatusDataPack pack = data;
 	pack->status->synced_files += 1;
 	LCUI_EncodeString( path, info->path, PATH_LEN, ENCODING_UTF8 );
+	if( Dict_FetchValue( pack->moved_files, path ) ) {
+		return;
+	}
 	DB_DeleteFile( path );
 	//wprintf(L"sync: delete file: %s\n", wpath);
 }
 
+/**
+ * 为尚未计算文件指纹的文件补算指纹
+ * 每次只处理一部分，以免在首次升级后的同步中花费太多时间。无法读取的文件的
+ * 大小会被记为 -1，不会参与移动检测。
+ */
+static void SyncFingerprints( void )
+{
+	int i, n;
+	char **paths;
+	wchar_t *wpath;
+	FileFingerprintRec fp;
+	n = DB_GetFilesWithoutFingerprint( &paths,
+					   FINGERPRINT_BACKFILL_LIMIT );
+	if( n < 0 ) {
+		return;
+	}
+	for( i = 0; i < n; ++i ) {
+		wpath = DecodeUTF8( paths[i] );
+		if( wgetfilefingerprint( wpath, &fp ) != 0 ) {
+			fp.size = -1;
+			fp.hash = 0;
+		}
+		DB_SetFileFingerprint( paths[i], fp.size, fp.hash );
+		free( paths[i] );
+		free( wpath );
+	}
+	free( paths );
+}
+
 DB_Dir LCFinder_GetSourceDir( const char *filepath )
 {
 	size_t i;
@@ -331,90 +422,146 @@ size_t LCFinder_GetSourceDirList( DB_Dir **outdirs )
 
 int64_t LCFinder_GetThumbDBTotalSize( void )
 {
-	size_t i;
-	struct stat buf;
-	int64_t sum_size;
-
-	for( i = 0, sum_size = 0; i < finder.n_dirs; ++i ) {
-		if( !finder.thumb_paths[i] ) {
-			continue;
-		}
-		if( wgetfilestat( finder.thumb_paths[i], &buf ) == 0) {
-			sum_size += buf.st_size;
-		}
+	if( !finder.thumb_db ) {
+		return 0;
 	}
-	return sum_size;
+	return ThumbDB_GetSize( finder.thumb_db );
 }
 
-void LCFinder_SwitchTask( FileSyncStatus s );
-void LCFinder_ScanDir( FileSyncStatus s, const wchar_t *path );
+static void LCFinder_SwitchTask( FileSyncStatus s );
+static void LCFinder_ScanDir( FileSyncStatus s, const wchar_t *path );
 
 static void LCFinder_OnScanFinished( FileSyncStatus s )
 {
 	size_t i;
-	if( s->task_i < finder.n_dirs - 1 ) {
+	SyncTask t;
+	unsigned int generation;
+	DirStatusDataPackRec pack;
+
+	if( s->task ) {
+		t = s->task;
+		s->task = NULL;
+		s->added_files += t->added_files;
+		s->deleted_files += t->deleted_files;
+		s->changed_files += t->changed_files;
+		SyncTask_Finish( t );
+	}
+	if( s->task_i + 1 < finder.n_dirs ) {
 		s->task_i += 1;
-		if( s->task ) {
-			s->added_files += s->task->added_files;
-			s->deleted_files += s->task->deleted_files;
-			s->changed_files += s->task->changed_files;
-			SyncTask_Finish( s->task );
-		}
 		LCFinder_SwitchTask( s );
 		return;
 	}
-	DB_Begin();
 	s->state = STATE_SAVING;
 	LOG( "\n\nstart sync\n" );
+	/* 先在同步日志中记录将要提交的代号，若在提交过程中程序被中断，
+	 * 下次启动时可根据数据库中的代号判断文件数据库是否已提交 */
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		t = s->tasks[i];
+		if( t && finder.dirs[i] ) {
+			generation = DB_GetDirSyncGeneration( finder.dirs[i] );
+			SyncTask_PrepareCommit( t, generation + 1 );
+		}
+	}
+	pack.status = s;
+	pack.deleted_files = StrDict_Create( NULL, OnDeleteDeletedFile );
+	pack.moved_files = StrDict_Create( NULL, NULL );
+	DB_Begin();
+	/* 先收集所有源文件夹中已删除的文件，以便识别跨文件夹移动的文件 */
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		t = s->tasks[i];
+		pack.dir = finder.dirs[i];
+		if( t && pack.dir ) {
+			SyncTask_InDeletedFiles( t, CollectDeletedFile, &pack );
+		}
+	}
 	for( i = 0; i < finder.n_dirs; ++i ) {
-		DirStatusDataPackRec pack;
+		t = s->tasks[i];
 		pack.dir = finder.dirs[i];
-		if( !pack.dir ) {
+		if( t && pack.dir ) {
+			SyncTask_InAddedFiles( t, SyncAddedFile, &pack );
+		}
+	}
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		t = s->tasks[i];
+		pack.dir = finder.dirs[i];
+		if( !t || !pack.dir ) {
 			continue;
 		}
-		pack.status = s;
-		s->task = s->tasks[i];
-		SyncTask_InAddedFiles( s->task, SyncAddedFile, &pack );
-		SyncTask_InDeletedFiles( s->task, SyncDeletedFile, &pack );
-		SyncTask_InChangedFiles( s->task, SyncChangedFile, &pack );
-		SyncTask_Commit( s->task );
-		SyncTask_Delete( s->task );
-		s->task = NULL;
+		SyncTask_InDeletedFiles( t, SyncDeletedFile, &pack );
+		SyncTask_InChangedFiles( t, SyncChangedFile, &pack );
+		DB_SetDirSyncGeneration( pack.dir, t->generation );
 	}
+	SyncFingerprints();
 	DB_Commit();
+	StrDict_Release( pack.moved_files );
+	StrDict_Release( pack.deleted_files );
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		t = s->tasks[i];
+		if( !t ) {
+			continue;
+		}
+		if( finder.dirs[i] ) {
+			SyncTask_Commit( t );
+		}
+		SyncTask_Delete( t );
+		s->tasks[i] = NULL;
+	}
 	LOG( "\n\nend sync\n" );
 	s->state = STATE_FINISHED;
 	s->task = NULL;
 	s->task_i = 0;
 	free( s->tasks );
 	s->tasks = NULL;
+	LCUIMutex_Destroy( &s->mutex );
 	if( s->callback ) {
 		s->callback( s->data );
 	}
 }
 
+/** 判断当前任务是否已扫描完，需在加锁后调用 */
+static LCUI_BOOL LCFinder_IsScanFinished( FileSyncStatus s )
+{
+	return s->scaned_dirs == s->dirs && s->scaned_files == s->files;
+}
+
+/** 释放对目录的引用，若该目录已扫描完则记录到同步日志，需在加锁后调用 */
+static void LCFinder_ReleaseDir( FileSyncStatus s, FileSyncDir dir )
+{
+	dir->refs -= 1;
+	if( dir->refs > 0 ) {
+		return;
+	}
+	SyncTask_FinishDirW( s->task, dir->path );
+	free( dir->path );
+	free( dir );
+}
+
 static void LCFinder_OnScanFile( FileStatus *status, void *data )
 {
+	LCUI_BOOL finished;
 	unsigned int ctime, mtime;
 	FileSyncDataPack pack = data;
+	FileSyncStatus s = pack->status;
 
-	if( !status ) {
-		goto finish;
-	}
-	ctime = (unsigned int)status->ctime;
-	mtime = (unsigned int)status->mtime;
-	SyncTask_AddFileW( pack->status->task, pack->path, ctime, mtime );
-finish:
-	pack->status->scaned_files += 1;
-	if( pack->status->scaned_dirs == pack->status->dirs &&
-	    pack->status->scaned_files == pack->status->files ) {
-		LCFinder_OnScanFinished( pack->status );
+	if( status ) {
+		ctime = (unsigned int)status->ctime;
+		mtime = (unsigned int)status->mtime;
+		SyncTask_AddFileW( s->task, pack->path, ctime, mtime );
 	}
+	LCUIMutex_Lock( &s->mutex );
+	s->scaned_files += 1;
+	LCFinder_ReleaseDir( s, pack->dir );
+	finished = LCFinder_IsScanFinished( s );
+	LCUIMutex_Unlock( &s->mutex );
 	free( pack->path );
 	free( pack );
+	if( finished ) {
+		LCFinder_OnScanFinished( s );
+	}
 }
 
-static void LCFinder_ScanFile( FileSyncStatus s, const wchar_t *path )
+static void LCFinder_ScanFile( FileSyncStatus s, FileSyncDir dir,
+			       const wchar_t *path )
 {
 	FileSyncDataPack pack;
 	size_t len = wcslen( path );
@@ -425,9 +572,13 @@ static void LCFinder_ScanFile( FileSyncStatus s, const wchar_t *path )
 		len -= 1;
 	}
 	pack->status = s;
+	pack->dir = dir;
 	pack->path[len] = 0;
 	pack->path_len = len;
-	pack->status->files += 1;
+	LCUIMutex_Lock( &s->mutex );
+	s->files += 1;
+	dir->refs += 1;
+	LCUIMutex_Unlock( &s->mutex );
 	FileStorage_GetStatus( finder.storage, path, FALSE,
 			       LCFinder_OnScanFile, pack );
 }
@@ -435,54 +586,77 @@ static void LCFinder_ScanFile( FileSyncStatus s, const wchar_t *path )
 static void LCFinder_OnScanDir( FileStatus *status,
 				FileStream stream, void *data )
 {
-	char *p;
-	char buf[PATH_LEN];
-	size_t max_len;
-	wchar_t *name;
-	wchar_t path[PATH_LEN];
+	size_t len, max_len = 0;
+	wchar_t *name, *path = NULL, *buf;
+	LCUI_BOOL finished;
+	FileDirEntry entry;
 	FileSyncDataPack pack = data;
+	FileSyncStatus s = pack->status;
 	
 	if( !status || !stream ) {
 		goto finish;
 	}
-	path[PATH_LEN - 1] = 0;
-	name = path + pack->path_len;
-	max_len = PATH_LEN - pack->path_len - 1;
-	wcsncpy( path, pack->path, PATH_LEN - 1 );
-	if( path[pack->path_len - 1] != PATH_SEP ) {
-		path[pack->path_len] = PATH_SEP;
-		path[pack->path_len + 1] = 0;
-		name += 1;
-	}
-	while( 1 ) {
-		p = FileStream_ReadLine( stream, buf, PATH_LEN - 1 );
-		if( !p ) {
-			break;
+	while( FileStream_ReadDirEntry( stream, &entry ) ) {
+		/* UTF-8 编码的字节数不少于解码后的字符数 */
+		len = pack->path_len + entry.name_len + 2;
+		if( len > max_len ) {
+			buf = realloc( path, sizeof( wchar_t ) * len );
+			if( !buf ) {
+				break;
+			}
+			path = buf;
+			max_len = len;
+			wcsncpy( path, pack->path, pack->path_len );
+			path[pack->path_len] = PATH_SEP;
+		}
+		name = path + pack->path_len + 1;
+		len = LCUI_DecodeString( name, entry.name, entry.name_len + 1,
+					 ENCODING_UTF8 );
+		name[len] = 0;
+		if( entry.type == FILE_TYPE_DIRECTORY ) {
+			/* 跳过已扫描完或已在扫描队列中的目录 */
+			if( SyncTask_AddDirW( s->task, path ) ) {
+				LCFinder_ScanDir( s, path );
+			}
+			continue;
 		}
-		buf[PATH_LEN - 1] = 0;
-		buf[strlen( buf ) - 1] = 0;
-		LCUI_DecodeString( name, buf + 1, max_len, ENCODING_UTF8 );
-		if( buf[0] == 'd' ) {
-			LCFinder_ScanDir( pack->status, path );
+		/* 列表项已附带文件时间，不必再逐个获取文件状态 */
+		if( entry.with_status ) {
+			SyncTask_AddFileW( s->task, path,
+					   (unsigned int)entry.ctime,
+					   (unsigned int)entry.mtime );
+			LCUIMutex_Lock( &s->mutex );
+			s->files += 1;
+			s->scaned_files += 1;
+			LCUIMutex_Unlock( &s->mutex );
 			continue;
 		}
-		LCFinder_ScanFile( pack->status, path );
+		LCFinder_ScanFile( s, pack->dir, path );
 	}
+	free( path );
 
 finish:
-	pack->status->scaned_dirs += 1;
-	if( pack->status->scaned_dirs == pack->status->dirs &&
-	    pack->status->scaned_files == pack->status->files ) {
-		LCFinder_OnScanFinished( pack->status );
-	}
+	LCUIMutex_Lock( &s->mutex );
+	s->scaned_dirs += 1;
+	LCFinder_ReleaseDir( s, pack->dir );
+	finished = LCFinder_IsScanFinished( s );
+	LCUIMutex_Unlock( &s->mutex );
 	free( pack->path );
 	free( pack );
+	if( finished ) {
+		LCFinder_OnScanFinished( s );
+	}
 }
 
 static void LCFinder_ScanDir( FileSyncStatus s, const wchar_t *path )
 {
+	FileSyncDir dir;
 	FileSyncDataPack pack;
 	size_t len = wcslen( path );
+	dir = NEW( FileSyncDirRec, 1 );
+	dir->path = malloc( sizeof( wchar_t ) * (len + 1) );
+	wcsncpy( dir->path, path, len + 1 );
+	dir->refs = 1;
 	pack = NEW( FileSyncDataPackRec, 1 );
 	pack->path = malloc( sizeof( wchar_t ) * (len + 1) );
 	wcsncpy( pack->path, path, len );
@@ -490,32 +664,69 @@ static void LCFinder_ScanDir( FileSyncStatus s, const wchar_t *path )
 		len -= 1;
 	}
 	pack->status = s;
+	pack->dir = dir;
 	pack->path[len] = 0;
 	pack->path_len = len;
-	pack->status->dirs += 1;
-	FileStorage_GetFile( finder.storage_for_scan,
+	LCUIMutex_Lock( &s->mutex );
+	s->dirs += 1;
+	LCUIMutex_Unlock( &s->mutex );
+	FileStorage_ScanDir( finder.storage_for_scan,
 			     path, LCFinder_OnScanDir, pack );
 }
 
+static void LCFinder_OnPendingDir( void *data, const wchar_t *path )
+{
+	LCFinder_ScanDir( data, path );
+}
+
+/** 从上次中断处继续扫描 */
+static void LCFinder_ResumeTask( FileSyncStatus s )
+{
+	LCUI_BOOL finished;
+	if( s->task->journal_state != SYNC_JOURNAL_SCANNING ) {
+		LCFinder_OnScanFinished( s );
+		return;
+	}
+	/* 在分派完所有待扫描的目录之前占用一个目录计数，以免扫描
+	 * 速度较快时被提前判定为已扫描完 */
+	LCUIMutex_Lock( &s->mutex );
+	s->dirs += 1;
+	LCUIMutex_Unlock( &s->mutex );
+	SyncTask_InPendingDirs( s->task, LCFinder_OnPendingDir, s );
+	LCUIMutex_Lock( &s->mutex );
+	s->scaned_dirs += 1;
+	finished = LCFinder_IsScanFinished( s );
+	LCUIMutex_Unlock( &s->mutex );
+	if( finished ) {
+		LCFinder_OnScanFinished( s );
+	}
+}
+
 static void LCFinder_SwitchTask( FileSyncStatus s )
 {
 	DB_Dir dir;
 	wchar_t *path;
 	s->task = s->tasks[s->task_i];
-	if( s->task ) {
-		SyncTask_Start( s->task );
-		dir = finder.dirs[s->task_i];
-		path = DecodeUTF8( dir->path );
-		LCFinder_ScanDir( s, path );
-		free( path );
-	} else {
+	if( !s->task ) {
 		LCFinder_OnScanFinished( s );
+		return;
 	}
+	SyncTask_Start( s->task );
+	if( s->task->resumed ) {
+		LCFinder_ResumeTask( s );
+		return;
+	}
+	dir = finder.dirs[s->task_i];
+	path = DecodeUTF8( dir->path );
+	SyncTask_AddDirW( s->task, path );
+	LCFinder_ScanDir( s, path );
+	free( path );
 }
 
 void LCFinder_SyncFilesAsync( FileSyncStatus s )
 {
 	size_t i;
+	unsigned int generation;
 	wchar_t path[PATH_LEN];
 	path[PATH_LEN - 1] = 0;
 	s->task_i = 0;
@@ -524,11 +735,13 @@ void LCFinder_SyncFilesAsync( FileSyncStatus s )
 	s->files = 0;
 	s->dirs = 0;
 	s->added_files = 0;
+	s->changed_files = 0;
 	s->synced_files = 0;
 	s->scaned_files = 0;
 	s->scaned_dirs = 0;
 	s->deleted_files = 0;
 	s->state = STATE_STARTED;
+	LCUIMutex_Init( &s->mutex );
 	if( finder.n_dirs < 1 ) {
 		s->tasks = NULL;
 		LCFinder_OnScanFinished( s );
@@ -543,28 +756,18 @@ void LCFinder_SyncFilesAsync( FileSyncStatus s )
 		LCUI_DecodeString( path, dir->path,
 				   PATH_LEN - 1, ENCODING_UTF8 );
 		s->tasks[i] = SyncTask_NewW( finder.fileset_dir, path );
+		/* 完成上次被中断的提交 */
+		generation = DB_GetDirSyncGeneration( dir );
+		SyncTask_Recover( s->tasks[i], generation );
 	}
 	LCFinder_SwitchTask( s );
 }
 
-/** 初始化工作目录 */
-static int LCFinder_InitWorkDir( void )
+/** 初始化数据目录，文件数据库、文件列表缓存和缩略图数据库都存放在其中 */
+static int LCFinder_InitDataDir( const wchar_t *data_dir )
 {
 	size_t len, tdir_len, fdir_len;
-	wchar_t data_dir[PATH_LEN];
 	wchar_t *dirs[2] = { L"fileset", L"thumbs" };
-	if( GetAppInstalledLocationW( data_dir, PATH_LEN ) != 0 ) {
-		LOG( "[workdir] error\n" );
-		return -1;
-	}
-	len = wcslen( data_dir ) + 1;
-	finder.work_dir = NEW( wchar_t, len );
-	wcsncpy( finder.work_dir, data_dir, len );
-	wchdir( finder.work_dir );
-	if( GetAppDataFolderW( data_dir, PATH_LEN ) != 0 ) {
-		LOG( "[workdir] error\n" );
-		return -1;
-	}
 	len = wcslen( data_dir ) + 2;
 	tdir_len = len + wcslen( dirs[0] );
 	fdir_len = len + wcslen( dirs[1] );
@@ -576,11 +779,31 @@ static int LCFinder_InitWorkDir( void )
 	wpathjoin( finder.thumbs_dir, data_dir, dirs[1] );
 	wmkdir( finder.fileset_dir );
 	wmkdir( finder.thumbs_dir );
-	LOGW( L"[workdir] work path: %s\n", finder.work_dir );
 	LOGW( L"[workdir] data path: %s\n", finder.data_dir );
 	return 0;
 }
 
+/** 初始化工作目录 */
+static int LCFinder_InitWorkDir( void )
+{
+	size_t len;
+	wchar_t data_dir[PATH_LEN];
+	if( GetAppInstalledLocationW( data_dir, PATH_LEN ) != 0 ) {
+		LOG( "[workdir] error\n" );
+		return -1;
+	}
+	len = wcslen( data_dir ) + 1;
+	finder.work_dir = NEW( wchar_t, len );
+	wcsncpy( finder.work_dir, data_dir, len );
+	wchdir( finder.work_dir );
+	LOGW( L"[workdir] work path: %s\n", finder.work_dir );
+	if( GetAppDataFolderW( data_dir, PATH_LEN ) != 0 ) {
+		LOG( "[workdir] error\n" );
+		return -1;
+	}
+	return LCFinder_InitDataDir( data_dir );
+}
+
 DB_Tag LCFinder_GetTag( const char *tagname )
 {
 	size_t i;
@@ -753,29 +976,21 @@ static int LCFinder_InitLanguage( void )
 	return -1;
 }
 
-static void ThumbDBDict_ValDel( void *privdata, void *val )
-{
-	ThumbDB_Close( val );
-}
-
 /** 初始化缩略图数据库 */
 static int LCFinder_InitThumbDB( void )
 {
 	size_t i;
-	wchar_t *path;
 	LOG("[thumbdb] init ...\n");
-	finder.thumb_dbs = StrDict_Create( NULL, ThumbDBDict_ValDel );
-	finder.thumb_paths = malloc( sizeof( wchar_t* )*finder.n_dirs );
-	if( !finder.thumb_dbs || !finder.thumb_paths ) {
-		return -ENOMEM;
-	}
+	ThumbDB_SetCodecFromEnv();
 	for( i = 0; i < finder.n_dirs; ++i ) {
-		if( !finder.dirs[i] ) {
-			continue;
+		if( finder.dirs[i] ) {
+			LCFinder_RemoveLegacyThumbDB( finder.dirs[i]->path );
 		}
-		path = LCFinder_CreateThumbDB( finder.dirs[i]->path );
-		finder.thumb_paths[i] = path;
-		LOGW(L"[thumbdb] %d: %s\n", i, path);
+	}
+	finder.thumb_db = ThumbDB_Open( finder.thumbs_dir );
+	if( !finder.thumb_db ) {
+		LOGW( L"[thumbdb] cannot open db: %s\n", finder.thumbs_dir );
+		return -1;
 	}
 	LOG("[thumbdb] init done\n");
 	return 0;
@@ -784,54 +999,98 @@ static int LCFinder_InitThumbDB( void )
 /** 退出缩略图数据库 */
 static void LCFinder_ExitThumbDB( void )
 {
-	size_t i;
-	if( !finder.thumb_dbs ) {
+	if( !finder.thumb_db ) {
 		return;
 	}
 	LOG("[thumbdb] exit ..\n");
-	Dict_Release( finder.thumb_dbs );
-	for( i = 0; i < finder.n_dirs; ++i ) {
-		free( finder.thumb_paths[i] );
-		finder.thumb_paths[i] = NULL;
-	}
-	free( finder.thumb_paths );
-	finder.thumb_paths = NULL;
-	finder.thumb_dbs = NULL;
+	ThumbDB_Close( finder.thumb_db );
+	finder.thumb_db = NULL;
 	LOG("[thumbdb] exit done\n");
 }
 
 /** 清除缩略图数据库 */
 void LCFinder_ClearThumbDB( void )
 {
-	size_t i;
-	wchar_t *path;
-	Dict_Release( finder.thumb_dbs );
-	for( i = 0; i < finder.n_dirs; ++i ) {
-		path = finder.thumb_paths[i];
-		finder.thumb_paths[i] = NULL;
-#ifdef _WIN32
-		_wremove( path );
-#endif
-		free( path );
-	}
-	free( finder.thumb_paths );
-	finder.thumb_paths = NULL;
-	finder.thumb_dbs = NULL;
+	ThumbGenerator_Stop( TRUE );
+	LCFinder_ExitThumbDB();
+	ThumbDB_Remove( finder.thumbs_dir );
 	LCFinder_InitThumbDB();
 	LCFinder_TriggerEvent( EVENT_THUMBDB_DEL_DONE, NULL );
 }
 
+/**
+ * 在同步完成后开始预先生成缩略图
+ * 有新增或改变的文件时从头开始处理，否则继续上次未完成的处理。私人空间中的
+ * 文件不会被处理。
+ */
+static void OnSyncDone( void *privdata, void *arg )
+{
+	size_t i, n;
+	DB_Dir *dirs;
+	FileSyncStatus s = arg;
+	LCUI_BOOL restart = FALSE;
+
+	/* 进度是查询结果中的偏移量，删除文件后继续使用它会漏掉一些文件 */
+	if( s && (s->added_files > 0 || s->changed_files > 0 ||
+		  s->deleted_files > 0) ) {
+		restart = TRUE;
+	}
+	dirs = malloc( (finder.n_dirs + 1) * sizeof( DB_Dir ) );
+	if( !dirs ) {
+		return;
+	}
+	for( n = 0, i = 0; i < finder.n_dirs; ++i ) {
+		if( finder.dirs[i] && finder.dirs[i]->visible ) {
+			dirs[n++] = finder.dirs[i];
+		}
+	}
+	ThumbGenerator_Start( dirs, n, restart );
+	free( dirs );
+}
+
+static int LCFinder_InitThumbGenerator( void )
+{
+	if( ThumbGenerator_Init( &finder.thumb_db, finder.storage_for_idle,
+				 finder.thumbs_dir ) != 0 ) {
+		return -1;
+	}
+	LCFinder_BindEvent( EVENT_SYNC_DONE, OnSyncDone, NULL );
+	return 0;
+}
+
 static int LCFinder_InitFileStorage( void )
 {
 	FileStorage_Init();
 	finder.storage = FileStorage_Connect();
 	finder.storage_for_image = FileStorage_Connect();
+	finder.storage_for_preload = FileStorage_Connect();
 	finder.storage_for_thumb = FileStorage_Connect();
 	finder.storage_for_scan = FileStorage_Connect();
+	finder.storage_for_idle = FileStorage_Connect();
 	ASSERT( finder.storage > 0 );
 	ASSERT( finder.storage_for_image > 0 );
+	ASSERT( finder.storage_for_preload > 0 );
 	ASSERT( finder.storage_for_thumb > 0 );
 	ASSERT( finder.storage_for_scan > 0 );
+	ASSERT( finder.storage_for_idle > 0 );
+	FileStorage_SetPriority( finder.storage, FILE_PRIORITY_SCAN );
+	FileStorage_SetPriority( finder.storage_for_image,
+				 FILE_PRIORITY_PICTURE );
+	FileStorage_SetPriority( finder.storage_for_preload,
+				 FILE_PRIORITY_PRELOAD );
+	FileStorage_SetPriority( finder.storage_for_thumb,
+				 FILE_PRIORITY_THUMB );
+	FileStorage_SetPriority( finder.storage_for_scan,
+				 FILE_PRIORITY_SCAN );
+	FileStorage_SetPriority( finder.storage_for_idle,
+				 FILE_PRIORITY_IDLE );
+	FileStorage_SetName( finder.storage, "storage" );
+	FileStorage_SetName( finder.storage_for_image, "storage_for_image" );
+	FileStorage_SetName( finder.storage_for_preload,
+			     "storage_for_preload" );
+	FileStorage_SetName( finder.storage_for_thumb, "storage_for_thumb" );
+	FileStorage_SetName( finder.storage_for_scan, "storage_for_scan" );
+	FileStorage_SetName( finder.storage_for_idle, "storage_for_idle" );
 	return 0;
 
 error:
@@ -842,8 +1101,10 @@ static void LCFinder_ExitFileStorage( void )
 {
 	FileStorage_Close( finder.storage );
 	FileStorage_Close( finder.storage_for_image );
+	FileStorage_Close( finder.storage_for_preload );
 	FileStorage_Close( finder.storage_for_thumb );
 	FileStorage_Close( finder.storage_for_scan );
+	FileStorage_Close( finder.storage_for_idle );
 	FileStorage_Exit();
 }
 
@@ -964,6 +1225,7 @@ int LCFinder_Init( int argc, char **argv )
 	ASSERT( LCFinder_InitThumbDB() == 0 );
 	ASSERT( LCFinder_InitThumbCache() == 0 );
 	ASSERT( LCFinder_InitFileStorage() == 0 );
+	ASSERT( LCFinder_InitThumbGenerator() == 0 );
 	ASSERT( UI_Init( argc, argv ) == 0 );
 	LCUI_BindEvent( LCUI_QUIT, LCFinder_OnExit, NULL, NULL );
 	finder.state = FINDER_STATE_ACTIVATED;
@@ -974,14 +1236,37 @@ error:
 	return -1;
 }
 
-void LCFinder_Exit( void )
+int LCFinder_InitCore( const wchar_t *data_dir )
 {
-	UI_Exit();
+	LCFinder_InitEvent();
+	ASSERT( LCFinder_InitDataDir( data_dir ) == 0 );
+	ASSERT( LCFinder_InitFileDB() == 0 );
+	ASSERT( LCFinder_InitThumbDB() == 0 );
+	ASSERT( LCFinder_InitThumbCache() == 0 );
+	ASSERT( LCFinder_InitFileStorage() == 0 );
+	ASSERT( LCFinder_InitThumbGenerator() == 0 );
+	finder.state = FINDER_STATE_ACTIVATED;
+	return 0;
+
+error:
+	finder.state = FINDER_STATE_BLOCKED;
+	return -1;
+}
+
+void LCFinder_ExitCore( void )
+{
+	ThumbGenerator_Exit();
 	LCFinder_ExitThumbDB();
 	LCFinder_ExitFileStorage();
 	LCFinder_ExitFileDB();
 }
 
+void LCFinder_Exit( void )
+{
+	UI_Exit();
+	LCFinder_ExitCore();
+}
+
 int LCFinder_Run( void )
 {
 	if( finder.state != FINDER_STATE_ACTIVATED ) {
@@ -991,9 +1276,12 @@ int LCFinder_Run( void )
 	return UI_Run();
 }
 
-#ifndef PLATFORM_WIN32_PC_APP
+#if !defined(PLATFORM_WIN32_PC_APP) && !defined(LCFINDER_NO_MAIN)
 int main( int argc, char **argv )
 {
+	if( argc == 3 && strcmp( argv[1], FILE_WORKER_ARG ) == 0 ) {
+		return FileWorker_Run( atoi( argv[2] ) );
+	}
 	LCFinder_Init( argc, argv );
 	return LCFinder_Run();
 }
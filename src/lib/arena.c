@@ -0,0 +1,139 @@
+﻿/* ***************************************************************************
+ * arena.c -- bump-pointer memory arena
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * arena.c -- 以指针递增方式分配内存的内存池
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define LCFINDER_ARENA_C
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+/** 内存块 */
+typedef struct ArenaBlockRec_ {
+	struct ArenaBlockRec_ *next;	/**< 下一个内存块 */
+	size_t size;			/**< 可用空间大小 */
+	size_t used;			/**< 已使用的空间大小 */
+} ArenaBlockRec, *ArenaBlock;
+
+/** 内存池，以指针递增的方式分配内存 */
+typedef struct ArenaRec_ {
+	ArenaBlock blocks;		/**< 内存块列表，首个为当前使用的块 */
+	size_t block_size;		/**< 默认的内存块大小 */
+	size_t total_size;		/**< 已申请的内存总量 */
+} ArenaRec, *Arena;
+
+#include "arena.h"
+
+#define ARENA_ALIGN		sizeof( void* )
+#define ARENA_ALIGN_SIZE(N)	(((N) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_HEAD_SIZE		ARENA_ALIGN_SIZE( sizeof( ArenaBlockRec ) )
+#define ArenaBlock_GetData(B)	((char*)(B) + ARENA_HEAD_SIZE)
+
+Arena Arena_Create( size_t block_size )
+{
+	Arena arena = malloc( sizeof( ArenaRec ) );
+	if( !arena ) {
+		return NULL;
+	}
+	arena->blocks = NULL;
+	arena->total_size = 0;
+	arena->block_size = block_size > 0 ? block_size : 64 * 1024;
+	return arena;
+}
+
+void Arena_Destroy( Arena arena )
+{
+	ArenaBlock block, next;
+	for( block = arena->blocks; block; block = next ) {
+		next = block->next;
+		free( block );
+	}
+	free( arena );
+}
+
+void *Arena_Alloc( Arena arena, size_t size )
+{
+	void *ptr;
+	size_t block_size;
+	ArenaBlock block = arena->blocks;
+
+	size = ARENA_ALIGN_SIZE( size );
+	if( block && block->size - block->used >= size ) {
+		ptr = ArenaBlock_GetData( block ) + block->used;
+		block->used += size;
+		return ptr;
+	}
+	/* 过大的内存直接单独申请一块，并放在当前块之后，以免浪费当前块的剩余空间 */
+	block_size = size > arena->block_size / 4 ? size : arena->block_size;
+	block = malloc( ARENA_HEAD_SIZE + block_size );
+	if( !block ) {
+		return NULL;
+	}
+	block->size = block_size;
+	block->used = size;
+	arena->total_size += ARENA_HEAD_SIZE + block_size;
+	if( block_size == size && arena->blocks ) {
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+	} else {
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	return ArenaBlock_GetData( block );
+}
+
+char *Arena_StrDup( Arena arena, const char *str, size_t len )
+{
+	char *newstr = Arena_Alloc( arena, len + 1 );
+	if( newstr ) {
+		memcpy( newstr, str, len );
+		newstr[len] = 0;
+	}
+	return newstr;
+}
+
+wchar_t *Arena_WcsDup( Arena arena, const wchar_t *str, size_t len )
+{
+	wchar_t *newstr = Arena_Alloc( arena, sizeof( wchar_t ) * (len + 1) );
+	if( newstr ) {
+		memcpy( newstr, str, sizeof( wchar_t ) * len );
+		newstr[len] = 0;
+	}
+	return newstr;
+}
+
+size_t Arena_GetSize( Arena arena )
+{
+	return arena->total_size;
+}
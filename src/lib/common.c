@@ -43,8 +43,24 @@
 #include <LCUI/LCUI.h>
 #include <LCUI/font/charset.h>
 #include "sha1.h"
+#include "xxhash.h"
 #include "common.h"
 
+/** 计算文件指纹时读取的数据块大小 */
+#define FINGERPRINT_BLOCK_SIZE 8192
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+#endif
+
 char *EncodeUTF8( const wchar_t *wstr )
 {
 	int len = LCUI_EncodeString( NULL, wstr, 0, ENCODING_UTF8 ) + 1;
@@ -271,6 +287,41 @@ int wgetfilestat( const wchar_t *wpath, struct stat *buf )
 	return ret;
 }
 
+int wgetfilefingerprint( const wchar_t *wpath, FileFingerprint fp )
+{
+	FILE *file;
+	size_t size, block_size;
+	unsigned char buf[FINGERPRINT_BLOCK_SIZE * 2];
+
+	file = wfopen( wpath, "rb" );
+	if( !file ) {
+		return -1;
+	}
+	if( fseeko( file, 0, SEEK_END ) != 0 ) {
+		fclose( file );
+		return -1;
+	}
+	fp->size = (int64_t)ftello( file );
+	rewind( file );
+	/* 文件较小时直接读取全部内容，否则只读取首尾两块数据 */
+	if( fp->size <= (int64_t)sizeof( buf ) ) {
+		size = fread( buf, 1, (size_t)fp->size, file );
+	} else {
+		block_size = FINGERPRINT_BLOCK_SIZE;
+		size = fread( buf, 1, block_size, file );
+		if( size == block_size &&
+		    fseeko( file, -(int64_t)block_size, SEEK_END ) == 0 ) {
+			size += fread( buf + size, 1, block_size, file );
+		}
+	}
+	fclose( file );
+	if( (int64_t)size < fp->size && size < sizeof( buf ) ) {
+		return -1;
+	}
+	fp->hash = XXH64( buf, size, (uint64_t)fp->size );
+	return 0;
+}
+
 size_t pathjoin( char *path, const char *path1, const char *path2 )
 {
 	size_t len = strlen( path1 );
@@ -347,6 +398,91 @@ int wchdir( wchar_t *wpath )
 #endif
 }
 
+FILE *wfopen( const wchar_t *wpath, const char *mode )
+{
+#ifdef _WIN32
+	wchar_t wmode[8];
+	swprintf( wmode, 8, L"%hs", mode );
+	return _wfopen( wpath, wmode );
+#else
+	FILE *fp;
+	char *path = EncodeUTF8( wpath );
+	fp = fopen( path, mode );
+	free( path );
+	return fp;
+#endif
+}
+
+int wremove( const wchar_t *wpath )
+{
+#ifdef _WIN32
+	return _wremove( wpath );
+#else
+	char *path = EncodeUTF8( wpath );
+	int ret = remove( path );
+	free( path );
+	return ret;
+#endif
+}
+
+int wrename( const wchar_t *oldpath, const wchar_t *newpath )
+{
+#ifdef _WIN32
+	/* Windows 上的 rename() 不会覆盖已存在的文件 */
+	if( MoveFileExW( oldpath, newpath, MOVEFILE_REPLACE_EXISTING ) ) {
+		return 0;
+	}
+	return -1;
+#else
+	int ret;
+	char *path1 = EncodeUTF8( oldpath );
+	char *path2 = EncodeUTF8( newpath );
+	ret = rename( path1, path2 );
+	free( path1 );
+	free( path2 );
+	return ret;
+#endif
+}
+
+int getcpucount( void )
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+int setthreadbackground( void )
+{
+#ifdef _WIN32
+	if( SetThreadPriority( GetCurrentThread(),
+			       THREAD_MODE_BACKGROUND_BEGIN ) ) {
+		return 0;
+	}
+	return -1;
+#elif defined(__linux__)
+	/* 在 Linux 上，优先级是按线程设置的 */
+	int ret = 0;
+	pid_t tid = (pid_t)syscall( SYS_gettid );
+	if( setpriority( PRIO_PROCESS, tid, 19 ) != 0 ) {
+		ret = -1;
+	}
+#ifdef SYS_ioprio_set
+	if( syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+		     IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT ) != 0 ) {
+		ret = -1;
+	}
+#endif
+	return ret;
+#else
+	return -1;
+#endif
+}
+
 int wgetnumberstr( wchar_t *str, int max_len, size_t number )
 {
 	int right, j, k, len, buf_len, count;
@@ -36,89 +36,846 @@
 #define DEBUG
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
 #include <LCUI/font/charset.h>
 #include "unqlite.h"
 #include "common.h"
+#include "arena.h"
+#include "xxhash.h"
 #include "file_cache.h"
 
+#ifdef _WIN32
+#include <io.h>
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #define MAX_PATH_LEN	2048
 #define WCSLEN(STR)	(sizeof( STR ) / sizeof( wchar_t ))
 #define GetDirStats(T)	(DirStats)(((char*)(T)) + sizeof(SyncTaskRec))
 
+#define JOURNAL_MAGIC		"LCSJ"
+#define JOURNAL_VERSION		2
+/** 每扫描完多少个目录保存一次检查点 */
+#define CHECKPOINT_DIRS		64
+/** 保存检查点的最大时间间隔（秒） */
+#define CHECKPOINT_INTERVAL	5
+
+#define SNAPSHOT_MAGIC		"LCFS"
+#define SNAPSHOT_VERSION	1
+/** 每隔多少条记录设置一个重启点，重启点处的记录保存完整路径 */
+#define SNAPSHOT_RESTART_INTERVAL 16
+/** 内存池中每个内存块的大小 */
+#define ARENA_BLOCK_SIZE	(256 * 1024)
+/** 键表的最小槽数量 */
+#define KEY_TABLE_MIN_SIZE	64
+
+/** 目录的扫描状态 */
+enum DirState {
+	DIR_NONE,
+	DIR_PENDING,
+	DIR_FINISHED
+};
+
  /** 文件状态信息 */
 typedef struct FileStatusRec_ {
 	unsigned int ctime;	/**< 创建时间 */
 	unsigned int mtime;	/**< 修改时间 */
 } FileStatusRec, *FileStatus;
 
+/**
+ * 同步日志的头部信息，之后依次是已扫描完的目录和待扫描的目录
+ * 目录路径是相对于扫描目录的 UTF-8 路径
+ */
+typedef struct SyncJournalHeaderRec_ {
+	char magic[4];			/**< 标记，固定为 JOURNAL_MAGIC */
+	uint32_t version;		/**< 格式版本 */
+	uint32_t state;			/**< 同步日志的状态 */
+	uint32_t generation;		/**< 提交时使用的代号 */
+	uint32_t finished_dirs;		/**< 已扫描完的目录数量 */
+	uint32_t pending_dirs;		/**< 待扫描的目录数量 */
+} SyncJournalHeaderRec;
+
+/**
+ * 文件列表快照的头部信息
+ * 快照由头部、记录数据和重启点偏移表组成。记录按路径的字节序排列，每条记录
+ * 只保存与上一条记录的路径不同的部分：
+ * varint 共享长度 | varint 非共享长度 | uint32 ctime | uint32 mtime | 非共享部分
+ */
+typedef struct SnapshotHeaderRec_ {
+	char magic[4];			/**< 标记，固定为 SNAPSHOT_MAGIC */
+	uint32_t version;		/**< 格式版本 */
+	uint32_t count;			/**< 记录数量 */
+	uint32_t restart_interval;	/**< 重启点间隔 */
+	uint32_t restarts;		/**< 重启点数量 */
+	uint32_t data_size;		/**< 记录数据的大小 */
+} SnapshotHeaderRec;
+
+/** 文件列表快照，以只读方式映射到内存中 */
+typedef struct SnapshotRec_ {
+	const uint8_t *data;		/**< 记录数据 */
+	const uint8_t *restarts;	/**< 重启点偏移表 */
+	uint32_t count;			/**< 记录数量 */
+	uint32_t n_restarts;		/**< 重启点数量 */
+	uint32_t data_size;		/**< 记录数据的大小 */
+	void *base;			/**< 映射或分配的内存 */
+	size_t size;			/**< 内存大小 */
+	LCUI_BOOL mapped;		/**< 是否为内存映射 */
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+} SnapshotRec, *Snapshot;
+
+/** 快照游标，用于按顺序遍历快照中的记录 */
+typedef struct SnapshotCursorRec_ {
+	const uint8_t *p;		/**< 下条记录的位置 */
+	const uint8_t *end;		/**< 记录数据的末尾 */
+	char key[MAX_PATH_LEN];		/**< 当前记录的路径 */
+	size_t key_len;			/**< 当前记录的路径长度 */
+	uint32_t ctime;			/**< 当前记录的创建时间 */
+	uint32_t mtime;			/**< 当前记录的修改时间 */
+	LCUI_BOOL valid;		/**< 当前记录是否有效 */
+} SnapshotCursorRec, *SnapshotCursor;
+
+/** 字节缓存 */
+typedef struct ByteBufferRec_ {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} ByteBufferRec, *ByteBuffer;
+
+/** 快照生成器，记录需按路径顺序添加 */
+typedef struct SnapshotWriterRec_ {
+	ByteBufferRec data;		/**< 记录数据 */
+	ByteBufferRec restarts;		/**< 重启点偏移表 */
+	char last_key[MAX_PATH_LEN];	/**< 上一条记录的路径 */
+	size_t last_len;		/**< 上一条记录的路径长度 */
+	uint32_t count;			/**< 记录数量 */
+} SnapshotWriterRec, *SnapshotWriter;
+
+/** 扫描到的文件条目 */
+typedef struct FileEntryRec_ {
+	const char *path;	/**< 相对于扫描目录的 UTF-8 路径，存放于内存池中 */
+	uint32_t ctime;		/**< 创建时间 */
+	uint32_t mtime;		/**< 修改时间 */
+} FileEntryRec, *FileEntry;
+
+/** 键表中的槽 */
+typedef struct KeySlotRec_ {
+	const char *key;	/**< 键，为 NULL 时表示空槽 */
+	uint32_t hash;		/**< 键的哈希值 */
+	uint32_t len;		/**< 键的长度 */
+	size_t value;		/**< 值 */
+} KeySlotRec, *KeySlot;
+
+/**
+ * 键表
+ * 以开放寻址法实现的哈希表，键是 UTF-8 路径，只在内存池中保存一份，不支持删除。
+ */
+typedef struct KeyTableRec_ {
+	KeySlot slots;		/**< 槽列表 */
+	size_t size;		/**< 槽数量，总是 2 的幂 */
+	size_t count;		/**< 键的数量 */
+} KeyTableRec, *KeyTable;
+
+/** 扫描记录的头部，之后是路径 */
+typedef struct FileLogRecordRec_ {
+	uint32_t path_len;
+	uint32_t ctime;
+	uint32_t mtime;
+} FileLogRecordRec;
+
+/** 文件信息列表 */
+typedef struct FileInfoListRec_ {
+	FileInfoRec *items;
+	size_t length;
+	size_t size;
+} FileInfoListRec, *FileInfoList;
+
 /** 文件夹内的文件变更状态统计 */
 typedef struct DirStatsRec_ {
-	unqlite *db;
-	Dict *files;		/**< 之前已缓存的文件列表 */
-	Dict *added_files;	/**< 新增的文件 */
-	Dict *changed_files;	/**< 已改变的文件 */
-	Dict *deleted_files;	/**< 删除的文件 */
+	SnapshotRec snapshot;		/**< 上次同步后的文件列表快照 */
+	LCUI_BOOL snapshot_opened;	/**< 快照是否已打开 */
+	FILE *log;			/**< 扫描记录文件 */
+	LCUI_Mutex mutex;		/**< 互斥锁，保护扫描记录及目录列表 */
+	Arena arena;			/**< 内存池，存放路径等数据，随任务一起释放 */
+	KeyTableRec files;		/**< 文件路径表，值为文件在列表中的位置 + 1 */
+	KeyTableRec dirs;		/**< 目录路径表，值为目录的扫描状态 */
+	FileEntry entries;		/**< 本次扫描到的文件 */
+	size_t n_entries;		/**< 本次扫描到的文件数量 */
+	size_t max_entries;		/**< 文件列表的容量 */
+	FileInfoListRec added_files;	/**< 新增的文件 */
+	FileInfoListRec changed_files;	/**< 已改变的文件 */
+	FileInfoListRec deleted_files;	/**< 删除的文件 */
+	char **removed_keys;		/**< 待从快照中移除的记录 */
+	size_t n_removed_keys;		/**< 待移除的记录数量 */
+	size_t unsaved_dirs;		/**< 自上次检查点以来扫描完的目录数量 */
+	time_t checkpoint_time;		/**< 上次保存检查点的时间 */
 } DirStatsRec, *DirStats;
 
-static unsigned int Dict_KeyHash( const wchar_t *buf )
+static uint32_t HashKey( const char *key, size_t len )
 {
-	unsigned int hash = 5381;
-	while( *buf ) {
-		hash = ((hash << 5) + hash) + (*buf++);
+	uint64_t hash = XXH64( key, len, 0 );
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/** 查找键所在的槽，如果键不存在则返回可用于存放该键的空槽 */
+static KeySlot KeyTable_Lookup( KeyTable table, const char *key,
+				size_t len, uint32_t hash )
+{
+	KeySlot slot;
+	size_t mask = table->size - 1;
+	size_t i = hash & mask;
+	while( 1 ) {
+		slot = &table->slots[i];
+		if( !slot->key ) {
+			return slot;
+		}
+		if( slot->hash == hash && slot->len == len &&
+		    memcmp( slot->key, key, len ) == 0 ) {
+			return slot;
+		}
+		i = (i + 1) & mask;
 	}
-	return hash;
 }
 
-static int Dict_KeyCompare( void *privdata, const void *key1, const void *key2 )
+static int KeyTable_Grow( KeyTable table )
 {
-	if( wcscmp( key1, key2 ) == 0 ) {
-		return 1;
+	size_t i, size;
+	KeySlot slots, slot;
+	KeyTableRec newtable;
+
+	size = table->size > 0 ? table->size * 2 : KEY_TABLE_MIN_SIZE;
+	slots = calloc( size, sizeof( KeySlotRec ) );
+	if( !slots ) {
+		return -ENOMEM;
 	}
+	newtable.slots = slots;
+	newtable.size = size;
+	newtable.count = table->count;
+	for( i = 0; i < table->size; ++i ) {
+		slot = &table->slots[i];
+		if( slot->key ) {
+			*KeyTable_Lookup( &newtable, slot->key, slot->len,
+					  slot->hash ) = *slot;
+		}
+	}
+	free( table->slots );
+	*table = newtable;
 	return 0;
 }
 
-static void *Dict_KeyDup( void *privdata, const void *key )
+/**
+ * 获取键所在的槽，如果键不存在则将其复制到内存池中并插入
+ * 新插入的键的值为 0
+ */
+static KeySlot KeyTable_Put( KeyTable table, Arena arena,
+			     const char *key, size_t len )
 {
-	size_t len;
-	wchar_t *newkey;
-	len = wcslen( key ) + 1;
-	newkey = malloc( len * sizeof( wchar_t ) );
-	if( !newkey ) {
+	KeySlot slot;
+	uint32_t hash = HashKey( key, len );
+
+	/* 负载因子保持在 0.7 以下 */
+	if( (table->count + 1) * 10 > table->size * 7 ) {
+		if( KeyTable_Grow( table ) != 0 ) {
+			return NULL;
+		}
+	}
+	slot = KeyTable_Lookup( table, key, len, hash );
+	if( slot->key ) {
+		return slot;
+	}
+	slot->key = Arena_StrDup( arena, key, len );
+	if( !slot->key ) {
 		return NULL;
 	}
-	wcsncpy( newkey, key, len );
-	return newkey;
+	slot->hash = hash;
+	slot->len = (uint32_t)len;
+	slot->value = 0;
+	table->count += 1;
+	return slot;
 }
 
-static void Dict_KeyDestructor( void *privdata, void *key )
+static size_t KeyTable_Count( KeyTable table, size_t value )
 {
-	free( key );
+	size_t i, count = 0;
+	for( i = 0; i < table->size; ++i ) {
+		if( table->slots[i].key && table->slots[i].value == value ) {
+			++count;
+		}
+	}
+	return count;
 }
 
-static void FilesDict_ValDestructor( void *privdata, void *val )
+static void KeyTable_Clear( KeyTable table )
 {
-	free( val );
+	free( table->slots );
+	table->slots = NULL;
+	table->size = 0;
+	table->count = 0;
 }
 
-static DictType FilePathsDict = {
-	Dict_KeyHash,
-	Dict_KeyDup,
-	NULL,
-	Dict_KeyCompare,
-	Dict_KeyDestructor,
-	NULL
-};
+static int ByteBuffer_Append( ByteBuffer buf, const void *data, size_t len )
+{
+	uint8_t *mem;
+	size_t size = buf->size;
+	if( buf->length + len > size ) {
+		size = size > 0 ? size : 4096;
+		while( buf->length + len > size ) {
+			size *= 2;
+		}
+		mem = realloc( buf->data, size );
+		if( !mem ) {
+			return -ENOMEM;
+		}
+		buf->data = mem;
+		buf->size = size;
+	}
+	memcpy( buf->data + buf->length, data, len );
+	buf->length += len;
+	return 0;
+}
 
-static DictType FilesDict = {
-	Dict_KeyHash,
-	Dict_KeyDup,
-	NULL,
-	Dict_KeyCompare,
-	Dict_KeyDestructor,
-	FilesDict_ValDestructor
-};
+static void ByteBuffer_Free( ByteBuffer buf )
+{
+	free( buf->data );
+	buf->data = NULL;
+	buf->length = 0;
+	buf->size = 0;
+}
+
+static size_t EncodeVarint( uint8_t *buf, uint32_t value )
+{
+	size_t i = 0;
+	while( value >= 0x80 ) {
+		buf[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[i++] = (uint8_t)value;
+	return i;
+}
+
+static const uint8_t *DecodeVarint( const uint8_t *p, const uint8_t *end,
+				    uint32_t *value )
+{
+	int shift;
+	uint32_t result = 0;
+	for( shift = 0; shift <= 28 && p < end; shift += 7 ) {
+		uint32_t byte = *p++;
+		result |= (byte & 0x7f) << shift;
+		if( !(byte & 0x80) ) {
+			*value = result;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/** 将文件缓冲区的内容写入磁盘，确保在重命名替换旧文件前数据已落盘 */
+static int FlushFile( FILE *fp )
+{
+	if( fflush( fp ) != 0 ) {
+		return -1;
+	}
+#ifdef _WIN32
+	return _commit( _fileno( fp ) );
+#else
+	return fsync( fileno( fp ) );
+#endif
+}
+
+static void SnapshotWriter_Init( SnapshotWriter w )
+{
+	memset( w, 0, sizeof( SnapshotWriterRec ) );
+}
+
+static void SnapshotWriter_Destroy( SnapshotWriter w )
+{
+	ByteBuffer_Free( &w->data );
+	ByteBuffer_Free( &w->restarts );
+}
+
+static int SnapshotWriter_Add( SnapshotWriter w, const char *key,
+			       uint32_t ctime, uint32_t mtime )
+{
+	uint8_t head[18];
+	uint32_t offset;
+	size_t shared = 0, len = strlen( key ), n;
+	if( len >= MAX_PATH_LEN ) {
+		return -1;
+	}
+	if( w->count % SNAPSHOT_RESTART_INTERVAL == 0 ) {
+		offset = (uint32_t)w->data.length;
+		if( ByteBuffer_Append( &w->restarts, &offset,
+				       sizeof( offset ) ) != 0 ) {
+			return -ENOMEM;
+		}
+	} else {
+		while( shared < len && shared < w->last_len &&
+		       key[shared] == w->last_key[shared] ) {
+			++shared;
+		}
+	}
+	n = EncodeVarint( head, (uint32_t)shared );
+	n += EncodeVarint( head + n, (uint32_t)(len - shared) );
+	if( ByteBuffer_Append( &w->data, head, n ) != 0 ||
+	    ByteBuffer_Append( &w->data, &ctime, sizeof( ctime ) ) != 0 ||
+	    ByteBuffer_Append( &w->data, &mtime, sizeof( mtime ) ) != 0 ||
+	    ByteBuffer_Append( &w->data, key + shared, len - shared ) != 0 ) {
+		return -ENOMEM;
+	}
+	memcpy( w->last_key, key, len + 1 );
+	w->last_len = len;
+	w->count += 1;
+	return 0;
+}
+
+static void SnapshotWriter_GetHeader( SnapshotWriter w,
+				      SnapshotHeaderRec *head )
+{
+	memcpy( head->magic, SNAPSHOT_MAGIC, sizeof( head->magic ) );
+	head->version = SNAPSHOT_VERSION;
+	head->count = w->count;
+	head->restart_interval = SNAPSHOT_RESTART_INTERVAL;
+	head->restarts = (uint32_t)(w->restarts.length / sizeof( uint32_t ));
+	head->data_size = (uint32_t)w->data.length;
+}
+
+/** 将快照写入文件，写入完成后会同步到磁盘 */
+static int SnapshotWriter_Save( SnapshotWriter w, const wchar_t *path )
+{
+	int ret = 0;
+	FILE *fp;
+	SnapshotHeaderRec head;
+
+	fp = wfopen( path, "wb" );
+	if( !fp ) {
+		return -1;
+	}
+	SnapshotWriter_GetHeader( w, &head );
+	if( fwrite( &head, sizeof( head ), 1, fp ) != 1 ||
+	    fwrite( w->data.data, 1, w->data.length, fp ) !=
+	    w->data.length ||
+	    fwrite( w->restarts.data, 1, w->restarts.length, fp ) !=
+	    w->restarts.length || FlushFile( fp ) != 0 ) {
+		ret = -1;
+	}
+	fclose( fp );
+	return ret;
+}
+
+static int Snapshot_Init( Snapshot snap, void *base, size_t size )
+{
+	SnapshotHeaderRec head;
+	size_t restarts_size;
+
+	snap->count = 0;
+	snap->n_restarts = 0;
+	snap->data_size = 0;
+	snap->data = NULL;
+	snap->restarts = NULL;
+	if( !base || size < sizeof( head ) ) {
+		return -1;
+	}
+	memcpy( &head, base, sizeof( head ) );
+	if( memcmp( head.magic, SNAPSHOT_MAGIC, sizeof( head.magic ) ) ||
+	    head.version != SNAPSHOT_VERSION ||
+	    head.restart_interval != SNAPSHOT_RESTART_INTERVAL ) {
+		return -1;
+	}
+	restarts_size = (size_t)head.restarts * sizeof( uint32_t );
+	if( sizeof( head ) + head.data_size + restarts_size > size ) {
+		return -1;
+	}
+	snap->count = head.count;
+	snap->n_restarts = head.restarts;
+	snap->data_size = head.data_size;
+	snap->data = (const uint8_t*)base + sizeof( head );
+	snap->restarts = snap->data + head.data_size;
+	return 0;
+}
+
+/** 以只读方式映射快照文件 */
+static int Snapshot_Map( Snapshot snap, const wchar_t *path )
+{
+#ifdef _WIN32
+	HANDLE file;
+	LARGE_INTEGER size;
+
+	snap->base = NULL;
+	snap->mapping = NULL;
+	file = CreateFileW( path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( file == INVALID_HANDLE_VALUE ) {
+		return -ENOENT;
+	}
+	if( !GetFileSizeEx( file, &size ) || size.QuadPart == 0 ) {
+		CloseHandle( file );
+		return -1;
+	}
+	snap->mapping = CreateFileMappingW( file, NULL, PAGE_READONLY,
+					    0, 0, NULL );
+	CloseHandle( file );
+	if( !snap->mapping ) {
+		return -1;
+	}
+	snap->base = MapViewOfFile( snap->mapping, FILE_MAP_READ, 0, 0, 0 );
+	if( !snap->base ) {
+		CloseHandle( snap->mapping );
+		snap->mapping = NULL;
+		return -1;
+	}
+	snap->size = (size_t)size.QuadPart;
+#else
+	int fd;
+	void *base;
+	struct stat buf;
+	char *filepath = EncodeUTF8( path );
+
+	snap->base = NULL;
+	fd = open( filepath, O_RDONLY );
+	free( filepath );
+	if( fd < 0 ) {
+		return -ENOENT;
+	}
+	if( fstat( fd, &buf ) != 0 || buf.st_size == 0 ) {
+		close( fd );
+		return -1;
+	}
+	base = mmap( NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( base == MAP_FAILED ) {
+		return -1;
+	}
+	snap->base = base;
+	snap->size = (size_t)buf.st_size;
+#endif
+	snap->mapped = TRUE;
+	return 0;
+}
+
+static void Snapshot_Close( Snapshot snap )
+{
+	if( snap->base ) {
+		if( !snap->mapped ) {
+			free( snap->base );
+		} else {
+#ifdef _WIN32
+			UnmapViewOfFile( snap->base );
+			CloseHandle( snap->mapping );
+			snap->mapping = NULL;
+#else
+			munmap( snap->base, snap->size );
+#endif
+		}
+	}
+	snap->base = NULL;
+	snap->size = 0;
+	snap->mapped = FALSE;
+	Snapshot_Init( snap, NULL, 0 );
+}
+
+/** 将快照生成器中的内容作为快照载入 */
+static int Snapshot_LoadWriter( Snapshot snap, SnapshotWriter w )
+{
+	uint8_t *base;
+	SnapshotHeaderRec head;
+	size_t size = sizeof( head ) + w->data.length + w->restarts.length;
+
+	base = malloc( size );
+	if( !base ) {
+		return -ENOMEM;
+	}
+	SnapshotWriter_GetHeader( w, &head );
+	memcpy( base, &head, sizeof( head ) );
+	if( w->data.length > 0 ) {
+		memcpy( base + sizeof( head ), w->data.data, w->data.length );
+	}
+	if( w->restarts.length > 0 ) {
+		memcpy( base + sizeof( head ) + w->data.length,
+			w->restarts.data, w->restarts.length );
+	}
+	snap->base = base;
+	snap->size = size;
+	snap->mapped = FALSE;
+	return Snapshot_Init( snap, base, size );
+}
+
+static void SnapshotCursor_Next( SnapshotCursor cur )
+{
+	uint32_t shared, unshared;
+	const uint8_t *p = cur->p;
+
+	cur->valid = FALSE;
+	if( !p || p >= cur->end ) {
+		return;
+	}
+	p = DecodeVarint( p, cur->end, &shared );
+	if( p ) {
+		p = DecodeVarint( p, cur->end, &unshared );
+	}
+	if( !p || shared > cur->key_len ||
+	    shared + unshared >= MAX_PATH_LEN ||
+	    p + sizeof( uint32_t ) * 2 + unshared > cur->end ) {
+		cur->p = NULL;
+		return;
+	}
+	memcpy( &cur->ctime, p, sizeof( uint32_t ) );
+	memcpy( &cur->mtime, p + sizeof( uint32_t ), sizeof( uint32_t ) );
+	p += sizeof( uint32_t ) * 2;
+	memcpy( cur->key + shared, p, unshared );
+	cur->key_len = shared + unshared;
+	cur->key[cur->key_len] = 0;
+	cur->p = p + unshared;
+	cur->valid = TRUE;
+}
+
+/** 从指定偏移处开始遍历快照 */
+static void SnapshotCursor_Seek( SnapshotCursor cur, Snapshot snap,
+				 uint32_t offset )
+{
+	cur->key_len = 0;
+	cur->key[0] = 0;
+	cur->end = snap->data ? snap->data + snap->data_size : NULL;
+	cur->p = snap->data ? snap->data + offset : NULL;
+	SnapshotCursor_Next( cur );
+}
+
+static uint32_t Snapshot_GetRestart( Snapshot snap, uint32_t i )
+{
+	uint32_t offset;
+	memcpy( &offset, snap->restarts + i * sizeof( uint32_t ),
+		sizeof( offset ) );
+	return offset;
+}
+
+/** 在快照中查找记录，利用重启点进行二分查找 */
+static LCUI_BOOL Snapshot_Find( Snapshot snap, const char *key )
+{
+	int cmp;
+	uint32_t left = 0, right, mid;
+	SnapshotCursorRec cur;
+
+	if( snap->n_restarts < 1 ) {
+		return FALSE;
+	}
+	right = snap->n_restarts - 1;
+	while( left < right ) {
+		mid = (left + right + 1) / 2;
+		SnapshotCursor_Seek( &cur, snap, Snapshot_GetRestart( snap, mid ) );
+		if( cur.valid && strcmp( cur.key, key ) <= 0 ) {
+			left = mid;
+		} else {
+			right = mid - 1;
+		}
+	}
+	SnapshotCursor_Seek( &cur, snap, Snapshot_GetRestart( snap, left ) );
+	while( cur.valid ) {
+		cmp = strcmp( cur.key, key );
+		if( cmp == 0 ) {
+			return TRUE;
+		} else if( cmp > 0 ) {
+			break;
+		}
+		SnapshotCursor_Next( &cur );
+	}
+	return FALSE;
+}
+
+static int FileInfoList_Append( FileInfoList list, wchar_t *path,
+				uint32_t ctime, uint32_t mtime )
+{
+	FileInfoRec *items;
+	if( !path ) {
+		return -ENOMEM;
+	}
+	if( list->length >= list->size ) {
+		size_t size = list->size > 0 ? list->size * 2 : 64;
+		items = realloc( list->items, size * sizeof( FileInfoRec ) );
+		if( !items ) {
+			return -ENOMEM;
+		}
+		list->items = items;
+		list->size = size;
+	}
+	list->items[list->length].path = path;
+	list->items[list->length].ctime = ctime;
+	list->items[list->length].mtime = mtime;
+	list->length += 1;
+	return 0;
+}
+
+/** 清空文件信息列表，列表中的路径存放于内存池中，无需释放 */
+static void FileInfoList_Clear( FileInfoList list )
+{
+	free( list->items );
+	list->items = NULL;
+	list->length = 0;
+	list->size = 0;
+}
+
+static int FileInfoList_ForEach( FileInfoList list, FileInfoHanlder func,
+				 void *data )
+{
+	size_t i;
+	for( i = 0; i < list->length; ++i ) {
+		func( data, &list->items[i] );
+	}
+	return (int)list->length;
+}
+
+/**
+ * 获取相对于扫描目录的 UTF-8 路径
+ * @param[out] key 用于存放路径的缓存，大小为 MAX_PATH_LEN
+ * @returns 路径的长度，如果路径不在扫描目录内或过长则返回 -1
+ */
+static int SyncTask_GetKey( SyncTask t, const wchar_t *path, char *key )
+{
+	int len;
+	char *str;
+	size_t dir_len = wcslen( t->scan_dir );
+
+	if( wcsncmp( path, t->scan_dir, dir_len ) != 0 ) {
+		return -1;
+	}
+	path += dir_len;
+	if( *path == PATH_SEP ) {
+		++path;
+	}
+	/* 每个宽字符编码为 UTF-8 后不超过 4 个字节，短路径可直接写入缓存 */
+	if( wcslen( path ) * 4 < MAX_PATH_LEN ) {
+		len = LCUI_EncodeString( key, path, MAX_PATH_LEN,
+					 ENCODING_UTF8 );
+		if( len < 0 || len >= MAX_PATH_LEN ) {
+			return -1;
+		}
+	} else {
+		str = EncodeUTF8( path );
+		len = (int)strlen( str );
+		if( len >= MAX_PATH_LEN ) {
+			free( str );
+			return -1;
+		}
+		memcpy( key, str, len );
+		free( str );
+	}
+	key[len] = 0;
+	return len;
+}
+
+/** 根据相对路径获取完整路径，路径存放于内存池中 */
+static wchar_t *SyncTask_GetPath( SyncTask t, const char *key )
+{
+	int len;
+	wchar_t *path, name[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+	size_t dir_len = wcslen( t->scan_dir );
+
+	len = LCUI_DecodeString( name, key, MAX_PATH_LEN, ENCODING_UTF8 );
+	if( len < 0 || len >= MAX_PATH_LEN ) {
+		return NULL;
+	}
+	name[len] = 0;
+	path = Arena_Alloc( ds->arena, sizeof( wchar_t ) *
+			    (dir_len + len + 2) );
+	if( !path ) {
+		return NULL;
+	}
+	wcscpy( path, t->scan_dir );
+	if( len > 0 ) {
+		if( dir_len > 0 && t->scan_dir[dir_len - 1] != PATH_SEP ) {
+			path[dir_len++] = PATH_SEP;
+		}
+		wcscpy( path + dir_len, name );
+	}
+	return path;
+}
+
+static int CompareFileEntry( const void *a, const void *b )
+{
+	const FileEntryRec *e1 = a, *e2 = b;
+	return strcmp( e1->path, e2->path );
+}
+
+static int CompareKey( const void *a, const void *b )
+{
+	return strcmp( *(char* const*)a, *(char* const*)b );
+}
+
+static int FileEntryList_Append( FileEntry *entries, size_t *length,
+				 size_t *size, const char *path,
+				 uint32_t ctime, uint32_t mtime )
+{
+	FileEntry list;
+	if( *length >= *size ) {
+		size_t n = *size > 0 ? *size * 2 : 1024;
+		list = realloc( *entries, n * sizeof( FileEntryRec ) );
+		if( !list ) {
+			return -ENOMEM;
+		}
+		*entries = list;
+		*size = n;
+	}
+	list = *entries + *length;
+	list->path = path;
+	list->ctime = ctime;
+	list->mtime = mtime;
+	*length += 1;
+	return 0;
+}
+
+/** 添加文件条目，如果文件已存在则更新它的时间信息 */
+static int SyncTask_PutEntry( SyncTask t, const char *key, size_t len,
+			      uint32_t ctime, uint32_t mtime )
+{
+	KeySlot slot;
+	FileEntry e;
+	DirStats ds = GetDirStats( t );
+
+	slot = KeyTable_Put( &ds->files, ds->arena, key, len );
+	if( !slot ) {
+		return -ENOMEM;
+	}
+	if( slot->value > 0 ) {
+		e = &ds->entries[slot->value - 1];
+		e->ctime = ctime;
+		e->mtime = mtime;
+		return 0;
+	}
+	if( FileEntryList_Append( &ds->entries, &ds->n_entries,
+				  &ds->max_entries, slot->key,
+				  ctime, mtime ) != 0 ) {
+		return -ENOMEM;
+	}
+	slot->value = ds->n_entries;
+	return 0;
+}
+
+static void SyncTask_ClearEntries( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	KeyTable_Clear( &ds->files );
+	free( ds->entries );
+	ds->entries = NULL;
+	ds->n_entries = 0;
+	ds->max_entries = 0;
+}
+
+/** 对文件列表排序，排序后文件路径表中记录的位置将失效 */
+static void SyncTask_SortEntries( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->n_entries > 1 ) {
+		qsort( ds->entries, ds->n_entries, sizeof( FileEntryRec ),
+		       CompareFileEntry );
+	}
+}
 
 SyncTask SyncTask_New( const char *data_dir, const char *scan_dir )
 {
@@ -143,27 +900,35 @@ SyncTask SyncTask_NewW( const wchar_t *data_dir, const wchar_t *scan_dir )
 	wchar_t name[44];
 	size_t max_len, len1, len2;
 	const wchar_t suffix[] = L".tmp";
+	const wchar_t log_suffix[] = L".log";
+	const wchar_t journal_suffix[] = L".journal";
 
 	t = malloc( sizeof( SyncTaskRec ) + sizeof( DirStatsRec ) );
 	ds = GetDirStats( t );
+	memset( ds, 0, sizeof( DirStatsRec ) );
 	len1 = wcslen( data_dir ) + 1;
 	len2 = wcslen( scan_dir ) + 1;
-	ds->files = Dict_Create( &FilesDict, NULL );
-	ds->added_files = Dict_Create( &FilesDict, NULL );
-	ds->changed_files = Dict_Create( &FilePathsDict, NULL );
-	ds->deleted_files = Dict_Create( &FilePathsDict, NULL );
+	ds->arena = Arena_Create( ARENA_BLOCK_SIZE );
+	LCUIMutex_Init( &ds->mutex );
 	t->data_dir = malloc( sizeof( wchar_t ) * len1 );
 	t->scan_dir = malloc( sizeof( wchar_t ) * len2 );
 	wcsncpy( t->data_dir, data_dir, len1 );
 	wcsncpy( t->scan_dir, scan_dir, len2 );
 	WEncodeSHA1( name, t->scan_dir, len2 );
-	max_len = len1 + WCSLEN( name ) + WCSLEN( suffix ) + 1;
+	max_len = len1 + WCSLEN( name ) + WCSLEN( journal_suffix ) + 1;
 	t->tmpfile = malloc( max_len * sizeof( wchar_t ) );
+	t->logfile = malloc( max_len * sizeof( wchar_t ) );
+	t->journal = malloc( max_len * sizeof( wchar_t ) );
 	t->file = malloc( max_len * sizeof( wchar_t ) );
 	wcsncpy( t->tmpfile, t->data_dir, len1 );
 	wpathjoin( t->file, data_dir, name );
 	swprintf( t->tmpfile, max_len, L"%ls%ls", t->file, suffix );
+	swprintf( t->logfile, max_len, L"%ls%ls", t->file, log_suffix );
+	swprintf( t->journal, max_len, L"%ls%ls", t->file, journal_suffix );
 	t->state = STATE_NONE;
+	t->journal_state = SYNC_JOURNAL_NONE;
+	t->generation = 0;
+	t->resumed = FALSE;
 	t->changed_files = 0;
 	t->deleted_files = 0;
 	t->total_files = 0;
@@ -173,229 +938,702 @@ SyncTask SyncTask_NewW( const wchar_t *data_dir, const wchar_t *scan_dir )
 
 void SyncTask_ClearCache( SyncTask t )
 {
-#ifdef _WIN32
-	_wremove( t->file );
-	_wremove( t->tmpfile );
-#else
-	char *file = EncodeUTF8( t->file );
-	char *tmpfile = EncodeUTF8( t->tmpfile );
-	remove( file );
-	remove( tmpfile );
-	free( file );
-	free( tmpfile );
-#endif
+	wremove( t->file );
+	wremove( t->tmpfile );
+	wremove( t->logfile );
+	wremove( t->journal );
+}
+
+static void SyncTask_CloseLog( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->log ) {
+		fclose( ds->log );
+		ds->log = NULL;
+	}
 }
 
 void SyncTask_Delete( SyncTask t )
 {
+	size_t i;
 	DirStats ds = GetDirStats( t );
+	SyncTask_CloseCache( t );
+	SyncTask_CloseLog( t );
+	SyncTask_ClearEntries( t );
+	FileInfoList_Clear( &ds->added_files );
+	FileInfoList_Clear( &ds->changed_files );
+	FileInfoList_Clear( &ds->deleted_files );
+	for( i = 0; i < ds->n_removed_keys; ++i ) {
+		free( ds->removed_keys[i] );
+	}
+	free( ds->removed_keys );
 	free( t->scan_dir );
 	free( t->data_dir );
 	free( t->file );
 	free( t->tmpfile );
+	free( t->logfile );
+	free( t->journal );
 	t->file = NULL;
 	t->tmpfile = NULL;
+	t->logfile = NULL;
+	t->journal = NULL;
 	t->scan_dir = NULL;
 	t->data_dir = NULL;
-	Dict_Release( ds->files );
-	Dict_Release( ds->added_files );
-	Dict_Release( ds->changed_files );
-	Dict_Release( ds->deleted_files );
+	KeyTable_Clear( &ds->dirs );
+	Arena_Destroy( ds->arena );
+	LCUIMutex_Destroy( &ds->mutex );
 	free( t );
 }
 
-static int FileDict_ForEach( Dict *d, FileInfoHanlder func, void *data )
-{
-	int count = 0;
-	DictEntry *entry;
-	DictIterator *iter = Dict_GetIterator( d );
-	while( (entry = Dict_Next( iter )) ) {
-		func( data, DictEntry_GetVal( entry ) );
-		++count;
-	}
-	Dict_ReleaseIterator( iter );
-	return count;
-}
-
 int SyncTask_InAddedFiles( SyncTask t, FileInfoHanlder func, void *func_data )
 {
 	DirStats ds = GetDirStats( t );
-	return FileDict_ForEach( ds->added_files, func, func_data );
+	return FileInfoList_ForEach( &ds->added_files, func, func_data );
 }
 
 int SyncTask_InChangedFiles( SyncTask t, FileInfoHanlder func, void *func_data )
 {
 	DirStats ds = GetDirStats( t );
-	return FileDict_ForEach( ds->changed_files, func, func_data );
+	return FileInfoList_ForEach( &ds->changed_files, func, func_data );
 }
 
 int SyncTask_InDeletedFiles( SyncTask t, FileInfoHanlder func, void *func_data )
 {
 	DirStats ds = GetDirStats( t );
-	return FileDict_ForEach( ds->deleted_files, func, func_data );
+	return FileInfoList_ForEach( &ds->deleted_files, func, func_data );
 }
 
-int SyncTask_OpenCacheW( SyncTask t, const wchar_t *path )
+/**
+ * 载入旧版本的文件列表缓存
+ * 旧版本使用 unqlite 数据库存储，以宽字符路径作为键，在此将其转换为快照。
+ */
+static int SyncTask_LoadLegacyCache( SyncTask t, const wchar_t *path )
 {
-	DirStats ds;
-	int len, rc;
+	int rc, len;
 	char *dbfile;
+	unqlite *db;
+	unqlite_kv_cursor *cur;
+	SnapshotWriterRec w;
+	FileStatusRec status;
+	wchar_t buf[MAX_PATH_LEN];
+	char key[MAX_PATH_LEN];
+	FileEntry entries = NULL;
+	size_t i, n_entries = 0, max_entries = 0;
+	DirStats ds = GetDirStats( t );
 
-	ds = GetDirStats( t );
-	path = path ? path : t->file;
 	len = LCUI_EncodeString( NULL, path, 0, ENCODING_UTF8 ) + 1;
 	dbfile = malloc( sizeof( char )*len );
 	if( !dbfile ) {
 		return -ENOMEM;
 	}
 	LCUI_EncodeString( dbfile, path, len, ENCODING_UTF8 );
-	rc = unqlite_open( &ds->db, dbfile, UNQLITE_OPEN_CREATE );
+	rc = unqlite_open( &db, dbfile, UNQLITE_OPEN_READONLY );
 	free( dbfile );
 	if( rc != UNQLITE_OK ) {
-		return rc;
+		return -1;
+	}
+	rc = unqlite_kv_cursor_init( db, &cur );
+	if( rc != UNQLITE_OK ) {
+		unqlite_close( db );
+		return -1;
+	}
+	rc = unqlite_kv_cursor_first_entry( cur );
+	while( rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry( cur ) ) {
+		const char *path;
+		int key_size = (MAX_PATH_LEN - 1) * sizeof( wchar_t );
+		unqlite_int64 data_size = sizeof( FileStatusRec );
+		unqlite_kv_cursor_key( cur, buf, &key_size );
+		unqlite_kv_cursor_data( cur, &status, &data_size );
+		buf[key_size / sizeof( wchar_t )] = 0;
+		len = SyncTask_GetKey( t, buf, key );
+		path = len >= 0 ? Arena_StrDup( ds->arena, key, len ) : NULL;
+		if( path ) {
+			FileEntryList_Append( &entries, &n_entries,
+					      &max_entries, path,
+					      status.ctime, status.mtime );
+		}
+		rc = unqlite_kv_cursor_next_entry( cur );
+	}
+	unqlite_kv_cursor_release( db, cur );
+	unqlite_close( db );
+	if( n_entries > 1 ) {
+		qsort( entries, n_entries, sizeof( FileEntryRec ),
+		       CompareFileEntry );
+	}
+	SnapshotWriter_Init( &w );
+	for( i = 0; i < n_entries; ++i ) {
+		FileEntry e = &entries[i];
+		if( i == 0 || strcmp( e->path, w.last_key ) != 0 ) {
+			SnapshotWriter_Add( &w, e->path, e->ctime, e->mtime );
+		}
+	}
+	free( entries );
+	rc = Snapshot_LoadWriter( &ds->snapshot, &w );
+	SnapshotWriter_Destroy( &w );
+	return rc;
+}
+
+int SyncTask_OpenCacheW( SyncTask t, const wchar_t *path )
+{
+	int ret;
+	DirStats ds = GetDirStats( t );
+
+	SyncTask_CloseCache( t );
+	path = path ? path : t->file;
+	ret = Snapshot_Map( &ds->snapshot, path );
+	if( ret == 0 ) {
+		ret = Snapshot_Init( &ds->snapshot, ds->snapshot.base,
+				     ds->snapshot.size );
+		if( ret != 0 ) {
+			Snapshot_Close( &ds->snapshot );
+			ret = SyncTask_LoadLegacyCache( t, path );
+		}
+	}
+	if( ret != 0 ) {
+		Snapshot_Close( &ds->snapshot );
+		return ret;
 	}
+	ds->snapshot_opened = TRUE;
 	return 0;
 }
 
+/** 将移除了部分记录的快照重新写入文件 */
+static int SyncTask_SaveRemovedKeys( SyncTask t )
+{
+	int ret;
+	size_t i = 0;
+	wchar_t *newfile;
+	SnapshotWriterRec w;
+	SnapshotCursorRec cur;
+	DirStats ds = GetDirStats( t );
+	size_t len = wcslen( t->file ) + 5;
+
+	qsort( ds->removed_keys, ds->n_removed_keys,
+	       sizeof( char* ), CompareKey );
+	SnapshotWriter_Init( &w );
+	SnapshotCursor_Seek( &cur, &ds->snapshot, 0 );
+	for( ; cur.valid; SnapshotCursor_Next( &cur ) ) {
+		while( i < ds->n_removed_keys &&
+		       strcmp( ds->removed_keys[i], cur.key ) < 0 ) {
+			++i;
+		}
+		if( i < ds->n_removed_keys &&
+		    strcmp( ds->removed_keys[i], cur.key ) == 0 ) {
+			continue;
+		}
+		SnapshotWriter_Add( &w, cur.key, cur.ctime, cur.mtime );
+	}
+	newfile = malloc( sizeof( wchar_t ) * len );
+	swprintf( newfile, len, L"%ls.new", t->file );
+	ret = SnapshotWriter_Save( &w, newfile );
+	SnapshotWriter_Destroy( &w );
+	/* 需先解除映射才能替换文件 */
+	Snapshot_Close( &ds->snapshot );
+	if( ret == 0 ) {
+		ret = wrename( newfile, t->file );
+	} else {
+		wremove( newfile );
+	}
+	free( newfile );
+	return ret;
+}
+
 void SyncTask_CloseCache( SyncTask t )
 {
+	size_t i;
 	DirStats ds = GetDirStats( t );
-	unqlite_close( ds->db );
+	if( !ds->snapshot_opened ) {
+		return;
+	}
+	if( ds->n_removed_keys > 0 ) {
+		SyncTask_SaveRemovedKeys( t );
+		for( i = 0; i < ds->n_removed_keys; ++i ) {
+			free( ds->removed_keys[i] );
+		}
+		free( ds->removed_keys );
+		ds->removed_keys = NULL;
+		ds->n_removed_keys = 0;
+	}
+	Snapshot_Close( &ds->snapshot );
+	ds->snapshot_opened = FALSE;
 }
 
-/** 从缓存记录中载入文件列表 */
-static int SyncTask_LoadCache( SyncTask t )
+/** 将扫描记录写入日志，以便在中断后恢复 */
+static void SyncTask_WriteLog( SyncTask t, const char *key, size_t len,
+			       uint32_t ctime, uint32_t mtime )
 {
-	int rc, count;
-	wchar_t buf[MAX_PATH_LEN];
-	unqlite_kv_cursor *cur;
-	FileStatusRec status;
-	DirStats ds;
+	FileLogRecordRec rec;
+	DirStats ds = GetDirStats( t );
+	if( !ds->log ) {
+		return;
+	}
+	rec.path_len = (uint32_t)len;
+	rec.ctime = ctime;
+	rec.mtime = mtime;
+	fwrite( &rec, sizeof( rec ), 1, ds->log );
+	fwrite( key, 1, rec.path_len, ds->log );
+}
 
-	ds = GetDirStats( t );
-	SyncTask_OpenCacheW( t, t->file );
-	rc = unqlite_kv_cursor_init( ds->db, &cur );
-	if( rc != UNQLITE_OK ) {
-		unqlite_close( ds->db );
+/** 从扫描记录中恢复上次同步已扫描的文件，并重写扫描记录以去除不完整的记录 */
+static int SyncTask_LoadProgress( SyncTask t )
+{
+	size_t i;
+	FILE *fp;
+	FileLogRecordRec rec;
+	char key[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+
+	fp = wfopen( t->logfile, "rb" );
+	if( fp ) {
+		while( fread( &rec, sizeof( rec ), 1, fp ) == 1 ) {
+			if( rec.path_len >= MAX_PATH_LEN ||
+			    fread( key, 1, rec.path_len, fp ) != rec.path_len ) {
+				break;
+			}
+			key[rec.path_len] = 0;
+			if( SyncTask_PutEntry( t, key, rec.path_len,
+					       rec.ctime, rec.mtime ) != 0 ) {
+				break;
+			}
+		}
+		fclose( fp );
+	}
+	ds->log = wfopen( t->logfile, "wb" );
+	for( i = 0; i < ds->n_entries; ++i ) {
+		FileEntry e = &ds->entries[i];
+		SyncTask_WriteLog( t, e->path, strlen( e->path ),
+				   e->ctime, e->mtime );
+	}
+	t->total_files = (unsigned long)ds->n_entries;
+	return (int)ds->n_entries;
+}
+
+/**
+ * 计算文件列表的变更
+ * 将排序后的扫描结果与快照进行归并对比，同时生成新的快照。
+ */
+static int SyncTask_Diff( SyncTask t )
+{
+	int ret, cmp;
+	size_t i = 0;
+	FileEntry e;
+	SnapshotWriterRec w;
+	SnapshotCursorRec cur;
+	DirStats ds = GetDirStats( t );
+
+	SyncTask_SortEntries( t );
+	FileInfoList_Clear( &ds->added_files );
+	FileInfoList_Clear( &ds->changed_files );
+	FileInfoList_Clear( &ds->deleted_files );
+	SnapshotWriter_Init( &w );
+	SnapshotCursor_Seek( &cur, &ds->snapshot, 0 );
+	while( cur.valid || i < ds->n_entries ) {
+		e = i < ds->n_entries ? &ds->entries[i] : NULL;
+		if( !e ) {
+			cmp = -1;
+		} else if( !cur.valid ) {
+			cmp = 1;
+		} else {
+			cmp = strcmp( cur.key, e->path );
+		}
+		if( cmp < 0 ) {
+			FileInfoList_Append( &ds->deleted_files,
+					     SyncTask_GetPath( t, cur.key ),
+					     cur.ctime, cur.mtime );
+			SnapshotCursor_Next( &cur );
+			continue;
+		}
+		if( cmp > 0 ) {
+			FileInfoList_Append( &ds->added_files,
+					     SyncTask_GetPath( t, e->path ),
+					     e->ctime, e->mtime );
+		} else {
+			if( cur.ctime != e->ctime || cur.mtime != e->mtime ) {
+				FileInfoList_Append( &ds->changed_files,
+						     SyncTask_GetPath( t, e->path ),
+						     e->ctime, e->mtime );
+			}
+			SnapshotCursor_Next( &cur );
+		}
+		SnapshotWriter_Add( &w, e->path, e->ctime, e->mtime );
+		++i;
+	}
+	t->total_files = (unsigned long)ds->n_entries;
+	t->added_files = (unsigned long)ds->added_files.length;
+	t->changed_files = (unsigned long)ds->changed_files.length;
+	t->deleted_files = (unsigned long)ds->deleted_files.length;
+	ret = SnapshotWriter_Save( &w, t->tmpfile );
+	SnapshotWriter_Destroy( &w );
+	SyncTask_ClearEntries( t );
+	return ret;
+}
+
+static void SyncTask_ResetDirs( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	KeyTable_Clear( &ds->dirs );
+}
+
+static int WriteJournalDirs( FILE *fp, KeyTable dirs, size_t state )
+{
+	size_t i;
+	KeySlot slot;
+	for( i = 0; i < dirs->size; ++i ) {
+		slot = &dirs->slots[i];
+		if( !slot->key || slot->value != state ) {
+			continue;
+		}
+		if( fwrite( &slot->len, sizeof( slot->len ), 1, fp ) != 1 ||
+		    fwrite( slot->key, sizeof( char ),
+			    slot->len, fp ) != slot->len ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int ReadJournalDirs( FILE *fp, SyncTask t, size_t state,
+			    uint32_t count )
+{
+	uint32_t i, len;
+	KeySlot slot;
+	char buf[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+	for( i = 0; i < count; ++i ) {
+		if( fread( &len, sizeof( len ), 1, fp ) != 1 ||
+		    len >= MAX_PATH_LEN ) {
+			return -1;
+		}
+		if( fread( buf, sizeof( char ), len, fp ) != len ) {
+			return -1;
+		}
+		buf[len] = 0;
+		slot = KeyTable_Put( &ds->dirs, ds->arena, buf, len );
+		if( !slot ) {
+			return -1;
+		}
+		slot->value = state;
+	}
+	return 0;
+}
+
+/** 写入同步日志，先写入临时文件再替换，以保证日志文件始终是完整的 */
+static int SyncTask_WriteJournal( SyncTask t )
+{
+	int ret = 0;
+	FILE *fp;
+	wchar_t *tmpfile;
+	SyncJournalHeaderRec head;
+	DirStats ds = GetDirStats( t );
+	size_t len = wcslen( t->journal ) + 5;
+
+	tmpfile = malloc( sizeof( wchar_t ) * len );
+	swprintf( tmpfile, len, L"%ls.tmp", t->journal );
+	fp = wfopen( tmpfile, "wb" );
+	if( !fp ) {
+		free( tmpfile );
+		return -1;
+	}
+	memcpy( head.magic, JOURNAL_MAGIC, sizeof( head.magic ) );
+	head.version = JOURNAL_VERSION;
+	head.state = t->journal_state;
+	head.generation = t->generation;
+	head.finished_dirs = (uint32_t)KeyTable_Count( &ds->dirs, DIR_FINISHED );
+	head.pending_dirs = (uint32_t)KeyTable_Count( &ds->dirs, DIR_PENDING );
+	if( fwrite( &head, sizeof( head ), 1, fp ) != 1 ||
+	    WriteJournalDirs( fp, &ds->dirs, DIR_FINISHED ) != 0 ||
+	    WriteJournalDirs( fp, &ds->dirs, DIR_PENDING ) != 0 ||
+	    FlushFile( fp ) != 0 ) {
+		ret = -1;
+	}
+	fclose( fp );
+	if( ret == 0 ) {
+		ret = wrename( tmpfile, t->journal );
+	} else {
+		wremove( tmpfile );
+	}
+	free( tmpfile );
+	return ret;
+}
+
+/** 打开同步日志并读取头部信息 */
+static FILE *SyncTask_OpenJournal( SyncTask t, SyncJournalHeaderRec *head )
+{
+	FILE *fp = wfopen( t->journal, "rb" );
+	if( !fp ) {
+		return NULL;
+	}
+	if( fread( head, sizeof( SyncJournalHeaderRec ), 1, fp ) != 1 ||
+	    memcmp( head->magic, JOURNAL_MAGIC, sizeof( head->magic ) ) ||
+	    head->version != JOURNAL_VERSION ) {
+		fclose( fp );
+		return NULL;
+	}
+	return fp;
+}
+
+/** 读取同步日志，载入已扫描完的目录和待扫描的目录 */
+static int SyncTask_ReadJournal( SyncTask t )
+{
+	FILE *fp;
+	SyncJournalHeaderRec head;
+
+	fp = SyncTask_OpenJournal( t, &head );
+	if( !fp ) {
+		return -1;
+	}
+	if( ReadJournalDirs( fp, t, DIR_FINISHED,
+			     head.finished_dirs ) != 0 ||
+	    ReadJournalDirs( fp, t, DIR_PENDING,
+			     head.pending_dirs ) != 0 ) {
+		SyncTask_ResetDirs( t );
+		fclose( fp );
+		return -1;
+	}
+	fclose( fp );
+	t->generation = head.generation;
+	t->journal_state = head.state;
+	return 0;
+}
+
+int SyncTask_Recover( SyncTask t, unsigned int generation )
+{
+	FILE *fp;
+	SyncJournalHeaderRec head;
+
+	fp = SyncTask_OpenJournal( t, &head );
+	if( !fp ) {
 		return 0;
 	}
-	rc = unqlite_kv_cursor_first_entry( cur );
-	if( rc != UNQLITE_OK ) {
-		unqlite_kv_cursor_release( ds->db, cur );
-		unqlite_close( ds->db );
+	fclose( fp );
+	if( head.state != SYNC_JOURNAL_COMMITTING ||
+	    head.generation > generation ) {
 		return 0;
 	}
-	count = 0;
-	while( unqlite_kv_cursor_valid_entry( cur ) ) {
-		int key_size = MAX_PATH_LEN;
-		FileInfo info = NEW( FileInfoRec, 1 );
-		unqlite_int64 data_size = sizeof( FileStatusRec );
-		unqlite_kv_cursor_key( cur, buf, &key_size );
-		unqlite_kv_cursor_data( cur, &status, &data_size );
-		unqlite_kv_cursor_next_entry( cur );
-		info->path = malloc( key_size + sizeof( wchar_t ) );
-		info->mtime = status.mtime;
-		info->ctime = status.ctime;
-		key_size /= sizeof( wchar_t );
-		buf[(int)key_size] = 0;
-		wcsncpy( info->path, buf, key_size + 1 );
-		Dict_Add( ds->files, info->path, info );
-		Dict_Add( ds->deleted_files, info->path, info );
-		++count;
-	}
-	unqlite_kv_cursor_release( ds->db, cur );
-	unqlite_close( ds->db );
-	t->deleted_files = count;
-	return count;
+	/* 文件数据库已经提交了本次的变更，只差替换快照文件 */
+	DEBUG_MSG( "recover commit: %ls\n", t->scan_dir );
+	if( wrename( t->tmpfile, t->file ) != 0 ) {
+		return 0;
+	}
+	wremove( t->logfile );
+	wremove( t->journal );
+	return 1;
 }
 
 int SyncTask_AddFileW( SyncTask t, const wchar_t *path,
 		       unsigned int ctime, unsigned int mtime )
 {
-	size_t len;
-	FileInfo info;
-	FileStatusRec status;
+	int ret, len;
+	char key[MAX_PATH_LEN];
 	DirStats ds = GetDirStats( t );
 	if( t->state != STATE_STARTED ) {
 		return -1;
 	}
-	len = wcslen( path );
-	/* 若该文件路径存在于之前的缓存中，说明未被删除，否则将之
-	 * 视为新增的文件。
-	 */
-	info = Dict_FetchValue( ds->files, path );
-	if( info ) {
-		if( ctime != info->ctime || mtime != info->mtime ) {
-			info->ctime = ctime;
-			info->mtime = mtime;
-			Dict_Add( ds->changed_files, info->path, info );
-			DEBUG_MSG( "changed file: %ls\n", path );
-			++t->changed_files;
-		} else {
-			DEBUG_MSG( "unchanged file: %ls\n", path );
-		}
-		Dict_Delete( ds->deleted_files, path );
-		--t->deleted_files;
-	} else {
-		info = NEW( FileInfoRec, 1 );
-		info->path = NEW( wchar_t, len + 1 );
-		wcsncpy( info->path, path, len + 1 );
-		info->ctime = ctime;
-		info->mtime = mtime;
-		Dict_Add( ds->added_files, info->path, info );
-		DEBUG_MSG( "added file: %ls\n", path );
-		++t->added_files;
-	}
-	status.ctime = info->ctime;
-	status.mtime = info->mtime;
-	len = sizeof( wchar_t ) / sizeof( char ) * len;
-	unqlite_kv_store( ds->db, path, len, &status,
-			  sizeof( FileStatusRec ) );
-	++t->total_files;
-	return 0;
+	len = SyncTask_GetKey( t, path, key );
+	if( len < 0 ) {
+		return -1;
+	}
+	LCUIMutex_Lock( &ds->mutex );
+	SyncTask_WriteLog( t, key, len, ctime, mtime );
+	ret = SyncTask_PutEntry( t, key, len, ctime, mtime );
+	t->total_files = (unsigned long)ds->n_entries;
+	LCUIMutex_Unlock( &ds->mutex );
+	return ret;
 }
 
 int SyncTask_DeleteFileW( SyncTask t, const wchar_t *filepath )
 {
+	int len;
+	char **keys, key[MAX_PATH_LEN];
 	DirStats ds = GetDirStats( t );
-	size_t size = sizeof( wchar_t ) * wcslen( filepath );
-	int rc = unqlite_kv_delete( ds->db, filepath, size );
-	if( rc == UNQLITE_OK ) {
+
+	len = SyncTask_GetKey( t, filepath, key );
+	if( len < 0 || !Snapshot_Find( &ds->snapshot, key ) ) {
+		return -1;
+	}
+	/* 快照是只读的，先记录下来，在关闭时统一重写 */
+	keys = realloc( ds->removed_keys,
+			sizeof( char* ) * (ds->n_removed_keys + 1) );
+	if( !keys ) {
+		return -ENOMEM;
+	}
+	ds->removed_keys = keys;
+	keys[ds->n_removed_keys] = malloc( len + 1 );
+	if( !keys[ds->n_removed_keys] ) {
+		return -ENOMEM;
+	}
+	memcpy( keys[ds->n_removed_keys++], key, len + 1 );
+	return 0;
+}
+
+int SyncTask_AddDirW( SyncTask t, const wchar_t *dirpath )
+{
+	int ret = 0, len;
+	KeySlot slot;
+	char key[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+
+	len = SyncTask_GetKey( t, dirpath, key );
+	if( len < 0 ) {
 		return 0;
 	}
-	return -1;
+	LCUIMutex_Lock( &ds->mutex );
+	slot = KeyTable_Put( &ds->dirs, ds->arena, key, len );
+	if( slot && slot->value == DIR_NONE ) {
+		slot->value = DIR_PENDING;
+		ret = 1;
+	}
+	LCUIMutex_Unlock( &ds->mutex );
+	return ret;
+}
+
+static int SyncTask_SaveCheckpoint( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	/* 先将扫描记录写入磁盘，确保日志中记录的已扫描完的目录内的文件都已保存 */
+	if( ds->log ) {
+		if( FlushFile( ds->log ) != 0 ) {
+			return -1;
+		}
+	}
+	if( SyncTask_WriteJournal( t ) != 0 ) {
+		return -1;
+	}
+	ds->unsaved_dirs = 0;
+	ds->checkpoint_time = time( NULL );
+	return 0;
+}
+
+void SyncTask_FinishDirW( SyncTask t, const wchar_t *dirpath )
+{
+	int len;
+	KeySlot slot;
+	char key[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+
+	len = SyncTask_GetKey( t, dirpath, key );
+	if( len < 0 ) {
+		return;
+	}
+	LCUIMutex_Lock( &ds->mutex );
+	slot = KeyTable_Put( &ds->dirs, ds->arena, key, len );
+	if( slot ) {
+		slot->value = DIR_FINISHED;
+	}
+	ds->unsaved_dirs += 1;
+	if( ds->unsaved_dirs >= CHECKPOINT_DIRS ||
+	    time( NULL ) - ds->checkpoint_time >= CHECKPOINT_INTERVAL ) {
+		SyncTask_SaveCheckpoint( t );
+	}
+	LCUIMutex_Unlock( &ds->mutex );
+}
+
+int SyncTask_InPendingDirs( SyncTask t, DirPathHandler func, void *func_data )
+{
+	size_t i, n, count;
+	wchar_t **dirs;
+	KeySlot slot;
+	DirStats ds = GetDirStats( t );
+
+	/* 先复制一份目录列表，因为在处理目录时可能会有其它线程修改列表 */
+	LCUIMutex_Lock( &ds->mutex );
+	count = KeyTable_Count( &ds->dirs, DIR_PENDING );
+	dirs = malloc( sizeof( wchar_t* ) * (count + 1) );
+	if( !dirs ) {
+		LCUIMutex_Unlock( &ds->mutex );
+		return -ENOMEM;
+	}
+	for( i = 0, n = 0; i < ds->dirs.size && n < count; ++i ) {
+		slot = &ds->dirs.slots[i];
+		if( slot->key && slot->value == DIR_PENDING ) {
+			dirs[n] = SyncTask_GetPath( t, slot->key );
+			if( dirs[n] ) {
+				++n;
+			}
+		}
+	}
+	LCUIMutex_Unlock( &ds->mutex );
+	for( i = 0; i < n; ++i ) {
+		func( func_data, dirs[i] );
+	}
+	free( dirs );
+	return (int)n;
+}
+
+int SyncTask_Checkpoint( SyncTask t )
+{
+	int ret;
+	DirStats ds = GetDirStats( t );
+	LCUIMutex_Lock( &ds->mutex );
+	ret = SyncTask_SaveCheckpoint( t );
+	LCUIMutex_Unlock( &ds->mutex );
+	return ret;
 }
 
 int SyncTask_Start( SyncTask t )
 {
-	SyncTask_LoadCache( t );
-	if( 0 != SyncTask_OpenCacheW( t, t->tmpfile ) ) {
+	DirStats ds = GetDirStats( t );
+	t->resumed = FALSE;
+	if( SyncTask_ReadJournal( t ) == 0 ) {
+		t->resumed = TRUE;
+	} else {
+		/* 没有可用的同步日志，上次遗留的扫描记录已不可信 */
+		wremove( t->tmpfile );
+		wremove( t->logfile );
+		wremove( t->journal );
+	}
+	SyncTask_OpenCacheW( t, t->file );
+	if( t->resumed ) {
+		SyncTask_LoadProgress( t );
+		/* 上次的提交未完成，文件数据库中没有这些变更，需重新提交 */
+		if( t->journal_state == SYNC_JOURNAL_COMMITTING ) {
+			t->journal_state = SYNC_JOURNAL_SCANNED;
+		}
+		DEBUG_MSG( "resume sync: %ls, files: %lu\n",
+			   t->scan_dir, t->total_files );
+	} else {
+		ds->log = wfopen( t->logfile, "wb" );
+		t->journal_state = SYNC_JOURNAL_SCANNING;
+	}
+	if( !ds->log ) {
 		return -1;
 	}
+	ds->unsaved_dirs = 0;
+	ds->checkpoint_time = time( NULL );
 	t->state = STATE_STARTED;
 	return 0;
 }
 
 void SyncTask_Finish( SyncTask t )
 {
+	DirStats ds = GetDirStats( t );
 	t->state = STATE_FINISHED;
+	LCUIMutex_Lock( &ds->mutex );
+	SyncTask_Diff( t );
+	t->journal_state = SYNC_JOURNAL_SCANNED;
+	SyncTask_SaveCheckpoint( t );
+	SyncTask_CloseLog( t );
+	LCUIMutex_Unlock( &ds->mutex );
 	SyncTask_CloseCache( t );
 }
 
-void SyncTask_Commit( SyncTask t )
+int SyncTask_PrepareCommit( SyncTask t, unsigned int generation )
 {
+	int ret;
 	DirStats ds = GetDirStats( t );
-#ifdef _WIN32
-	unqlite_close( ds->db );
-	_wremove( t->file );
-	_wrename( t->tmpfile, t->file );
-#else
-	char *file = EncodeUTF8( t->file );
-	char *tmpfile = EncodeUTF8( t->tmpfile );
-	unqlite_close( ds->db );
-	remove( file );
-	rename( tmpfile, file );
-	free( file );
-	free( tmpfile );
-#endif
+	LCUIMutex_Lock( &ds->mutex );
+	t->generation = generation;
+	t->journal_state = SYNC_JOURNAL_COMMITTING;
+	ret = SyncTask_WriteJournal( t );
+	LCUIMutex_Unlock( &ds->mutex );
+	return ret;
+}
+
+void SyncTask_Commit( SyncTask t )
+{
+	SyncTask_CloseCache( t );
+	wrename( t->tmpfile, t->file );
+	wremove( t->logfile );
+	wremove( t->journal );
+	t->journal_state = SYNC_JOURNAL_NONE;
 }
@@ -0,0 +1,405 @@
+﻿/* ***************************************************************************
+ * file_metrics.c -- file service metrics.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_metrics.c -- 文件服务的统计数据。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define LCFINDER_FILE_METRICS_C
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
+#include "build.h"
+#include "file_service.h"
+#include "file_metrics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+typedef struct FileMetricsRec_ {
+	LCUI_Mutex mutex;
+	FileConnectionMetrics data;
+	LinkedListNode node;
+} FileMetricsRec;
+
+static struct FileMetricsModule {
+	LCUI_BOOL inited;
+	LCUI_Mutex mutex;
+	LinkedList list;		/**< 所有连接的统计数据 */
+	struct {
+		LCUI_BOOL active;
+		int interval;		/**< 输出间隔（毫秒） */
+		char *path;		/**< 输出文件路径 */
+		LCUI_Thread thread;
+		LCUI_Cond cond;
+		LCUI_Mutex mutex;
+	} dump;
+} self;
+
+static const char *method_names[REQUEST_METHOD_TOTAL] = {
+	"head", "get", "post", "put", "delete", "head_batch"
+};
+
+static const char *stage_names[FILE_STAGE_TOTAL] = {
+	"queue", "stat", "decode", "zoom", "transfer"
+};
+
+static const char *priority_names[FILE_PRIORITY_TOTAL] = {
+	"thumb", "picture", "preload", "scan", "idle"
+};
+
+void FileMetrics_Init( void )
+{
+	if( self.inited ) {
+		return;
+	}
+	LinkedList_Init( &self.list );
+	LCUIMutex_Init( &self.mutex );
+	LCUICond_Init( &self.dump.cond );
+	LCUIMutex_Init( &self.dump.mutex );
+	self.inited = TRUE;
+}
+
+int64_t FileMetrics_GetTime( void )
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency( &freq );
+	QueryPerformanceCounter( &count );
+	return (int64_t)(count.QuadPart / freq.QuadPart * 1000000 +
+			 count.QuadPart % freq.QuadPart * 1000000 /
+			 freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+FileMetrics FileMetrics_Create( unsigned int id )
+{
+	FileMetrics metrics;
+	metrics = NEW( FileMetricsRec, 1 );
+	if( !metrics ) {
+		return NULL;
+	}
+	metrics->data.id = id;
+	snprintf( metrics->data.name, sizeof( metrics->data.name ),
+		  "connection_%u", id );
+	metrics->node.data = metrics;
+	LCUIMutex_Init( &metrics->mutex );
+	LCUIMutex_Lock( &self.mutex );
+	LinkedList_AppendNode( &self.list, &metrics->node );
+	LCUIMutex_Unlock( &self.mutex );
+	return metrics;
+}
+
+void FileMetrics_SetName( FileMetrics metrics, const char *name )
+{
+	if( !metrics ) {
+		return;
+	}
+	LCUIMutex_Lock( &metrics->mutex );
+	strncpy( metrics->data.name, name, sizeof( metrics->data.name ) - 1 );
+	metrics->data.name[sizeof( metrics->data.name ) - 1] = 0;
+	LCUIMutex_Unlock( &metrics->mutex );
+}
+
+void FileMetrics_AddRequest( FileMetrics metrics, int method, int status )
+{
+	FileMethodMetrics *m;
+	if( !metrics || method < 0 || method >= REQUEST_METHOD_TOTAL ) {
+		return;
+	}
+	m = &metrics->data.methods[method];
+	LCUIMutex_Lock( &metrics->mutex );
+	m->requests += 1;
+	if( status == RESPONSE_STATUS_CANCELED ) {
+		m->canceled += 1;
+	} else if( status != RESPONSE_STATUS_OK ) {
+		m->errors += 1;
+	}
+	LCUIMutex_Unlock( &metrics->mutex );
+}
+
+void FileMetrics_AddTime( FileMetrics metrics, int method,
+			  int stage, int64_t usec )
+{
+	int i;
+	uint64_t value;
+	FileLatencyHistogram *hist;
+	if( !metrics || method < 0 || method >= REQUEST_METHOD_TOTAL ||
+	    stage < 0 || stage >= FILE_STAGE_TOTAL ) {
+		return;
+	}
+	value = usec > 0 ? (uint64_t)usec : 0;
+	/* 桶的序号即耗时的二进制位数 */
+	for( i = 0; value >> i && i < FILE_METRICS_BUCKETS - 1; ++i );
+	hist = &metrics->data.methods[method].stages[stage];
+	LCUIMutex_Lock( &metrics->mutex );
+	hist->count += 1;
+	hist->sum_us += value;
+	hist->buckets[i] += 1;
+	if( value > hist->max_us ) {
+		hist->max_us = value;
+	}
+	LCUIMutex_Unlock( &metrics->mutex );
+}
+
+void FileMetrics_AddImage( FileMetrics metrics, uint64_t bytes,
+			   uint64_t pixels )
+{
+	if( !metrics ) {
+		return;
+	}
+	LCUIMutex_Lock( &metrics->mutex );
+	metrics->data.bytes_read += bytes;
+	metrics->data.decoded_pixels += pixels;
+	LCUIMutex_Unlock( &metrics->mutex );
+}
+
+size_t FileMetrics_GetSnapshot( FileConnectionMetrics **outlist )
+{
+	size_t i = 0;
+	LinkedListNode *node;
+	FileMetrics metrics;
+	FileConnectionMetrics *list;
+
+	*outlist = NULL;
+	if( !self.inited ) {
+		return 0;
+	}
+	LCUIMutex_Lock( &self.mutex );
+	list = NEW( FileConnectionMetrics, self.list.length + 1 );
+	if( !list ) {
+		LCUIMutex_Unlock( &self.mutex );
+		return 0;
+	}
+	for( LinkedList_Each( node, &self.list ) ) {
+		metrics = node->data;
+		LCUIMutex_Lock( &metrics->mutex );
+		list[i++] = metrics->data;
+		LCUIMutex_Unlock( &metrics->mutex );
+	}
+	LCUIMutex_Unlock( &self.mutex );
+	*outlist = list;
+	return i;
+}
+
+/** 输出 JSON 字符串，连接名称由调用者指定，需要转义特殊字符 */
+static void WriteJSONString( FILE *fp, const char *str )
+{
+	fputc( '"', fp );
+	for( ; *str; ++str ) {
+		if( *str == '"' || *str == '\\' ) {
+			fprintf( fp, "\\%c", *str );
+		} else if( (unsigned char)*str < 0x20 ) {
+			fprintf( fp, "\\u%04x", *str );
+		} else {
+			fputc( *str, fp );
+		}
+	}
+	fputc( '"', fp );
+}
+
+static void WriteHistogram( FILE *fp, const FileLatencyHistogram *hist )
+{
+	int i, n;
+	/* 省略末尾的空桶 */
+	for( n = FILE_METRICS_BUCKETS; n > 0 && !hist->buckets[n - 1]; --n );
+	fprintf( fp, "{\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu,"
+		 "\"buckets\":[", (unsigned long long)hist->count,
+		 (unsigned long long)hist->sum_us,
+		 (unsigned long long)hist->max_us );
+	for( i = 0; i < n; ++i ) {
+		fprintf( fp, i > 0 ? ",%llu" : "%llu",
+			 (unsigned long long)hist->buckets[i] );
+	}
+	fputs( "]}", fp );
+}
+
+static void WriteMethod( FILE *fp, const FileMethodMetrics *m )
+{
+	int i;
+	LCUI_BOOL first = TRUE;
+	fprintf( fp, "{\"requests\":%llu,\"errors\":%llu,\"canceled\":%llu,"
+		 "\"stages\":{", (unsigned long long)m->requests,
+		 (unsigned long long)m->errors,
+		 (unsigned long long)m->canceled );
+	for( i = 0; i < FILE_STAGE_TOTAL; ++i ) {
+		if( m->stages[i].count < 1 ) {
+			continue;
+		}
+		fprintf( fp, "%s\"%s\":", first ? "" : ",", stage_names[i] );
+		WriteHistogram( fp, &m->stages[i] );
+		first = FALSE;
+	}
+	fputs( "}}", fp );
+}
+
+static void WriteConnection( FILE *fp, const FileConnectionMetrics *conn )
+{
+	int i;
+	LCUI_BOOL first = TRUE;
+	fprintf( fp, "{\"id\":%u,\"name\":", conn->id );
+	WriteJSONString( fp, conn->name );
+	fprintf( fp, ",\"bytes_read\":%llu,\"decoded_pixels\":%llu,"
+		 "\"methods\":{", (unsigned long long)conn->bytes_read,
+		 (unsigned long long)conn->decoded_pixels );
+	/* 只输出用过的请求方式 */
+	for( i = 0; i < REQUEST_METHOD_TOTAL; ++i ) {
+		if( conn->methods[i].requests < 1 &&
+		    conn->methods[i].stages[FILE_STAGE_QUEUE].count < 1 ) {
+			continue;
+		}
+		fprintf( fp, "%s\"%s\":", first ? "" : ",", method_names[i] );
+		WriteMethod( fp, &conn->methods[i] );
+		first = FALSE;
+	}
+	fputs( "}}", fp );
+}
+
+int FileMetrics_Dump( const char *path )
+{
+	FILE *fp;
+	char *tmppath;
+	size_t i, n, len;
+	size_t depths[FILE_PRIORITY_TOTAL];
+	FileConnectionMetrics *list;
+
+	len = strlen( path ) + 5;
+	tmppath = malloc( len );
+	if( !tmppath ) {
+		return -ENOMEM;
+	}
+	/* 先写入临时文件再替换，读取方不会读到写了一半的内容 */
+	snprintf( tmppath, len, "%s.tmp", path );
+	fp = fopen( tmppath, "wb" );
+	if( !fp ) {
+		free( tmppath );
+		return -1;
+	}
+	n = FileMetrics_GetSnapshot( &list );
+	FileService_GetQueueDepths( depths );
+	fprintf( fp, "{\"time\":%lld,\"queues\":{", (long long)time( NULL ) );
+	for( i = 0; i < FILE_PRIORITY_TOTAL; ++i ) {
+		fprintf( fp, "%s\"%s\":%lu", i > 0 ? "," : "",
+			 priority_names[i], (unsigned long)depths[i] );
+	}
+	fputs( "},\"connections\":[", fp );
+	for( i = 0; i < n; ++i ) {
+		if( i > 0 ) {
+			fputc( ',', fp );
+		}
+		WriteConnection( fp, &list[i] );
+	}
+	fputs( "]}\n", fp );
+	free( list );
+	if( fclose( fp ) != 0 ) {
+		remove( tmppath );
+		free( tmppath );
+		return -1;
+	}
+#ifdef _WIN32
+	remove( path );
+#endif
+	if( rename( tmppath, path ) != 0 ) {
+		remove( tmppath );
+		free( tmppath );
+		return -1;
+	}
+	free( tmppath );
+	return 0;
+}
+
+static void FileMetrics_DumpThread( void *arg )
+{
+	LCUIMutex_Lock( &self.dump.mutex );
+	while( self.dump.active ) {
+		LCUICond_TimedWait( &self.dump.cond, &self.dump.mutex,
+				    self.dump.interval );
+		FileMetrics_Dump( self.dump.path );
+	}
+	LCUIMutex_Unlock( &self.dump.mutex );
+	LCUIThread_Exit( NULL );
+}
+
+int FileMetrics_StartDump( const char *path, int interval )
+{
+	if( !self.inited || self.dump.active ) {
+		return -1;
+	}
+	self.dump.path = strdup( path );
+	if( !self.dump.path ) {
+		return -ENOMEM;
+	}
+	self.dump.interval = interval > 0 ? interval :
+		FILE_METRICS_DUMP_INTERVAL;
+	self.dump.active = TRUE;
+	if( LCUIThread_Create( &self.dump.thread,
+			       FileMetrics_DumpThread, NULL ) != 0 ) {
+		self.dump.active = FALSE;
+		free( self.dump.path );
+		self.dump.path = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int FileMetrics_StartDumpFromEnv( void )
+{
+	const char *path = getenv( FILE_METRICS_ENV );
+	if( !path || !path[0] ) {
+		return 0;
+	}
+	return FileMetrics_StartDump( path, FILE_METRICS_DUMP_INTERVAL );
+}
+
+void FileMetrics_StopDump( void )
+{
+	if( !self.dump.active ) {
+		return;
+	}
+	LCUIMutex_Lock( &self.dump.mutex );
+	self.dump.active = FALSE;
+	LCUICond_Signal( &self.dump.cond );
+	LCUIMutex_Unlock( &self.dump.mutex );
+	LCUIThread_Join( self.dump.thread, NULL );
+	free( self.dump.path );
+	self.dump.path = NULL;
+}
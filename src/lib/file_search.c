@@ -36,6 +36,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "sqlite3.h"
@@ -66,6 +67,12 @@ enum SQLCodeList {
 	SQL_ADD_DIR,
 	SQL_GET_DIR,
 	SQL_DEL_DIR,
+	SQL_GET_DIR_SYNC,
+	SQL_SET_DIR_SYNC,
+	SQL_MOVE_FILE,
+	SQL_GET_FILE_FINGERPRINT,
+	SQL_SET_FILE_FINGERPRINT,
+	SQL_GET_FILES_NO_FINGERPRINT,
 	SQL_TOTAL
 };
 
@@ -116,6 +123,17 @@ CREATE TABLE IF NOT EXISTS file_tag_relation (\
 	FOREIGN KEY (fid) REFERENCES file(id) ON DELETE CASCADE,\
 	FOREIGN KEY (tid) REFERENCES tag(id) ON DELETE CASCADE,\
 	UNIQUE(fid, tid)\
+);\
+CREATE TABLE IF NOT EXISTS dir_sync (\
+	did INTEGER PRIMARY KEY,\
+	generation INTEGER NOT NULL DEFAULT 0,\
+	FOREIGN KEY(did) REFERENCES dir(id) ON DELETE CASCADE\
+);\
+CREATE TABLE IF NOT EXISTS file_fingerprint (\
+	fid INTEGER PRIMARY KEY,\
+	size INTEGER NOT NULL,\
+	hash INTEGER NOT NULL,\
+	FOREIGN KEY(fid) REFERENCES file(id) ON DELETE CASCADE\
 );";
 
 STATIC_STR sql_get_dir_total = "SELECT COUNT(*) FROM dir;";
@@ -151,6 +169,28 @@ STATIC_STR sql_file_set_time_by_path = "\
 UPDATE file SET create_time = ?, modify_time = ? \
 WHERE did = ? AND path = ?;";
 
+STATIC_STR sql_get_dir_sync = "\
+SELECT generation FROM dir_sync WHERE did = ?;";
+
+STATIC_STR sql_set_dir_sync = "\
+REPLACE INTO dir_sync(did, generation) VALUES(?, ?);";
+
+STATIC_STR sql_move_file = "\
+UPDATE file SET did = ?, path = ?, create_time = ?, modify_time = ? \
+WHERE path = ?;";
+
+STATIC_STR sql_get_file_fingerprint = "\
+SELECT fp.size, fp.hash FROM file f, file_fingerprint fp \
+WHERE f.path = ? AND fp.fid = f.id;";
+
+STATIC_STR sql_set_file_fingerprint = "\
+REPLACE INTO file_fingerprint(fid, size, hash) \
+SELECT id, ?, ? FROM file WHERE path = ?;";
+
+STATIC_STR sql_get_files_no_fingerprint = "\
+SELECT f.path FROM file f LEFT JOIN file_fingerprint fp ON fp.fid = f.id \
+WHERE fp.fid IS NULL LIMIT ?;";
+
 STATIC_STR sql_file_add_tag = "\
 REPLACE INTO file_tag_relation(fid, tid) VALUES(?, ?);";
 
@@ -253,6 +293,12 @@ int DB_Init( const char *dbpath )
 	self.sqls[SQL_GET_FILE_TAGS] = sql_get_file_tags;
 	self.sqls[SQL_GET_DIR_LIST] = sql_get_dir_list;
 	self.sqls[SQL_GET_DIR_TOTAL] = sql_get_dir_total;
+	self.sqls[SQL_GET_DIR_SYNC] = sql_get_dir_sync;
+	self.sqls[SQL_SET_DIR_SYNC] = sql_set_dir_sync;
+	self.sqls[SQL_MOVE_FILE] = sql_move_file;
+	self.sqls[SQL_GET_FILE_FINGERPRINT] = sql_get_file_fingerprint;
+	self.sqls[SQL_SET_FILE_FINGERPRINT] = sql_set_file_fingerprint;
+	self.sqls[SQL_GET_FILES_NO_FINGERPRINT] = sql_get_files_no_fingerprint;
 	for( i = 0; i < SQL_TOTAL; ++i ) {
 		sqlite3_stmt *stmt;
 		const char *sql = self.sqls[i];
@@ -433,6 +479,77 @@ void DB_DeleteFile( const char *filepath )
 	sqlite3_step( stmt );
 }
 
+int DB_MoveFile( DB_Dir dir, const char *oldpath, const char *newpath,
+		 int ctime, int mtime )
+{
+	int ret;
+	sqlite3_stmt *stmt = self.stmts[SQL_MOVE_FILE];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, dir->id );
+	sqlite3_bind_text( stmt, 2, newpath, -1, NULL );
+	sqlite3_bind_int( stmt, 3, ctime );
+	sqlite3_bind_int( stmt, 4, mtime );
+	sqlite3_bind_text( stmt, 5, oldpath, -1, NULL );
+	ret = sqlite3_step( stmt );
+	if( ret == SQLITE_DONE ) {
+		return 0;
+	}
+	printf( "[database] error: %s\n", sqlite3_errmsg( self.db ) );
+	return -1;
+}
+
+int DB_GetFileFingerprint( const char *filepath,
+			    int64_t *size, uint64_t *hash )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_FILE_FINGERPRINT];
+	sqlite3_reset( stmt );
+	sqlite3_bind_text( stmt, 1, filepath, -1, NULL );
+	if( sqlite3_step( stmt ) != SQLITE_ROW ) {
+		return -1;
+	}
+	*size = sqlite3_column_int64( stmt, 0 );
+	*hash = (uint64_t)sqlite3_column_int64( stmt, 1 );
+	return 0;
+}
+
+int DB_SetFileFingerprint( const char *filepath,
+			    int64_t size, uint64_t hash )
+{
+	int ret;
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_FILE_FINGERPRINT];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int64( stmt, 1, size );
+	sqlite3_bind_int64( stmt, 2, (sqlite3_int64)hash );
+	sqlite3_bind_text( stmt, 3, filepath, -1, NULL );
+	ret = sqlite3_step( stmt );
+	if( ret == SQLITE_DONE ) {
+		return 0;
+	}
+	printf( "[database] error: %s\n", sqlite3_errmsg( self.db ) );
+	return -1;
+}
+
+int DB_GetFilesWithoutFingerprint( char ***outlist, int limit )
+{
+	char **list;
+	int i = 0;
+	const char *path;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_FILES_NO_FINGERPRINT];
+	list = malloc( sizeof( char* ) * (limit + 1) );
+	if( !list ) {
+		return -ENOMEM;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, limit );
+	while( i < limit && sqlite3_step( stmt ) == SQLITE_ROW ) {
+		path = (const char*)sqlite3_column_text( stmt, 0 );
+		list[i++] = strdup( path );
+	}
+	list[i] = NULL;
+	*outlist = list;
+	return i;
+}
+
 DB_File DBFile_Dup( DB_File file )
 {
 	DB_File f = malloc( sizeof(DB_FileRec) );
@@ -635,6 +752,33 @@ int DBFile_SetSize( DB_File file, int width, int height )
 	return -1;
 }
 
+unsigned int DB_GetDirSyncGeneration( DB_Dir dir )
+{
+	unsigned int generation = 0;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_DIR_SYNC];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, dir->id );
+	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		generation = (unsigned int)sqlite3_column_int64( stmt, 0 );
+	}
+	return generation;
+}
+
+int DB_SetDirSyncGeneration( DB_Dir dir, unsigned int generation )
+{
+	int ret;
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_DIR_SYNC];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, dir->id );
+	sqlite3_bind_int64( stmt, 2, generation );
+	ret = sqlite3_step( stmt );
+	if( ret == SQLITE_DONE ) {
+		return 0;
+	}
+	printf( "[database] error: %s\n", sqlite3_errmsg( self.db ) );
+	return -1;
+}
+
 void DBTag_Release( DB_Tag tag )
 {
 	free( tag->name );
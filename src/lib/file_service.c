@@ -35,8 +35,12 @@
  * ****************************************************************************/
 
 #define LCFINDER_FILE_SERVICE_C
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
 #include <LCUI/font/charset.h>
@@ -47,6 +51,9 @@
 #include "bridge.h"
 #include "common.h"
 #include "file_service.h"
+#include "file_metrics.h"
+#include "image_loader.h"
+#include "image_scaler.h"
 
 #ifdef _WIN32
 #define _S_ISTYPE(mode, mask)	(((mode) & _S_IFMT) == (mask))
@@ -54,6 +61,38 @@
 #define S_ISREG(mode)		_S_ISTYPE((mode), _S_IFREG)
 #endif
 
+/** Linux 上用 statx() 获取文件状态，只取需要的字段，也不必与远端文件系统同步 */
+#if defined(__linux__) && defined(STATX_TYPE)
+#define FILE_SERVICE_USE_STATX
+#define FILE_SERVICE_STATX_MASK (STATX_TYPE | STATX_SIZE | \
+				 STATX_CTIME | STATX_MTIME)
+#endif
+
+/** 工作线程的最少数量，文件读取会阻塞线程，单核时也需要多个线程 */
+#define FILE_SERVICE_MIN_WORKERS 2
+
+/** 任务每等待这么久（毫秒），其优先级就提升一级 */
+#define FILE_SERVICE_AGING_TIME 500
+
+/** 文件列表所用的环形缓冲区的容量，必须是 2 的幂 */
+#define FILE_STREAM_RING_SIZE 65536
+
+/** 文件列表记录的对齐字节数 */
+#define FILE_DIR_RECORD_ALIGN 8
+#define FILE_DIR_RECORD_SIZE(len) (((len) + FILE_DIR_RECORD_ALIGN - 1) & \
+				   ~(size_t)(FILE_DIR_RECORD_ALIGN - 1))
+
+/** 环形缓冲区的读写位置由读写双方各自更新，对方需要用原子操作读取 */
+#ifdef _WIN32
+#define RING_LOAD(p)		((unsigned int)InterlockedCompareExchange( \
+				 (volatile LONG*)(p), 0, 0 ))
+#define RING_STORE(p, v)	InterlockedExchange( (volatile LONG*)(p), \
+						     (LONG)(v) )
+#else
+#define RING_LOAD(p)		__atomic_load_n( p, __ATOMIC_SEQ_CST )
+#define RING_STORE(p, v)	__atomic_store_n( p, v, __ATOMIC_SEQ_CST )
+#endif
+
 //#define DEBUG
 #ifndef DEBUG
 #undef LOG
@@ -62,13 +101,59 @@
 #define LOGW(...) NULL
 #endif
 
+typedef void( *FileStreamReceiver )(FileStreamChunk*, void*);
+
+/**
+ * 单生产者单消费者的环形缓冲区
+ * 读写都不需要加锁，只有在缓冲区为空或已满时，等待的一方才会借用文件流的互斥
+ * 锁和条件变量进入睡眠。
+ */
+typedef struct FileStreamRingRec_ {
+	char *data;			/**< 缓冲区 */
+	unsigned int size;		/**< 容量 */
+	volatile unsigned int head;	/**< 读取位置，只由读取方修改 */
+	volatile unsigned int tail;	/**< 写入位置，只由写入方修改 */
+	volatile unsigned int waiting;	/**< 等待者的数量，只在持有互斥锁时修改 */
+	unsigned int record_len;	/**< 读取方正在引用的记录的长度 */
+} FileStreamRingRec, *FileStreamRing;
+
+/**
+ * 文件列表记录的头部
+ * 头部之后依次是可选的文件状态和以 0 结尾的文件名，整条记录连续存放在环形缓冲
+ * 区中，不会跨越缓冲区末尾，读取方可以直接引用其中的数据。
+ */
+typedef struct FileDirRecordHeader_ {
+	uint32_t length;	/**< 整条记录的长度，包括对齐填充，为 0 表示余下部分是填充 */
+	uint8_t type;		/**< 文件类型 */
+	uint8_t with_status;	/**< 是否附带文件状态 */
+	uint16_t name_len;	/**< 文件名的字节数，不包括结尾的 0 */
+} FileDirRecordHeader;
+
+/** 文件列表记录中的文件状态 */
+typedef struct FileDirRecordStatus_ {
+	uint64_t size;
+	int64_t ctime;
+	int64_t mtime;
+} FileDirRecordStatus;
+
+/** 由引用计数管理的图像 */
+typedef struct FileImageRec_ {
+	int refs;			/**< 引用计数 */
+	LCUI_Mutex mutex;		/**< 互斥锁 */
+	LCUI_Graph graph;		/**< 图像数据 */
+} FileImageRec;
+
 typedef struct FileStreamRec_ {
-	LCUI_BOOL active;
+	int refs;			/**< 引用计数 */
 	LCUI_BOOL closed;
 	LCUI_Cond cond;
 	LCUI_Mutex mutex;
 	LinkedList data;		/**< 数据块列表 */
 	FileStreamChunk *chunk;		/**< 当前操作的数据块 */
+	FileStreamReceiver receiver;	/**< 接收者，设置后写入的数据块会直接交给它 */
+	void *receiver_arg;		/**< 接收者的附加参数 */
+	FileStreamRingRec ring;		/**< 字节数据的环形缓冲区，未启用时 data 为 NULL */
+	int64_t clock;			/**< 响应发出时的计时器读数，用于统计传输耗时 */
 } FileStreamRec;
 
 typedef struct ConnectionRecord_ {
@@ -85,11 +170,13 @@ typedef struct ConnectionRec_ {
 	LCUI_Thread thread;
 	FileStream input;
 	FileStream output;
+	FileMetrics metrics;		/**< 统计数据，与对端的连接共用 */
 } ConnectionRec;
 
 typedef struct FileClientTask_ {
 	FileRequest request;
 	FileRequestHandler handler;
+	LinkedListNode node;
 } FileClientTask;
 
 typedef struct FileClientRec_ {
@@ -98,9 +185,42 @@ typedef struct FileClientRec_ {
 	LCUI_Mutex mutex;
 	LCUI_Thread thread;
 	Connection connection;
-	LinkedList tasks;
+	unsigned int base_id;		/**< 用于分配请求标识号 */
+	size_t max_requests;		/**< 最多同时等待响应的请求数量 */
+	LinkedList tasks;		/**< 尚未发送的请求 */
+	LinkedList requests;		/**< 已发送、正在等待响应的请求 */
+	LinkedList canceled;		/**< 未发送就被取消、等待本地响应的请求，不占用请求数量 */
 } FileClientRec, *FileClient;
 
+/**
+ * 正在进行的图片读取
+ * 同一文件的相同或更小尺寸的请求会挂起等待它的结果，而不是重新解码
+ */
+typedef struct FileServiceDecodeRec_ {
+	wchar_t *path;			/**< 文件路径 */
+	time_t mtime;			/**< 文件修改时间 */
+	LCUI_BOOL get_thumbnail;	/**< 是否读取的是缩略图 */
+	unsigned int width;		/**< 缩略图的最大宽度 */
+	unsigned int height;		/**< 缩略图的最大高度 */
+	LCUI_BOOL listed;		/**< 是否还在 service.decodes.list 中 */
+	LinkedList waiters;		/**< 等待结果的任务 */
+	LinkedListNode node;		/**< 在 service.decodes.list 中的节点 */
+} FileServiceDecodeRec, *FileServiceDecode;
+
+/** 文件服务的任务，即一个待处理的请求 */
+typedef struct FileServiceTaskRec_ {
+	Connection conn;		/**< 请求来源的连接 */
+	FileRequest request;		/**< 请求 */
+	int64_t time;			/**< 进入队列的时间 */
+	int64_t clock;			/**< 进入队列时的计时器读数，用于统计耗时 */
+	LCUI_BOOL canceled;		/**< 是否已被取消 */
+	LCUI_ImageReader reader;	/**< 正在使用的图片读取器 */
+	FileServiceDecode decode;	/**< 由该任务负责的图片读取 */
+	FileStreamChunk chunk;		/**< 挂起时暂存的响应 */
+	LinkedListNode node;		/**< 在任务队列中的节点 */
+	LinkedListNode wait_node;	/**< 在图片读取的等待列表中的节点 */
+} FileServiceTaskRec, *FileServiceTask;
+
 static struct FileService {
 	LCUI_BOOL active;
 	LCUI_Thread thread;
@@ -109,6 +229,20 @@ static struct FileService {
 	int backlog;
 	LinkedList requests;
 	LinkedList connections;
+	struct {
+		int count;			/**< 工作线程数量 */
+		LCUI_Thread *threads;		/**< 工作线程列表 */
+		LCUI_Thread idle_thread;	/**< 以后台模式处理空闲任务的线程 */
+		LinkedList queues[FILE_PRIORITY_TOTAL];	/**< 各优先级的任务队列 */
+		LinkedList running;		/**< 正在处理的任务 */
+		LCUI_Cond cond;
+		LCUI_Mutex mutex;
+	} workers;
+	struct {
+		LinkedList list;		/**< 正在进行的图片读取 */
+		LCUI_Mutex mutex;
+	} decodes;
+	FileServiceForwarderRec forwarder;	/**< 请求转发器 */
 } service;
 
 void FileStreamChunk_Destroy( FileStreamChunk *chunk )
@@ -120,10 +254,16 @@ void FileStreamChunk_Destroy( FileStreamChunk *chunk )
 		}
 		break;
 	case DATA_CHUNK_IMAGE:
-		Graph_Free( &chunk->image );
+		if( chunk->image ) {
+			FileImage_Release( chunk->image );
+			chunk->image = NULL;
+		}
 		break;
 	case DATA_CHUNK_THUMB:
-		Graph_Free( &chunk->thumb );
+		if( chunk->thumb ) {
+			FileImage_Release( chunk->thumb );
+			chunk->thumb = NULL;
+		}
 		break;
 	case DATA_CHUNK_BUFFER:
 		free( chunk->data );
@@ -135,6 +275,75 @@ void FileStreamChunk_Destroy( FileStreamChunk *chunk )
 	}
 }
 
+FileImage FileImage_Create( void )
+{
+	FileImage image = NEW( FileImageRec, 1 );
+	if( !image ) {
+		return NULL;
+	}
+	image->refs = 1;
+	Graph_Init( &image->graph );
+	LCUIMutex_Init( &image->mutex );
+	return image;
+}
+
+FileImage FileImage_CreateWithSize( unsigned int width, unsigned int height )
+{
+	FileImage image = FileImage_Create();
+	if( !image ) {
+		return NULL;
+	}
+	/* 按带透明通道的格式分配，这样解码任何格式的图片时都能复用这块内存 */
+	image->graph.color_type = COLOR_TYPE_ARGB;
+	if( Graph_Create( &image->graph, width, height ) != 0 ) {
+		FileImage_Release( image );
+		return NULL;
+	}
+	return image;
+}
+
+void FileImage_AddRef( FileImage image )
+{
+	LCUIMutex_Lock( &image->mutex );
+	image->refs += 1;
+	LCUIMutex_Unlock( &image->mutex );
+}
+
+void FileImage_Release( FileImage image )
+{
+	int refs;
+	LCUIMutex_Lock( &image->mutex );
+	refs = --image->refs;
+	LCUIMutex_Unlock( &image->mutex );
+	if( refs > 0 ) {
+		return;
+	}
+	Graph_Free( &image->graph );
+	LCUIMutex_Destroy( &image->mutex );
+	free( image );
+}
+
+LCUI_Graph *FileImage_GetGraph( FileImage image )
+{
+	return &image->graph;
+}
+
+int FileImage_Take( FileImage image, LCUI_Graph *graph )
+{
+	int ret = 0;
+	Graph_Init( graph );
+	LCUIMutex_Lock( &image->mutex );
+	if( image->refs == 1 ) {
+		*graph = image->graph;
+		Graph_Init( &image->graph );
+	} else {
+		ret = Graph_Copy( graph, &image->graph );
+	}
+	LCUIMutex_Unlock( &image->mutex );
+	FileImage_Release( image );
+	return ret;
+}
+
 static void FileStreamChunk_Release( FileStreamChunk *chunk )
 {
 	FileStreamChunk_Destroy( chunk );
@@ -145,55 +354,443 @@ FileStream FileStream_Create( void )
 {
 	FileStream stream;
 	stream = NEW( FileStreamRec, 1 );
+	stream->refs = 1;
 	stream->closed = FALSE;
-	stream->active = TRUE;
+	stream->chunk = NULL;
+	stream->receiver = NULL;
+	stream->receiver_arg = NULL;
 	LinkedList_Init( &stream->data );
 	LCUICond_Init( &stream->cond );
 	LCUIMutex_Init( &stream->mutex );
 	return stream;
 }
 
+void FileStream_AddRef( FileStream stream )
+{
+	LCUIMutex_Lock( &stream->mutex );
+	stream->refs += 1;
+	LCUIMutex_Unlock( &stream->mutex );
+}
+
 void FileStream_Close( FileStream stream )
 {
-	if( stream->active ) {
-		LCUIMutex_Lock( &stream->mutex );
-		stream->closed = TRUE;
-		LCUICond_Signal( &stream->cond );
+	LCUI_BOOL closed;
+	FileStreamChunk chunk = { 0 };
+
+	LCUIMutex_Lock( &stream->mutex );
+	closed = stream->closed;
+	stream->closed = TRUE;
+	LCUICond_Broadcast( &stream->cond );
+	LCUIMutex_Unlock( &stream->mutex );
+	/* 接收者收不到后续的数据块，需要告诉它数据流已经关闭 */
+	if( !closed && stream->receiver ) {
+		chunk.type = DATA_CHUNK_END;
+		stream->receiver( &chunk, stream->receiver_arg );
+	}
+}
+
+static void FileStream_Destroy( FileStream stream )
+{
+	if( stream->chunk ) {
+		FileStreamChunk_Release( stream->chunk );
+		stream->chunk = NULL;
+	}
+	LinkedList_Clear( &stream->data, FileStreamChunk_Release );
+	if( stream->ring.data ) {
+		free( stream->ring.data );
+		stream->ring.data = NULL;
+	}
+	LCUIMutex_Destroy( &stream->mutex );
+	LCUICond_Destroy( &stream->cond );
+	free( stream );
+}
+
+void FileStream_Release( FileStream stream )
+{
+	int refs;
+	LCUIMutex_Lock( &stream->mutex );
+	/* 读写双方中的任何一方放弃后，另一方都没必要再继续 */
+	stream->closed = TRUE;
+	refs = --stream->refs;
+	LCUICond_Broadcast( &stream->cond );
+	LCUIMutex_Unlock( &stream->mutex );
+	if( refs == 0 ) {
+		FileStream_Destroy( stream );
+	}
+}
+
+/**
+ * 为文件流启用环形缓冲区
+ * 之后 FileStream_Write() 写入的字节数据不再逐块分配内存，缓冲区满时写入方会
+ * 等待读取方。需要在文件流交给读取方之前调用。
+ */
+static int FileStream_InitRing( FileStream stream, unsigned int size )
+{
+	FileStreamRing ring = &stream->ring;
+	ring->data = malloc( size );
+	if( !ring->data ) {
+		return -ENOMEM;
+	}
+	ring->size = size;
+	ring->head = ring->tail = 0;
+	ring->waiting = 0;
+	return 0;
+}
+
+static size_t FileStreamRing_Write( FileStreamRing ring,
+				    const char *buf, size_t len )
+{
+	size_t n, offset;
+	unsigned int head = RING_LOAD( &ring->head );
+	unsigned int tail = ring->tail;
+
+	n = ring->size - (tail - head);
+	if( n > len ) {
+		n = len;
+	}
+	offset = tail & (ring->size - 1);
+	if( offset + n > ring->size ) {
+		len = ring->size - offset;
+		memcpy( ring->data + offset, buf, len );
+		memcpy( ring->data, buf + len, n - len );
+	} else {
+		memcpy( ring->data + offset, buf, n );
+	}
+	RING_STORE( &ring->tail, tail + (unsigned int)n );
+	return n;
+}
+
+/** 从环形缓冲区读取数据，delim 不为 0 时读到该字符为止（包括它） */
+static size_t FileStreamRing_Read( FileStreamRing ring, char *buf,
+				   size_t len, int delim )
+{
+	size_t i, n, offset;
+	unsigned int tail = RING_LOAD( &ring->tail );
+	unsigned int head = ring->head;
+
+	n = tail - head;
+	if( n > len ) {
+		n = len;
+	}
+	if( delim ) {
+		for( i = 0; i < n; ++i ) {
+			buf[i] = ring->data[(head + i) & (ring->size - 1)];
+			if( buf[i] == delim ) {
+				n = i + 1;
+				break;
+			}
+		}
+	} else {
+		offset = head & (ring->size - 1);
+		if( offset + n > ring->size ) {
+			len = ring->size - offset;
+			memcpy( buf, ring->data + offset, len );
+			memcpy( buf + len, ring->data, n - len );
+		} else {
+			memcpy( buf, ring->data + offset, n );
+		}
+	}
+	RING_STORE( &ring->head, head + (unsigned int)n );
+	return n;
+}
+
+/**
+ * 等待环形缓冲区中有 need 字节可读或可写
+ * 返回 -1 表示不会再有数据可读写：流已关闭，或者写入方已经改为写入数据块。
+ * waiting 的写入与读写位置的检查都是顺序一致的，所以对方要么看到 waiting
+ * 并唤醒这里，要么在这里检查之前就已经更新了读写位置。
+ */
+static int FileStream_WaitRing( FileStream stream, LCUI_BOOL for_write,
+				unsigned int need )
+{
+	int ret = 0;
+	unsigned int used;
+	FileStreamRing ring = &stream->ring;
+
+	LCUIMutex_Lock( &stream->mutex );
+	/* 读写双方可能同时处于等待中，所以用计数而不是标志 */
+	RING_STORE( &ring->waiting, ring->waiting + 1 );
+	while( 1 ) {
+		used = RING_LOAD( &ring->tail ) - RING_LOAD( &ring->head );
+		if( for_write ? ring->size - used >= need : used >= need ) {
+			break;
+		}
+		if( stream->closed || (!for_write && stream->data.length > 0) ) {
+			ret = -1;
+			break;
+		}
+		LCUICond_Wait( &stream->cond, &stream->mutex );
+	}
+	RING_STORE( &ring->waiting, ring->waiting - 1 );
+	LCUIMutex_Unlock( &stream->mutex );
+	return ret;
+}
+
+/** 唤醒因环形缓冲区为空或已满而等待的另一方，没有等待者时不加锁 */
+static void FileStream_WakeRing( FileStream stream )
+{
+	if( RING_LOAD( &stream->ring.waiting ) ) {
 		LCUIMutex_Lock( &stream->mutex );
+		LCUICond_Broadcast( &stream->cond );
+		LCUIMutex_Unlock( &stream->mutex );
 	}
 }
 
-static LCUI_BOOL FileStream_Useable( FileStream stream )
+static size_t FileStream_WriteRing( FileStream stream, const char *buf,
+				    size_t size, size_t count )
 {
-	if( stream->active ) {
-		if( stream->chunk || stream->data.length > 0 ) {
-			return TRUE;
+	size_t n, len = 0, total = size * count;
+	while( len < total && !stream->closed ) {
+		n = FileStreamRing_Write( &stream->ring, buf + len,
+					  total - len );
+		if( n == 0 ) {
+			if( FileStream_WaitRing( stream, TRUE, 1 ) != 0 ) {
+				break;
+			}
+			continue;
 		}
-		if( stream->closed ) {
-			return FALSE;
+		FileStream_WakeRing( stream );
+		len += n;
+	}
+	return len / size;
+}
+
+static size_t FileStream_ReadRing( FileStream stream, char *buf,
+				   size_t size, size_t count )
+{
+	size_t n, len = 0, total = size * count;
+	while( len < total ) {
+		n = FileStreamRing_Read( &stream->ring, buf + len,
+					 total - len, 0 );
+		if( n == 0 ) {
+			if( FileStream_WaitRing( stream, FALSE, 1 ) != 0 ) {
+				break;
+			}
+			continue;
 		}
+		FileStream_WakeRing( stream );
+		len += n;
 	}
-	return TRUE;
+	return len / size;
 }
 
-void FileStream_Destroy( FileStream stream )
+static char *FileStream_ReadRingLine( FileStream stream,
+				      char *buf, size_t size )
 {
-	if( !stream->active ) {
-		return;
+	size_t n, len = 0;
+	while( len < size - 1 ) {
+		n = FileStreamRing_Read( &stream->ring, buf + len,
+					 size - 1 - len, '\n' );
+		if( n == 0 ) {
+			if( FileStream_WaitRing( stream, FALSE, 1 ) != 0 ) {
+				break;
+			}
+			continue;
+		}
+		FileStream_WakeRing( stream );
+		len += n;
+		if( buf[len - 1] == '\n' ) {
+			break;
+		}
 	}
-	stream->active = FALSE;
-	LinkedList_Clear( &stream->data, FileStreamChunk_Release );
-	LCUIMutex_Destroy( &stream->mutex );
-	LCUICond_Destroy( &stream->cond );
+	if( len == 0 ) {
+		return NULL;
+	}
+	buf[len] = 0;
+	return buf;
 }
 
-int FileStream_ReadChunk( FileStream stream, FileStreamChunk *chunk )
+/**
+ * 在环形缓冲区中预留一段连续空间，用于写入一条文件列表记录
+ * 缓冲区末尾剩余的空间不够时，会用填充记录跳过它，从缓冲区开头预留。
+ * wait 为 FALSE 时，空间不够就直接返回 NULL，不等待读取方。
+ */
+static char *FileStream_ReserveRecord( FileStream stream, size_t len,
+				       LCUI_BOOL wait )
 {
-	LinkedListNode *node;
-	if( !FileStream_Useable( stream ) ) {
-		FileStream_Destroy( stream );
+	size_t offset;
+	unsigned int head, used, space, need;
+	FileDirRecordHeader padding = { 0 };
+	FileStreamRing ring = &stream->ring;
+
+	while( !stream->closed ) {
+		head = RING_LOAD( &ring->head );
+		used = ring->tail - head;
+		offset = ring->tail & (ring->size - 1);
+		space = ring->size - (unsigned int)offset;
+		if( space >= len ) {
+			need = (unsigned int)len;
+		} else {
+			need = space;
+		}
+		if( ring->size - used < need ) {
+			if( !wait ||
+			    FileStream_WaitRing( stream, TRUE, need ) != 0 ) {
+				break;
+			}
+			continue;
+		}
+		if( space >= len ) {
+			return ring->data + offset;
+		}
+		memcpy( ring->data + offset, &padding, sizeof( padding ) );
+		RING_STORE( &ring->tail, ring->tail + space );
+		FileStream_WakeRing( stream );
+	}
+	return NULL;
+}
+
+/** 写入一条文件列表记录，文件名直接编码到环形缓冲区中 */
+static int FileStream_WriteDirEntry( FileStream stream, int type,
+				     const wchar_t *name,
+				     const FileStatus *status )
+{
+	char *p;
+	size_t len;
+	FileDirRecordStatus rstatus;
+	FileDirRecordHeader header = { 0 };
+
+	len = sizeof( header ) + wcslen( name ) * 4 + 1;
+	if( status ) {
+		len += sizeof( rstatus );
+	}
+	p = FileStream_ReserveRecord( stream, FILE_DIR_RECORD_SIZE( len ),
+				      TRUE );
+	if( !p ) {
+		return -1;
+	}
+	len = sizeof( header );
+	if( status ) {
+		rstatus.size = status->size;
+		rstatus.ctime = status->ctime;
+		rstatus.mtime = status->mtime;
+		memcpy( p + len, &rstatus, sizeof( rstatus ) );
+		len += sizeof( rstatus );
+		header.with_status = 1;
+	}
+	header.name_len = LCUI_EncodeString( p + len, name, 
+					     wcslen( name ) * 4 + 1,
+					     ENCODING_UTF8 );
+	p[len + header.name_len] = 0;
+	len += header.name_len + 1;
+	header.type = type;
+	header.length = (uint32_t)FILE_DIR_RECORD_SIZE( len );
+	memcpy( p, &header, sizeof( header ) );
+	RING_STORE( &stream->ring.tail, stream->ring.tail + header.length );
+	FileStream_WakeRing( stream );
+	return 0;
+}
+
+int FileStream_InitDirList( FileStream stream )
+{
+	return FileStream_InitRing( stream, FILE_STREAM_RING_SIZE );
+}
+
+static int FileStream_PutDirEntry( FileStream stream,
+				  const FileDirEntry *entry, LCUI_BOOL wait )
+{
+	char *p;
+	size_t len;
+	FileDirRecordStatus rstatus;
+	FileDirRecordHeader header = { 0 };
+
+	len = sizeof( header ) + entry->name_len + 1;
+	if( entry->with_status ) {
+		len += sizeof( rstatus );
+	}
+	p = FileStream_ReserveRecord( stream, FILE_DIR_RECORD_SIZE( len ),
+				      wait );
+	if( !p ) {
+		return wait || stream->closed ? -1 : -EAGAIN;
+	}
+	len = sizeof( header );
+	if( entry->with_status ) {
+		rstatus.size = entry->size;
+		rstatus.ctime = entry->ctime;
+		rstatus.mtime = entry->mtime;
+		memcpy( p + len, &rstatus, sizeof( rstatus ) );
+		len += sizeof( rstatus );
+		header.with_status = 1;
+	}
+	memcpy( p + len, entry->name, entry->name_len );
+	p[len + entry->name_len] = 0;
+	len += entry->name_len + 1;
+	header.type = entry->type;
+	header.name_len = (uint16_t)entry->name_len;
+	header.length = (uint32_t)FILE_DIR_RECORD_SIZE( len );
+	memcpy( p, &header, sizeof( header ) );
+	RING_STORE( &stream->ring.tail, stream->ring.tail + header.length );
+	FileStream_WakeRing( stream );
+	return 0;
+}
+
+int FileStream_CopyDirEntry( FileStream stream, const FileDirEntry *entry )
+{
+	return FileStream_PutDirEntry( stream, entry, TRUE );
+}
+
+int FileStream_TryCopyDirEntry( FileStream stream,
+				const FileDirEntry *entry )
+{
+	return FileStream_PutDirEntry( stream, entry, FALSE );
+}
+
+int FileStream_ReadDirEntry( FileStream stream, FileDirEntry *entry )
+{
+	char *p;
+	size_t offset;
+	FileDirRecordStatus rstatus;
+	FileDirRecordHeader header;
+	FileStreamRing ring = &stream->ring;
+
+	if( !ring->data ) {
 		return 0;
 	}
+	/* 上一条记录已经不再被引用，归还它占用的空间 */
+	if( ring->record_len > 0 ) {
+		RING_STORE( &ring->head, ring->head + ring->record_len );
+		ring->record_len = 0;
+		FileStream_WakeRing( stream );
+	}
+	while( 1 ) {
+		if( RING_LOAD( &ring->tail ) == ring->head ) {
+			if( FileStream_WaitRing( stream, FALSE, 1 ) != 0 ) {
+				return 0;
+			}
+			continue;
+		}
+		offset = ring->head & (ring->size - 1);
+		p = ring->data + offset;
+		memcpy( &header, p, sizeof( header ) );
+		if( header.length > 0 ) {
+			break;
+		}
+		RING_STORE( &ring->head, ring->head +
+			    (ring->size - (unsigned int)offset) );
+		FileStream_WakeRing( stream );
+	}
+	ring->record_len = header.length;
+	p += sizeof( header );
+	entry->type = header.type;
+	entry->with_status = header.with_status;
+	if( header.with_status ) {
+		memcpy( &rstatus, p, sizeof( rstatus ) );
+		entry->size = rstatus.size;
+		entry->ctime = rstatus.ctime;
+		entry->mtime = rstatus.mtime;
+		p += sizeof( rstatus );
+	} else {
+		entry->size = 0;
+		entry->ctime = entry->mtime = 0;
+	}
+	entry->name = p;
+	entry->name_len = header.name_len;
+	return 1;
+}
+
+int FileStream_ReadChunk( FileStream stream, FileStreamChunk *chunk )
+{
+	LinkedListNode *node;
 	LCUIMutex_Lock( &stream->mutex );
 	while( stream->data.length < 1 && !stream->closed ) {
 		LCUICond_Wait( &stream->cond, &stream->mutex );
@@ -202,6 +799,7 @@ int FileStream_ReadChunk( FileStream stream, FileStreamChunk *chunk )
 		node = LinkedList_GetNode( &stream->data, 0 );
 		LinkedList_Unlink( &stream->data, node );
 		*chunk = *((FileStreamChunk*)node->data);
+		free( node->data );
 		LinkedListNode_Delete( node );
 		LCUIMutex_Unlock( &stream->mutex );
 		return 1;
@@ -213,17 +811,23 @@ int FileStream_ReadChunk( FileStream stream, FileStreamChunk *chunk )
 int FileStream_WriteChunk( FileStream stream, FileStreamChunk *chunk )
 {
 	FileStreamChunk *buf;
-	if( !FileStream_Useable( stream ) ) {
-		FileStream_Destroy( stream );
+	LCUIMutex_Lock( &stream->mutex );
+	if( stream->closed ) {
+		LCUIMutex_Unlock( &stream->mutex );
 		return -1;
 	}
-	LCUIMutex_Lock( &stream->mutex );
+	if( stream->receiver ) {
+		LCUIMutex_Unlock( &stream->mutex );
+		stream->receiver( chunk, stream->receiver_arg );
+		return 1;
+	}
 	buf = NEW( FileStreamChunk, 1 );
 	*buf = *chunk;
 	buf->cur = 0;
+	/* 数据块的大小由写入方设置，不能覆盖 */
 	if( chunk->type == DATA_CHUNK_REQUEST ) {
 		buf->size = sizeof( buf->request );
-	} else {
+	} else if( chunk->type == DATA_CHUNK_RESPONSE ) {
 		buf->size = sizeof( buf->response );
 	}
 	LinkedList_Append( &stream->data, buf );
@@ -238,9 +842,8 @@ size_t FileStream_Read( FileStream stream, char *buf,
 	LinkedListNode *node;
 	FileStreamChunk *chunk;
 	size_t read_count = 0, cur = 0;
-	if( !FileStream_Useable( stream ) ) {
-		FileStream_Destroy( stream );
-		return 0;
+	if( stream->ring.data ) {
+		return FileStream_ReadRing( stream, buf, size, count );
 	}
 	while( 1 ) {
 		size_t n, read_size;
@@ -260,9 +863,9 @@ size_t FileStream_Read( FileStream stream, char *buf,
 			LinkedList_Unlink( &stream->data, node );
 			LinkedListNode_Delete( node );
 			LCUIMutex_Unlock( &stream->mutex );
-			if( chunk->type != DATA_CHUNK_BUFFER ||
+			if( chunk->type != DATA_CHUNK_BUFFER &&
 			    chunk->type != DATA_CHUNK_FILE ) {
-				FileStreamChunk_Release( stream->chunk );
+				FileStreamChunk_Release( chunk );
 				break;
 			}
 			stream->chunk = chunk;
@@ -299,12 +902,12 @@ size_t FileStream_Write( FileStream stream, char *buf,
 			 size_t size, size_t count )
 {
 	FileStreamChunk *chunk;
-	if( !FileStream_Useable( stream ) ) {
-		FileStream_Destroy( stream );
-		return 0;
+	if( stream->ring.data ) {
+		return FileStream_WriteRing( stream, buf, size, count );
 	}
 	LCUIMutex_Lock( &stream->mutex );
 	if( stream->closed ) {
+		LCUIMutex_Unlock( &stream->mutex );
 		return 0;
 	}
 	chunk = NEW( FileStreamChunk, 1 );
@@ -327,9 +930,8 @@ char *FileStream_ReadLine( FileStream stream, char *buf, size_t size )
 	LinkedListNode *node;
 	FileStreamChunk *chunk;
 
-	if( !FileStream_Useable( stream ) ) {
-		FileStream_Destroy( stream );
-		return 0;
+	if( stream->ring.data ) {
+		return FileStream_ReadRingLine( stream, buf, size );
 	}
 	do {
 		if( stream->chunk ) {
@@ -350,6 +952,7 @@ char *FileStream_ReadLine( FileStream stream, char *buf, size_t size )
 			LCUIMutex_Unlock( &stream->mutex );
 			if( chunk->type != DATA_CHUNK_BUFFER &&
 			    chunk->type != DATA_CHUNK_FILE ) {
+				FileStreamChunk_Release( chunk );
 				if( count == 0 ) {
 					return NULL;
 				}
@@ -387,6 +990,23 @@ char *FileStream_ReadLine( FileStream stream, char *buf, size_t size )
 	return buf;
 }
 
+/** 向客户端的输入流写入一个表示请求已被取消的响应 */
+static int FileStream_WriteCanceledResponse( FileStream stream,
+					     unsigned int id )
+{
+	FileStreamChunk chunk = { 0 };
+	chunk.type = DATA_CHUNK_RESPONSE;
+	chunk.response.id = id;
+	chunk.response.status = RESPONSE_STATUS_CANCELED;
+	chunk.response.stream = FileStream_Create();
+	FileStream_Close( chunk.response.stream );
+	if( FileStream_WriteChunk( stream, &chunk ) < 1 ) {
+		FileStream_Release( chunk.response.stream );
+		return -1;
+	}
+	return 0;
+}
+
 Connection Connection_Create( void )
 {
 	Connection conn;
@@ -429,15 +1049,17 @@ int Connection_WriteChunk( Connection conn, FileStreamChunk *chunk )
 	if( conn->closed ) {
 		return -1;
 	}
+	if( chunk->type == DATA_CHUNK_RESPONSE && chunk->response.stream ) {
+		chunk->response.stream->clock = FileMetrics_GetTime();
+	}
 	return FileStream_WriteChunk( conn->output, chunk );
 }
 
 void Connection_Close( Connection conn )
 {
-	LCUIMutex_Lock( &conn->output->mutex );
 	conn->closed = TRUE;
-	LCUICond_Signal( &conn->output->cond );
-	LCUIMutex_Unlock( &conn->output->mutex );
+	FileStream_Close( conn->input );
+	FileStream_Close( conn->output );
 }
 
 void Connection_Destroy( Connection conn )
@@ -445,25 +1067,37 @@ void Connection_Destroy( Connection conn )
 
 }
 
-static int FileService_GetFileImageStatus( FileRequest *request,
-					       FileStreamChunk *chunk )
+/** 获取图片尺寸，只读取图片文件头 */
+static int FileService_GetImageSize( const wchar_t *wpath,
+				     FileImageStatus *image )
 {
-	int width, height;
-	FileResponse *response = &chunk->response;
+	int ret, width, height;
 #ifdef _WIN32
-	char *path = EncodeANSI( request->path );
+	char *path = EncodeANSI( wpath );
 #else
-	char *path = EncodeUTF8( request->path );
+	char *path = EncodeUTF8( wpath );
 #endif
-	if( LCUI_GetImageSize( path, &width, &height ) == 0 ) {
+	ret = LCUI_GetImageSize( path, &width, &height );
+	free( path );
+	if( ret != 0 ) {
+		return -1;
+	}
+	image->width = width;
+	image->height = height;
+	return 0;
+}
+
+static int FileService_GetFileImageStatus( FileRequest *request,
+					       FileStreamChunk *chunk )
+{
+	FileImageStatus image;
+	FileResponse *response = &chunk->response;
+	if( FileService_GetImageSize( request->path, &image ) == 0 ) {
 		response->file.image = NEW( FileImageStatus, 1 );
-		response->file.image->width = width;
-		response->file.image->height = height;
-		free( path );
+		*response->file.image = image;
 		return 0;
 	}
 	response->file.image = NULL;
-	free( path );
 	return -1;
 }
 
@@ -481,23 +1115,51 @@ static int GetStatusByErrorCode( int code )
 	return RESPONSE_STATUS_ERROR;
 }
 
-static int FileService_GetFileStatus( FileRequest *request,
-				      FileStreamChunk *chunk )
+/** 获取文件状态，不包括图片尺寸 */
+static int FileService_StatFile( const wchar_t *wpath, FileStatus *file )
 {
 	int ret;
-	struct stat buf;
-	FileResponse *response = &chunk->response;
-	ret = wgetfilestat( request->path, &buf );
-	if( ret == 0 ) {
+#ifdef FILE_SERVICE_USE_STATX
+	struct statx buf;
+	char *path = EncodeANSI( wpath );
+	ret = statx( AT_FDCWD, path, AT_STATX_DONT_SYNC,
+		     FILE_SERVICE_STATX_MASK, &buf );
+	free( path );
+	if( ret != 0 ) {
+		return -errno;
+	}
+	file->ctime = buf.stx_ctime.tv_sec;
+	file->mtime = buf.stx_mtime.tv_sec;
+	file->size = (size_t)buf.stx_size;
+	ret = S_ISDIR( buf.stx_mode );
+#else
+	struct stat buf;
+	ret = wgetfilestat( wpath, &buf );
+	if( ret != 0 ) {
+		return ret;
+	}
+	file->ctime = buf.st_ctime;
+	file->mtime = buf.st_mtime;
+	file->size = buf.st_size;
+	ret = S_ISDIR( buf.st_mode );
+#endif
+	if( ret ) {
+		file->type = FILE_TYPE_DIRECTORY;
+	} else {
+		file->type = FILE_TYPE_ARCHIVE;
+	}
+	file->image = NULL;
+	return 0;
+}
+
+static int FileService_GetFileStatus( FileRequest *request,
+				      FileStreamChunk *chunk )
+{
+	int ret;
+	FileResponse *response = &chunk->response;
+	ret = FileService_StatFile( request->path, &response->file );
+	if( ret == 0 ) {
 		response->status = RESPONSE_STATUS_OK;
-		response->file.ctime = buf.st_ctime;
-		response->file.mtime = buf.st_mtime;
-		response->file.size = buf.st_size;
-		if( S_ISDIR( buf.st_mode ) ) {
-			response->file.type = FILE_TYPE_DIRECTORY;
-		} else {
-			response->file.type = FILE_TYPE_ARCHIVE;
-		}
 		if( request->params.with_image_status ) {
 			FileService_GetFileImageStatus( request, chunk );
 		}
@@ -507,6 +1169,56 @@ static int FileService_GetFileStatus( FileRequest *request,
 	return ret;
 }
 
+/**
+ * 批量获取文件状态
+ * 结果按路径列表的顺序存放在一个数据块中，整个列表只需一次请求和响应。
+ */
+static int FileService_GetFileStatusList( FileServiceTask task,
+					  FileStreamChunk *chunk )
+{
+	size_t i;
+	FileStatusItem *items;
+	FileStreamChunk body = { 0 };
+	FileResponse *response = &chunk->response;
+	FileRequestParams *params = &task->request.params;
+
+	if( !params->paths || params->n_paths < 1 ) {
+		response->status = RESPONSE_STATUS_BAD_REQUEST;
+		return -1;
+	}
+	items = NEW( FileStatusItem, params->n_paths );
+	if( !items ) {
+		response->status = RESPONSE_STATUS_ERROR;
+		return -ENOMEM;
+	}
+	for( i = 0; i < params->n_paths && !task->canceled; ++i ) {
+		FileStatusItem *item = &items[i];
+		const wchar_t *path = params->paths[i];
+		item->status = GetStatusByErrorCode(
+			FileService_StatFile( path, &item->file ) );
+		if( item->status != RESPONSE_STATUS_OK ||
+		    item->file.type != FILE_TYPE_ARCHIVE ||
+		    !params->with_image_status ) {
+			continue;
+		}
+		if( FileService_GetImageSize( path, &item->image ) == 0 ) {
+			item->file.image = &item->image;
+		}
+	}
+	if( task->canceled ) {
+		free( items );
+		return -1;
+	}
+	body.type = DATA_CHUNK_BUFFER;
+	body.data = (char*)items;
+	body.size = sizeof( FileStatusItem ) * params->n_paths;
+	if( FileStream_WriteChunk( response->stream, &body ) < 1 ) {
+		free( items );
+	}
+	response->status = RESPONSE_STATUS_OK;
+	return 0;
+}
+
 static int FileService_RemoveFile( const wchar_t *path, 
 				   FileResponse *response )
 {
@@ -515,22 +1227,61 @@ static int FileService_RemoveFile( const wchar_t *path,
 	return ret;
 }
 
-static int FileService_GetFiles( Connection conn,
-				 FileRequest *request,
+/** 发送响应，之后响应的内容由客户端负责释放 */
+static int FileService_SendResponse( Connection conn, FileStreamChunk *chunk )
+{
+	int ret = 0;
+	if( chunk->type != DATA_CHUNK_RESPONSE ) {
+		return 0;
+	}
+	if( Connection_WriteChunk( conn, chunk ) < 1 ) {
+		/* 连接已经关闭，替客户端释放它持有的那份文件流引用 */
+		FileStream_Release( chunk->response.stream );
+		FileStreamChunk_Destroy( chunk );
+		ret = -1;
+	}
+	/* 标记为已发送，避免重复发送 */
+	chunk->type = DATA_CHUNK_END;
+	return ret;
+}
+
+/** 记录任务在某个阶段的耗时，start 为该阶段开始时的计时器读数 */
+static void FileService_AddTime( FileServiceTask task, int stage,
+				 int64_t start )
+{
+	FileMetrics_AddTime( task->conn->metrics, task->request.method,
+			     stage, FileMetrics_GetTime() - start );
+}
+
+static int FileService_GetFiles( FileServiceTask task,
 				 FileStreamChunk *chunk )
 {
-	int ret;
+	int ret, type;
+	size_t len, max_len = 0;
+	Connection conn = task->conn;
+	FileRequest *request = &task->request;
 	LCUI_Dir dir;
 	LCUI_DirEntry *entry;
-	char buf[PATH_LEN];
+	FileStatus status, *pstatus = NULL;
+	wchar_t *path = NULL, *buf;
+	FileStream stream = chunk->response.stream;
 
 	ret = LCUI_OpenDirW( request->path, &dir );
 	chunk->response.status = GetStatusByErrorCode( ret );
 	if( ret != 0 ) {
 		return ret;
 	}
-	while( !conn->closed && (entry = LCUI_ReadDirW( &dir )) ) {
-		int size;
+	if( FileStream_InitDirList( stream ) != 0 ) {
+		chunk->response.status = RESPONSE_STATUS_ERROR;
+		LCUI_CloseDir( &dir );
+		return -ENOMEM;
+	}
+	if( request->params.with_file_status ) {
+		pstatus = &status;
+	}
+	/* 文件列表是边读边发的，需要先发出响应，列表记录经环形缓冲区传递 */
+	FileService_SendResponse( conn, chunk );
+	while( !task->canceled && (entry = LCUI_ReadDirW( &dir )) ) {
 		wchar_t *name = LCUI_GetFileNameW( entry );
 		/* 忽略 . 和 .. 文件夹 */
 		if( name[0] == '.' ) {
@@ -549,55 +1300,349 @@ static int FileService_GetFiles( Connection conn,
 			if( !IsImageFile( name ) ) {
 				continue;
 			}
-			buf[0] = '-';
+			type = FILE_TYPE_ARCHIVE;
 			break;
 		case FILE_FILTER_FOLDER:
 			if( !LCUI_FileIsDirectory( entry ) ) {
 				continue;
 			}
-			buf[0] = 'd';
+			type = FILE_TYPE_DIRECTORY;
 			break;
 		default:
 			if( LCUI_FileIsRegular( entry ) ) {
 				if( !IsImageFile( name ) ) {
 					continue;
 				}
-				buf[0] = '-';
+				type = FILE_TYPE_ARCHIVE;
 			} else if( LCUI_FileIsDirectory( entry ) ) {
-				buf[0] = 'd';
+				type = FILE_TYPE_DIRECTORY;
 			} else {
 				continue;
 			}
 			break;
 		}
-		size = LCUI_EncodeString( buf + 1, name, PATH_LEN - 2,
-					 ENCODING_UTF8 );
-		buf[size++] = '\n';
-		buf[size] = 0;
-		Connection_Write( conn, buf, sizeof( char ), size );
+		if( pstatus ) {
+			len = wcslen( request->path ) + wcslen( name ) + 2;
+			if( len > max_len ) {
+				buf = realloc( path, sizeof( wchar_t ) * len );
+				if( !buf ) {
+					break;
+				}
+				path = buf;
+				max_len = len;
+			}
+			wpathjoin( path, request->path, name );
+			if( FileService_StatFile( path, &status ) != 0 ) {
+				continue;
+			}
+		}
+		if( FileStream_WriteDirEntry( stream, type, 
+					      name, pstatus ) != 0 ) {
+			break;
+		}
 	}
+	LCUI_CloseDir( &dir );
+	free( path );
 	return 0;
 }
 
-static int FileService_GetFile( Connection conn,
-				FileRequest *request,
-				FileStreamChunk *chunk )
+/** 判断正在进行的图片读取的结果能否满足请求 */
+static LCUI_BOOL FileServiceDecode_Match( FileServiceDecode decode,
+					  const FileRequest *request,
+					  time_t mtime )
+{
+	const FileRequestParams *params = &request->params;
+	if( decode->mtime != mtime || wcscmp( decode->path, request->path ) ) {
+		return FALSE;
+	}
+	/* 原图能缩放成任意尺寸的缩略图 */
+	if( !decode->get_thumbnail ) {
+		return TRUE;
+	}
+	if( !params->get_thumbnail ) {
+		return FALSE;
+	}
+	/* 缩略图只能满足限制方式相同且尺寸不超过它的请求 */
+	if( (decode->width == 0) != (params->width == 0) ||
+	    (decode->height == 0) != (params->height == 0) ) {
+		return FALSE;
+	}
+	return decode->width >= params->width &&
+		decode->height >= params->height;
+}
+
+/**
+ * 加入正在进行的图片读取
+ * 找到能满足请求的图片读取时，任务连同暂存的响应会被挂到它的等待列表上，
+ * 由负责读取的任务发出响应；否则将当前任务登记为新的图片读取的负责者。
+ * @returns 任务被挂起时返回 TRUE
+ */
+static LCUI_BOOL FileService_JoinDecode( FileServiceTask task,
+					 FileStreamChunk *chunk )
+{
+	size_t len;
+	LinkedListNode *node;
+	FileServiceDecode decode;
+	FileRequest *request = &task->request;
+	FileRequestParams *params = &request->params;
+	time_t mtime = chunk->response.file.mtime;
+	/* 结果要写入发送方预先分配的图像，不能与其它请求共享 */
+	if( params->target ) {
+		return FALSE;
+	}
+	LCUIMutex_Lock( &service.decodes.mutex );
+	for( LinkedList_Each( node, &service.decodes.list ) ) {
+		decode = node->data;
+		if( FileServiceDecode_Match( decode, request, mtime ) ) {
+			task->chunk = *chunk;
+			task->wait_node.data = task;
+			LinkedList_AppendNode( &decode->waiters,
+					       &task->wait_node );
+			LCUIMutex_Unlock( &service.decodes.mutex );
+			return TRUE;
+		}
+	}
+	decode = NEW( FileServiceDecodeRec, 1 );
+	len = wcslen( request->path ) + 1;
+	decode->path = NEW( wchar_t, len );
+	wcsncpy( decode->path, request->path, len );
+	decode->mtime = mtime;
+	decode->get_thumbnail = params->get_thumbnail;
+	decode->width = params->width;
+	decode->height = params->height;
+	decode->listed = TRUE;
+	decode->node.data = decode;
+	LinkedList_Init( &decode->waiters );
+	LinkedList_AppendNode( &service.decodes.list, &decode->node );
+	task->decode = decode;
+	LCUIMutex_Unlock( &service.decodes.mutex );
+	return FALSE;
+}
+
+/**
+ * 放弃当前任务负责的图片读取
+ * 还有未取消的等待者时不能放弃，否则将它移出列表，以免再有任务加入。
+ */
+static LCUI_BOOL FileService_AbandonDecode( FileServiceTask task )
+{
+	LinkedListNode *node;
+	FileServiceTask waiter;
+	FileServiceDecode decode = task->decode;
+	if( !decode ) {
+		return TRUE;
+	}
+	LCUIMutex_Lock( &service.decodes.mutex );
+	for( LinkedList_Each( node, &decode->waiters ) ) {
+		waiter = node->data;
+		if( !waiter->canceled ) {
+			LCUIMutex_Unlock( &service.decodes.mutex );
+			return FALSE;
+		}
+	}
+	if( decode->listed ) {
+		LinkedList_Unlink( &service.decodes.list, &decode->node );
+		decode->listed = FALSE;
+	}
+	LCUIMutex_Unlock( &service.decodes.mutex );
+	return TRUE;
+}
+
+/** 发出响应，并结束响应所用的文件流 */
+static void FileService_EndResponse( FileServiceTask task,
+				     FileStreamChunk *chunk )
+{
+	FileStream stream = chunk->response.stream;
+	if( task->canceled ) {
+		chunk->response.status = RESPONSE_STATUS_CANCELED;
+	}
+	FileService_SendResponse( task->conn, chunk );
+	chunk->type = DATA_CHUNK_END;
+	chunk->size = chunk->cur = 0;
+	chunk->data = NULL;
+	FileStream_WriteChunk( stream, chunk );
+	FileStream_Close( stream );
+	FileStream_Release( stream );
+}
+
+/** 回应挂起的任务，原图或更大的缩略图会被缩放成它请求的尺寸 */
+static void FileService_ResumeTask( FileServiceTask task,
+				    const FileResponse *result,
+				    FileImage image )
+{
+	int ret;
+	int64_t clock;
+	FileImage thumb;
+	const LCUI_Graph *graph;
+	FileStreamChunk body = { 0 };
+	FileResponse *response = &task->chunk.response;
+	FileRequestParams *params = &task->request.params;
+	if( task->canceled ) {
+		goto exit;
+	}
+	if( result->status != RESPONSE_STATUS_OK ) {
+		response->status = result->status;
+		goto exit;
+	}
+	response->file.image = NEW( FileImageStatus, 1 );
+	*response->file.image = *result->file.image;
+	graph = &image->graph;
+	if( params->get_thumbnail &&
+	    ((params->width > 0 && graph->width > params->width) ||
+	     (params->height > 0 && graph->height > params->height)) ) {
+		clock = FileMetrics_GetTime();
+		thumb = FileImage_Create();
+		ret = ImageScaler_Zoom( graph, &thumb->graph, TRUE,
+					params->width, params->height );
+		FileService_AddTime( task, FILE_STAGE_ZOOM, clock );
+		if( ret != 0 ) {
+			FileImage_Release( thumb );
+			response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+			goto exit;
+		}
+		image = thumb;
+	} else {
+		FileImage_AddRef( image );
+	}
+	if( params->get_thumbnail ) {
+		body.type = DATA_CHUNK_THUMB;
+		body.thumb = image;
+	} else {
+		body.type = DATA_CHUNK_IMAGE;
+		body.image = image;
+	}
+	if( FileStream_WriteChunk( response->stream, &body ) < 1 ) {
+		FileStreamChunk_Destroy( &body );
+	}
+
+exit:
+	FileService_EndResponse( task, &task->chunk );
+	LCUIMutex_Lock( &service.workers.mutex );
+	LinkedList_Unlink( &service.workers.running, &task->node );
+	LCUIMutex_Unlock( &service.workers.mutex );
+	free( task );
+}
+
+/** 结束当前任务负责的图片读取，并回应等待它的任务 */
+static void FileService_FinishDecode( FileServiceTask task,
+				      FileResponse *response,
+				      FileImage image )
+{
+	LinkedListNode *node;
+	FileServiceDecode decode = task->decode;
+	LCUIMutex_Lock( &service.decodes.mutex );
+	if( decode->listed ) {
+		LinkedList_Unlink( &service.decodes.list, &decode->node );
+		decode->listed = FALSE;
+	}
+	LCUIMutex_Unlock( &service.decodes.mutex );
+	/* 移出列表后不会再有任务加入，可以不加锁地访问等待列表 */
+	while( (node = LinkedList_GetNode( &decode->waiters, 0 )) ) {
+		LinkedList_Unlink( &decode->waiters, node );
+		FileService_ResumeTask( node->data, response, image );
+	}
+	task->decode = NULL;
+	free( decode->path );
+	free( decode );
+}
+
+/** 转发图片读取进度，返回 FALSE 表示应当中止读取 */
+static LCUI_BOOL FileService_OnLoadProgress( void *arg, float progress )
+{
+	FileServiceTask task = arg;
+	FileRequestParams *params = &task->request.params;
+	if( task->canceled && FileService_AbandonDecode( task ) ) {
+		return FALSE;
+	}
+	if( params->progress ) {
+		params->progress( params->progress_arg, progress );
+	}
+	return TRUE;
+}
+
+/** 图片读取进度的回调，在请求被取消时跳出读取过程 */
+static void FileService_OnReadProgress( void *arg, float progress )
+{
+	FileServiceTask task = arg;
+	if( !FileService_OnLoadProgress( arg, progress ) ) {
+		longjmp( task->reader->env, 1 );
+	}
+}
+
+/**
+ * 以缩小的尺寸读取缩略图，再缩放到请求的尺寸
+ * @returns 图片不支持缩小读取时返回 -ENOTSUP，调用者应改用完整的解码
+ */
+static int FileService_ReadScaledImage( FileServiceTask task, FILE *fp,
+					FileResponse *response,
+					FileImage *out )
+{
+	int ret;
+	LCUI_Graph img;
+	FileImage image;
+	ImageLoaderRec loader = { 0 };
+	FileRequestParams *params = &task->request.params;
+	int64_t clock = FileMetrics_GetTime();
+
+	Graph_Init( &img );
+	loader.fp = fp;
+	loader.width = params->width;
+	loader.height = params->height;
+	loader.progress = FileService_OnLoadProgress;
+	loader.progress_arg = task;
+	ret = ImageLoader_ReadScaled( &loader, &img );
+	if( ret == -ENOTSUP ) {
+		return ret;
+	}
+	FileService_AddTime( task, FILE_STAGE_DECODE, clock );
+	if( ret != 0 ) {
+		/* 被取消时的响应状态由 FileService_EndResponse() 设置 */
+		response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+		return -1;
+	}
+	/* 只读取了预览图时，不能按整个文件的大小统计 */
+	FileMetrics_AddImage( task->conn->metrics, loader.bytes_read,
+			      (uint64_t)img.width * img.height );
+	response->file.image = NEW( FileImageStatus, 1 );
+	response->file.image->width = loader.src_width;
+	response->file.image->height = loader.src_height;
+	if( params->target ) {
+		image = params->target;
+		FileImage_AddRef( image );
+	} else {
+		image = FileImage_Create();
+	}
+	/* 缩小读取的结果只是接近请求的尺寸，最后再做一次完整的缩放 */
+	clock = FileMetrics_GetTime();
+	ret = ImageScaler_Zoom( &img, &image->graph, TRUE,
+				params->width, params->height );
+	FileService_AddTime( task, FILE_STAGE_ZOOM, clock );
+	Graph_Free( &img );
+	if( ret != 0 ) {
+		FileImage_Release( image );
+		response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+		return -1;
+	}
+	*out = image;
+	return 0;
+}
+
+/** 读取图片，成功时图像的引用存入 out */
+static int FileService_ReadImage( FileServiceTask task,
+				  FileResponse *response,
+				  FileImage *out )
 {
 	int ret;
 	char *path;
 	FILE *fp;
 	LCUI_Graph img;
+	int64_t clock;
+	int orientation;
+	unsigned int width, height;
+	/* 读取被取消时会从 longjmp() 返回，需要保证它的值仍然可用 */
+	volatile FileImage image = NULL;
 	LCUI_ImageReaderRec reader = { 0 };
-	FileResponse *response = &chunk->response;
+	FileRequest *request = &task->request;
 	FileRequestParams *params = &request->params;
-	ret = FileService_GetFileStatus( request, chunk );
-	if( response->status != RESPONSE_STATUS_OK ) {
-		return ret;
-	}
-	if( response->file.type == FILE_TYPE_DIRECTORY ) {
-		Connection_WriteChunk( conn, chunk );
-		return FileService_GetFiles( conn, request, chunk );
-	}
 	Graph_Init( &img );
 	path = EncodeANSI( request->path );
 	LOG( "load image: %s\n", path );
@@ -607,9 +1652,21 @@ static int FileService_GetFile( Connection conn,
 		response->status = RESPONSE_STATUS_NOT_FOUND;
 		return - 1;
 	}
+	if( params->get_thumbnail ) {
+		ret = FileService_ReadScaledImage( task, fp, response, out );
+		if( ret != -ENOTSUP ) {
+			fclose( fp );
+			return ret;
+		}
+		fseek( fp, 0, SEEK_SET );
+	}
+	clock = FileMetrics_GetTime();
+	/* 通用的读取器不处理 EXIF 方向标记，解码后再转正 */
+	orientation = ImageLoader_GetOrientation( fp );
 	LCUI_SetImageReaderForFile( &reader, fp );
-	reader.fn_prog = request->params.progress;
-	reader.prog_arg = request->params.progress_arg;
+	task->reader = &reader;
+	reader.fn_prog = FileService_OnReadProgress;
+	reader.prog_arg = task;
 	if( LCUI_InitImageReader( &reader ) != 0 ) {
 		goto load_image_falied;
 	}
@@ -619,54 +1676,169 @@ static int FileService_GetFile( Connection conn,
 	if( LCUI_ReadImageHeader( &reader ) != 0 ) {
 		goto load_image_falied;
 	}
-	response->file.image = NEW( FileImageStatus, 1 );
-	response->file.image->width = reader.header.width;
-	response->file.image->height = reader.header.height;
-	if( LCUI_ReadImage( &reader, &img ) != 0 ) {
-		goto load_image_falied;
+	/* 需要旋转 90 度的图片，转正后的宽高是原图的高宽 */
+	width = reader.header.width;
+	height = reader.header.height;
+	if( orientation >= 5 ) {
+		width = reader.header.height;
+		height = reader.header.width;
 	}
-	fclose( fp );
-	LOG( "load image success, size: %d,%d\n", img.width, img.height );
-	LOG( "write response, status: %d\n", response->status );
-	Connection_WriteChunk( conn, chunk );
-	if( !params->get_thumbnail ) {
-		chunk->type = DATA_CHUNK_IMAGE;
-		chunk->image = img;
-		return 0;
+	response->file.image = NEW( FileImageStatus, 1 );
+	response->file.image->width = width;
+	response->file.image->height = height;
+	/* 发送方预先分配了图像时，结果直接写入它的内存 */
+	if( params->target ) {
+		image = params->target;
+		FileImage_AddRef( image );
+	} else {
+		image = FileImage_Create();
 	}
-	Graph_Init( &chunk->thumb );
-	if( (params->width > 0 && img.width > (int)params->width)
-	    || (params->height > 0 && img.height > (int)params->height) ) {
-	    Graph_Zoom( &img, &chunk->thumb, TRUE,
-			params->width, params->height );
-	    Graph_Free( &img );
+	/* 不需要缩放时直接解码到要交给客户端的图像中 */
+	if( !params->get_thumbnail ||
+	    ((params->width < 1 || width <= params->width) &&
+	     (params->height < 1 || height <= params->height)) ) {
+		ret = LCUI_ReadImage( &reader, &image->graph );
+		FileService_AddTime( task, FILE_STAGE_DECODE, clock );
 	} else {
-		chunk->thumb = img;
+		ret = LCUI_ReadImage( &reader, &img );
+		FileService_AddTime( task, FILE_STAGE_DECODE, clock );
+		if( ret == 0 ) {
+			/* 先缩放再转正，缩放的目标尺寸也要交换宽高 */
+			clock = FileMetrics_GetTime();
+			if( orientation >= 5 ) {
+				ret = ImageScaler_Zoom( &img, &image->graph,
+							TRUE, params->height,
+							params->width );
+			} else {
+				ret = ImageScaler_Zoom( &img, &image->graph,
+							TRUE, params->width,
+							params->height );
+			}
+			FileService_AddTime( task, FILE_STAGE_ZOOM, clock );
+		}
+		Graph_Free( &img );
+	}
+	if( ret == 0 ) {
+		ret = ImageLoader_Orient( &image->graph, orientation );
+	}
+	if( ret != 0 ) {
+		goto load_image_falied;
 	}
-	chunk->type = DATA_CHUNK_THUMB;
+	FileMetrics_AddImage( task->conn->metrics, response->file.size,
+			      (uint64_t)reader.header.width *
+			      reader.header.height );
+	fclose( fp );
+	task->reader = NULL;
+	LCUI_DestroyImageReader( &reader );
+	LOG( "load image success\n" );
+	*out = image;
 	return 0;
 
 load_image_falied:
 	LOG( "load image failed\n" );
+	task->reader = NULL;
+	LCUI_DestroyImageReader( &reader );
+	/* 被取消时的响应状态由 FileService_EndResponse() 设置 */
 	response->status = RESPONSE_STATUS_NOT_ACCEPTABLE;
+	if( image ) {
+		FileImage_Release( image );
+	}
 	Graph_Free( &img );
 	fclose( fp );
 	return -1;
 }
 
-static void FileService_HandleRequest( Connection conn, 
-				       FileRequest *request )
+/**
+ * 获取文件
+ * @returns 任务被挂起、等待其它任务的读取结果时返回 1
+ */
+static int FileService_GetFile( FileServiceTask task,
+				FileStreamChunk *chunk )
+{
+	int ret;
+	FileImage image = NULL;
+	FileStreamChunk body = { 0 };
+	FileRequest *request = &task->request;
+	FileResponse *response = &chunk->response;
+	FileRequestParams *params = &request->params;
+	int64_t clock = FileMetrics_GetTime();
+	ret = FileService_GetFileStatus( request, chunk );
+	FileService_AddTime( task, FILE_STAGE_STAT, clock );
+	if( response->status != RESPONSE_STATUS_OK ) {
+		return ret;
+	}
+	if( response->file.type == FILE_TYPE_DIRECTORY ) {
+		return FileService_GetFiles( task, chunk );
+	}
+	/* 同一文件正在被读取时，挂起并等待共享它的结果 */
+	if( FileService_JoinDecode( task, chunk ) ) {
+		return 1;
+	}
+	ret = FileService_ReadImage( task, response, &image );
+	if( task->decode ) {
+		FileService_FinishDecode( task, response, image );
+	}
+	if( ret != 0 ) {
+		return -1;
+	}
+	/* 为等待者继续读完的图像不再发给已取消的请求 */
+	if( task->canceled ) {
+		FileImage_Release( image );
+		return -1;
+	}
+	/**
+	 * 图像数据要在发出响应前写入文件流，以免客户端在处理响应时等待解码，
+	 * 进而阻塞该连接上其它已完成的请求。数据块只携带图像的引用，
+	 * 像素数据不会被复制。
+	 */
+	if( params->get_thumbnail ) {
+		body.type = DATA_CHUNK_THUMB;
+		body.thumb = image;
+	} else {
+		body.type = DATA_CHUNK_IMAGE;
+		body.image = image;
+	}
+	if( FileStream_WriteChunk( response->stream, &body ) < 1 ) {
+		FileStreamChunk_Destroy( &body );
+	}
+	return 0;
+}
+
+/**
+ * 处理请求
+ * @returns 任务被挂起时返回 FALSE，此后它由负责图片读取的任务回应和释放
+ */
+static LCUI_BOOL FileService_HandleRequest( FileServiceTask task )
 {
 	FileStreamChunk chunk = { 0 };
+	FileRequest *request = &task->request;
 	const wchar_t *path = request->path;
+	FileStream stream = FileStream_Create();
+	int64_t clock = FileMetrics_GetTime();
+	FileMetrics_AddTime( task->conn->metrics, request->method,
+			     FILE_STAGE_QUEUE, clock - task->clock );
+	/* 一份引用归客户端所有，由它在处理完响应后释放 */
+	FileStream_AddRef( stream );
 	chunk.type = DATA_CHUNK_RESPONSE;
+	chunk.response.id = request->id;
+	chunk.response.stream = stream;
+	if( task->canceled ) {
+		goto exit;
+	}
 	switch( request->method ) {
 	case REQUEST_METHOD_HEAD:
 		FileService_GetFileStatus( request, &chunk );
+		FileService_AddTime( task, FILE_STAGE_STAT, clock );
+		break;
+	case REQUEST_METHOD_HEAD_BATCH:
+		FileService_GetFileStatusList( task, &chunk );
+		FileService_AddTime( task, FILE_STAGE_STAT, clock );
 		break;
 	case REQUEST_METHOD_POST:
 	case REQUEST_METHOD_GET:
-		FileService_GetFile( conn, request, &chunk );
+		if( FileService_GetFile( task, &chunk ) == 1 ) {
+			return FALSE;
+		}
 		break;
 	case REQUEST_METHOD_DELETE:
 		FileService_RemoveFile( path, &chunk.response );
@@ -678,36 +1850,214 @@ static void FileService_HandleRequest( Connection conn,
 		chunk.response.status = RESPONSE_STATUS_BAD_REQUEST;
 		break;
 	}
-	Connection_WriteChunk( conn, &chunk );
-	chunk.type = DATA_CHUNK_END;
-	chunk.size = chunk.cur = 0;
-	chunk.data = NULL;
-	Connection_WriteChunk( conn, &chunk );
+exit:
+	FileService_EndResponse( task, &chunk );
+	return TRUE;
 }
 
-void FileService_Handler( void *arg )
+/**
+ * 取出下一个要处理的任务
+ * 各队列的队首任务等待得最久，按等待时长提升它们的优先级后取最优先的，以免
+ * 低优先级的任务被持续到来的高优先级任务饿死。空闲任务不参与提升，只在其它
+ * 队列都为空时处理。
+ */
+static FileServiceTask FileService_TakeTask( void )
 {
-	int n;
-	FileStreamChunk chunk;
-	Connection conn = arg;
-	LOG( "[file service][thread %d] started, connection: %d\n",
-	     LCUIThread_SelfID(), conn->id );
-	while( 1 ) {
-		n = Connection_ReadChunk( conn, &chunk );
-		if( n == -1 ) {
-			break;
-		} else if( n == 0 ) {
+	int i, level, best_level = 0;
+	LinkedListNode *node;
+	FileServiceTask task, best = NULL;
+	int64_t now = LCUI_GetTime();
+
+	/* 空闲任务不在这里取，由 FileService_IdleWorker() 处理 */
+	for( i = 0; i < FILE_PRIORITY_IDLE; ++i ) {
+		node = LinkedList_GetNode( &service.workers.queues[i], 0 );
+		if( !node ) {
+			continue;
+		}
+		task = node->data;
+		level = i - (int)((now - task->time) /
+				  FILE_SERVICE_AGING_TIME);
+		if( !best || level < best_level ) {
+			best = task;
+			best_level = level;
+		}
+	}
+	if( best ) {
+		i = best->request.priority;
+		LinkedList_Unlink( &service.workers.queues[i], &best->node );
+	}
+	return best;
+}
+
+static FileServiceTask FileService_TakeIdleTask( void )
+{
+	LinkedList *queue = &service.workers.queues[FILE_PRIORITY_IDLE];
+	LinkedListNode *node = LinkedList_GetNode( queue, 0 );
+	if( !node ) {
+		return NULL;
+	}
+	LinkedList_Unlink( queue, node );
+	return node->data;
+}
+
+/** 从任务队列中取出请求并处理，完成顺序与请求顺序无关 */
+static void FileService_RunTasks( LCUI_BOOL idle )
+{
+	FileServiceTask task;
+	LCUIMutex_Lock( &service.workers.mutex );
+	while( service.active ) {
+		if( idle ) {
+			task = FileService_TakeIdleTask();
+		} else {
+			task = FileService_TakeTask();
+		}
+		if( !task ) {
+			LCUICond_Wait( &service.workers.cond,
+				       &service.workers.mutex );
 			continue;
 		}
-		chunk.request.stream = conn->input;
-		FileService_HandleRequest( conn, &chunk.request );
+		LinkedList_AppendNode( &service.workers.running, &task->node );
+		LCUIMutex_Unlock( &service.workers.mutex );
+		/* 连接已经关闭，客户端不会再需要结果 */
+		if( !task->conn->output->closed &&
+		    !FileService_HandleRequest( task ) ) {
+			LCUIMutex_Lock( &service.workers.mutex );
+			continue;
+		}
+		LCUIMutex_Lock( &service.workers.mutex );
+		LinkedList_Unlink( &service.workers.running, &task->node );
+		free( task );
 	}
-	LOG( "[file service][thread %d] stopped, connection: %d\n",
-	     LCUIThread_SelfID(), conn->id );
-	Connection_Destroy( conn );
+	LCUIMutex_Unlock( &service.workers.mutex );
+}
+
+/** 工作线程，处理空闲任务以外的请求 */
+static void FileService_Worker( void *arg )
+{
+	FileService_RunTasks( FALSE );
+	LCUIThread_Exit( NULL );
+}
+
+/**
+ * 空闲任务的工作线程
+ * 线程的优先级降低后在 Linux 上无法恢复，所以空闲任务只交给这个一直处于
+ * 后台模式的线程处理，不会占用前台的处理器和磁盘。
+ */
+static void FileService_IdleWorker( void *arg )
+{
+	setthreadbackground();
+	FileService_RunTasks( TRUE );
 	LCUIThread_Exit( NULL );
 }
 
+static void FileService_PostTask( Connection conn, FileRequest *request )
+{
+	FileServiceTask task;
+	task = NEW( FileServiceTaskRec, 1 );
+	task->conn = conn;
+	task->request = *request;
+	task->time = LCUI_GetTime();
+	task->clock = FileMetrics_GetTime();
+	task->node.data = task;
+	if( task->request.priority < 0 ||
+	    task->request.priority >= FILE_PRIORITY_TOTAL ) {
+		task->request.priority = FILE_PRIORITY_SCAN;
+	}
+	LCUIMutex_Lock( &service.workers.mutex );
+	LinkedList_AppendNode( &service.workers.queues[task->request.priority],
+			       &task->node );
+	/* 空闲任务只有一个线程能处理，唤醒单个线程可能会唤醒错 */
+	LCUICond_Broadcast( &service.workers.cond );
+	LCUIMutex_Unlock( &service.workers.mutex );
+}
+
+/**
+ * 取消任务
+ * 还在队列中的任务会被直接移除并回应，正在处理的任务则只做标记，由处理它的
+ * 工作线程在适当的时候中止。
+ */
+static void FileService_CancelTask( Connection conn, unsigned int id )
+{
+	int i;
+	LinkedListNode *node;
+	FileServiceTask task;
+
+	LCUIMutex_Lock( &service.workers.mutex );
+	for( i = 0; i < FILE_PRIORITY_TOTAL; ++i ) {
+		for( LinkedList_Each( node, &service.workers.queues[i] ) ) {
+			task = node->data;
+			if( task->conn == conn && task->request.id == id ) {
+				LinkedList_Unlink( &service.workers.queues[i],
+						   node );
+				LCUIMutex_Unlock( &service.workers.mutex );
+				FileStream_WriteCanceledResponse( conn->output,
+								  id );
+				free( task );
+				return;
+			}
+		}
+	}
+	for( LinkedList_Each( node, &service.workers.running ) ) {
+		task = node->data;
+		if( task->conn == conn && task->request.id == id ) {
+			task->canceled = TRUE;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &service.workers.mutex );
+}
+
+/** 接收连接上发来的数据块，请求会直接进入任务队列，不需要为连接创建线程 */
+static void FileService_OnReceiveChunk( FileStreamChunk *chunk, void *arg )
+{
+	Connection conn = arg;
+	FileServiceForwarder forwarder = &service.forwarder;
+	switch( chunk->type ) {
+	case DATA_CHUNK_REQUEST:
+		chunk->request.stream = conn->input;
+		if( forwarder->forward && forwarder->forward(
+			conn, &chunk->request, forwarder->arg ) == 0 ) {
+			break;
+		}
+		FileService_PostTask( conn, &chunk->request );
+		break;
+	case DATA_CHUNK_CANCEL:
+		if( forwarder->cancel ) {
+			forwarder->cancel( conn, chunk->request.id,
+					   forwarder->arg );
+		}
+		FileService_CancelTask( conn, chunk->request.id );
+		break;
+	case DATA_CHUNK_END:
+		if( forwarder->close ) {
+			forwarder->close( conn, forwarder->arg );
+		}
+		break;
+	default:
+		FileStreamChunk_Destroy( chunk );
+		break;
+	}
+}
+
+void FileService_GetQueueDepths( size_t depths[FILE_PRIORITY_TOTAL] )
+{
+	int i;
+	LCUIMutex_Lock( &service.workers.mutex );
+	for( i = 0; i < FILE_PRIORITY_TOTAL; ++i ) {
+		depths[i] = service.workers.queues[i].length;
+	}
+	LCUIMutex_Unlock( &service.workers.mutex );
+}
+
+void FileService_SetForwarder( FileServiceForwarder forwarder )
+{
+	if( forwarder ) {
+		service.forwarder = *forwarder;
+	} else {
+		memset( &service.forwarder, 0, sizeof( service.forwarder ) );
+	}
+}
+
 int FileService_Listen( int backlog )
 {
 	LCUIMutex_Lock( &service.mutex );
@@ -745,10 +2095,14 @@ Connection FileService_Accept( void )
 	conn_client->closed = FALSE;
 	conn_service->id = conn->id;
 	conn_service->closed = FALSE;
+	conn_service->metrics = FileMetrics_Create( conn->id );
+	conn_client->metrics = conn_service->metrics;
 	conn_client->input = conn->streams[0];
 	conn_client->output = conn->streams[1];
 	conn_service->input = conn->streams[1];
 	conn_service->output = conn->streams[0];
+	conn->streams[1]->receiver = FileService_OnReceiveChunk;
+	conn->streams[1]->receiver_arg = conn_service;
 	LinkedList_AppendNode( &service.connections, &conn->node );
 	LCUICond_Signal( &conn_client->cond );
 	LCUIMutex_Unlock( &conn_client->mutex );
@@ -757,11 +2111,20 @@ Connection FileService_Accept( void )
 
 void FileService_Run( void )
 {
+	int i;
 	Connection conn;
 	LCUIMutex_Lock( &service.mutex );
 	service.active = TRUE;
 	LCUICond_Signal( &service.cond );
 	LCUIMutex_Unlock( &service.mutex );
+	service.workers.count = max( getcpucount(), FILE_SERVICE_MIN_WORKERS );
+	service.workers.threads = NEW( LCUI_Thread, service.workers.count );
+	for( i = 0; i < service.workers.count; ++i ) {
+		LCUIThread_Create( &service.workers.threads[i],
+				   FileService_Worker, NULL );
+	}
+	LCUIThread_Create( &service.workers.idle_thread,
+			   FileService_IdleWorker, NULL );
 	LOG( "[file service] file service started\n" );
 	while( service.active ) {
 		LOG( "[file service] listen...\n" );
@@ -769,12 +2132,21 @@ void FileService_Run( void )
 			continue;
 		}
 		conn = FileService_Accept();
-		LOG( "[file service] accept connection %d\n", conn->id );
 		if( !conn ) {
 			continue;
 		}
-		LCUIThread_Create( &conn->thread, FileService_Handler, conn );
+		LOG( "[file service] accept connection %d\n", conn->id );
+	}
+	LCUIMutex_Lock( &service.workers.mutex );
+	LCUICond_Broadcast( &service.workers.cond );
+	LCUIMutex_Unlock( &service.workers.mutex );
+	for( i = 0; i < service.workers.count; ++i ) {
+		LCUIThread_Join( service.workers.threads[i], NULL );
 	}
+	LCUIThread_Join( service.workers.idle_thread, NULL );
+	free( service.workers.threads );
+	service.workers.threads = NULL;
+	service.workers.count = 0;
 	LOG( "[file service] file service stopped\n" );
 }
 
@@ -799,12 +2171,24 @@ void FileService_Close( void )
 
 void FileService_Init( void )
 {
+	int i;
 	service.backlog = 1;
 	service.active = FALSE;
 	LinkedList_Init( &service.connections );
 	LinkedList_Init( &service.requests );
 	LCUICond_Init( &service.cond );
 	LCUIMutex_Init( &service.mutex );
+	service.workers.count = 0;
+	service.workers.threads = NULL;
+	for( i = 0; i < FILE_PRIORITY_TOTAL; ++i ) {
+		LinkedList_Init( &service.workers.queues[i] );
+	}
+	LinkedList_Init( &service.workers.running );
+	LCUICond_Init( &service.workers.cond );
+	LCUIMutex_Init( &service.workers.mutex );
+	LinkedList_Init( &service.decodes.list );
+	LCUIMutex_Init( &service.decodes.mutex );
+	FileMetrics_Init();
 }
 
 int Connection_SendRequest( Connection conn, 
@@ -822,17 +2206,18 @@ int Connection_SendRequest( Connection conn,
 int Connection_ReceiveRequest( Connection conn,
 			       FileRequest *request )
 {
-	size_t ret;
+	int ret;
 	FileStreamChunk chunk;
 	ret = Connection_ReadChunk( conn, &chunk );
-	if( ret > 0 ) {
-		if( chunk.type != DATA_CHUNK_REQUEST ) {
-			return 0;
-		}
-		*request = chunk.request;
-		return 1;
+	if( ret < 1 ) {
+		return -1;
 	}
-	return 0;
+	if( chunk.type != DATA_CHUNK_REQUEST ) {
+		FileStreamChunk_Destroy( &chunk );
+		return 0;
+	}
+	*request = chunk.request;
+	return 1;
 }
 
 int Connection_SendResponse( Connection conn, 
@@ -850,17 +2235,18 @@ int Connection_SendResponse( Connection conn,
 int Connection_ReceiveResponse( Connection conn, 
 				FileResponse *response )
 {
-	size_t ret;
+	int ret;
 	FileStreamChunk chunk;
 	ret = Connection_ReadChunk( conn, &chunk );
-	if( ret > 0 ) {
-		if( chunk.type != DATA_CHUNK_RESPONSE ) {
-			return 0;
-		}
-		*response = chunk.response;
-		return 1;
+	if( ret < 1 ) {
+		return -1;
 	}
-	return 0;
+	if( chunk.type != DATA_CHUNK_RESPONSE ) {
+		FileStreamChunk_Destroy( &chunk );
+		return 0;
+	}
+	*response = chunk.response;
+	return 1;
 }
 
 FileClient FileClient_Create( void )
@@ -870,9 +2256,13 @@ FileClient FileClient_Create( void )
 	client->thread = 0;
 	client->active = FALSE;
 	client->connection = NULL;
+	client->base_id = 0;
+	client->max_requests = FILE_CLIENT_MAX_REQUESTS;
 	LCUICond_Init( &client->cond );
 	LCUIMutex_Init( &client->mutex );
 	LinkedList_Init( &client->tasks );
+	LinkedList_Init( &client->requests );
+	LinkedList_Init( &client->canceled );
 	return client;
 }
 
@@ -930,10 +2320,73 @@ void FileClient_Destroy( FileClient client )
 	
 }
 
+/** 在未超出数量限制的前提下，发送尚未发送的请求 */
+static void FileClient_Flush( FileClient client )
+{
+	LinkedListNode *node;
+	FileClientTask *task;
+	Connection conn = client->connection;
+	if( !conn ) {
+		return;
+	}
+	while( client->requests.length < client->max_requests ) {
+		node = LinkedList_GetNode( &client->tasks, 0 );
+		if( !node ) {
+			break;
+		}
+		task = node->data;
+		LinkedList_Unlink( &client->tasks, node );
+		LOGW( L"[file client][connection %d] send request %u, "
+		      L"method: %d, path: %s\n", conn->id, task->request.id,
+		      task->request.method, task->request.path );
+		if( Connection_SendRequest( conn, &task->request ) == 0 ) {
+			free( task );
+			continue;
+		}
+		LinkedList_AppendNode( &client->requests, &task->node );
+	}
+}
+
+/** 取出与响应对应的请求 */
+static FileClientTask *FileClient_TakeRequest( FileClient client,
+					       unsigned int id )
+{
+	LinkedListNode *node;
+	FileClientTask *task;
+	for( LinkedList_Each( node, &client->requests ) ) {
+		task = node->data;
+		if( task->request.id == id ) {
+			LinkedList_Unlink( &client->requests, node );
+			return task;
+		}
+	}
+	for( LinkedList_Each( node, &client->canceled ) ) {
+		task = node->data;
+		if( task->request.id == id ) {
+			LinkedList_Unlink( &client->canceled, node );
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/** 记录请求的处理结果，以及从服务发出响应到客户端处理完它的耗时 */
+static void FileClient_AddMetrics( FileClient client, FileClientTask *task,
+				   const FileResponse *response )
+{
+	FileMetrics metrics = client->connection->metrics;
+	FileMetrics_AddRequest( metrics, task->request.method,
+				response->status );
+	if( response->stream && response->stream->clock > 0 ) {
+		FileMetrics_AddTime( metrics, task->request.method,
+				     FILE_STAGE_TRANSFER, FileMetrics_GetTime() -
+				     response->stream->clock );
+	}
+}
+
 void FileClient_Run( FileClient client )
 {
 	int n;
-	LinkedListNode *node;
 	FileClientTask *task;
 	FileResponse response;
 	Connection conn = client->connection;
@@ -941,39 +2394,34 @@ void FileClient_Run( FileClient client )
 	LOG( "[file client] work started\n" );
 	client->active = TRUE;
 	while( client->active ) {
-		LCUIMutex_Lock( &client->mutex );
-		LOG( "[file client] waitting task...\n" );
-		while( client->tasks.length < 1 && client->active ) {
-			LCUICond_Wait( &client->cond, &client->mutex );
-		}
-		node = LinkedList_GetNode( &client->tasks, 0 );
-		LOG( "[file client] getted task: %p\n", node );
-		if( !node ) {
-			LCUIMutex_Unlock( &client->mutex );
+		n = Connection_ReceiveResponse( conn, &response );
+		if( n < 0 ) {
+			break;
+		} else if( n == 0 ) {
 			continue;
 		}
-		LinkedList_Unlink( &client->tasks, node );
+		LCUIMutex_Lock( &client->mutex );
+		task = FileClient_TakeRequest( client, response.id );
+		FileClient_Flush( client );
 		LCUIMutex_Unlock( &client->mutex );
-		task = node->data;
-		LOGW( L"[file client][connection %d] send request, "
-		      L"method: %d, path: %s\n",
-		      conn->id, task->request.method, task->request.path );
-		n = Connection_SendRequest( conn, &task->request );
-		if( n == 0 ) {
-			continue;
-		}
-		while( client->active ) {
-			n = Connection_ReceiveResponse( conn, &response );
-			if( n != 0 ) {
-				break;
-			}
+		LOG( "[file client][connection %d] received response %u, "
+		     "status: %d\n", conn->id, response.id, response.status );
+		if( task ) {
+			task->handler.callback( &response, task->handler.data );
+			FileClient_AddMetrics( client, task, &response );
+			free( task );
 		}
-		if( !client->active ) {
-			break;
+		if( response.file.image ) {
+			free( response.file.image );
 		}
-		response.stream = conn->input;
-		task->handler.callback( &response, task->handler.data );
+		FileStream_Release( response.stream );
 	}
+	LCUIMutex_Lock( &client->mutex );
+	client->active = FALSE;
+	LinkedList_ClearData( &client->tasks, free );
+	LinkedList_ClearData( &client->requests, free );
+	LinkedList_ClearData( &client->canceled, free );
+	LCUIMutex_Unlock( &client->mutex );
 	LOG( "[file client] work stopped\n" );
 }
 
@@ -999,16 +2447,82 @@ void FileClient_RunAsync( FileClient client )
 	LCUIThread_Create( &client->thread, FileClient_Thread, client );
 }
 
-void FileClient_SendRequest( FileClient client,
-			     const FileRequest *request,
-			     const FileRequestHandler *handler )
+void FileClient_SetName( FileClient client, const char *name )
+{
+	if( client->connection ) {
+		FileMetrics_SetName( client->connection->metrics, name );
+	}
+}
+
+void FileClient_SetMaxRequests( FileClient client, size_t n )
+{
+	LCUIMutex_Lock( &client->mutex );
+	client->max_requests = max( n, 1 );
+	FileClient_Flush( client );
+	LCUIMutex_Unlock( &client->mutex );
+}
+
+unsigned int FileClient_SendRequest( FileClient client,
+				     const FileRequest *request,
+				     const FileRequestHandler *handler )
 {
+	unsigned int id;
 	FileClientTask *task;
 	task = NEW( FileClientTask, 1 );
 	task->handler = *handler;
 	task->request = *request;
+	task->node.data = task;
 	LCUIMutex_Lock( &client->mutex );
-	LinkedList_Append( &client->tasks, task );
-	LCUICond_Signal( &client->cond );
+	/* 标识号保持在 int 的取值范围内，且不为 0，方便调用者保存 */
+	client->base_id = (client->base_id + 1) & 0x7fffffff;
+	if( client->base_id == 0 ) {
+		client->base_id = 1;
+	}
+	id = task->request.id = client->base_id;
+	LinkedList_AppendNode( &client->tasks, &task->node );
+	FileClient_Flush( client );
+	LCUIMutex_Unlock( &client->mutex );
+	return id;
+}
+
+void FileClient_CancelRequest( FileClient client, unsigned int id )
+{
+	LinkedListNode *node;
+	FileClientTask *task;
+	FileStreamChunk chunk = { 0 };
+	Connection conn = client->connection;
+
+	if( !conn || id == 0 ) {
+		return;
+	}
+	LCUIMutex_Lock( &client->mutex );
+	for( LinkedList_Each( node, &client->tasks ) ) {
+		task = node->data;
+		if( task->request.id != id ) {
+			continue;
+		}
+		/**
+		 * 请求还没发出，直接在本地生成响应，回调函数仍由客户端线程
+		 * 调用，调用者不需要处理同步调用的情况。它不计入正在等待响应
+		 * 的请求数量，以免超出 max_requests 的限制。
+		 */
+		LinkedList_Unlink( &client->tasks, node );
+		LinkedList_AppendNode( &client->canceled, node );
+		if( FileStream_WriteCanceledResponse( conn->input, id ) != 0 ) {
+			LinkedList_Unlink( &client->canceled, node );
+			free( task );
+		}
+		LCUIMutex_Unlock( &client->mutex );
+		return;
+	}
+	for( LinkedList_Each( node, &client->requests ) ) {
+		task = node->data;
+		if( task->request.id == id ) {
+			chunk.type = DATA_CHUNK_CANCEL;
+			chunk.request.id = id;
+			Connection_WriteChunk( conn, &chunk );
+			break;
+		}
+	}
 	LCUIMutex_Unlock( &client->mutex );
 }
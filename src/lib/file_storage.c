@@ -42,12 +42,15 @@
 #include "build.h"
 #include "bridge.h"
 #include "file_storage.h"
+#include "file_metrics.h"
+#include "file_worker.h"
 
 enum HandlerDataType {
 	HANDLER_ON_GET_FILE,
 	HANDLER_ON_GET_IMAGE,
 	HANDLER_ON_GET_THUMB,
-	HANDLER_ON_GET_PROPS
+	HANDLER_ON_GET_PROPS,
+	HANDLER_ON_GET_PROPS_LIST
 };
 
 typedef struct HandlerDataPackRec_ {
@@ -57,13 +60,17 @@ typedef struct HandlerDataPackRec_ {
 		HandlerOnGetThumbnail on_get_thumb;
 		HandlerOnGetStatus on_get_status;
 		HandlerOnGetImage on_get_image;
+		HandlerOnGetStatusList on_get_status_list;
 	};
 	HandlerOnGetProgress on_get_prog;
+	wchar_t **paths;		/**< 批量请求的路径列表，收到响应后释放 */
+	size_t n_paths;			/**< 路径数量 */
 	void *data;
 } HandlerDataPackRec, *HandlerDataPack;
 
 typedef struct FileStorageConnectionRec_ {
 	int id;
+	int priority;
 	FileClient client;
 	LCUI_BOOL active;
 	LinkedListNode node;
@@ -78,6 +85,10 @@ void FileStorage_Init( void )
 {
 	self.base_id = 1;
 	FileService_Init();
+	/* 设置了工作进程数量时，文件的读取和解码在独立的进程中进行 */
+	FileWorker_LaunchFromEnv();
+	/* 设置了统计数据的输出路径时，定时输出文件服务的统计数据 */
+	FileMetrics_StartDumpFromEnv();
 	FileService_RunAsync();
 	LinkedList_Init( &self.clients );
 }
@@ -99,6 +110,7 @@ int FileStorage_Connect( void )
 	int ret;
 	ASSIGN( conn, FileStorageConnection );
 	conn->active = FALSE;
+	conn->priority = FILE_PRIORITY_PICTURE;
 	conn->client = FileClient_Create();
 	ret = FileClient_Connect( conn->client );
 	if( ret == 0 ) {
@@ -115,6 +127,38 @@ int FileStorage_Connect( void )
 	return conn->id;
 }
 
+void FileStorage_SetPriority( int conn_id, int priority )
+{
+	FileStorageConnection conn = FileStorage_GetConnection( conn_id );
+	if( conn ) {
+		conn->priority = priority;
+	}
+}
+
+void FileStorage_SetName( int conn_id, const char *name )
+{
+	FileStorageConnection conn = FileStorage_GetConnection( conn_id );
+	if( conn && conn->active ) {
+		FileClient_SetName( conn->client, name );
+	}
+}
+
+void FileStorage_SetMaxRequests( int conn_id, size_t n )
+{
+	FileStorageConnection conn = FileStorage_GetConnection( conn_id );
+	if( conn && conn->active ) {
+		FileClient_SetMaxRequests( conn->client, n );
+	}
+}
+
+void FileStorage_Cancel( int conn_id, int request_id )
+{
+	FileStorageConnection conn = FileStorage_GetConnection( conn_id );
+	if( conn && conn->active && request_id > 0 ) {
+		FileClient_CancelRequest( conn->client, request_id );
+	}
+}
+
 void FileStorage_Close( int id )
 {
 	FileStorageConnection conn = FileStorage_GetConnection( id );
@@ -127,15 +171,19 @@ void FileStorage_Close( int id )
 
 void FileStorage_Exit( void )
 {
+	FileMetrics_StopDump();
+	FileWorker_Shutdown();
 	FileService_Close();
 }
 
 static void OnResponse( FileResponse *response, void *data )
 {
 	int n;
-	FileStreamChunk chunk;
+	LCUI_Graph graph;
+	FileStreamChunk chunk = { 0 };
 	HandlerDataPack pack = data;
 
+	Graph_Init( &graph );
 	switch( pack->type ) {
 	case HANDLER_ON_GET_FILE:
 		if( response->status != RESPONSE_STATUS_OK ) {
@@ -155,8 +203,10 @@ static void OnResponse( FileResponse *response, void *data )
 			pack->on_get_thumb( NULL, NULL, pack->data );
 			break;
 		}
-		pack->on_get_thumb( &response->file,
-				    &chunk.thumb, pack->data );
+		/* 取出像素数据的所有权，回调函数可以直接接管它 */
+		FileImage_Take( chunk.thumb, &graph );
+		chunk.thumb = NULL;
+		pack->on_get_thumb( &response->file, &graph, pack->data );
 		break;
 	case HANDLER_ON_GET_IMAGE:
 		if( response->status != RESPONSE_STATUS_OK ) {
@@ -168,7 +218,9 @@ static void OnResponse( FileResponse *response, void *data )
 			pack->on_get_image( NULL, pack->data );
 			break;
 		}
-		pack->on_get_image( &chunk.image, pack->data );
+		FileImage_Take( chunk.image, &graph );
+		chunk.image = NULL;
+		pack->on_get_image( &graph, pack->data );
 		break;
 	case HANDLER_ON_GET_PROPS:
 		if( response->status != RESPONSE_STATUS_OK ) {
@@ -177,9 +229,26 @@ static void OnResponse( FileResponse *response, void *data )
 		}
 		pack->on_get_status( &response->file, pack->data );
 		break;
+	case HANDLER_ON_GET_PROPS_LIST:
+		if( response->status != RESPONSE_STATUS_OK ) {
+			pack->on_get_status_list( NULL, 0, pack->data );
+			break;
+		}
+		n = FileStream_ReadChunk( response->stream, &chunk );
+		if( n == 0 || chunk.type != DATA_CHUNK_BUFFER ) {
+			pack->on_get_status_list( NULL, 0, pack->data );
+			break;
+		}
+		pack->on_get_status_list( (FileStatusItem*)chunk.data,
+					  pack->n_paths, pack->data );
+		break;
 	default: break;
 	}
 	FileStreamChunk_Destroy( &chunk );
+	Graph_Free( &graph );
+	if( pack->paths ) {
+		free( pack->paths );
+	}
 	free( pack );
 }
 
@@ -201,10 +270,10 @@ int FileStorage_GetFile( int conn_id, const wchar_t *filename,
 	pack->data = data;
 	request.method = REQUEST_METHOD_GET;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
 
 int FileStorage_GetFiles( int conn_id, const wchar_t *filename,
@@ -226,10 +295,10 @@ int FileStorage_GetFiles( int conn_id, const wchar_t *filename,
 	request.method = REQUEST_METHOD_GET;
 	request.params.filter = FILE_FILTER_FILE;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
 
 int FileStorage_GetFolders( int conn_id, const wchar_t *filename,
@@ -251,10 +320,36 @@ int FileStorage_GetFolders( int conn_id, const wchar_t *filename,
 	request.method = REQUEST_METHOD_GET;
 	request.params.filter = FILE_FILTER_FOLDER;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
+}
+
+int FileStorage_ScanDir( int conn_id, const wchar_t *dirpath,
+			 HandlerOnGetFile callback, void *data )
+{
+	HandlerDataPack pack;
+	FileRequestHandler handler;
+	FileStorageConnection conn;
+	FileRequest request = { 0 };
+
+	conn = FileStorage_GetConnection( conn_id );
+	if( !conn || !conn->active ) {
+		return -1;
+	}
+	pack = NEW( HandlerDataPackRec, 1 );
+	pack->type = HANDLER_ON_GET_FILE;
+	pack->on_get_file = callback;
+	pack->data = data;
+	request.method = REQUEST_METHOD_GET;
+	request.params.filter = FILE_FILTER_NONE;
+	request.params.with_file_status = TRUE;
+	wcsncpy( request.path, dirpath, 255 );
+	request.priority = conn->priority;
+	handler.callback = OnResponse;
+	handler.data = pack;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
 
 static void FileStorgage_OnGetProgress( void *data, float progress )
@@ -286,10 +381,10 @@ int FileStorage_GetImage( int conn_id, const wchar_t *filename,
 	request.params.progress_arg = pack;
 	request.params.progress = FileStorgage_OnGetProgress;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
 
 int FileStorage_GetThumbnail( int conn_id, const wchar_t *filename,
@@ -314,10 +409,10 @@ int FileStorage_GetThumbnail( int conn_id, const wchar_t *filename,
 	request.params.width = width;
 	request.params.height = height;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
 
 int FileStorage_GetStatus( int conn_id, const wchar_t *filename,
@@ -340,8 +435,55 @@ int FileStorage_GetStatus( int conn_id, const wchar_t *filename,
 	request.method = REQUEST_METHOD_HEAD;
 	request.params.with_image_status = with_extra;
 	wcsncpy( request.path, filename, 255 );
+	request.priority = conn->priority;
+	handler.callback = OnResponse;
+	handler.data = pack;
+	return FileClient_SendRequest( conn->client, &request, &handler );
+}
+
+int FileStorage_GetStatusList( int conn_id, wchar_t *const *filenames,
+			       size_t count, LCUI_BOOL with_extra,
+			       HandlerOnGetStatusList callback, void *data )
+{
+	size_t i, len;
+	wchar_t *str;
+	HandlerDataPack pack;
+	FileRequestHandler handler;
+	FileStorageConnection conn;
+	FileRequest request = { 0 };
+
+	conn = FileStorage_GetConnection( conn_id );
+	if( !conn || !conn->active || count < 1 ) {
+		return -1;
+	}
+	/* 指针数组和路径字符串放在同一块内存里，收到响应后一并释放 */
+	for( i = 0, len = 0; i < count; ++i ) {
+		len += wcslen( filenames[i] ) + 1;
+	}
+	pack = NEW( HandlerDataPackRec, 1 );
+	pack->paths = malloc( sizeof( wchar_t* ) * count +
+			      sizeof( wchar_t ) * len );
+	if( !pack->paths ) {
+		free( pack );
+		return -1;
+	}
+	str = (wchar_t*)(pack->paths + count);
+	for( i = 0; i < count; ++i ) {
+		len = wcslen( filenames[i] ) + 1;
+		wcsncpy( str, filenames[i], len );
+		pack->paths[i] = str;
+		str += len;
+	}
+	pack->n_paths = count;
+	pack->type = HANDLER_ON_GET_PROPS_LIST;
+	pack->on_get_status_list = callback;
+	pack->data = data;
+	request.method = REQUEST_METHOD_HEAD_BATCH;
+	request.params.with_image_status = with_extra;
+	request.params.paths = pack->paths;
+	request.params.n_paths = count;
+	request.priority = conn->priority;
 	handler.callback = OnResponse;
 	handler.data = pack;
-	FileClient_SendRequest( conn->client, &request, &handler );
-	return 0;
+	return FileClient_SendRequest( conn->client, &request, &handler );
 }
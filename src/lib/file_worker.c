@@ -0,0 +1,1543 @@
+﻿/* ***************************************************************************
+ * file_worker.c -- file service worker processes.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * file_worker.c -- 文件服务的工作进程
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/thread.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "file_service.h"
+#include "file_worker.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/** 内联在消息中的数据的最大字节数，更大的数据放在内存文件中传递 */
+#define FILE_WORKER_INLINE_SIZE 32768
+
+/** 最多启动的工作进程数量 */
+#define FILE_WORKER_MAX_COUNT 16
+
+/** 工作进程连续启动失败这么多次后不再重启它 */
+#define FILE_WORKER_MAX_RESTARTS 3
+
+/** 有暂存的文件列表项时，每隔这么多毫秒尝试写入一次 */
+#define FILE_WORKER_DRAIN_INTERVAL 10
+
+/** 文件列表项按 8 字节对齐 */
+#define FILE_WORKER_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+enum FileWorkerMessageType {
+	WORKER_MSG_REQUEST,	/**< 请求，数据为 FileWorkerRequest 和路径列表 */
+	WORKER_MSG_CANCEL,	/**< 取消请求 */
+	WORKER_MSG_PROGRESS,	/**< 图片读取进度，数据为 float */
+	WORKER_MSG_RESPONSE,	/**< 响应，数据为 FileWorkerResponse */
+	WORKER_MSG_BUFFER,	/**< 数据块 */
+	WORKER_MSG_IMAGE,	/**< 图像，数据为 FileWorkerImage，像素在内存文件中 */
+	WORKER_MSG_THUMB,	/**< 缩略图，格式与图像相同 */
+	WORKER_MSG_DIR_ENTRIES,	/**< 一批文件列表项 */
+	WORKER_MSG_END,		/**< 响应的数据已经全部发出 */
+	WORKER_MSG_CLOSE	/**< 连接已关闭，工作进程可以释放对应的客户端 */
+};
+
+/** 消息头，同一条消息中紧跟着内联数据，内存文件经 SCM_RIGHTS 附带 */
+typedef struct FileWorkerMessage_ {
+	uint32_t type;		/**< 消息类型 */
+	uint32_t conn;		/**< 连接标识号，工作进程为每个连接建立一个客户端 */
+	uint32_t tag;		/**< 由主进程为转发的请求分配的标识号 */
+	uint32_t size;		/**< 内联数据的字节数 */
+	uint64_t file_size;	/**< 内存文件中的数据的字节数 */
+} FileWorkerMessage;
+
+typedef struct FileWorkerRequest_ {
+	int32_t method;
+	int32_t priority;
+	int32_t filter;
+	uint8_t with_file_status;
+	uint8_t get_thumbnail;
+	uint8_t with_image_status;
+	uint8_t with_progress;
+	uint32_t width;
+	uint32_t height;
+	uint32_t n_paths;	/**< 批量请求的路径数量，路径依次跟在后面 */
+	wchar_t path[256];
+} FileWorkerRequest;
+
+typedef struct FileWorkerResponse_ {
+	int32_t status;
+	int32_t type;
+	uint8_t with_image;	/**< 是否附带图片尺寸 */
+	uint8_t listing;	/**< 是否为文件列表，列表项在响应之后发出 */
+	uint64_t size;
+	int64_t ctime;
+	int64_t mtime;
+	uint32_t width;
+	uint32_t height;
+} FileWorkerResponse;
+
+typedef struct FileWorkerImage_ {
+	int32_t color_type;
+	uint32_t width;
+	uint32_t height;
+} FileWorkerImage;
+
+/** 文件列表项，后面跟着以 0 结尾的 UTF-8 文件名 */
+typedef struct FileWorkerDirEntry_ {
+	uint64_t size;
+	int64_t ctime;
+	int64_t mtime;
+	uint16_t name_len;
+	uint8_t type;
+	uint8_t with_status;
+} FileWorkerDirEntry;
+
+/** 工作进程 */
+typedef struct FileWorkerRec_ {
+	int fd;			/**< 与工作进程通信的套接字 */
+	pid_t pid;		/**< 进程标识号 */
+	size_t load;		/**< 正在处理的请求数量 */
+	int failures;		/**< 连续启动失败的次数 */
+	LCUI_BOOL alive;	/**< 是否在运行 */
+	LCUI_Thread thread;	/**< 接收该工作进程的消息的线程 */
+	LCUI_Mutex send_mutex;	/**< 发送消息和更换套接字时加锁，发送时不占用进程池的锁 */
+	LinkedList draining;	/**< 有暂存的文件列表项的请求，只在接收线程中访问 */
+} FileWorkerRec, *FileWorker;
+
+/** 已转发给工作进程、尚未结束的请求 */
+typedef struct FileWorkerTaskRec_ {
+	uint32_t tag;		/**< 转发时分配的标识号 */
+	unsigned int id;	/**< 原请求的标识号 */
+	int method;		/**< 请求方式 */
+	Connection conn;	/**< 请求来源的连接 */
+	FileWorker worker;	/**< 处理请求的工作进程 */
+	FileStream stream;	/**< 响应的文件流，收到第一条消息时创建 */
+	LCUI_BOOL responded;	/**< 是否已经发出响应 */
+	FileImage target;	/**< 发送方预先分配的图像 */
+	void( *progress )(void*, float);
+	void *progress_arg;
+	LCUI_BOOL ended;	/**< 已收到结束消息，等暂存的文件列表项写完后再结束 */
+	LinkedList pending;	/**< 文件流的缓冲区已满时暂存的文件列表项 */
+	LinkedListNode drain_node;
+	LinkedListNode node;
+} FileWorkerTaskRec, *FileWorkerTask;
+
+/** 一批暂存的文件列表项 */
+typedef struct FileWorkerBatchRec_ {
+	char *data;
+	size_t size;
+	size_t offset;		/**< 已经写入文件流的字节数 */
+} FileWorkerBatchRec, *FileWorkerBatch;
+
+/** 连接与它在消息中的标识号 */
+typedef struct FileWorkerConnRec_ {
+	Connection conn;
+	uint32_t id;
+	LinkedListNode node;
+} FileWorkerConnRec, *FileWorkerConn;
+
+/** 工作进程中，与主进程的一个连接对应的客户端 */
+typedef struct FileWorkerClientRec_ {
+	uint32_t conn;
+	FileClient client;
+	LCUI_BOOL closing;	/**< 连接已关闭，等请求都结束后再关闭客户端 */
+	LinkedListNode node;
+} FileWorkerClientRec, *FileWorkerClient;
+
+/** 工作进程中正在处理的请求 */
+typedef struct FileWorkerJobRec_ {
+	uint32_t tag;		/**< 主进程分配的标识号 */
+	int method;		/**< 请求方式 */
+	unsigned int id;	/**< 在本进程的客户端上的请求标识号 */
+	float progress;		/**< 上次发出的读取进度 */
+	LCUI_BOOL canceled;	/**< 在得到请求标识号之前就被取消了 */
+	FileClient client;	/**< 处理请求的客户端 */
+	char *data;		/**< 请求数据，路径列表指向其中 */
+	wchar_t **paths;	/**< 批量请求的路径列表 */
+	LinkedListNode node;
+} FileWorkerJobRec, *FileWorkerJob;
+
+/** 主进程中的工作进程池 */
+static struct FileWorkerPool {
+	LCUI_BOOL active;
+	int count;
+	uint32_t base_tag;
+	uint32_t base_conn;
+	FileWorkerRec workers[FILE_WORKER_MAX_COUNT];
+	LinkedList tasks;
+	LinkedList conns;
+	LCUI_Mutex mutex;
+} pool;
+
+/** 工作进程自身的状态 */
+static struct FileWorkerProcess {
+	int fd;
+	LinkedList clients;
+	LinkedList jobs;
+	LCUI_Mutex mutex;
+} proc;
+
+/** 新建内存文件，并写入数据 */
+static int FileWorker_CreateMemFile( const void *data, size_t size )
+{
+	int fd;
+	ssize_t n;
+	size_t offset = 0;
+
+	fd = memfd_create( "lcfinder-file-worker", MFD_CLOEXEC );
+	if( fd < 0 ) {
+		return -1;
+	}
+	while( offset < size ) {
+		n = write( fd, (const char*)data + offset, size - offset );
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			close( fd );
+			return -1;
+		}
+		offset += n;
+	}
+	return fd;
+}
+
+static int FileWorker_ReadMemFile( int fd, void *buf, size_t size )
+{
+	ssize_t n;
+	size_t offset = 0;
+
+	while( offset < size ) {
+		n = pread( fd, (char*)buf + offset, size - offset, offset );
+		if( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if( n <= 0 ) {
+			return -1;
+		}
+		offset += n;
+	}
+	return 0;
+}
+
+/** 发送消息，memfd 不为 -1 时附带这个内存文件 */
+static int FileWorker_SendRaw( int sock, const FileWorkerMessage *msg,
+			       const void *data, int memfd )
+{
+	struct iovec iov[2];
+	struct msghdr mh = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE( sizeof( int ) )];
+	} ctrl;
+
+	iov[0].iov_base = (void*)msg;
+	iov[0].iov_len = sizeof( *msg );
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = msg->size;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = msg->size > 0 ? 2 : 1;
+	if( memfd >= 0 ) {
+		memset( &ctrl, 0, sizeof( ctrl ) );
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = sizeof( ctrl.buf );
+		cmsg = CMSG_FIRSTHDR( &mh );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+		memcpy( CMSG_DATA( cmsg ), &memfd, sizeof( int ) );
+	}
+	while( sendmsg( sock, &mh, MSG_NOSIGNAL ) < 0 ) {
+		if( errno != EINTR ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** 发送消息，数据超出内联大小时改为放在内存文件中 */
+static int FileWorker_Send( int sock, uint32_t type, uint32_t conn,
+			    uint32_t tag, const void *data, size_t size )
+{
+	int ret, memfd = -1;
+	FileWorkerMessage msg = { 0 };
+
+	msg.type = type;
+	msg.conn = conn;
+	msg.tag = tag;
+	if( size > FILE_WORKER_INLINE_SIZE ) {
+		memfd = FileWorker_CreateMemFile( data, size );
+		if( memfd < 0 ) {
+			return -1;
+		}
+		msg.file_size = size;
+	} else {
+		msg.size = (uint32_t)size;
+	}
+	ret = FileWorker_SendRaw( sock, &msg, data, memfd );
+	if( memfd >= 0 ) {
+		close( memfd );
+	}
+	return ret;
+}
+
+/**
+ * 向工作进程发送消息
+ * 发送可能会阻塞，调用时不能占用进程池的锁，否则接收线程也会被阻塞。
+ */
+static int FileWorker_SendTo( FileWorker worker, uint32_t type, uint32_t conn,
+			      uint32_t tag, const void *data, size_t size )
+{
+	int ret = -1;
+
+	LCUIMutex_Lock( &worker->send_mutex );
+	if( worker->fd >= 0 ) {
+		ret = FileWorker_Send( worker->fd, type, conn, tag, data, size );
+	}
+	LCUIMutex_Unlock( &worker->send_mutex );
+	return ret;
+}
+
+/**
+ * 接收消息
+ * 内联数据存入 buf，附带的内存文件存入 memfd，没有时为 -1
+ * @returns 对方已关闭或出错时返回 -1
+ */
+static int FileWorker_Recv( int sock, FileWorkerMessage *msg,
+			    char *buf, int *memfd )
+{
+	ssize_t n;
+	struct iovec iov[2];
+	struct msghdr mh = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE( sizeof( int ) )];
+	} ctrl;
+
+	*memfd = -1;
+	iov[0].iov_base = msg;
+	iov[0].iov_len = sizeof( *msg );
+	iov[1].iov_base = buf;
+	iov[1].iov_len = FILE_WORKER_INLINE_SIZE;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = ctrl.buf;
+	mh.msg_controllen = sizeof( ctrl.buf );
+	do {
+		n = recvmsg( sock, &mh, MSG_CMSG_CLOEXEC );
+	} while( n < 0 && errno == EINTR );
+	if( n < (ssize_t)sizeof( *msg ) ) {
+		return -1;
+	}
+	for( cmsg = CMSG_FIRSTHDR( &mh ); cmsg;
+	     cmsg = CMSG_NXTHDR( &mh, cmsg ) ) {
+		if( cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS ) {
+			memcpy( memfd, CMSG_DATA( cmsg ), sizeof( int ) );
+		}
+	}
+	if( msg->size != n - sizeof( *msg ) ||
+	    (msg->file_size > 0 && *memfd < 0) ) {
+		if( *memfd >= 0 ) {
+			close( *memfd );
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/** 取出消息中的数据，存入新分配的内存中 */
+static char *FileWorker_TakeData( const FileWorkerMessage *msg,
+				  const char *buf, int memfd, size_t *size )
+{
+	char *data;
+
+	if( msg->file_size > 0 ) {
+		*size = (size_t)msg->file_size;
+		data = malloc( *size );
+		if( data && FileWorker_ReadMemFile( memfd, data, *size ) != 0 ) {
+			free( data );
+			return NULL;
+		}
+		return data;
+	}
+	*size = msg->size;
+	data = malloc( *size > 0 ? *size : 1 );
+	if( data ) {
+		memcpy( data, buf, *size );
+	}
+	return data;
+}
+
+/*------------------------------ 主进程 ------------------------------*/
+
+static uint32_t FileWorker_GetConnId( Connection conn )
+{
+	LinkedListNode *node;
+	FileWorkerConn wconn;
+
+	for( LinkedList_Each( node, &pool.conns ) ) {
+		wconn = node->data;
+		if( wconn->conn == conn ) {
+			return wconn->id;
+		}
+	}
+	wconn = NEW( FileWorkerConnRec, 1 );
+	wconn->conn = conn;
+	wconn->id = ++pool.base_conn;
+	wconn->node.data = wconn;
+	LinkedList_AppendNode( &pool.conns, &wconn->node );
+	return wconn->id;
+}
+
+static FileWorkerTask FileWorker_FindTask( uint32_t tag )
+{
+	LinkedListNode *node;
+	FileWorkerTask task;
+
+	for( LinkedList_Each( node, &pool.tasks ) ) {
+		task = node->data;
+		if( task->tag == tag ) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static char *FileWorker_EncodeRequest( const FileRequest *request,
+				       size_t *size )
+{
+	size_t i, len;
+	wchar_t *p;
+	FileWorkerRequest *wreq;
+	const FileRequestParams *params = &request->params;
+
+	*size = sizeof( FileWorkerRequest );
+	for( i = 0; params->paths && i < params->n_paths; ++i ) {
+		*size += (wcslen( params->paths[i] ) + 1) * sizeof( wchar_t );
+	}
+	wreq = calloc( 1, *size );
+	if( !wreq ) {
+		return NULL;
+	}
+	wreq->method = request->method;
+	wreq->priority = request->priority;
+	wreq->filter = params->filter;
+	wreq->with_file_status = params->with_file_status ? 1 : 0;
+	wreq->get_thumbnail = params->get_thumbnail ? 1 : 0;
+	wreq->with_image_status = params->with_image_status ? 1 : 0;
+	wreq->with_progress = params->progress ? 1 : 0;
+	wreq->width = params->width;
+	wreq->height = params->height;
+	wcsncpy( wreq->path, request->path, 255 );
+	p = (wchar_t*)(wreq + 1);
+	for( i = 0; params->paths && i < params->n_paths; ++i ) {
+		len = wcslen( params->paths[i] ) + 1;
+		memcpy( p, params->paths[i], len * sizeof( wchar_t ) );
+		p += len;
+	}
+	wreq->n_paths = params->paths ? (uint32_t)params->n_paths : 0;
+	return (char*)wreq;
+}
+
+/** 转发请求给负载最小的工作进程 */
+static int FileWorker_Forward( Connection conn, const FileRequest *request,
+			       void *arg )
+{
+	int i;
+	char *data;
+	size_t size;
+	uint32_t tag, conn_id;
+	LCUI_BOOL found;
+	FileWorkerTask task;
+	FileWorker worker = NULL;
+
+	data = FileWorker_EncodeRequest( request, &size );
+	if( !data ) {
+		return -1;
+	}
+	LCUIMutex_Lock( &pool.mutex );
+	for( i = 0; i < pool.count; ++i ) {
+		if( !pool.workers[i].alive ) {
+			continue;
+		}
+		if( !worker || pool.workers[i].load < worker->load ) {
+			worker = &pool.workers[i];
+		}
+	}
+	if( !worker ) {
+		LCUIMutex_Unlock( &pool.mutex );
+		free( data );
+		return -1;
+	}
+	task = NEW( FileWorkerTaskRec, 1 );
+	pool.base_tag = pool.base_tag + 1 ? pool.base_tag + 1 : 1;
+	task->tag = pool.base_tag;
+	task->id = request->id;
+	task->method = request->method;
+	task->conn = conn;
+	task->worker = worker;
+	task->target = request->params.target;
+	task->progress = request->params.progress;
+	task->progress_arg = request->params.progress_arg;
+	task->node.data = task;
+	LinkedList_Init( &task->pending );
+	/* 先加入列表再发送，以便接收线程能找到它 */
+	tag = task->tag;
+	conn_id = FileWorker_GetConnId( conn );
+	worker->load += 1;
+	LinkedList_AppendNode( &pool.tasks, &task->node );
+	LCUIMutex_Unlock( &pool.mutex );
+	if( FileWorker_SendTo( worker, WORKER_MSG_REQUEST, conn_id,
+			       tag, data, size ) == 0 ) {
+		free( data );
+		return 0;
+	}
+	free( data );
+	/* 工作进程退出时，接收线程可能已经以错误状态结束了这个请求 */
+	LCUIMutex_Lock( &pool.mutex );
+	found = FileWorker_FindTask( tag ) == task;
+	if( found ) {
+		LinkedList_Unlink( &pool.tasks, &task->node );
+		worker->load -= 1;
+	}
+	LCUIMutex_Unlock( &pool.mutex );
+	if( !found ) {
+		return 0;
+	}
+	free( task );
+	return -1;
+}
+
+static void FileWorker_Cancel( Connection conn, unsigned int id, void *arg )
+{
+	uint32_t tag = 0;
+	LinkedListNode *node;
+	FileWorkerTask task;
+	FileWorker worker = NULL;
+
+	LCUIMutex_Lock( &pool.mutex );
+	for( LinkedList_Each( node, &pool.tasks ) ) {
+		task = node->data;
+		if( task->conn == conn && task->id == id ) {
+			worker = task->worker;
+			tag = task->tag;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &pool.mutex );
+	if( worker ) {
+		FileWorker_SendTo( worker, WORKER_MSG_CANCEL, 0, tag, NULL, 0 );
+	}
+}
+
+/** 连接关闭后移除它的标识号，并让工作进程释放对应的客户端 */
+static void FileWorker_CloseConn( Connection conn, void *arg )
+{
+	int i, n = 0;
+	uint32_t id = 0;
+	LinkedListNode *node;
+	FileWorkerConn wconn;
+
+	LCUIMutex_Lock( &pool.mutex );
+	for( LinkedList_Each( node, &pool.conns ) ) {
+		wconn = node->data;
+		if( wconn->conn != conn ) {
+			continue;
+		}
+		id = wconn->id;
+		n = pool.count;
+		LinkedList_Unlink( &pool.conns, node );
+		free( wconn );
+		break;
+	}
+	LCUIMutex_Unlock( &pool.mutex );
+	/* 已退出的工作进程的套接字为 -1，或者发送会失败，不必检查 */
+	for( i = 0; i < n; ++i ) {
+		FileWorker_SendTo( &pool.workers[i], WORKER_MSG_CLOSE,
+				   id, 0, NULL, 0 );
+	}
+}
+
+static FileStream FileWorker_GetStream( FileWorkerTask task )
+{
+	if( !task->stream ) {
+		task->stream = FileStream_Create();
+		/* 一份引用归客户端所有，由它在处理完响应后释放 */
+		FileStream_AddRef( task->stream );
+	}
+	return task->stream;
+}
+
+static void FileWorker_WriteChunk( FileWorkerTask task,
+				   FileStreamChunk *chunk )
+{
+	if( FileStream_WriteChunk( FileWorker_GetStream( task ),
+				   chunk ) < 1 ) {
+		FileStreamChunk_Destroy( chunk );
+	}
+}
+
+static void FileWorker_Respond( FileWorkerTask task,
+				const FileWorkerResponse *wres )
+{
+	FileResponse response = { 0 };
+	FileStream stream = FileWorker_GetStream( task );
+
+	response.id = task->id;
+	response.status = wres->status;
+	response.stream = stream;
+	response.file.type = wres->type;
+	response.file.size = (size_t)wres->size;
+	response.file.ctime = (time_t)wres->ctime;
+	response.file.mtime = (time_t)wres->mtime;
+	if( wres->with_image ) {
+		response.file.image = NEW( FileImageStatus, 1 );
+		response.file.image->width = wres->width;
+		response.file.image->height = wres->height;
+	}
+	if( wres->listing && FileStream_InitDirList( stream ) != 0 ) {
+		response.status = RESPONSE_STATUS_ERROR;
+	}
+	task->responded = TRUE;
+	if( !Connection_SendResponse( task->conn, &response ) ) {
+		/* 连接已经关闭，替客户端释放它持有的那份文件流引用 */
+		FileStream_Release( stream );
+		free( response.file.image );
+	}
+}
+
+static void FileWorker_FreeBatch( void *arg )
+{
+	FileWorkerBatch batch = arg;
+	free( batch->data );
+	free( batch );
+}
+
+/** 结束请求，尚未发出响应时以 status 作为响应状态 */
+static void FileWorker_EndTask( FileWorkerTask task, int status )
+{
+	FileWorkerResponse wres = { 0 };
+	FileStreamChunk chunk = { 0 };
+
+	if( task->pending.length > 0 ) {
+		LinkedList_ClearData( &task->pending, FileWorker_FreeBatch );
+		LinkedList_Unlink( &task->worker->draining,
+				   &task->drain_node );
+	}
+	if( !task->responded ) {
+		wres.status = status;
+		FileWorker_Respond( task, &wres );
+	}
+	chunk.type = DATA_CHUNK_END;
+	FileStream_WriteChunk( task->stream, &chunk );
+	FileStream_Close( task->stream );
+	FileStream_Release( task->stream );
+	LCUIMutex_Lock( &pool.mutex );
+	LinkedList_Unlink( &pool.tasks, &task->node );
+	task->worker->load -= 1;
+	LCUIMutex_Unlock( &pool.mutex );
+	free( task );
+}
+
+/** 接收图像，发送方预先分配了图像时直接写入其中 */
+static FileImage FileWorker_ReceiveImage( FileWorkerTask task,
+					  const FileWorkerImage *wimg,
+					  int memfd, size_t size )
+{
+	FileImage image;
+	LCUI_Graph *graph;
+
+	if( task->target ) {
+		image = task->target;
+		FileImage_AddRef( image );
+	} else {
+		image = FileImage_Create();
+	}
+	graph = FileImage_GetGraph( image );
+	graph->color_type = wimg->color_type;
+	if( Graph_Create( graph, wimg->width, wimg->height ) != 0 ) {
+		FileImage_Release( image );
+		return NULL;
+	}
+	if( size > graph->mem_size ) {
+		size = graph->mem_size;
+	}
+	if( FileWorker_ReadMemFile( memfd, graph->bytes, size ) != 0 ) {
+		FileImage_Release( image );
+		return NULL;
+	}
+	return image;
+}
+
+/** 批量获取的文件状态中的指针来自工作进程，需要改为指向本地的数据 */
+static void FileWorker_FixStatusList( char *data, size_t size )
+{
+	size_t i, n = size / sizeof( FileStatusItem );
+	FileStatusItem *items = (FileStatusItem*)data;
+
+	for( i = 0; i < n; ++i ) {
+		if( items[i].file.image ) {
+			items[i].file.image = &items[i].image;
+		}
+	}
+}
+
+/**
+ * 从 offset 处开始把一批文件列表项写入文件流，不等待读取方
+ * 文件流的缓冲区已满时返回 -EAGAIN，offset 为下次开始写入的位置。
+ */
+static int FileWorker_WriteDirEntries( FileWorkerTask task, const char *data,
+				       size_t size, size_t *offset )
+{
+	int ret;
+	size_t len;
+	FileDirEntry entry;
+	FileWorkerDirEntry rec;
+
+	while( *offset + sizeof( rec ) <= size ) {
+		memcpy( &rec, data + *offset, sizeof( rec ) );
+		len = FILE_WORKER_ALIGN( sizeof( rec ) + rec.name_len + 1 );
+		if( *offset + len > size ) {
+			break;
+		}
+		entry.type = rec.type;
+		entry.with_status = rec.with_status;
+		entry.size = rec.size;
+		entry.ctime = rec.ctime;
+		entry.mtime = rec.mtime;
+		entry.name_len = rec.name_len;
+		entry.name = data + *offset + sizeof( rec );
+		ret = FileStream_TryCopyDirEntry( task->stream, &entry );
+		if( ret == -EAGAIN ) {
+			return ret;
+		}
+		/* 文件流已关闭，余下的列表项没有读取方了 */
+		if( ret != 0 ) {
+			break;
+		}
+		*offset += len;
+	}
+	*offset = size;
+	return 0;
+}
+
+/**
+ * 写入文件列表项，写不下的部分暂存在请求中
+ * 接收线程由所有连接共用，不能等待某个读取方腾出缓冲区。
+ */
+static void FileWorker_QueueDirEntries( FileWorkerTask task,
+					const char *data, size_t size )
+{
+	size_t offset = 0;
+	FileWorkerBatch batch;
+
+	if( task->pending.length == 0 &&
+	    FileWorker_WriteDirEntries( task, data, size, &offset ) == 0 ) {
+		return;
+	}
+	batch = NEW( FileWorkerBatchRec, 1 );
+	if( !batch ) {
+		return;
+	}
+	batch->size = size - offset;
+	batch->data = malloc( batch->size );
+	if( !batch->data ) {
+		free( batch );
+		return;
+	}
+	memcpy( batch->data, data + offset, batch->size );
+	if( task->pending.length == 0 ) {
+		task->drain_node.data = task;
+		LinkedList_AppendNode( &task->worker->draining,
+				       &task->drain_node );
+	}
+	LinkedList_Append( &task->pending, batch );
+}
+
+/** 写入暂存的文件列表项，返回是否已经全部写完 */
+static LCUI_BOOL FileWorker_FlushDirEntries( FileWorkerTask task )
+{
+	LinkedListNode *node;
+	FileWorkerBatch batch;
+
+	while( task->pending.length > 0 ) {
+		node = task->pending.head.next;
+		batch = node->data;
+		if( FileWorker_WriteDirEntries( task, batch->data, batch->size,
+						&batch->offset ) != 0 ) {
+			return FALSE;
+		}
+		FileWorker_FreeBatch( batch );
+		LinkedList_DeleteNode( &task->pending, node );
+	}
+	return TRUE;
+}
+
+/** 尝试写入各个请求暂存的文件列表项，并结束已经写完且已收到结束消息的请求 */
+static void FileWorker_FlushTasks( FileWorker worker )
+{
+	LinkedListNode *node, *prev;
+	FileWorkerTask task;
+
+	for( LinkedList_Each( node, &worker->draining ) ) {
+		task = node->data;
+		if( !FileWorker_FlushDirEntries( task ) ) {
+			continue;
+		}
+		prev = node->prev;
+		LinkedList_Unlink( &worker->draining, node );
+		node = prev;
+		if( task->ended ) {
+			FileWorker_EndTask( task, RESPONSE_STATUS_ERROR );
+		}
+	}
+}
+
+static void FileWorker_HandleMessage( FileWorker worker,
+				      const FileWorkerMessage *msg,
+				      const char *buf, int memfd )
+{
+	float progress;
+	size_t size;
+	FileWorkerTask task;
+	FileStreamChunk chunk = { 0 };
+
+	LCUIMutex_Lock( &pool.mutex );
+	task = FileWorker_FindTask( msg->tag );
+	LCUIMutex_Unlock( &pool.mutex );
+	/* 请求只会在当前线程中结束，所以之后可以不加锁地访问它 */
+	if( !task ) {
+		return;
+	}
+	switch( msg->type ) {
+	case WORKER_MSG_PROGRESS:
+		if( task->progress && msg->size == sizeof( progress ) ) {
+			memcpy( &progress, buf, sizeof( progress ) );
+			task->progress( task->progress_arg, progress );
+		}
+		break;
+	case WORKER_MSG_BUFFER:
+		chunk.data = FileWorker_TakeData( msg, buf, memfd, &size );
+		if( !chunk.data ) {
+			break;
+		}
+		if( task->method == REQUEST_METHOD_HEAD_BATCH ) {
+			FileWorker_FixStatusList( chunk.data, size );
+		}
+		chunk.type = DATA_CHUNK_BUFFER;
+		chunk.size = size;
+		FileWorker_WriteChunk( task, &chunk );
+		break;
+	case WORKER_MSG_IMAGE:
+	case WORKER_MSG_THUMB:
+		if( msg->size != sizeof( FileWorkerImage ) || memfd < 0 ) {
+			break;
+		}
+		chunk.image = FileWorker_ReceiveImage(
+			task, (const FileWorkerImage*)buf,
+			memfd, (size_t)msg->file_size );
+		if( !chunk.image ) {
+			break;
+		}
+		if( msg->type == WORKER_MSG_IMAGE ) {
+			chunk.type = DATA_CHUNK_IMAGE;
+		} else {
+			chunk.type = DATA_CHUNK_THUMB;
+		}
+		FileWorker_WriteChunk( task, &chunk );
+		break;
+	case WORKER_MSG_RESPONSE:
+		if( msg->size == sizeof( FileWorkerResponse ) &&
+		    !task->responded ) {
+			FileWorker_Respond( task,
+					    (const FileWorkerResponse*)buf );
+		}
+		break;
+	case WORKER_MSG_DIR_ENTRIES:
+		if( task->responded && msg->file_size == 0 ) {
+			FileWorker_QueueDirEntries( task, buf, msg->size );
+		}
+		break;
+	case WORKER_MSG_END:
+		if( task->pending.length > 0 ) {
+			task->ended = TRUE;
+			break;
+		}
+		FileWorker_EndTask( task, RESPONSE_STATUS_ERROR );
+		break;
+	default: break;
+	}
+}
+
+/** 以错误状态结束工作进程上所有未完成的请求 */
+static void FileWorker_FailTasks( FileWorker worker )
+{
+	LinkedListNode *node;
+	FileWorkerTask task;
+
+	while( 1 ) {
+		task = NULL;
+		LCUIMutex_Lock( &pool.mutex );
+		for( LinkedList_Each( node, &pool.tasks ) ) {
+			if( ((FileWorkerTask)node->data)->worker == worker ) {
+				task = node->data;
+				break;
+			}
+		}
+		LCUIMutex_Unlock( &pool.mutex );
+		if( !task ) {
+			break;
+		}
+		FileWorker_EndTask( task, RESPONSE_STATUS_ERROR );
+	}
+}
+
+/** 启动工作进程，新进程执行的是当前程序 */
+static int FileWorker_Spawn( FileWorker worker )
+{
+	pid_t pid;
+	int fds[2];
+	char fdstr[16];
+	char *argv[4];
+
+	if( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC,
+			0, fds ) != 0 ) {
+		return -1;
+	}
+	snprintf( fdstr, sizeof( fdstr ), "%d", fds[1] );
+	argv[0] = "lcfinder";
+	argv[1] = FILE_WORKER_ARG;
+	argv[2] = fdstr;
+	argv[3] = NULL;
+	pid = fork();
+	if( pid < 0 ) {
+		close( fds[0] );
+		close( fds[1] );
+		return -1;
+	}
+	if( pid == 0 ) {
+		/* 子进程中只能调用异步信号安全的函数 */
+		fcntl( fds[1], F_SETFD, 0 );
+		execv( "/proc/self/exe", argv );
+		_exit( 127 );
+	}
+	close( fds[1] );
+	LCUIMutex_Lock( &worker->send_mutex );
+	worker->fd = fds[0];
+	LCUIMutex_Unlock( &worker->send_mutex );
+	LCUIMutex_Lock( &pool.mutex );
+	worker->pid = pid;
+	worker->load = 0;
+	worker->alive = TRUE;
+	LCUIMutex_Unlock( &pool.mutex );
+	return 0;
+}
+
+/** 回收退出的工作进程，并在需要时重新启动它 */
+static int FileWorker_Restart( FileWorker worker )
+{
+	LCUIMutex_Lock( &pool.mutex );
+	worker->alive = FALSE;
+	LCUIMutex_Unlock( &pool.mutex );
+	FileWorker_FailTasks( worker );
+	/* 先唤醒阻塞在发送中的线程，再等它释放锁后关闭套接字 */
+	shutdown( worker->fd, SHUT_RDWR );
+	LCUIMutex_Lock( &worker->send_mutex );
+	close( worker->fd );
+	worker->fd = -1;
+	LCUIMutex_Unlock( &worker->send_mutex );
+	waitpid( worker->pid, NULL, 0 );
+	if( !pool.active || worker->failures >= FILE_WORKER_MAX_RESTARTS ) {
+		return -1;
+	}
+	worker->failures += 1;
+	return FileWorker_Spawn( worker );
+}
+
+/** 等待套接字可读，超时或被信号中断时返回 0 */
+static int FileWorker_Poll( int sock, int timeout )
+{
+	struct pollfd pfd;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll( &pfd, 1, timeout ) > 0;
+}
+
+static void FileWorker_Thread( void *arg )
+{
+	int memfd;
+	FileWorker worker = arg;
+	FileWorkerMessage msg;
+	char *buf = malloc( FILE_WORKER_INLINE_SIZE );
+
+	while( buf ) {
+		/* 有暂存的文件列表项时不能一直阻塞在接收中 */
+		if( worker->draining.length > 0 ) {
+			FileWorker_FlushTasks( worker );
+			if( worker->draining.length > 0 &&
+			    !FileWorker_Poll( worker->fd,
+					      FILE_WORKER_DRAIN_INTERVAL ) ) {
+				continue;
+			}
+		}
+		if( FileWorker_Recv( worker->fd, &msg, buf, &memfd ) != 0 ) {
+			if( FileWorker_Restart( worker ) != 0 ) {
+				break;
+			}
+			continue;
+		}
+		worker->failures = 0;
+		FileWorker_HandleMessage( worker, &msg, buf, memfd );
+		if( memfd >= 0 ) {
+			close( memfd );
+		}
+	}
+	free( buf );
+	LCUIThread_Exit( NULL );
+}
+
+int FileWorker_Launch( int count )
+{
+	int i, n = 0;
+	FileServiceForwarderRec forwarder;
+
+	if( pool.active ) {
+		return pool.count;
+	}
+	if( count > FILE_WORKER_MAX_COUNT ) {
+		count = FILE_WORKER_MAX_COUNT;
+	}
+	LinkedList_Init( &pool.tasks );
+	LinkedList_Init( &pool.conns );
+	LCUIMutex_Init( &pool.mutex );
+	pool.active = TRUE;
+	for( i = 0; i < count; ++i ) {
+		pool.workers[i].fd = -1;
+		LinkedList_Init( &pool.workers[i].draining );
+		LCUIMutex_Init( &pool.workers[i].send_mutex );
+	}
+	for( i = 0; i < count; ++i ) {
+		if( FileWorker_Spawn( &pool.workers[n] ) != 0 ) {
+			continue;
+		}
+		LCUIThread_Create( &pool.workers[n].thread,
+				   FileWorker_Thread, &pool.workers[n] );
+		LCUIMutex_Lock( &pool.mutex );
+		pool.count = ++n;
+		LCUIMutex_Unlock( &pool.mutex );
+	}
+	if( n < 1 ) {
+		pool.active = FALSE;
+		return 0;
+	}
+	forwarder.forward = FileWorker_Forward;
+	forwarder.cancel = FileWorker_Cancel;
+	forwarder.close = FileWorker_CloseConn;
+	forwarder.arg = NULL;
+	FileService_SetForwarder( &forwarder );
+	return n;
+}
+
+int FileWorker_LaunchFromEnv( void )
+{
+	const char *value = getenv( FILE_WORKER_ENV );
+	if( !value || atoi( value ) < 1 ) {
+		return 0;
+	}
+	return FileWorker_Launch( atoi( value ) );
+}
+
+void FileWorker_Shutdown( void )
+{
+	int i;
+
+	if( !pool.active ) {
+		return;
+	}
+	FileService_SetForwarder( NULL );
+	LCUIMutex_Lock( &pool.mutex );
+	pool.active = FALSE;
+	for( i = 0; i < pool.count; ++i ) {
+		if( pool.workers[i].alive ) {
+			shutdown( pool.workers[i].fd, SHUT_RDWR );
+		}
+	}
+	LCUIMutex_Unlock( &pool.mutex );
+	for( i = 0; i < pool.count; ++i ) {
+		LCUIThread_Join( pool.workers[i].thread, NULL );
+	}
+	pool.count = 0;
+	LinkedList_ClearData( &pool.conns, free );
+}
+
+/*------------------------------ 工作进程 ------------------------------*/
+
+static FileClient FileWorker_GetClient( uint32_t conn )
+{
+	LinkedListNode *node;
+	FileWorkerClient wclient;
+
+	for( LinkedList_Each( node, &proc.clients ) ) {
+		wclient = node->data;
+		if( wclient->conn == conn && !wclient->closing ) {
+			return wclient->client;
+		}
+	}
+	wclient = NEW( FileWorkerClientRec, 1 );
+	wclient->conn = conn;
+	wclient->closing = FALSE;
+	wclient->client = FileClient_Create();
+	if( FileClient_Connect( wclient->client ) != 0 ) {
+		FileClient_Destroy( wclient->client );
+		free( wclient );
+		return NULL;
+	}
+	/* 主进程的客户端已经限制了请求数量，这里不必再限制 */
+	FileClient_SetMaxRequests( wclient->client, (size_t)-1 );
+	FileClient_RunAsync( wclient->client );
+	wclient->node.data = wclient;
+	LinkedList_AppendNode( &proc.clients, &wclient->node );
+	return wclient->client;
+}
+
+static FileWorkerJob FileWorker_FindJob( uint32_t tag )
+{
+	LinkedListNode *node;
+	FileWorkerJob job;
+
+	for( LinkedList_Each( node, &proc.jobs ) ) {
+		job = node->data;
+		if( job->tag == tag ) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void FileWorker_OnProgress( void *arg, float progress )
+{
+	FileWorkerJob job = arg;
+	/* 进度变化不到 1% 时不必发送 */
+	if( progress < 100.0f && progress - job->progress < 1.0f ) {
+		return;
+	}
+	job->progress = progress;
+	FileWorker_Send( proc.fd, WORKER_MSG_PROGRESS, 0, job->tag,
+			 &progress, sizeof( progress ) );
+}
+
+static void FileWorker_SendImage( FileWorkerJob job, uint32_t type,
+				  FileImage image )
+{
+	int memfd;
+	FileWorkerImage wimg;
+	FileWorkerMessage msg = { 0 };
+	LCUI_Graph *graph = FileImage_GetGraph( image );
+
+	memfd = FileWorker_CreateMemFile( graph->bytes, graph->mem_size );
+	if( memfd < 0 ) {
+		return;
+	}
+	wimg.color_type = graph->color_type;
+	wimg.width = graph->width;
+	wimg.height = graph->height;
+	msg.type = type;
+	msg.tag = job->tag;
+	msg.size = sizeof( wimg );
+	msg.file_size = graph->mem_size;
+	FileWorker_SendRaw( proc.fd, &msg, &wimg, memfd );
+	close( memfd );
+}
+
+/** 分批发送文件列表项，每批不超过内联数据的大小 */
+static void FileWorker_SendDirEntries( FileWorkerJob job, FileStream stream )
+{
+	char *buf;
+	size_t len, size = 0;
+	FileDirEntry entry;
+	FileWorkerDirEntry rec = { 0 };
+
+	buf = malloc( FILE_WORKER_INLINE_SIZE );
+	if( !buf ) {
+		return;
+	}
+	while( FileStream_ReadDirEntry( stream, &entry ) ) {
+		len = FILE_WORKER_ALIGN( sizeof( rec ) + entry.name_len + 1 );
+		if( len > FILE_WORKER_INLINE_SIZE ) {
+			continue;
+		}
+		if( size + len > FILE_WORKER_INLINE_SIZE ) {
+			FileWorker_Send( proc.fd, WORKER_MSG_DIR_ENTRIES, 0,
+					 job->tag, buf, size );
+			size = 0;
+		}
+		rec.size = entry.size;
+		rec.ctime = entry.ctime;
+		rec.mtime = entry.mtime;
+		rec.name_len = (uint16_t)entry.name_len;
+		rec.type = (uint8_t)entry.type;
+		rec.with_status = entry.with_status ? 1 : 0;
+		memset( buf + size, 0, len );
+		memcpy( buf + size, &rec, sizeof( rec ) );
+		memcpy( buf + size + sizeof( rec ), entry.name,
+			entry.name_len );
+		size += len;
+	}
+	if( size > 0 ) {
+		FileWorker_Send( proc.fd, WORKER_MSG_DIR_ENTRIES, 0,
+				 job->tag, buf, size );
+	}
+	free( buf );
+}
+
+/** 转发响应，除文件列表外，数据块都在响应之前发出 */
+static void FileWorker_OnResponse( FileResponse *response, void *arg )
+{
+	FileWorkerJob job = arg;
+	FileStreamChunk chunk;
+	FileWorkerResponse wres = { 0 };
+
+	wres.status = response->status;
+	wres.type = response->file.type;
+	wres.size = response->file.size;
+	wres.ctime = response->file.ctime;
+	wres.mtime = response->file.mtime;
+	if( response->file.image ) {
+		wres.with_image = 1;
+		wres.width = response->file.image->width;
+		wres.height = response->file.image->height;
+	}
+	wres.listing = (job->method == REQUEST_METHOD_GET ||
+			job->method == REQUEST_METHOD_POST) &&
+		response->status == RESPONSE_STATUS_OK &&
+		response->file.type == FILE_TYPE_DIRECTORY;
+	if( wres.listing ) {
+		FileWorker_Send( proc.fd, WORKER_MSG_RESPONSE, 0, job->tag,
+				 &wres, sizeof( wres ) );
+		FileWorker_SendDirEntries( job, response->stream );
+	}
+	while( FileStream_ReadChunk( response->stream, &chunk ) == 1 ) {
+		if( chunk.type == DATA_CHUNK_END ) {
+			break;
+		}
+		switch( chunk.type ) {
+		case DATA_CHUNK_BUFFER:
+			FileWorker_Send( proc.fd, WORKER_MSG_BUFFER, 0,
+					 job->tag, chunk.data, chunk.size );
+			break;
+		case DATA_CHUNK_IMAGE:
+			FileWorker_SendImage( job, WORKER_MSG_IMAGE,
+					      chunk.image );
+			break;
+		case DATA_CHUNK_THUMB:
+			FileWorker_SendImage( job, WORKER_MSG_THUMB,
+					      chunk.thumb );
+			break;
+		default: break;
+		}
+		FileStreamChunk_Destroy( &chunk );
+	}
+	if( !wres.listing ) {
+		FileWorker_Send( proc.fd, WORKER_MSG_RESPONSE, 0, job->tag,
+				 &wres, sizeof( wres ) );
+	}
+	FileWorker_Send( proc.fd, WORKER_MSG_END, 0, job->tag, NULL, 0 );
+	LCUIMutex_Lock( &proc.mutex );
+	LinkedList_Unlink( &proc.jobs, &job->node );
+	LCUIMutex_Unlock( &proc.mutex );
+	free( job->paths );
+	free( job->data );
+	free( job );
+}
+
+static void FileWorker_HandleRequest( const FileWorkerMessage *msg,
+				      const char *buf, int memfd )
+{
+	size_t i, size;
+	unsigned int id;
+	wchar_t *p, *end;
+	FileWorkerJob job;
+	FileClient client;
+	FileWorkerRequest *wreq;
+	FileRequest request = { 0 };
+	FileRequestHandler handler;
+	FileRequestParams *params = &request.params;
+
+	job = NEW( FileWorkerJobRec, 1 );
+	job->tag = msg->tag;
+	job->data = FileWorker_TakeData( msg, buf, memfd, &size );
+	if( !job->data || size < sizeof( FileWorkerRequest ) ) {
+		goto failed;
+	}
+	wreq = (FileWorkerRequest*)job->data;
+	job->method = request.method = wreq->method;
+	request.priority = wreq->priority;
+	wcsncpy( request.path, wreq->path, 255 );
+	params->filter = wreq->filter;
+	params->with_file_status = wreq->with_file_status;
+	params->get_thumbnail = wreq->get_thumbnail;
+	params->with_image_status = wreq->with_image_status;
+	params->width = wreq->width;
+	params->height = wreq->height;
+	if( wreq->with_progress ) {
+		params->progress = FileWorker_OnProgress;
+		params->progress_arg = job;
+	}
+	if( wreq->n_paths > 0 ) {
+		job->paths = NEW( wchar_t*, wreq->n_paths );
+		if( !job->paths ) {
+			goto failed;
+		}
+		p = (wchar_t*)(wreq + 1);
+		end = (wchar_t*)(job->data + size);
+		for( i = 0; i < wreq->n_paths && p < end; ++i ) {
+			job->paths[i] = p;
+			p += wcsnlen( p, end - p ) + 1;
+		}
+		if( p > end ) {
+			goto failed;
+		}
+		params->paths = job->paths;
+		params->n_paths = i;
+	}
+	handler.callback = FileWorker_OnResponse;
+	handler.data = job;
+	LCUIMutex_Lock( &proc.mutex );
+	client = FileWorker_GetClient( msg->conn );
+	if( !client ) {
+		LCUIMutex_Unlock( &proc.mutex );
+		goto failed;
+	}
+	job->client = client;
+	job->node.data = job;
+	LinkedList_AppendNode( &proc.jobs, &job->node );
+	LCUIMutex_Unlock( &proc.mutex );
+	id = FileClient_SendRequest( client, &request, &handler );
+	/* 请求可能已经处理完，需要确认它还在列表中 */
+	LCUIMutex_Lock( &proc.mutex );
+	if( FileWorker_FindJob( msg->tag ) == job ) {
+		job->id = id;
+		/* 补上在此之前收到的取消 */
+		if( job->canceled ) {
+			FileClient_CancelRequest( client, id );
+		}
+	}
+	LCUIMutex_Unlock( &proc.mutex );
+	return;
+
+failed:
+	FileWorker_Send( proc.fd, WORKER_MSG_END, 0, msg->tag, NULL, 0 );
+	free( job->paths );
+	free( job->data );
+	free( job );
+}
+
+static void FileWorker_CancelJob( uint32_t tag )
+{
+	FileWorkerJob job;
+
+	LCUIMutex_Lock( &proc.mutex );
+	job = FileWorker_FindJob( tag );
+	if( job ) {
+		if( job->id ) {
+			FileClient_CancelRequest( job->client, job->id );
+		} else {
+			job->canceled = TRUE;
+		}
+	}
+	LCUIMutex_Unlock( &proc.mutex );
+}
+
+/** 标记连接对应的客户端为待关闭，并取消它上面还没结束的请求 */
+static void FileWorker_CloseClient( uint32_t conn )
+{
+	FileWorkerJob job;
+	LinkedListNode *node;
+	FileWorkerClient wclient = NULL;
+
+	LCUIMutex_Lock( &proc.mutex );
+	for( LinkedList_Each( node, &proc.clients ) ) {
+		wclient = node->data;
+		if( wclient->conn == conn && !wclient->closing ) {
+			break;
+		}
+		wclient = NULL;
+	}
+	if( wclient ) {
+		wclient->closing = TRUE;
+		for( LinkedList_Each( node, &proc.jobs ) ) {
+			job = node->data;
+			if( job->client != wclient->client ) {
+				continue;
+			}
+			if( job->id ) {
+				FileClient_CancelRequest( job->client,
+							  job->id );
+			} else {
+				job->canceled = TRUE;
+			}
+		}
+	}
+	LCUIMutex_Unlock( &proc.mutex );
+}
+
+/** 关闭已经没有请求的待关闭客户端，响应在客户端线程中回调，不能在那里关闭 */
+static void FileWorker_ReleaseClients( void )
+{
+	LCUI_BOOL busy;
+	LinkedList clients;
+	LinkedListNode *node, *prev, *job_node;
+	FileWorkerClient wclient;
+	FileWorkerJob job;
+
+	LinkedList_Init( &clients );
+	LCUIMutex_Lock( &proc.mutex );
+	for( LinkedList_Each( node, &proc.clients ) ) {
+		wclient = node->data;
+		if( !wclient->closing ) {
+			continue;
+		}
+		busy = FALSE;
+		for( LinkedList_Each( job_node, &proc.jobs ) ) {
+			job = job_node->data;
+			if( job->client == wclient->client ) {
+				busy = TRUE;
+				break;
+			}
+		}
+		if( busy ) {
+			continue;
+		}
+		prev = node->prev;
+		LinkedList_Unlink( &proc.clients, node );
+		LinkedList_AppendNode( &clients, node );
+		node = prev;
+	}
+	LCUIMutex_Unlock( &proc.mutex );
+	/* 关闭客户端要等待它的线程退出，不能占用锁 */
+	for( LinkedList_Each( node, &clients ) ) {
+		wclient = node->data;
+		FileClient_Close( wclient->client );
+	}
+	LinkedList_ClearData( &clients, free );
+}
+
+int FileWorker_Run( int fd )
+{
+	int memfd;
+	char *buf;
+	LinkedListNode *node;
+	FileWorkerMessage msg;
+	FileWorkerClient wclient;
+
+	buf = malloc( FILE_WORKER_INLINE_SIZE );
+	if( !buf ) {
+		return -ENOMEM;
+	}
+	proc.fd = fd;
+	LinkedList_Init( &proc.jobs );
+	LinkedList_Init( &proc.clients );
+	LCUIMutex_Init( &proc.mutex );
+	FileService_Init();
+	FileService_RunAsync();
+	while( FileWorker_Recv( fd, &msg, buf, &memfd ) == 0 ) {
+		switch( msg.type ) {
+		case WORKER_MSG_REQUEST:
+			FileWorker_HandleRequest( &msg, buf, memfd );
+			break;
+		case WORKER_MSG_CANCEL:
+			FileWorker_CancelJob( msg.tag );
+			break;
+		case WORKER_MSG_CLOSE:
+			FileWorker_CloseClient( msg.conn );
+			break;
+		default: break;
+		}
+		if( memfd >= 0 ) {
+			close( memfd );
+		}
+		FileWorker_ReleaseClients();
+	}
+	for( LinkedList_Each( node, &proc.clients ) ) {
+		wclient = node->data;
+		FileClient_Close( wclient->client );
+	}
+	LinkedList_ClearData( &proc.clients, free );
+	FileService_Close();
+	close( fd );
+	free( buf );
+	return 0;
+}
+
+#else
+
+int FileWorker_Launch( int count )
+{
+	return -1;
+}
+
+int FileWorker_LaunchFromEnv( void )
+{
+	return -1;
+}
+
+void FileWorker_Shutdown( void )
+{
+}
+
+int FileWorker_Run( int fd )
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,875 @@
+﻿/* ***************************************************************************
+ * image_loader.c -- reduced-size image decoding.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_loader.c -- 以缩小的尺寸解码图片。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "image_loader.h"
+
+#ifdef USE_LIBJPEG
+#include <jpeglib.h>
+#endif
+#ifdef USE_LIBPNG
+#include <png.h>
+#endif
+
+/** PNG 图片最多缩小的倍数，保证累加像素值时不会溢出 */
+#define IMAGE_LOADER_PNG_MAX_FACTOR 256
+/** JPEG 文件头中最多记录的内嵌预览图数量 */
+#define IMAGE_LOADER_MAX_PREVIEWS 4
+/** 查找 JPEG 帧头时最多跳过的段数 */
+#define IMAGE_LOADER_MAX_SEGMENTS 64
+/** 内嵌预览图的最大字节数 */
+#define IMAGE_LOADER_MAX_PREVIEW_SIZE (16 * 1024 * 1024)
+
+#if defined(USE_LIBJPEG) || defined(USE_LIBPNG)
+
+/** 计算在不小于要求的尺寸的前提下，图片最多可以缩小多少倍 */
+static unsigned int ImageLoader_GetFactor( unsigned int src_width,
+					   unsigned int src_height,
+					   unsigned int width,
+					   unsigned int height,
+					   unsigned int max_factor )
+{
+	unsigned int factor = max_factor;
+	if( width > 0 ) {
+		factor = min( factor, src_width / width );
+	}
+	if( height > 0 ) {
+		factor = min( factor, src_height / height );
+	}
+	return factor < 1 ? 1 : factor;
+}
+
+#endif
+
+#ifdef USE_LIBJPEG
+
+#define JPEG_MARKER_SOI		0xD8
+#define JPEG_MARKER_EOI		0xD9
+#define JPEG_MARKER_SOS		0xDA
+#define JPEG_MARKER_APP1	0xE1
+#define JPEG_MARKER_APP2	0xE2
+
+#define TIFF_TYPE_SHORT			3
+#define EXIF_TAG_ORIENTATION		0x0112
+#define EXIF_TAG_THUMBNAIL_OFFSET	0x0201
+#define EXIF_TAG_THUMBNAIL_LENGTH	0x0202
+#define MPF_TAG_ENTRY			0xB002
+#define MPF_ENTRY_SIZE			16
+
+/** JPEG 文件中的一个图像 */
+typedef struct JpegRegionRec_ {
+	long offset;			/**< 在文件中的位置 */
+	long length;			/**< 数据长度 */
+	unsigned int width;		/**< 宽度 */
+	unsigned int height;		/**< 高度 */
+} JpegRegionRec, *JpegRegion;
+
+/** 从 JPEG 文件头中读取的信息 */
+typedef struct JpegInfoRec_ {
+	JpegRegionRec image;		/**< 主图像 */
+	int orientation;		/**< EXIF 方向标记，取值范围为 1 ~ 8 */
+	size_t n_previews;		/**< 内嵌预览图的数量 */
+	JpegRegionRec previews[IMAGE_LOADER_MAX_PREVIEWS];
+} JpegInfoRec, *JpegInfo;
+
+/** TIFF 结构的数据，EXIF 和 MPF 都使用这种结构 */
+typedef struct TiffDataRec_ {
+	const uchar_t *data;
+	size_t size;
+	LCUI_BOOL little_endian;
+} TiffDataRec, *TiffData;
+
+typedef struct JpegErrorRec_ {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+} JpegErrorRec;
+
+typedef struct JpegProgressRec_ {
+	struct jpeg_progress_mgr pub;
+	ImageLoader loader;
+	JpegErrorRec *error;
+} JpegProgressRec;
+
+static void Jpeg_OnError( j_common_ptr cinfo )
+{
+	JpegErrorRec *err = (JpegErrorRec*)cinfo->err;
+	longjmp( err->env, 1 );
+}
+
+static void Jpeg_OnMessage( j_common_ptr cinfo )
+{
+	/* 不输出警告信息 */
+}
+
+static void Jpeg_OnProgress( j_common_ptr cinfo )
+{
+	float progress;
+	JpegProgressRec *prog = (JpegProgressRec*)cinfo->progress;
+	struct jpeg_progress_mgr *mgr = &prog->pub;
+	ImageLoader loader = prog->loader;
+
+	if( !loader->progress || mgr->pass_limit < 1 ||
+	    mgr->total_passes < 1 ) {
+		return;
+	}
+	progress = mgr->completed_passes +
+		1.0f * mgr->pass_counter / mgr->pass_limit;
+	progress = progress * 100.0f / mgr->total_passes;
+	if( !loader->progress( loader->progress_arg, progress ) ) {
+		longjmp( prog->error->env, 2 );
+	}
+}
+
+/** 读取一个大端序的 16 位整数 */
+static int Jpeg_ReadU16( FILE *fp, unsigned int *value )
+{
+	int high = fgetc( fp );
+	int low = fgetc( fp );
+	if( high == EOF || low == EOF ) {
+		return -1;
+	}
+	*value = (unsigned int)(high << 8 | low);
+	return 0;
+}
+
+static int Tiff_Init( TiffData tiff, const uchar_t *data, size_t size )
+{
+	if( size < 8 ) {
+		return -1;
+	}
+	if( data[0] == 'I' && data[1] == 'I' ) {
+		tiff->little_endian = TRUE;
+	} else if( data[0] == 'M' && data[1] == 'M' ) {
+		tiff->little_endian = FALSE;
+	} else {
+		return -1;
+	}
+	tiff->data = data;
+	tiff->size = size;
+	return 0;
+}
+
+/** 读取 16 位整数，越界时返回 0 */
+static unsigned int Tiff_GetU16( TiffData tiff, size_t offset )
+{
+	const uchar_t *p = tiff->data + offset;
+	if( offset > tiff->size || tiff->size - offset < 2 ) {
+		return 0;
+	}
+	if( tiff->little_endian ) {
+		return p[0] | p[1] << 8;
+	}
+	return p[0] << 8 | p[1];
+}
+
+/** 读取 32 位整数，越界时返回 0 */
+static unsigned int Tiff_GetU32( TiffData tiff, size_t offset )
+{
+	const uchar_t *p = tiff->data + offset;
+	if( offset > tiff->size || tiff->size - offset < 4 ) {
+		return 0;
+	}
+	if( tiff->little_endian ) {
+		return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+	}
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/** 读取 IFD 条目的值，只支持 SHORT 和 LONG 类型的单个值 */
+static unsigned int Tiff_GetValue( TiffData tiff, size_t entry )
+{
+	if( Tiff_GetU16( tiff, entry + 2 ) == TIFF_TYPE_SHORT ) {
+		return Tiff_GetU16( tiff, entry + 8 );
+	}
+	return Tiff_GetU32( tiff, entry + 8 );
+}
+
+/** 在 IFD 中查找标签，返回条目的偏移量，找不到时返回 0 */
+static size_t Tiff_FindTag( TiffData tiff, size_t ifd, unsigned int tag )
+{
+	size_t entry;
+	unsigned int i, n;
+
+	if( ifd < 8 ) {
+		return 0;
+	}
+	n = Tiff_GetU16( tiff, ifd );
+	for( i = 0; i < n; ++i ) {
+		entry = ifd + 2 + i * 12;
+		if( entry + 12 > tiff->size ) {
+			break;
+		}
+		if( Tiff_GetU16( tiff, entry ) == tag ) {
+			return entry;
+		}
+	}
+	return 0;
+}
+
+static size_t Tiff_GetNextIFD( TiffData tiff, size_t ifd )
+{
+	if( ifd < 8 ) {
+		return 0;
+	}
+	return Tiff_GetU32( tiff, ifd + 2 + Tiff_GetU16( tiff, ifd ) * 12 );
+}
+
+static void Jpeg_AddPreview( JpegInfo info, long offset, long length )
+{
+	JpegRegion region;
+
+	if( info->n_previews >= IMAGE_LOADER_MAX_PREVIEWS ) {
+		return;
+	}
+	region = &info->previews[info->n_previews++];
+	region->offset = offset;
+	region->length = length;
+	region->width = 0;
+	region->height = 0;
+}
+
+/**
+ * 解析 APP1 段中的 EXIF 数据
+ * 方向标记在 IFD0 中，缩略图的位置在 IFD1 中，偏移量都相对于 TIFF 头，
+ * base 是 TIFF 头在文件中的位置。
+ */
+static void Jpeg_ParseExif( JpegInfo info, const uchar_t *data,
+			    size_t size, long base )
+{
+	TiffDataRec tiff;
+	size_t ifd, entry;
+	unsigned int offset, length;
+
+	if( Tiff_Init( &tiff, data, size ) != 0 ) {
+		return;
+	}
+	ifd = Tiff_GetU32( &tiff, 4 );
+	entry = Tiff_FindTag( &tiff, ifd, EXIF_TAG_ORIENTATION );
+	if( entry ) {
+		offset = Tiff_GetValue( &tiff, entry );
+		if( offset >= 1 && offset <= 8 ) {
+			info->orientation = offset;
+		}
+	}
+	ifd = Tiff_GetNextIFD( &tiff, ifd );
+	entry = Tiff_FindTag( &tiff, ifd, EXIF_TAG_THUMBNAIL_OFFSET );
+	if( !entry ) {
+		return;
+	}
+	offset = Tiff_GetValue( &tiff, entry );
+	entry = Tiff_FindTag( &tiff, ifd, EXIF_TAG_THUMBNAIL_LENGTH );
+	if( !entry ) {
+		return;
+	}
+	length = Tiff_GetValue( &tiff, entry );
+	/* 缩略图的数据必须在 APP1 段内 */
+	if( offset < 8 || length < 4 || offset >= size ||
+	    length > size - offset ) {
+		return;
+	}
+	Jpeg_AddPreview( info, base + offset, length );
+}
+
+/**
+ * 解析 APP2 段中的 MPF（多图格式）数据
+ * MP 条目列出了文件中的各个图像，第一个是主图像，其余的通常是更大的预览图，
+ * 它们的偏移量相对于 MPF 的 TIFF 头。
+ */
+static void Jpeg_ParseMpf( JpegInfo info, const uchar_t *data,
+			   size_t size, long base )
+{
+	TiffDataRec tiff;
+	size_t ifd, entry, pos;
+	unsigned int i, count, offset, length;
+
+	if( Tiff_Init( &tiff, data, size ) != 0 ) {
+		return;
+	}
+	ifd = Tiff_GetU32( &tiff, 4 );
+	entry = Tiff_FindTag( &tiff, ifd, MPF_TAG_ENTRY );
+	if( !entry ) {
+		return;
+	}
+	count = Tiff_GetU32( &tiff, entry + 4 );
+	pos = Tiff_GetU32( &tiff, entry + 8 );
+	for( i = MPF_ENTRY_SIZE; i + MPF_ENTRY_SIZE <= count;
+	     i += MPF_ENTRY_SIZE ) {
+		length = Tiff_GetU32( &tiff, pos + i + 4 );
+		offset = Tiff_GetU32( &tiff, pos + i + 8 );
+		if( offset > 0 && length > 0 ) {
+			Jpeg_AddPreview( info, base + offset, length );
+		}
+	}
+}
+
+/**
+ * 读取 JPEG 文件头
+ * 从 offset 处开始逐段跳过，直到帧头（SOF）为止，只读取各段的长度和帧头中的
+ * 尺寸，尺寸存入 region。info 不为 NULL 时还会解析 APP1 和 APP2 段中的 EXIF
+ * 和 MPF 数据。
+ */
+static int Jpeg_ReadHeader( FILE *fp, long offset,
+			    JpegRegion region, JpegInfo info )
+{
+	long pos;
+	int marker;
+	uchar_t *data;
+	unsigned int i, length;
+
+	if( fseek( fp, offset, SEEK_SET ) != 0 ||
+	    fgetc( fp ) != 0xFF || fgetc( fp ) != JPEG_MARKER_SOI ) {
+		return -1;
+	}
+	for( i = 0; i < IMAGE_LOADER_MAX_SEGMENTS; ++i ) {
+		if( fgetc( fp ) != 0xFF ) {
+			return -1;
+		}
+		/* 标记前可以有多个用于填充的 0xFF */
+		do {
+			marker = fgetc( fp );
+		} while( marker == 0xFF );
+		if( marker == EOF || marker == JPEG_MARKER_SOS ||
+		    marker == JPEG_MARKER_EOI ) {
+			return -1;
+		}
+		/* TEM 和 RSTn 标记没有长度字段 */
+		if( marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7) ) {
+			continue;
+		}
+		if( Jpeg_ReadU16( fp, &length ) != 0 || length < 2 ) {
+			return -1;
+		}
+		length -= 2;
+		pos = ftell( fp );
+		/* SOF0 ~ SOF15，其中 0xC4、0xC8、0xCC 是其它用途的标记 */
+		if( marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+		    marker != 0xC8 && marker != 0xCC ) {
+			if( fgetc( fp ) == EOF ||
+			    Jpeg_ReadU16( fp, &region->height ) != 0 ||
+			    Jpeg_ReadU16( fp, &region->width ) != 0 ||
+			    region->width < 1 || region->height < 1 ) {
+				return -1;
+			}
+			return 0;
+		}
+		if( info && (marker == JPEG_MARKER_APP1 ||
+			     marker == JPEG_MARKER_APP2) ) {
+			data = malloc( length );
+			if( data && fread( data, 1, length, fp ) == length ) {
+				if( marker == JPEG_MARKER_APP1 && length > 6 &&
+				    memcmp( data, "Exif\0\0", 6 ) == 0 ) {
+					Jpeg_ParseExif( info, data + 6,
+							length - 6, pos + 6 );
+				} else if( marker == JPEG_MARKER_APP2 &&
+					   length > 4 &&
+					   memcmp( data, "MPF\0", 4 ) == 0 ) {
+					Jpeg_ParseMpf( info, data + 4,
+						       length - 4, pos + 4 );
+				}
+			}
+			free( data );
+		}
+		if( fseek( fp, pos + length, SEEK_SET ) != 0 ) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+static void JpegMem_InitSource( j_decompress_ptr cinfo )
+{
+}
+
+static boolean JpegMem_FillInput( j_decompress_ptr cinfo )
+{
+	/* 数据不完整时补上结束标记，让解码器输出已有的部分 */
+	static const JOCTET eoi[2] = { 0xFF, JPEG_MARKER_EOI };
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+static void JpegMem_SkipInput( j_decompress_ptr cinfo, long n )
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if( n <= 0 ) {
+		return;
+	}
+	if( (size_t)n > src->bytes_in_buffer ) {
+		JpegMem_FillInput( cinfo );
+		return;
+	}
+	src->next_input_byte += n;
+	src->bytes_in_buffer -= n;
+}
+
+static void JpegMem_TermSource( j_decompress_ptr cinfo )
+{
+}
+
+/** 取不超过缩小倍数的 2 的幂，1/8 是 libjpeg 支持的最小缩放比例 */
+static unsigned int Jpeg_GetScaleDenom( unsigned int factor )
+{
+	return factor >= 8 ? 8 : factor >= 4 ? 4 : factor >= 2 ? 2 : 1;
+}
+
+/**
+ * 解码 JPEG 图像，利用 libjpeg 的缩放解码，只做缩小后的尺寸所需的 IDCT
+ * data 为 NULL 时从文件中读取，否则从内存中读取。
+ */
+static int ImageLoader_DecodeJpeg( ImageLoader loader, const JOCTET *data,
+				   size_t size, unsigned int factor,
+				   LCUI_Graph *out )
+{
+	int ret;
+	JSAMPROW row;
+	uchar_t *src, *dst;
+	unsigned int x, y;
+	JSAMPLE *volatile buffer = NULL;
+	JpegErrorRec err;
+	JpegProgressRec prog;
+	struct jpeg_source_mgr mem;
+	struct jpeg_decompress_struct cinfo;
+
+	cinfo.err = jpeg_std_error( &err.pub );
+	err.pub.error_exit = Jpeg_OnError;
+	err.pub.output_message = Jpeg_OnMessage;
+	ret = setjmp( err.env );
+	if( ret != 0 ) {
+		jpeg_destroy_decompress( &cinfo );
+		free( buffer );
+		Graph_Free( out );
+		return ret == 2 ? -ECANCELED : -1;
+	}
+	jpeg_create_decompress( &cinfo );
+	if( data ) {
+		mem.next_input_byte = data;
+		mem.bytes_in_buffer = size;
+		mem.init_source = JpegMem_InitSource;
+		mem.fill_input_buffer = JpegMem_FillInput;
+		mem.skip_input_data = JpegMem_SkipInput;
+		mem.resync_to_restart = jpeg_resync_to_restart;
+		mem.term_source = JpegMem_TermSource;
+		cinfo.src = &mem;
+	} else {
+		jpeg_stdio_src( &cinfo, loader->fp );
+	}
+	jpeg_read_header( &cinfo, TRUE );
+	/* CMYK 等格式交给通用的读取器处理 */
+	if( cinfo.num_components != 1 && cinfo.num_components != 3 ) {
+		jpeg_destroy_decompress( &cinfo );
+		return -ENOTSUP;
+	}
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = Jpeg_GetScaleDenom( factor );
+	if( cinfo.num_components == 1 ) {
+		cinfo.out_color_space = JCS_GRAYSCALE;
+	} else {
+		cinfo.out_color_space = JCS_RGB;
+	}
+	prog.loader = loader;
+	prog.error = &err;
+	prog.pub.progress_monitor = Jpeg_OnProgress;
+	cinfo.progress = &prog.pub;
+	jpeg_start_decompress( &cinfo );
+	out->color_type = COLOR_TYPE_RGB;
+	if( Graph_Create( out, cinfo.output_width,
+			  cinfo.output_height ) != 0 ) {
+		jpeg_destroy_decompress( &cinfo );
+		return -ENOMEM;
+	}
+	buffer = malloc( cinfo.output_width * cinfo.output_components );
+	if( !buffer ) {
+		jpeg_destroy_decompress( &cinfo );
+		Graph_Free( out );
+		return -ENOMEM;
+	}
+	while( cinfo.output_scanline < cinfo.output_height ) {
+		y = cinfo.output_scanline;
+		row = buffer;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+		src = buffer;
+		dst = out->bytes + y * out->bytes_per_row;
+		/* LCUI 的 RGB 像素在内存中按 B、G、R 的顺序存放 */
+		if( cinfo.output_components == 1 ) {
+			for( x = 0; x < cinfo.output_width; ++x, dst += 3 ) {
+				dst[0] = dst[1] = dst[2] = src[x];
+			}
+			continue;
+		}
+		for( x = 0; x < cinfo.output_width; ++x, dst += 3, src += 3 ) {
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+		}
+	}
+	jpeg_finish_decompress( &cinfo );
+	jpeg_destroy_decompress( &cinfo );
+	free( buffer );
+	return 0;
+}
+
+/** 预览图与主图像的宽高比是否一致，部分相机会生成带黑边的缩略图 */
+static LCUI_BOOL Jpeg_IsSameAspect( JpegRegion a, JpegRegion b )
+{
+	int64_t x = (int64_t)a->width * b->height;
+	int64_t y = (int64_t)a->height * b->width;
+	int64_t diff = x > y ? x - y : y - x;
+	return diff * 50 <= x;
+}
+
+/** 读取内嵌的预览图 */
+static int ImageLoader_ReadJpegPreview( ImageLoader loader,
+					JpegRegion region,
+					unsigned int factor,
+					LCUI_Graph *out )
+{
+	int ret;
+	JOCTET *data;
+
+	if( region->length > IMAGE_LOADER_MAX_PREVIEW_SIZE ||
+	    fseek( loader->fp, region->offset, SEEK_SET ) != 0 ) {
+		return -1;
+	}
+	data = malloc( region->length );
+	if( !data ) {
+		return -ENOMEM;
+	}
+	if( fread( data, 1, region->length, loader->fp ) !=
+	    (size_t)region->length ) {
+		free( data );
+		return -1;
+	}
+	ret = ImageLoader_DecodeJpeg( loader, data, region->length,
+				      factor, out );
+	free( data );
+	return ret;
+}
+
+/**
+ * 读取 JPEG 图片
+ * 先只读取文件头，如果 EXIF 缩略图或 MPF 预览图不小于要求的尺寸，则解码其中
+ * 最小的一个，否则缩放解码主图像。结果会按 EXIF 方向标记转正。
+ */
+static int ImageLoader_ReadJpeg( ImageLoader loader, LCUI_Graph *out )
+{
+	int ret;
+	size_t i;
+	JpegInfoRec info = { 0 };
+	long header_size;
+	JpegRegion region, preview = NULL;
+	unsigned int factor, width = loader->width, height = loader->height;
+
+	info.orientation = 1;
+	if( Jpeg_ReadHeader( loader->fp, 0, &info.image, &info ) != 0 ) {
+		return -ENOTSUP;
+	}
+	header_size = max( ftell( loader->fp ), 0 );
+	loader->src_width = info.image.width;
+	loader->src_height = info.image.height;
+	/* 需要旋转 90 度的图片，要求的宽高对应原图的高宽 */
+	if( info.orientation >= 5 ) {
+		width = loader->height;
+		height = loader->width;
+		loader->src_width = info.image.height;
+		loader->src_height = info.image.width;
+	}
+	for( i = 0; i < info.n_previews; ++i ) {
+		region = &info.previews[i];
+		if( Jpeg_ReadHeader( loader->fp, region->offset,
+				     region, NULL ) != 0 ||
+		    region->width < width || region->height < height ||
+		    !Jpeg_IsSameAspect( region, &info.image ) ) {
+			continue;
+		}
+		if( !preview || region->width < preview->width ) {
+			preview = region;
+		}
+	}
+	ret = -1;
+	if( preview ) {
+		factor = ImageLoader_GetFactor( preview->width, preview->height,
+						width, height, 8 );
+		ret = ImageLoader_ReadJpegPreview( loader, preview,
+						   factor, out );
+		if( ret == -ECANCELED ) {
+			return ret;
+		}
+		/* 只读取了文件头和预览图 */
+		loader->bytes_read = (uint64_t)header_size + preview->length;
+	}
+	/* 预览图不可用时缩放解码主图像，不需要缩小的交给通用的读取器 */
+	if( ret != 0 ) {
+		factor = ImageLoader_GetFactor( info.image.width,
+						info.image.height,
+						width, height, 8 );
+		if( factor < 2 || fseek( loader->fp, 0, SEEK_SET ) != 0 ) {
+			return -ENOTSUP;
+		}
+		ret = ImageLoader_DecodeJpeg( loader, NULL, 0, factor, out );
+		if( ret != 0 ) {
+			return ret;
+		}
+		loader->bytes_read = (uint64_t)max( ftell( loader->fp ), 0 );
+	}
+	ret = ImageLoader_Orient( out, info.orientation );
+	if( ret != 0 ) {
+		Graph_Free( out );
+	}
+	return ret;
+}
+
+#endif
+
+#ifdef USE_LIBPNG
+
+static void Png_OnWarning( png_structp png, png_const_charp msg )
+{
+	/* 不输出警告信息 */
+}
+
+/**
+ * 读取 PNG 图片
+ * 逐行解码，每 factor 行按 factor x factor 的区域取平均值，输出一行缩小后的
+ * 像素，不需要保留整张原图。隔行扫描的图片需要读完所有扫描才能得到完整的行，
+ * 不适用这种方式。
+ */
+static int ImageLoader_ReadPng( ImageLoader loader, LCUI_Graph *out )
+{
+	uchar_t *dst;
+	png_infop info;
+	png_structp png;
+	png_uint_32 width, height;
+	int bit_depth, color_type, interlace;
+	unsigned int x, y, i, c, n, cols, rows, factor, channels;
+	png_bytep volatile row = NULL;
+	png_uint_32 *volatile sums = NULL;
+
+	png = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL,
+				      NULL, Png_OnWarning );
+	if( !png ) {
+		return -1;
+	}
+	info = png_create_info_struct( png );
+	if( !info ) {
+		png_destroy_read_struct( &png, NULL, NULL );
+		return -1;
+	}
+	if( setjmp( png_jmpbuf( png ) ) ) {
+		free( row );
+		free( sums );
+		png_destroy_read_struct( &png, &info, NULL );
+		Graph_Free( out );
+		return -1;
+	}
+	png_init_io( png, loader->fp );
+	png_read_info( png, info );
+	png_get_IHDR( png, info, &width, &height, &bit_depth,
+		      &color_type, &interlace, NULL, NULL );
+	loader->src_width = width;
+	loader->src_height = height;
+	factor = ImageLoader_GetFactor( width, height, loader->width,
+					loader->height,
+					IMAGE_LOADER_PNG_MAX_FACTOR );
+	if( factor < 2 || interlace != PNG_INTERLACE_NONE ) {
+		png_destroy_read_struct( &png, &info, NULL );
+		return -ENOTSUP;
+	}
+	/* 统一转换成 8 位的 BGR 或 BGRA 格式，与 LCUI 的像素格式一致 */
+	if( color_type == PNG_COLOR_TYPE_PALETTE ) {
+		png_set_palette_to_rgb( png );
+	}
+	if( color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8 ) {
+		png_set_expand_gray_1_2_4_to_8( png );
+	}
+	if( png_get_valid( png, info, PNG_INFO_tRNS ) ) {
+		png_set_tRNS_to_alpha( png );
+	}
+	if( bit_depth == 16 ) {
+		png_set_strip_16( png );
+	}
+	if( color_type == PNG_COLOR_TYPE_GRAY ||
+	    color_type == PNG_COLOR_TYPE_GRAY_ALPHA ) {
+		png_set_gray_to_rgb( png );
+	}
+	png_set_bgr( png );
+	png_read_update_info( png, info );
+	channels = png_get_channels( png, info );
+	out->color_type = channels == 4 ? COLOR_TYPE_ARGB : COLOR_TYPE_RGB;
+	if( Graph_Create( out, (width + factor - 1) / factor,
+			  (height + factor - 1) / factor ) != 0 ) {
+		png_destroy_read_struct( &png, &info, NULL );
+		return -ENOMEM;
+	}
+	row = malloc( png_get_rowbytes( png, info ) );
+	sums = calloc( out->width * channels, sizeof( png_uint_32 ) );
+	if( !row || !sums ) {
+		png_longjmp( png, 1 );
+	}
+	for( y = 0; y < height; ++y ) {
+		png_read_row( png, row, NULL );
+		for( x = 0, i = 0; x < width; ++i ) {
+			cols = min( factor, width - x );
+			for( n = 0; n < cols; ++n, ++x ) {
+				for( c = 0; c < channels; ++c ) {
+					sums[i * channels + c] +=
+						row[x * channels + c];
+				}
+			}
+		}
+		if( (y + 1) % factor != 0 && y + 1 < height ) {
+			continue;
+		}
+		rows = y % factor + 1;
+		dst = out->bytes + (y / factor) * out->bytes_per_row;
+		for( i = 0, x = 0; x < width; ++i, x += factor ) {
+			n = min( factor, width - x ) * rows;
+			for( c = 0; c < channels; ++c ) {
+				dst[i * channels + c] = (uchar_t)
+					((sums[i * channels + c] + n / 2) / n);
+			}
+		}
+		memset( sums, 0, out->width * channels * sizeof( png_uint_32 ) );
+		if( loader->progress &&
+		    !loader->progress( loader->progress_arg,
+				       100.0f * (y + 1) / height ) ) {
+			free( row );
+			free( sums );
+			png_destroy_read_struct( &png, &info, NULL );
+			Graph_Free( out );
+			return -ECANCELED;
+		}
+	}
+	free( row );
+	free( sums );
+	png_destroy_read_struct( &png, &info, NULL );
+	loader->bytes_read = (uint64_t)max( ftell( loader->fp ), 0 );
+	return 0;
+}
+
+#endif
+
+int ImageLoader_ReadScaled( ImageLoader loader, LCUI_Graph *out )
+{
+	unsigned char sig[8];
+
+	if( loader->width < 1 && loader->height < 1 ) {
+		return -ENOTSUP;
+	}
+	if( fread( sig, 1, sizeof( sig ), loader->fp ) != sizeof( sig ) ||
+	    fseek( loader->fp, 0, SEEK_SET ) != 0 ) {
+		return -ENOTSUP;
+	}
+#ifdef USE_LIBJPEG
+	if( sig[0] == 0xFF && sig[1] == 0xD8 && sig[2] == 0xFF ) {
+		return ImageLoader_ReadJpeg( loader, out );
+	}
+#endif
+#ifdef USE_LIBPNG
+	if( png_sig_cmp( sig, 0, sizeof( sig ) ) == 0 ) {
+		return ImageLoader_ReadPng( loader, out );
+	}
+#endif
+	return -ENOTSUP;
+}
+
+int ImageLoader_GetOrientation( FILE *fp )
+{
+#ifdef USE_LIBJPEG
+	JpegInfoRec info = { 0 };
+
+	info.orientation = 1;
+	Jpeg_ReadHeader( fp, 0, &info.image, &info );
+	fseek( fp, 0, SEEK_SET );
+	return info.orientation;
+#else
+	return 1;
+#endif
+}
+
+int ImageLoader_Orient( LCUI_Graph *graph, int orientation )
+{
+	int ret;
+	LCUI_Graph buf;
+	uchar_t *src, *dst;
+	unsigned int x, y, dx, dy, w, h, bpp;
+
+	if( orientation < 2 || orientation > 8 ) {
+		return 0;
+	}
+	w = graph->width;
+	h = graph->height;
+	bpp = graph->bytes_per_pixel;
+	Graph_Init( &buf );
+	buf.color_type = graph->color_type;
+	/* 5 ~ 8 需要交换宽高 */
+	if( orientation >= 5 ) {
+		ret = Graph_Create( &buf, h, w );
+	} else {
+		ret = Graph_Create( &buf, w, h );
+	}
+	if( ret != 0 ) {
+		return -ENOMEM;
+	}
+	for( y = 0; y < h; ++y ) {
+		src = graph->bytes + y * graph->bytes_per_row;
+		for( x = 0; x < w; ++x, src += bpp ) {
+			switch( orientation ) {
+			case 2: dx = w - 1 - x; dy = y; break;
+			case 3: dx = w - 1 - x; dy = h - 1 - y; break;
+			case 4: dx = x; dy = h - 1 - y; break;
+			case 5: dx = y; dy = x; break;
+			case 6: dx = h - 1 - y; dy = x; break;
+			case 7: dx = h - 1 - y; dy = w - 1 - x; break;
+			default: dx = y; dy = w - 1 - x; break;
+			}
+			dst = buf.bytes + dy * buf.bytes_per_row + dx * bpp;
+			memcpy( dst, src, bpp );
+		}
+	}
+	Graph_Free( graph );
+	*graph = buf;
+	return 0;
+}
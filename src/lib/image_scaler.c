@@ -0,0 +1,489 @@
+﻿/* ***************************************************************************
+ * image_scaler.c -- image downscaling kernels.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * image_scaler.c -- 图像缩放。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "image_scaler.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_SCALER_X86
+#define IMAGE_SCALER_TARGET(ISA) __attribute__((target(ISA)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define IMAGE_SCALER_X86
+#define IMAGE_SCALER_TARGET(ISA)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+/**
+ * SSE2 实现用浮点乘以倒数代替整数除法，样本数量超过这个值后倒数的精度不够，
+ * 结果会与整数除法相差 1，改用普通实现
+ */
+#define SSE2_REDUCE_MAX_SAMPLES 16384
+
+/** 双线性插值的权重精度（位） */
+#define BILINEAR_SHIFT 8
+#define BILINEAR_ONE (1 << BILINEAR_SHIFT)
+
+/** 区域平均和双线性插值中可以用 SIMD 指令加速的部分 */
+typedef struct ImageScalerKernelRec_ {
+	const char *name;
+	/** 将一行的 count 个字节分别累加到 sums 中 */
+	void( *accumulate )(uint32_t *sums, const uchar_t *row, size_t count);
+	/**
+	 * 将 ARGB 像素的累加值按每 kx 个像素一组求平均值，输出 count 个像素
+	 * n 为每组像素的累加值中包含的样本数量
+	 */
+	void( *reduce_argb )(uchar_t *dst, const uint32_t *sums,
+			      unsigned int count, unsigned int kx,
+			      unsigned int n);
+} ImageScalerKernelRec, *ImageScalerKernel;
+
+static void Scalar_Accumulate( uint32_t *sums, const uchar_t *row,
+			       size_t count )
+{
+	size_t i;
+	for( i = 0; i < count; ++i ) {
+		sums[i] += row[i];
+	}
+}
+
+static void Scalar_ReduceARGB( uchar_t *dst, const uint32_t *sums,
+			       unsigned int count, unsigned int kx,
+			       unsigned int n )
+{
+	unsigned int i, x, c;
+	uint32_t acc[4];
+
+	for( i = 0; i < count; ++i, dst += 4 ) {
+		acc[0] = acc[1] = acc[2] = acc[3] = 0;
+		for( x = 0; x < kx; ++x, sums += 4 ) {
+			for( c = 0; c < 4; ++c ) {
+				acc[c] += sums[c];
+			}
+		}
+		for( c = 0; c < 4; ++c ) {
+			dst[c] = (uchar_t)((acc[c] + n / 2) / n);
+		}
+	}
+}
+
+#ifdef IMAGE_SCALER_X86
+
+IMAGE_SCALER_TARGET( "sse2" )
+static void SSE2_Accumulate( uint32_t *sums, const uchar_t *row,
+			     size_t count )
+{
+	size_t i;
+	__m128i v, lo, hi, zero = _mm_setzero_si128();
+	__m128i *p;
+
+	for( i = 0; i + 16 <= count; i += 16 ) {
+		p = (__m128i*)(sums + i);
+		v = _mm_loadu_si128( (const __m128i*)(row + i) );
+		lo = _mm_unpacklo_epi8( v, zero );
+		hi = _mm_unpackhi_epi8( v, zero );
+		_mm_storeu_si128( p, _mm_add_epi32( _mm_loadu_si128( p ),
+				  _mm_unpacklo_epi16( lo, zero ) ) );
+		_mm_storeu_si128( p + 1, _mm_add_epi32( _mm_loadu_si128( p + 1 ),
+				  _mm_unpackhi_epi16( lo, zero ) ) );
+		_mm_storeu_si128( p + 2, _mm_add_epi32( _mm_loadu_si128( p + 2 ),
+				  _mm_unpacklo_epi16( hi, zero ) ) );
+		_mm_storeu_si128( p + 3, _mm_add_epi32( _mm_loadu_si128( p + 3 ),
+				  _mm_unpackhi_epi16( hi, zero ) ) );
+	}
+	Scalar_Accumulate( sums + i, row + i, count - i );
+}
+
+IMAGE_SCALER_TARGET( "sse2" )
+static void SSE2_ReduceARGB( uchar_t *dst, const uint32_t *sums,
+			     unsigned int count, unsigned int kx,
+			     unsigned int n )
+{
+	int value;
+	unsigned int i, x;
+	__m128i acc;
+	__m128 vinv, vhalf;
+
+	if( n > SSE2_REDUCE_MAX_SAMPLES ) {
+		Scalar_ReduceARGB( dst, sums, count, kx, n );
+		return;
+	}
+	/**
+	 * 与普通实现一样加上样本数量的一半再截断，多加的 0.25 用于抵消浮点
+	 * 乘法的误差，样本数量不超过 SSE2_REDUCE_MAX_SAMPLES 时结果与整数
+	 * 除法完全相同
+	 */
+	vinv = _mm_set1_ps( 1.0f / n );
+	vhalf = _mm_set1_ps( n / 2 + 0.25f );
+	for( i = 0; i < count; ++i, dst += 4 ) {
+		acc = _mm_setzero_si128();
+		for( x = 0; x < kx; ++x, sums += 4 ) {
+			acc = _mm_add_epi32( acc, _mm_loadu_si128(
+				(const __m128i*)sums ) );
+		}
+		acc = _mm_cvttps_epi32( _mm_mul_ps( _mm_add_ps(
+			_mm_cvtepi32_ps( acc ), vhalf ), vinv ) );
+		acc = _mm_packs_epi32( acc, acc );
+		acc = _mm_packus_epi16( acc, acc );
+		value = _mm_cvtsi128_si32( acc );
+		memcpy( dst, &value, 4 );
+	}
+}
+
+IMAGE_SCALER_TARGET( "avx2" )
+static void AVX2_Accumulate( uint32_t *sums, const uchar_t *row,
+			     size_t count )
+{
+	size_t i;
+	__m256i *p;
+	__m256i v;
+
+	for( i = 0; i + 8 <= count; i += 8 ) {
+		p = (__m256i*)(sums + i);
+		v = _mm256_cvtepu8_epi32( _mm_loadl_epi64(
+			(const __m128i*)(row + i) ) );
+		_mm256_storeu_si256( p, _mm256_add_epi32(
+			_mm256_loadu_si256( p ), v ) );
+	}
+	Scalar_Accumulate( sums + i, row + i, count - i );
+}
+
+/** 检测 CPU 和操作系统是否支持 AVX2 */
+static LCUI_BOOL ImageScaler_HasAVX2( void )
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid( info, 0 );
+	if( info[0] < 7 ) {
+		return FALSE;
+	}
+	__cpuid( info, 1 );
+	/* 需要 OSXSAVE 和 AVX，且操作系统保存了 YMM 寄存器的状态 */
+	if( (info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 ||
+	    (_xgetbv( 0 ) & 6) != 6 ) {
+		return FALSE;
+	}
+	__cpuidex( info, 7, 0 );
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+static LCUI_BOOL ImageScaler_HasSSE2( void )
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return TRUE;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid( info, 1 );
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "sse2" );
+#endif
+}
+
+#endif
+
+/** 由 ImageScaler_SetKernel() 指定的实现 */
+static ImageScalerKernelRec forced_kernel;
+static LCUI_BOOL kernel_forced = FALSE;
+
+static ImageScalerKernel ImageScaler_GetKernel( void )
+{
+	static ImageScalerKernelRec kernel;
+	static volatile LCUI_BOOL ready = FALSE;
+
+	if( kernel_forced ) {
+		return &forced_kernel;
+	}
+	if( ready ) {
+		return &kernel;
+	}
+	kernel.name = "scalar";
+	kernel.accumulate = Scalar_Accumulate;
+	kernel.reduce_argb = Scalar_ReduceARGB;
+#ifdef IMAGE_SCALER_X86
+	if( ImageScaler_HasSSE2() ) {
+		kernel.name = "sse2";
+		kernel.accumulate = SSE2_Accumulate;
+		kernel.reduce_argb = SSE2_ReduceARGB;
+		if( ImageScaler_HasAVX2() ) {
+			kernel.name = "avx2";
+			kernel.accumulate = AVX2_Accumulate;
+		}
+	}
+#endif
+	/* 重复检测的结果相同，多个线程同时初始化也没有问题 */
+	ready = TRUE;
+	return &kernel;
+}
+
+const char *ImageScaler_GetKernelName( void )
+{
+	return ImageScaler_GetKernel()->name;
+}
+
+int ImageScaler_SetKernel( const char *name )
+{
+	ImageScalerKernelRec kernel;
+
+	if( !name ) {
+		kernel_forced = FALSE;
+		return 0;
+	}
+	kernel.name = "scalar";
+	kernel.accumulate = Scalar_Accumulate;
+	kernel.reduce_argb = Scalar_ReduceARGB;
+	if( strcmp( name, "scalar" ) == 0 ) {
+		forced_kernel = kernel;
+		kernel_forced = TRUE;
+		return 0;
+	}
+#ifdef IMAGE_SCALER_X86
+	if( !ImageScaler_HasSSE2() ) {
+		return -1;
+	}
+	kernel.name = "sse2";
+	kernel.accumulate = SSE2_Accumulate;
+	kernel.reduce_argb = SSE2_ReduceARGB;
+	if( strcmp( name, "sse2" ) == 0 ) {
+		forced_kernel = kernel;
+		kernel_forced = TRUE;
+		return 0;
+	}
+	if( strcmp( name, "avx2" ) == 0 && ImageScaler_HasAVX2() ) {
+		kernel.name = "avx2";
+		kernel.accumulate = AVX2_Accumulate;
+		forced_kernel = kernel;
+		kernel_forced = TRUE;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/**
+ * 按 kx x ky 的区域取平均值缩小图像
+ * 宽高除不尽时，余下的像素并入最后一列和最后一行的区域。
+ */
+static int ImageScaler_Reduce( ImageScalerKernel kernel,
+			       const LCUI_Graph *src, LCUI_Graph *dst,
+			       unsigned int kx, unsigned int ky )
+{
+	uchar_t *out;
+	uint32_t *sums, acc;
+	unsigned int x, y, i, c, n, rows, cols, last_cols;
+	unsigned int bpp = src->bytes_per_pixel;
+	unsigned int width = src->width / kx;
+	unsigned int height = src->height / ky;
+	size_t count = (size_t)src->width * bpp;
+
+	dst->color_type = src->color_type;
+	if( Graph_Create( dst, width, height ) != 0 ) {
+		return -1;
+	}
+	sums = malloc( count * sizeof( uint32_t ) );
+	if( !sums ) {
+		Graph_Free( dst );
+		return -1;
+	}
+	last_cols = src->width - (width - 1) * kx;
+	for( y = 0; y < height; ++y ) {
+		rows = y + 1 < height ? ky : src->height - y * ky;
+		memset( sums, 0, count * sizeof( uint32_t ) );
+		for( i = 0; i < rows; ++i ) {
+			kernel->accumulate( sums, src->bytes + (size_t)(y * ky +
+					    i) * src->bytes_per_row, count );
+		}
+		out = dst->bytes + (size_t)y * dst->bytes_per_row;
+		n = kx * rows;
+		if( bpp == 4 && width > 1 ) {
+			kernel->reduce_argb( out, sums, width - 1, kx, n );
+			x = width - 1;
+		} else {
+			x = 0;
+		}
+		/* RGB 格式和最后一列用普通的方式计算 */
+		for( ; x < width; ++x ) {
+			cols = x + 1 < width ? kx : last_cols;
+			n = cols * rows;
+			for( c = 0; c < bpp; ++c ) {
+				acc = 0;
+				for( i = 0; i < cols; ++i ) {
+					acc += sums[(x * kx + i) * bpp + c];
+				}
+				out[x * bpp + c] = (uchar_t)((acc + n / 2) / n);
+			}
+		}
+	}
+	free( sums );
+	return 0;
+}
+
+/** 计算双线性插值时各个目标坐标对应的源坐标和权重 */
+static void ImageScaler_InitBilinear( unsigned int *index,
+				      unsigned int *weight,
+				      unsigned int src_size,
+				      unsigned int dst_size )
+{
+	unsigned int i;
+	double pos, scale = 1.0 * src_size / dst_size;
+
+	for( i = 0; i < dst_size; ++i ) {
+		/* 按像素中心对齐 */
+		pos = (i + 0.5) * scale - 0.5;
+		if( pos <= 0 ) {
+			index[i] = 0;
+			weight[i] = 0;
+		} else if( pos >= src_size - 1 ) {
+			index[i] = src_size - 1;
+			weight[i] = 0;
+		} else {
+			index[i] = (unsigned int)pos;
+			weight[i] = (unsigned int)((pos - index[i]) *
+						   BILINEAR_ONE + 0.5);
+		}
+	}
+}
+
+static int ImageScaler_Bilinear( const LCUI_Graph *src, LCUI_Graph *dst,
+				 unsigned int width, unsigned int height )
+{
+	uchar_t *out;
+	const uchar_t *row0, *row1, *p00, *p01, *p10, *p11;
+	unsigned int x, y, c, wx, wy, top, bottom;
+	unsigned int *xi, *xw, *yi, *yw;
+	unsigned int bpp = src->bytes_per_pixel;
+
+	dst->color_type = src->color_type;
+	if( Graph_Create( dst, width, height ) != 0 ) {
+		return -1;
+	}
+	xi = malloc( sizeof( unsigned int ) * (width + height) * 2 );
+	if( !xi ) {
+		Graph_Free( dst );
+		return -1;
+	}
+	xw = xi + width;
+	yi = xw + width;
+	yw = yi + height;
+	ImageScaler_InitBilinear( xi, xw, src->width, width );
+	ImageScaler_InitBilinear( yi, yw, src->height, height );
+	for( y = 0; y < height; ++y ) {
+		wy = yw[y];
+		row0 = src->bytes + (size_t)yi[y] * src->bytes_per_row;
+		row1 = wy > 0 ? row0 + src->bytes_per_row : row0;
+		out = dst->bytes + (size_t)y * dst->bytes_per_row;
+		for( x = 0; x < width; ++x, out += bpp ) {
+			wx = xw[x];
+			p00 = row0 + xi[x] * bpp;
+			p10 = row1 + xi[x] * bpp;
+			p01 = wx > 0 ? p00 + bpp : p00;
+			p11 = wx > 0 ? p10 + bpp : p10;
+			for( c = 0; c < bpp; ++c ) {
+				top = p00[c] * (BILINEAR_ONE - wx) + p01[c] * wx;
+				bottom = p10[c] * (BILINEAR_ONE - wx) +
+					p11[c] * wx;
+				out[c] = (uchar_t)((top * (BILINEAR_ONE - wy) +
+						    bottom * wy +
+						    (1 << (BILINEAR_SHIFT * 2 -
+							   1))) >>
+						   (BILINEAR_SHIFT * 2));
+			}
+		}
+	}
+	free( xi );
+	return 0;
+}
+
+int ImageScaler_Zoom( const LCUI_Graph *src, LCUI_Graph *dst,
+		      LCUI_BOOL keep_scale, int width, int height )
+{
+	int ret;
+	LCUI_Graph tmp;
+	unsigned int kx, ky;
+	double scale_x, scale_y;
+	const LCUI_Graph *mid = src;
+
+	if( !Graph_IsValid( src ) || (width <= 0 && height <= 0) ) {
+		return -1;
+	}
+	if( src->color_type != COLOR_TYPE_RGB &&
+	    src->color_type != COLOR_TYPE_ARGB ) {
+		return Graph_Zoom( src, dst, keep_scale, width, height );
+	}
+	scale_x = width > 0 ? 1.0 * width / src->width : 0;
+	scale_y = height > 0 ? 1.0 * height / src->height : 0;
+	if( width <= 0 ) {
+		scale_x = scale_y;
+	} else if( height <= 0 ) {
+		scale_y = scale_x;
+	} else if( keep_scale ) {
+		scale_x = scale_y = min( scale_x, scale_y );
+	}
+	width = max( 1, (int)(src->width * scale_x + 0.5) );
+	height = max( 1, (int)(src->height * scale_y + 0.5) );
+	/* 先按整数倍的区域取平均值，让剩下的缩放比例不超过 2 倍 */
+	kx = max( 1, src->width / width );
+	ky = max( 1, src->height / height );
+	Graph_Init( &tmp );
+	if( kx > 1 || ky > 1 ) {
+		/* 整数倍缩小就能得到目标尺寸时，直接输出到目标图像 */
+		if( src->width / kx == (unsigned)width &&
+		    src->height / ky == (unsigned)height ) {
+			return ImageScaler_Reduce( ImageScaler_GetKernel(),
+						   src, dst, kx, ky );
+		}
+		ret = ImageScaler_Reduce( ImageScaler_GetKernel(),
+					  src, &tmp, kx, ky );
+		if( ret != 0 ) {
+			return ret;
+		}
+		mid = &tmp;
+	}
+	ret = ImageScaler_Bilinear( mid, dst, width, height );
+	Graph_Free( &tmp );
+	return ret;
+}
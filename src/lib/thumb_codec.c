@@ -0,0 +1,481 @@
+﻿/* ***************************************************************************
+ * thumb_codec.c -- thumbnail data codecs.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_codec.c -- 缩略图数据的编解码器。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "thumb_codec.h"
+
+#ifdef USE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xC0
+#define QOI_OP_RGB	0xFE
+#define QOI_OP_RGBA	0xFF
+#define QOI_MASK	0xC0
+#define QOI_HEADER_SIZE	14
+#define QOI_PADDING	8
+#define QOI_HASH(P)	((P.r * 3 + P.g * 5 + P.b * 7 + P.a * 11) % 64)
+
+typedef struct QoiPixelRec_ {
+	uchar_t r, g, b, a;
+} QoiPixelRec;
+
+static const uchar_t qoi_padding[QOI_PADDING] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static int Raw_Encode( const LCUI_Graph *graph, int quality,
+		       uchar_t **data, size_t *size )
+{
+	size_t row_size = graph->width * graph->bytes_per_pixel;
+	uchar_t *dst = malloc( row_size * graph->height + 1 );
+	int y;
+
+	if( !dst ) {
+		return -ENOMEM;
+	}
+	*data = dst;
+	*size = row_size * graph->height;
+	for( y = 0; y < graph->height; ++y, dst += row_size ) {
+		memcpy( dst, graph->bytes + y * graph->bytes_per_row,
+			row_size );
+	}
+	return 0;
+}
+
+static int Raw_Decode( const uchar_t *data, size_t size, LCUI_Graph *graph )
+{
+	size_t row_size = graph->width * graph->bytes_per_pixel;
+	int y;
+
+	if( size != row_size * graph->height ) {
+		return -1;
+	}
+	/* 行之间没有填充时，一次复制全部像素 */
+	if( row_size == graph->bytes_per_row ) {
+		memcpy( graph->bytes, data, size );
+		return 0;
+	}
+	for( y = 0; y < graph->height; ++y, data += row_size ) {
+		memcpy( graph->bytes + y * graph->bytes_per_row,
+			data, row_size );
+	}
+	return 0;
+}
+
+static void Qoi_WriteU32( uchar_t *p, uint32_t value )
+{
+	p[0] = (uchar_t)(value >> 24);
+	p[1] = (uchar_t)(value >> 16);
+	p[2] = (uchar_t)(value >> 8);
+	p[3] = (uchar_t)value;
+}
+
+static uint32_t Qoi_ReadU32( const uchar_t *p )
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**
+ * QOI 编码
+ * 输出标准的 QOI 格式，LCUI 的像素按 B、G、R、A 的顺序存放，读写时需要调换。
+ */
+static int Qoi_Encode( const LCUI_Graph *graph, int quality,
+		       uchar_t **data, size_t *size )
+{
+	size_t n;
+	uchar_t *out;
+	const uchar_t *src;
+	int x, y, run = 0, hash, channels;
+	signed char vr, vg, vb, vg_r, vg_b;
+	QoiPixelRec index[64] = { 0 };
+	QoiPixelRec px = { 0, 0, 0, 255 }, prev = px;
+
+	if( graph->color_type != COLOR_TYPE_RGB &&
+	    graph->color_type != COLOR_TYPE_ARGB ) {
+		return -ENOTSUP;
+	}
+	channels = graph->color_type == COLOR_TYPE_ARGB ? 4 : 3;
+	out = malloc( QOI_HEADER_SIZE + QOI_PADDING +
+		      (size_t)graph->width * graph->height * (channels + 1) );
+	if( !out ) {
+		return -ENOMEM;
+	}
+	memcpy( out, "qoif", 4 );
+	Qoi_WriteU32( out + 4, graph->width );
+	Qoi_WriteU32( out + 8, graph->height );
+	out[12] = (uchar_t)channels;
+	out[13] = 0;
+	n = QOI_HEADER_SIZE;
+	for( y = 0; y < graph->height; ++y ) {
+		src = graph->bytes + y * graph->bytes_per_row;
+		for( x = 0; x < graph->width; ++x, src += channels ) {
+			px.b = src[0];
+			px.g = src[1];
+			px.r = src[2];
+			if( channels == 4 ) {
+				px.a = src[3];
+			}
+			if( px.r == prev.r && px.g == prev.g &&
+			    px.b == prev.b && px.a == prev.a ) {
+				if( ++run == 62 ) {
+					out[n++] = (uchar_t)(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if( run > 0 ) {
+				out[n++] = (uchar_t)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			hash = QOI_HASH( px );
+			if( index[hash].r == px.r && index[hash].g == px.g &&
+			    index[hash].b == px.b && index[hash].a == px.a ) {
+				out[n++] = (uchar_t)(QOI_OP_INDEX | hash);
+				prev = px;
+				continue;
+			}
+			index[hash] = px;
+			if( px.a != prev.a ) {
+				out[n++] = QOI_OP_RGBA;
+				out[n++] = px.r;
+				out[n++] = px.g;
+				out[n++] = px.b;
+				out[n++] = px.a;
+				prev = px;
+				continue;
+			}
+			vr = (signed char)(px.r - prev.r);
+			vg = (signed char)(px.g - prev.g);
+			vb = (signed char)(px.b - prev.b);
+			vg_r = (signed char)(vr - vg);
+			vg_b = (signed char)(vb - vg);
+			if( vr > -3 && vr < 2 && vg > -3 && vg < 2 &&
+			    vb > -3 && vb < 2 ) {
+				out[n++] = (uchar_t)(QOI_OP_DIFF | (vr + 2) << 4 |
+						     (vg + 2) << 2 | (vb + 2));
+			} else if( vg_r > -9 && vg_r < 8 && vg > -33 &&
+				   vg < 32 && vg_b > -9 && vg_b < 8 ) {
+				out[n++] = (uchar_t)(QOI_OP_LUMA | (vg + 32));
+				out[n++] = (uchar_t)((vg_r + 8) << 4 | (vg_b + 8));
+			} else {
+				out[n++] = QOI_OP_RGB;
+				out[n++] = px.r;
+				out[n++] = px.g;
+				out[n++] = px.b;
+			}
+			prev = px;
+		}
+	}
+	if( run > 0 ) {
+		out[n++] = (uchar_t)(QOI_OP_RUN | (run - 1));
+	}
+	memcpy( out + n, qoi_padding, QOI_PADDING );
+	*data = out;
+	*size = n + QOI_PADDING;
+	return 0;
+}
+
+static int Qoi_Decode( const uchar_t *data, size_t size, LCUI_Graph *graph )
+{
+	uchar_t *dst;
+	size_t p, end;
+	int x, y, b1, b2, vg, run = 0, channels;
+	QoiPixelRec index[64] = { 0 };
+	QoiPixelRec px = { 0, 0, 0, 255 };
+
+	channels = graph->color_type == COLOR_TYPE_ARGB ? 4 : 3;
+	if( size < QOI_HEADER_SIZE + QOI_PADDING ||
+	    memcmp( data, "qoif", 4 ) != 0 || data[12] != channels ||
+	    Qoi_ReadU32( data + 4 ) != (uint32_t)graph->width ||
+	    Qoi_ReadU32( data + 8 ) != (uint32_t)graph->height ) {
+		return -1;
+	}
+	p = QOI_HEADER_SIZE;
+	end = size - QOI_PADDING;
+	for( y = 0; y < graph->height; ++y ) {
+		dst = graph->bytes + y * graph->bytes_per_row;
+		for( x = 0; x < graph->width; ++x, dst += channels ) {
+			if( run > 0 ) {
+				--run;
+			} else if( p < end ) {
+				b1 = data[p++];
+				if( b1 == QOI_OP_RGB ) {
+					if( end - p < 3 ) {
+						return -1;
+					}
+					px.r = data[p++];
+					px.g = data[p++];
+					px.b = data[p++];
+				} else if( b1 == QOI_OP_RGBA ) {
+					if( end - p < 4 ) {
+						return -1;
+					}
+					px.r = data[p++];
+					px.g = data[p++];
+					px.b = data[p++];
+					px.a = data[p++];
+				} else if( (b1 & QOI_MASK) == QOI_OP_INDEX ) {
+					px = index[b1];
+				} else if( (b1 & QOI_MASK) == QOI_OP_DIFF ) {
+					px.r += ((b1 >> 4) & 0x03) - 2;
+					px.g += ((b1 >> 2) & 0x03) - 2;
+					px.b += (b1 & 0x03) - 2;
+				} else if( (b1 & QOI_MASK) == QOI_OP_LUMA ) {
+					if( p >= end ) {
+						return -1;
+					}
+					b2 = data[p++];
+					vg = (b1 & 0x3F) - 32;
+					px.r += vg - 8 + ((b2 >> 4) & 0x0F);
+					px.g += vg;
+					px.b += vg - 8 + (b2 & 0x0F);
+				} else {
+					run = b1 & 0x3F;
+				}
+				index[QOI_HASH( px )] = px;
+			} else {
+				return -1;
+			}
+			dst[0] = px.b;
+			dst[1] = px.g;
+			dst[2] = px.r;
+			if( channels == 4 ) {
+				dst[3] = px.a;
+			}
+		}
+	}
+	return 0;
+}
+
+#ifdef USE_LIBJPEG
+
+typedef struct JpegErrorRec_ {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+} JpegErrorRec;
+
+static void Jpeg_OnError( j_common_ptr cinfo )
+{
+	JpegErrorRec *err = (JpegErrorRec*)cinfo->err;
+	longjmp( err->env, 1 );
+}
+
+static void Jpeg_OnMessage( j_common_ptr cinfo )
+{
+	/* 不输出警告信息 */
+}
+
+/**
+ * 将图像压缩到 jpeg_mem_dest() 分配的内存中
+ * 输出缓存由调用者持有，出错时也需要由调用者释放，libjpeg 不会释放它。
+ */
+static int Jpeg_Compress( const LCUI_Graph *graph, int quality,
+			  uchar_t **out, unsigned long *out_size )
+{
+	int x;
+	JSAMPROW row;
+	const uchar_t *src;
+	JpegErrorRec err;
+	JSAMPLE *volatile buffer = NULL;
+	struct jpeg_compress_struct cinfo;
+
+	cinfo.err = jpeg_std_error( &err.pub );
+	err.pub.error_exit = Jpeg_OnError;
+	err.pub.output_message = Jpeg_OnMessage;
+	if( setjmp( err.env ) ) {
+		jpeg_destroy_compress( &cinfo );
+		free( buffer );
+		return -1;
+	}
+	jpeg_create_compress( &cinfo );
+	jpeg_mem_dest( &cinfo, out, out_size );
+	cinfo.image_width = graph->width;
+	cinfo.image_height = graph->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults( &cinfo );
+	jpeg_set_quality( &cinfo, quality, TRUE );
+	buffer = malloc( graph->width * 3 );
+	if( !buffer ) {
+		jpeg_destroy_compress( &cinfo );
+		return -ENOMEM;
+	}
+	jpeg_start_compress( &cinfo, TRUE );
+	while( cinfo.next_scanline < cinfo.image_height ) {
+		src = graph->bytes + cinfo.next_scanline * graph->bytes_per_row;
+		for( x = 0; x < graph->width; ++x, src += 3 ) {
+			buffer[x * 3] = src[2];
+			buffer[x * 3 + 1] = src[1];
+			buffer[x * 3 + 2] = src[0];
+		}
+		row = buffer;
+		jpeg_write_scanlines( &cinfo, &row, 1 );
+	}
+	jpeg_finish_compress( &cinfo );
+	jpeg_destroy_compress( &cinfo );
+	free( buffer );
+	return 0;
+}
+
+static int Jpeg_Encode( const LCUI_Graph *graph, int quality,
+			uchar_t **data, size_t *size )
+{
+	int ret;
+	uchar_t *out = NULL;
+	unsigned long out_size = 0;
+
+	if( graph->color_type != COLOR_TYPE_RGB ) {
+		return -ENOTSUP;
+	}
+	/* setjmp() 位于 Jpeg_Compress() 中，这里的局部变量在出错后仍然有效 */
+	ret = Jpeg_Compress( graph, quality, &out, &out_size );
+	if( ret != 0 ) {
+		free( out );
+		return ret;
+	}
+	/* 压缩完成后才将输出缓存交给调用者 */
+	*data = out;
+	*size = out_size;
+	return 0;
+}
+
+static int Jpeg_Decode( const uchar_t *data, size_t size, LCUI_Graph *graph )
+{
+#ifndef JCS_EXTENSIONS
+	int x;
+	uchar_t *dst;
+#endif
+	JSAMPROW row;
+	JpegErrorRec err;
+	JSAMPLE *volatile buffer = NULL;
+	struct jpeg_decompress_struct cinfo;
+
+	if( graph->color_type != COLOR_TYPE_RGB ) {
+		return -1;
+	}
+	cinfo.err = jpeg_std_error( &err.pub );
+	err.pub.error_exit = Jpeg_OnError;
+	err.pub.output_message = Jpeg_OnMessage;
+	if( setjmp( err.env ) ) {
+		jpeg_destroy_decompress( &cinfo );
+		free( buffer );
+		return -1;
+	}
+	jpeg_create_decompress( &cinfo );
+	jpeg_mem_src( &cinfo, (uchar_t*)data, (unsigned long)size );
+	jpeg_read_header( &cinfo, TRUE );
+#ifdef JCS_EXTENSIONS
+	/* libjpeg-turbo 可以直接输出 BGR 顺序的像素，解码到目标图像中 */
+	cinfo.out_color_space = JCS_EXT_BGR;
+#else
+	cinfo.out_color_space = JCS_RGB;
+#endif
+	jpeg_start_decompress( &cinfo );
+	if( cinfo.output_width != (JDIMENSION)graph->width ||
+	    cinfo.output_height != (JDIMENSION)graph->height ) {
+		jpeg_destroy_decompress( &cinfo );
+		return -1;
+	}
+#ifdef JCS_EXTENSIONS
+	while( cinfo.output_scanline < cinfo.output_height ) {
+		row = graph->bytes +
+			cinfo.output_scanline * graph->bytes_per_row;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+	}
+#else
+	buffer = malloc( graph->width * 3 );
+	if( !buffer ) {
+		jpeg_destroy_decompress( &cinfo );
+		return -ENOMEM;
+	}
+	while( cinfo.output_scanline < cinfo.output_height ) {
+		dst = graph->bytes + cinfo.output_scanline * graph->bytes_per_row;
+		row = buffer;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+		for( x = 0; x < graph->width; ++x, dst += 3 ) {
+			dst[0] = buffer[x * 3 + 2];
+			dst[1] = buffer[x * 3 + 1];
+			dst[2] = buffer[x * 3];
+		}
+	}
+#endif
+	jpeg_finish_decompress( &cinfo );
+	jpeg_destroy_decompress( &cinfo );
+	free( buffer );
+	return 0;
+}
+
+#endif
+
+static ThumbCodecRec thumb_codecs[THUMB_CODEC_TOTAL] = {
+	{ "raw", Raw_Encode, Raw_Decode },
+	{ "qoi", Qoi_Encode, Qoi_Decode },
+#ifdef USE_LIBJPEG
+	{ "jpeg", Jpeg_Encode, Jpeg_Decode }
+#else
+	{ "jpeg", NULL, NULL }
+#endif
+};
+
+ThumbCodec ThumbCodec_Get( int type )
+{
+	if( type < 0 || type >= THUMB_CODEC_TOTAL ||
+	    !thumb_codecs[type].encode ) {
+		return NULL;
+	}
+	return &thumb_codecs[type];
+}
+
+int ThumbCodec_GetType( const char *name )
+{
+	int i;
+	for( i = 0; i < THUMB_CODEC_TOTAL; ++i ) {
+		if( strcmp( thumb_codecs[i].name, name ) == 0 ) {
+			return i;
+		}
+	}
+	return -1;
+}
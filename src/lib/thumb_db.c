@@ -36,57 +36,794 @@
 
 #define LCFINDER_THUMB_DB_C
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
 #include <LCUI/graph.h>
 #include <LCUI/thread.h>
-#include "unqlite.h"
+#include "build.h"
+#include "common.h"
+#include "xxhash.h"
 #include "thumb_db.h"
+#include "thumb_codec.h"
+#include "image_scaler.h"
 
-typedef struct ThumbDBRec_ {
-	unqlite *db;
-	LCUI_BOOL closed;
-	LCUI_Mutex mutex;
-} ThumbDBRec;
+#ifdef _WIN32
+#include <io.h>
+#include <Windows.h>
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define THUMB_MAX_SIZE 8553600
+/** 数据块标记 */
+#define THUMB_BLOCK_MAGIC 0x4C435442
+#define THUMB_DEFAULT_QUALITY 85
+
+#define THUMB_PACK_MAGIC	"LCTP"
+#define THUMB_INDEX_MAGIC	"LCTI"
+#define THUMB_PACK_VERSION	1
+#define THUMB_RECORD_MAGIC	0x4C435452
+#define THUMB_PACK_FILE		L"thumbs.pack"
+#define THUMB_INDEX_FILE	L"thumbs.idx"
+#define THUMB_TMP_SUFFIX	L".tmp"
+/** 索引的最小槽数量 */
+#define THUMB_INDEX_MIN_CAPACITY 4096
+/** 无效数据超过这个大小且超过包文件的一半时，在后台压缩包文件 */
+#define THUMB_COMPACT_MIN_DEAD_SIZE (32 * 1024 * 1024)
+/** 复制记录时使用的缓冲区大小 */
+#define THUMB_COPY_BUFFER_SIZE (256 * 1024)
+/** 写入队列中积累多少条记录后提交 */
+#define THUMB_COMMIT_COUNT 64
+/** 写入队列中的记录最多等待多久提交，单位为毫秒 */
+#define THUMB_COMMIT_INTERVAL 500
+/** 写入队列的最大长度，超过时保存操作需要等待写入 */
+#define THUMB_QUEUE_MAX_LENGTH (THUMB_COMMIT_COUNT * 4)
+/** 等待生成的缩略图金字塔的最大数量，每个都持有一张未编码的缩略图 */
+#define THUMB_LEVELS_MAX_LENGTH 16
 
 typedef struct ThumbDataBlockRec_ {
+	uint32_t magic;			/**< 数据块标记 */
+	uint32_t codec;			/**< 编码方式 */
 	uint32_t width;
 	uint32_t height;
 	uint32_t origin_width;
 	uint32_t origin_height;
-	uint32_t mem_size;
+	uint32_t data_size;		/**< 编码后的数据长度 */
 	int color_type;
 	uint32_t modify_time;
 } ThumbDataBlockRec, *ThumbDataBlock;
 
-ThumbDB ThumbDB_Open( const char *filepath )
+/** 包文件的头部信息 */
+typedef struct ThumbPackHeaderRec_ {
+	char magic[4];			/**< 标记，固定为 THUMB_PACK_MAGIC */
+	uint32_t version;		/**< 格式版本 */
+	uint64_t reserved;
+} ThumbPackHeaderRec;
+
+/**
+ * 包文件中的记录头
+ * 包文件只追加写入，同一个键的记录被覆盖后，旧的记录成为无效数据，由压缩过程
+ * 清除。记录头之后是数据块。
+ */
+typedef struct ThumbRecordHeaderRec_ {
+	uint32_t magic;			/**< 标记，固定为 THUMB_RECORD_MAGIC */
+	uint32_t size;			/**< 数据块的大小 */
+	uint64_t checksum;		/**< 数据块的 xxHash 校验值 */
+	ThumbKeyRec key;		/**< 键 */
+} ThumbRecordHeaderRec;
+
+/**
+ * 索引文件的头部信息
+ * 索引是开放寻址的哈希表，可以由包文件重建。打开时 clean 被置为 0，正常关闭
+ * 时才置为 1，打开时发现它为 0 说明上次没有正常关闭，索引中的内容不可信。
+ */
+typedef struct ThumbIndexHeaderRec_ {
+	char magic[4];			/**< 标记，固定为 THUMB_INDEX_MAGIC */
+	uint32_t version;		/**< 格式版本 */
+	uint32_t clean;			/**< 是否已正常关闭 */
+	uint32_t capacity;		/**< 槽数量，是 2 的幂 */
+	uint32_t count;			/**< 记录数量 */
+	uint32_t reserved;
+	uint64_t pack_size;		/**< 包文件的大小 */
+	uint64_t dead_size;		/**< 无效数据的大小 */
+} ThumbIndexHeaderRec, *ThumbIndexHeader;
+
+/** 索引中的槽 */
+typedef struct ThumbIndexEntryRec_ {
+	ThumbKeyRec key;		/**< 键 */
+	uint64_t offset;		/**< 记录在包文件中的位置，为 0 时表示空槽 */
+	uint32_t size;			/**< 记录的大小，包括记录头 */
+	uint32_t reserved;
+} ThumbIndexEntryRec, *ThumbIndexEntry;
+
+/** 写入队列中等待提交的记录 */
+typedef struct ThumbPendingRec_ {
+	ThumbKeyRec key;
+	size_t size;
+	ThumbDataBlock block;
+	int refs;			/**< 引用计数，读取时在锁外解码 */
+} ThumbPendingRec, *ThumbPending;
+
+/** 等待写入线程缩小和编码的缩略图金字塔 */
+typedef struct ThumbLevelsTaskRec_ {
+	FileFingerprintRec fp;
+	ThumbDataRec data;		/**< 最大一级的缩略图，归任务所有 */
+} ThumbLevelsTaskRec, *ThumbLevelsTask;
+
+/** 文件的内存映射 */
+typedef struct ThumbMapRec_ {
+	uchar_t *base;
+	size_t size;
+	int refs;			/**< 引用计数，只用于包文件的映射 */
+	LCUI_BOOL retired;		/**< 是否已被新的映射取代 */
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+} ThumbMapRec, *ThumbMap;
+
+typedef struct ThumbDBRec_ {
+	FILE *pack;			/**< 包文件，用于追加记录 */
+	ThumbMap pack_map;		/**< 包文件的只读映射 */
+	ThumbMapRec index_map;		/**< 索引文件的读写映射 */
+	ThumbIndexHeader index;		/**< 索引头部 */
+	ThumbIndexEntry entries;	/**< 索引槽 */
+	wchar_t *pack_path;
+	wchar_t *index_path;
+	int map_refs;			/**< 所有包文件映射的引用总数 */
+	LCUI_BOOL closed;
+	LCUI_BOOL swapping;		/**< 是否正在替换文件 */
+	LCUI_BOOL compacting;		/**< 是否正在压缩 */
+	LCUI_BOOL has_compactor;	/**< 是否有未回收的压缩线程 */
+	LCUI_Thread compactor;
+	LCUI_Cond cond;
+	LCUI_Mutex mutex;
+	/** 写入队列，由写入线程批量提交，读取时优先在队列中查找 */
+	struct {
+		LCUI_BOOL active;
+		LinkedList list;
+		LinkedList levels;		/**< 等待生成的缩略图金字塔 */
+		LCUI_Thread thread;
+		LCUI_Cond cond;
+		LCUI_Mutex mutex;
+	} queue;
+} ThumbDBRec;
+
+/** 缩略图金字塔中各级的最大边长，从小到大排列 */
+static const int thumb_levels[THUMB_LEVEL_COUNT] = { 128, 256, 512 };
+
+/** 保存缩略图时使用的编码方式 */
+static struct ThumbDBCodecSetting {
+	int codec;
+	int quality;
+} thumb_codec = {
+#ifdef USE_LIBJPEG
+	THUMB_CODEC_JPEG,
+#else
+	THUMB_CODEC_QOI,
+#endif
+	THUMB_DEFAULT_QUALITY
+};
+
+int ThumbDB_SetCodec( int codec, int quality )
 {
-	int rc;
-	ThumbDB tdb = malloc( sizeof(ThumbDBRec) );
-	rc = unqlite_open( &tdb->db, filepath, UNQLITE_OPEN_CREATE );
-	if( rc != UNQLITE_OK ) {
-		free( tdb );
+	if( !ThumbCodec_Get( codec ) ) {
+		return -ENOTSUP;
+	}
+	if( quality < 1 || quality > 100 ) {
+		quality = THUMB_DEFAULT_QUALITY;
+	}
+	thumb_codec.codec = codec;
+	thumb_codec.quality = quality;
+	return 0;
+}
+
+int ThumbDB_SetCodecFromEnv( void )
+{
+	int codec;
+	char name[16];
+	const char *value = getenv( THUMB_DB_CODEC_ENV );
+	const char *sep;
+	size_t len;
+
+	if( !value ) {
+		return 0;
+	}
+	sep = strchr( value, ':' );
+	len = sep ? (size_t)(sep - value) : strlen( value );
+	if( len >= sizeof( name ) ) {
+		return -EINVAL;
+	}
+	strncpy( name, value, len );
+	name[len] = 0;
+	codec = ThumbCodec_GetType( name );
+	if( codec < 0 ) {
+		return -EINVAL;
+	}
+	return ThumbDB_SetCodec( codec, sep ? atoi( sep + 1 ) : 0 );
+}
+
+void ThumbKey_Init( ThumbKey key, const FileFingerprint fp,
+		    int width, int height )
+{
+	memset( key, 0, sizeof( ThumbKeyRec ) );
+	key->size = fp->size;
+	key->hash = fp->hash;
+	key->size_class = THUMB_SIZE_CLASS( width, height );
+}
+
+static LCUI_BOOL ThumbKey_Equal( const ThumbKeyRec *a, const ThumbKeyRec *b )
+{
+	return a->size == b->size && a->hash == b->hash &&
+		a->size_class == b->size_class;
+}
+
+static wchar_t *ThumbDB_JoinPath( const wchar_t *dirpath,
+				  const wchar_t *name, const wchar_t *suffix )
+{
+	size_t len = wcslen( dirpath ) + wcslen( name ) + wcslen( suffix ) + 2;
+	wchar_t *path = malloc( sizeof( wchar_t ) * len );
+
+	if( !path ) {
 		return NULL;
 	}
-	rc = unqlite_kv_store( tdb->db, "__program__", -1, "LCFinder", 9 );
-	if( rc != UNQLITE_OK ) {
-		printf( "[thumbdb] cannot open db: %s\n", filepath );
+	wpathjoin( path, dirpath, name );
+	wcscat( path, suffix );
+	return path;
+}
+
+/** 将文件映射到内存，writable 为 TRUE 时以读写方式映射 */
+static int ThumbMap_Open( ThumbMap map, const wchar_t *path,
+			  size_t size, LCUI_BOOL writable )
+{
+#ifdef _WIN32
+	HANDLE file;
+	DWORD access = GENERIC_READ | (writable ? GENERIC_WRITE : 0);
+
+	map->base = NULL;
+	map->mapping = NULL;
+	file = CreateFileW( path, access, FILE_SHARE_READ | FILE_SHARE_WRITE |
+			    FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			    FILE_FLAG_RANDOM_ACCESS, NULL );
+	if( file == INVALID_HANDLE_VALUE ) {
+		return -ENOENT;
+	}
+	map->mapping = CreateFileMappingW( file, NULL, writable ?
+					   PAGE_READWRITE : PAGE_READONLY,
+					   0, 0, NULL );
+	CloseHandle( file );
+	if( !map->mapping ) {
+		return -1;
+	}
+	map->base = MapViewOfFile( map->mapping, writable ? FILE_MAP_WRITE :
+				   FILE_MAP_READ, 0, 0, size );
+	if( !map->base ) {
+		CloseHandle( map->mapping );
+		map->mapping = NULL;
+		return -1;
+	}
+#else
+	int fd;
+	void *base;
+	char *filepath = EncodeUTF8( path );
+
+	map->base = NULL;
+	fd = open( filepath, writable ? O_RDWR : O_RDONLY );
+	free( filepath );
+	if( fd < 0 ) {
+		return -ENOENT;
+	}
+	base = mmap( NULL, size, PROT_READ | (writable ? PROT_WRITE : 0),
+		     MAP_SHARED, fd, 0 );
+	close( fd );
+	if( base == MAP_FAILED ) {
+		return -1;
+	}
+	map->base = base;
+#endif
+	map->size = size;
+	map->refs = 0;
+	map->retired = FALSE;
+	return 0;
+}
+
+static void ThumbMap_Sync( ThumbMap map )
+{
+	if( !map->base ) {
+		return;
+	}
+#ifdef _WIN32
+	FlushViewOfFile( map->base, map->size );
+#else
+	msync( map->base, map->size, MS_SYNC );
+#endif
+}
+
+static void ThumbMap_Close( ThumbMap map )
+{
+	if( !map->base ) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile( map->base );
+	CloseHandle( map->mapping );
+	map->mapping = NULL;
+#else
+	munmap( map->base, map->size );
+#endif
+	map->base = NULL;
+	map->size = 0;
+}
+
+static int ThumbDB_SyncFile( FILE *fp )
+{
+	if( fflush( fp ) != 0 ) {
+		return -1;
+	}
+#ifdef _WIN32
+	return _commit( _fileno( fp ) );
+#else
+	return fsync( fileno( fp ) );
+#endif
+}
+
+static int ThumbDB_TruncateFile( FILE *fp, int64_t size )
+{
+	fflush( fp );
+#ifdef _WIN32
+	return _chsize_s( _fileno( fp ), size );
+#else
+	return ftruncate( fileno( fp ), (off_t)size );
+#endif
+}
+
+/** 按键查找槽，找不到时返回应该插入的空槽 */
+static ThumbIndexEntry ThumbDB_FindSlot( ThumbIndexHeader index,
+					 ThumbIndexEntry entries,
+					 const ThumbKey key )
+{
+	uint32_t mask = index->capacity - 1;
+	uint32_t i = (uint32_t)XXH64( key, sizeof( ThumbKeyRec ), 0 ) & mask;
+
+	while( entries[i].offset != 0 &&
+	       !ThumbKey_Equal( &entries[i].key, key ) ) {
+		i = (i + 1) & mask;
+	}
+	return &entries[i];
+}
+
+/** 在索引中记录一条记录，返回被覆盖的记录的大小 */
+static uint32_t ThumbDB_PutEntry( ThumbIndexHeader index,
+				  ThumbIndexEntry entries, const ThumbKey key,
+				  uint64_t offset, uint32_t size )
+{
+	uint32_t old_size = 0;
+	ThumbIndexEntry entry = ThumbDB_FindSlot( index, entries, key );
+
+	if( entry->offset != 0 ) {
+		old_size = entry->size;
+	} else {
+		index->count += 1;
+	}
+	entry->key = *key;
+	entry->offset = offset;
+	entry->size = size;
+	return old_size;
+}
+
+/** 创建一个空的索引文件，不映射它 */
+static int ThumbDB_CreateIndexFile( const wchar_t *path, uint32_t capacity,
+				    const ThumbIndexHeader src,
+				    const ThumbIndexEntry src_entries )
+{
+	int ret = 0;
+	FILE *fp;
+	uint32_t i;
+	size_t size;
+	ThumbIndexHeaderRec head = { 0 };
+	ThumbIndexEntry entries;
+
+	size = sizeof( ThumbIndexEntryRec ) * capacity;
+	entries = calloc( 1, size );
+	if( !entries ) {
+		return -ENOMEM;
+	}
+	memcpy( head.magic, THUMB_INDEX_MAGIC, sizeof( head.magic ) );
+	head.version = THUMB_PACK_VERSION;
+	head.capacity = capacity;
+	if( src ) {
+		head.clean = src->clean;
+		head.pack_size = src->pack_size;
+		head.dead_size = src->dead_size;
+		for( i = 0; i < src->capacity; ++i ) {
+			if( src_entries[i].offset != 0 ) {
+				ThumbDB_PutEntry( &head, entries,
+						  &src_entries[i].key,
+						  src_entries[i].offset,
+						  src_entries[i].size );
+			}
+		}
+	}
+	fp = wfopen( path, "wb" );
+	if( !fp ) {
+		free( entries );
+		return -1;
+	}
+	if( fwrite( &head, sizeof( head ), 1, fp ) != 1 ||
+	    fwrite( entries, size, 1, fp ) != 1 ||
+	    ThumbDB_SyncFile( fp ) != 0 ) {
+		ret = -1;
+	}
+	fclose( fp );
+	free( entries );
+	return ret;
+}
+
+static int ThumbDB_MapIndex( ThumbDB tdb )
+{
+	ThumbIndexHeaderRec head;
+	FILE *fp = wfopen( tdb->index_path, "rb" );
+
+	if( !fp ) {
+		return -ENOENT;
+	}
+	if( fread( &head, sizeof( head ), 1, fp ) != 1 ) {
+		fclose( fp );
+		return -1;
+	}
+	fclose( fp );
+	if( memcmp( head.magic, THUMB_INDEX_MAGIC, sizeof( head.magic ) ) ||
+	    head.version != THUMB_PACK_VERSION ||
+	    head.capacity < THUMB_INDEX_MIN_CAPACITY ||
+	    (head.capacity & (head.capacity - 1)) != 0 ) {
+		return -1;
+	}
+	if( ThumbMap_Open( &tdb->index_map, tdb->index_path,
+			   sizeof( head ) + sizeof( ThumbIndexEntryRec ) *
+			   head.capacity, TRUE ) != 0 ) {
+		return -1;
+	}
+	tdb->index = (ThumbIndexHeader)tdb->index_map.base;
+	tdb->entries = (ThumbIndexEntry)(tdb->index + 1);
+	return 0;
+}
+
+static void ThumbDB_UnmapIndex( ThumbDB tdb )
+{
+	ThumbMap_Close( &tdb->index_map );
+	tdb->index = NULL;
+	tdb->entries = NULL;
+}
+
+/**
+ * 用新的索引文件替换当前的索引文件
+ * 重命名失败时重新映射旧的索引文件并返回错误。索引文件无法映射时，与压缩
+ * 失败时一样将数据库标记为已关闭，之后的操作都会在 ThumbDB_Lock() 中失败。
+ */
+static int ThumbDB_ReplaceIndex( ThumbDB tdb, const wchar_t *tmppath )
+{
+	int ret = 0;
+
+	ThumbDB_UnmapIndex( tdb );
+	if( wrename( tmppath, tdb->index_path ) != 0 ) {
+		wremove( tmppath );
+		ret = -1;
+	}
+	if( ThumbDB_MapIndex( tdb ) != 0 ) {
+		tdb->closed = TRUE;
+		return -1;
+	}
+	return ret;
+}
+
+/** 扩大索引的容量 */
+static int ThumbDB_GrowIndex( ThumbDB tdb )
+{
+	int ret;
+	wchar_t *tmppath;
+
+	tmppath = ThumbDB_JoinPath( tdb->index_path, L"", THUMB_TMP_SUFFIX );
+	if( !tmppath ) {
+		return -ENOMEM;
+	}
+	ret = ThumbDB_CreateIndexFile( tmppath, tdb->index->capacity * 2,
+				       tdb->index, tdb->entries );
+	if( ret == 0 ) {
+		ret = ThumbDB_ReplaceIndex( tdb, tmppath );
+	}
+	free( tmppath );
+	return ret;
+}
+
+/** 读取并校验一条记录，成功时返回记录的总大小 */
+static int64_t ThumbDB_ReadRecord( FILE *fp, ThumbRecordHeaderRec *head,
+				   uchar_t **buffer, size_t *buffer_size )
+{
+	uchar_t *buf;
+
+	if( fread( head, sizeof( *head ), 1, fp ) != 1 ||
+	    head->magic != THUMB_RECORD_MAGIC ||
+	    head->size > THUMB_MAX_SIZE ) {
+		return -1;
+	}
+	if( head->size > *buffer_size ) {
+		buf = realloc( *buffer, head->size );
+		if( !buf ) {
+			return -ENOMEM;
+		}
+		*buffer = buf;
+		*buffer_size = head->size;
+	}
+	if( fread( *buffer, head->size, 1, fp ) != 1 ||
+	    XXH64( *buffer, head->size, 0 ) != head->checksum ) {
+		return -1;
+	}
+	return sizeof( *head ) + head->size;
+}
+
+/**
+ * 由包文件重建索引
+ * 依次读取包文件中的记录，校验失败的记录及其之后的数据是崩溃时未写完的，
+ * 直接截掉。新的索引先写入临时文件再替换，重建过程中崩溃不会留下损坏的索引。
+ * 内存不足时返回 -ENOMEM，包文件保持原样。
+ */
+static int ThumbDB_RebuildIndex( ThumbDB tdb )
+{
+	int ret;
+	FILE *fp;
+	int64_t offset, size;
+	uint32_t i, capacity;
+	uchar_t *buffer = NULL;
+	size_t buffer_size = 0;
+	wchar_t *tmppath;
+	ThumbRecordHeaderRec head;
+	ThumbIndexHeaderRec index = { 0 };
+	ThumbIndexEntry entries;
+
+	tmppath = ThumbDB_JoinPath( tdb->index_path, L"", THUMB_TMP_SUFFIX );
+	if( !tmppath ) {
+		return -ENOMEM;
+	}
+	capacity = THUMB_INDEX_MIN_CAPACITY;
+	entries = calloc( capacity, sizeof( ThumbIndexEntryRec ) );
+	index.capacity = capacity;
+	fp = tdb->pack;
+	offset = sizeof( ThumbPackHeaderRec );
+	fseeko( fp, offset, SEEK_SET );
+	while( entries ) {
+		size = ThumbDB_ReadRecord( fp, &head, &buffer, &buffer_size );
+		/* 内存不足时记录不一定有问题，放弃重建，不能截断包文件 */
+		if( size == -ENOMEM ) {
+			free( entries );
+			entries = NULL;
+			break;
+		}
+		if( size < 0 ) {
+			break;
+		}
+		/* 负载超过 3/4 时扩大容量 */
+		if( (index.count + 1) * 4 > index.capacity * 3 ) {
+			ThumbIndexHeaderRec old = index;
+			ThumbIndexEntry old_entries = entries;
+			entries = calloc( capacity * 2,
+					  sizeof( ThumbIndexEntryRec ) );
+			if( !entries ) {
+				free( old_entries );
+				break;
+			}
+			capacity *= 2;
+			index.capacity = capacity;
+			index.count = 0;
+			for( i = 0; i < old.capacity; ++i ) {
+				if( old_entries[i].offset ) {
+					ThumbDB_PutEntry( &index, entries,
+							  &old_entries[i].key,
+							  old_entries[i].offset,
+							  old_entries[i].size );
+				}
+			}
+			free( old_entries );
+		}
+		index.dead_size += ThumbDB_PutEntry( &index, entries, &head.key,
+						     offset, (uint32_t)size );
+		offset += size;
+	}
+	free( buffer );
+	if( !entries ) {
+		free( tmppath );
+		return -ENOMEM;
+	}
+	ThumbDB_TruncateFile( fp, offset );
+	index.pack_size = offset;
+	ret = ThumbDB_CreateIndexFile( tmppath, capacity, &index, entries );
+	free( entries );
+	if( ret == 0 ) {
+		ThumbDB_UnmapIndex( tdb );
+		ret = wrename( tmppath, tdb->index_path );
+	}
+	free( tmppath );
+	if( ret != 0 ) {
+		return -1;
+	}
+	return ThumbDB_MapIndex( tdb );
+}
+
+/** 打开包文件，不存在时创建 */
+static FILE *ThumbDB_OpenPack( const wchar_t *path )
+{
+	FILE *fp;
+	ThumbPackHeaderRec head = { 0 };
+
+	fp = wfopen( path, "r+b" );
+	if( fp ) {
+		if( fread( &head, sizeof( head ), 1, fp ) == 1 &&
+		    memcmp( head.magic, THUMB_PACK_MAGIC, 4 ) == 0 &&
+		    head.version == THUMB_PACK_VERSION ) {
+			return fp;
+		}
+		fclose( fp );
+	}
+	fp = wfopen( path, "w+b" );
+	if( !fp ) {
+		return NULL;
+	}
+	memcpy( head.magic, THUMB_PACK_MAGIC, sizeof( head.magic ) );
+	head.version = THUMB_PACK_VERSION;
+	if( fwrite( &head, sizeof( head ), 1, fp ) != 1 ||
+	    ThumbDB_SyncFile( fp ) != 0 ) {
+		fclose( fp );
+		return NULL;
+	}
+	return fp;
+}
+
+/** 打开包文件和索引，索引不可用时重建 */
+static int ThumbDB_OpenFiles( ThumbDB tdb )
+{
+	int64_t size;
+
+	tdb->pack = ThumbDB_OpenPack( tdb->pack_path );
+	if( !tdb->pack ) {
+		return -1;
+	}
+	fseeko( tdb->pack, 0, SEEK_END );
+	size = ftello( tdb->pack );
+	if( ThumbDB_MapIndex( tdb ) != 0 || !tdb->index->clean ||
+	    tdb->index->pack_size != (uint64_t)size ) {
+		ThumbDB_UnmapIndex( tdb );
+		if( ThumbDB_RebuildIndex( tdb ) != 0 ) {
+			fclose( tdb->pack );
+			tdb->pack = NULL;
+			return -1;
+		}
+	}
+	tdb->index->clean = 0;
+	ThumbMap_Sync( &tdb->index_map );
+	return 0;
+}
+
+static void ThumbDB_CloseFiles( ThumbDB tdb )
+{
+	if( tdb->pack_map ) {
+		ThumbMap_Close( tdb->pack_map );
+		free( tdb->pack_map );
+		tdb->pack_map = NULL;
+	}
+	if( tdb->index ) {
+		ThumbDB_SyncFile( tdb->pack );
+		tdb->index->clean = 1;
+		ThumbMap_Sync( &tdb->index_map );
+		ThumbDB_UnmapIndex( tdb );
+	}
+	if( tdb->pack ) {
+		fclose( tdb->pack );
+		tdb->pack = NULL;
+	}
+}
+
+static void ThumbDB_WriterThread( void *arg );
+static void ThumbPending_Delete( void *data );
+static int ThumbDB_BuildLevels( ThumbDB tdb, const FileFingerprint fp,
+				ThumbData data, LCUI_BOOL wait );
+
+ThumbDB ThumbDB_Open( const wchar_t *dirpath )
+{
+	ThumbDB tdb = NEW( ThumbDBRec, 1 );
+
+	if( !tdb ) {
+		return NULL;
+	}
+	tdb->pack_path = ThumbDB_JoinPath( dirpath, THUMB_PACK_FILE, L"" );
+	tdb->index_path = ThumbDB_JoinPath( dirpath, THUMB_INDEX_FILE, L"" );
+	if( !tdb->pack_path || !tdb->index_path ||
+	    ThumbDB_OpenFiles( tdb ) != 0 ) {
+		free( tdb->pack_path );
+		free( tdb->index_path );
+		free( tdb );
+		return NULL;
 	}
 	tdb->closed = FALSE;
+	LCUICond_Init( &tdb->cond );
 	LCUIMutex_Init( &tdb->mutex );
+	LinkedList_Init( &tdb->queue.list );
+	LinkedList_Init( &tdb->queue.levels );
+	LCUICond_Init( &tdb->queue.cond );
+	LCUIMutex_Init( &tdb->queue.mutex );
+	tdb->queue.active = TRUE;
+	if( LCUIThread_Create( &tdb->queue.thread,
+			       ThumbDB_WriterThread, tdb ) != 0 ) {
+		tdb->queue.active = FALSE;
+	}
 	return tdb;
 }
 
+int ThumbDB_Remove( const wchar_t *dirpath )
+{
+	int ret = 0;
+	size_t i;
+	wchar_t *path;
+	const wchar_t *names[2] = { THUMB_PACK_FILE, THUMB_INDEX_FILE };
+
+	for( i = 0; i < 2; ++i ) {
+		path = ThumbDB_JoinPath( dirpath, names[i], L"" );
+		if( !path ) {
+			return -ENOMEM;
+		}
+		if( wremove( path ) != 0 ) {
+			ret = -1;
+		}
+		free( path );
+	}
+	return ret;
+}
+
+/** 等待所有包文件映射的引用被释放 */
+static void ThumbDB_WaitMaps( ThumbDB tdb )
+{
+	while( tdb->map_refs > 0 ) {
+		LCUICond_Wait( &tdb->cond, &tdb->mutex );
+	}
+}
+
 void ThumbDB_Close( ThumbDB tdb )
 {
-	tdb->closed = TRUE;
+	/* 先让写入线程提交队列中剩余的记录 */
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	if( tdb->queue.active ) {
+		tdb->queue.active = FALSE;
+		LCUICond_Broadcast( &tdb->queue.cond );
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		LCUIThread_Join( tdb->queue.thread, NULL );
+	} else {
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+	}
 	LCUIMutex_Lock( &tdb->mutex );
-	unqlite_close( tdb->db );
+	tdb->closed = TRUE;
+	while( tdb->compacting ) {
+		LCUICond_Wait( &tdb->cond, &tdb->mutex );
+	}
+	ThumbDB_WaitMaps( tdb );
+	ThumbDB_CloseFiles( tdb );
 	LCUIMutex_Unlock( &tdb->mutex );
+	if( tdb->has_compactor ) {
+		LCUIThread_Join( tdb->compactor, NULL );
+	}
+	LinkedList_Clear( &tdb->queue.list, ThumbPending_Delete );
+	LCUIMutex_Destroy( &tdb->queue.mutex );
+	LCUICond_Destroy( &tdb->queue.cond );
 	LCUIMutex_Destroy( &tdb->mutex );
+	LCUICond_Destroy( &tdb->cond );
+	free( tdb->pack_path );
+	free( tdb->index_path );
 	free( tdb );
 }
 
@@ -96,7 +833,12 @@ static int ThumbDB_Lock( ThumbDB tdb )
 		return -1;
 	}
 	LCUIMutex_Lock( &tdb->mutex );
+	/* 正在替换文件时，等待替换完成 */
+	while( tdb->swapping && !tdb->closed ) {
+		LCUICond_Wait( &tdb->cond, &tdb->mutex );
+	}
 	if( tdb->closed ) {
+		LCUIMutex_Unlock( &tdb->mutex );
 		return -1;
 	}
 	return 0;
@@ -105,62 +847,977 @@ static int ThumbDB_Lock( ThumbDB tdb )
 #define ThumbDB_Unlock(TDB) LCUIMutex_Unlock( &(TDB)->mutex )
 #define ASSERT(X) if(!(X)) { return -1; }
 
-int ThumbDB_Load( ThumbDB tdb, const char *filepath, ThumbData data )
+/** 获取覆盖 end 之前的内容的包文件映射，并增加它的引用计数 */
+static ThumbMap ThumbDB_RefPackMap( ThumbDB tdb, uint64_t end )
 {
-	int rc;
-	uchar_t *bytes;
-	unqlite_int64 size;
-	ThumbDataBlock block;
+	ThumbMap map = tdb->pack_map;
+
+	if( !map || map->size < end ) {
+		map = NEW( ThumbMapRec, 1 );
+		if( !map ) {
+			return NULL;
+		}
+		fflush( tdb->pack );
+		if( ThumbMap_Open( map, tdb->pack_path,
+				   (size_t)tdb->index->pack_size,
+				   FALSE ) != 0 ) {
+			free( map );
+			return NULL;
+		}
+		/* 旧的映射可能还在被其它线程使用，等引用释放后再关闭 */
+		if( tdb->pack_map ) {
+			tdb->pack_map->retired = TRUE;
+			if( tdb->pack_map->refs == 0 ) {
+				ThumbMap_Close( tdb->pack_map );
+				free( tdb->pack_map );
+			}
+		}
+		tdb->pack_map = map;
+	}
+	map->refs += 1;
+	tdb->map_refs += 1;
+	return map;
+}
+
+static void ThumbDB_UnrefPackMap( ThumbDB tdb, ThumbMap map )
+{
+	LCUIMutex_Lock( &tdb->mutex );
+	map->refs -= 1;
+	tdb->map_refs -= 1;
+	if( map->retired && map->refs == 0 ) {
+		ThumbMap_Close( map );
+		free( map );
+	}
+	if( tdb->map_refs == 0 ) {
+		LCUICond_Broadcast( &tdb->cond );
+	}
+	LCUIMutex_Unlock( &tdb->mutex );
+}
+
+/** 读取数据块，解码在调用者的线程中进行 */
+static int ThumbDB_ReadBlock( const uchar_t *block, size_t size,
+			      ThumbData data )
+{
+	ThumbCodec codec;
+	ThumbDataBlock head = (ThumbDataBlock)block;
+
+	if( size < sizeof( ThumbDataBlockRec ) ||
+	    head->magic != THUMB_BLOCK_MAGIC ) {
+		return -1;
+	}
+	codec = ThumbCodec_Get( head->codec );
+	if( !codec || head->data_size > size - sizeof( ThumbDataBlockRec ) ) {
+		return -1;
+	}
+	Graph_Init( &data->graph );
+	data->graph.color_type = head->color_type;
+	if( Graph_Create( &data->graph, head->width, head->height ) != 0 ) {
+		return -ENOMEM;
+	}
+	if( codec->decode( block + sizeof( ThumbDataBlockRec ),
+			   head->data_size, &data->graph ) != 0 ) {
+		Graph_Free( &data->graph );
+		return -1;
+	}
+	data->modify_time = head->modify_time;
+	data->origin_width = head->origin_width;
+	data->origin_height = head->origin_height;
+	return 0;
+}
+
+/** 释放一个引用，引用计数需要在写入队列的锁内修改 */
+static void ThumbPending_Delete( void *data )
+{
+	ThumbPending item = data;
+	if( --item->refs > 0 ) {
+		return;
+	}
+	free( item->block );
+	free( item );
+}
+
+/** 在写入队列中查找记录，找不到时返回 -ENOENT */
+static int ThumbDB_LoadPending( ThumbDB tdb, const ThumbKey key,
+				ThumbData data )
+{
+	int ret;
+	ThumbPending item = NULL;
+	LinkedListNode *node;
+	LinkedList *list = &tdb->queue.list;
+
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	/* 同一个键可能被保存了多次，从队尾开始找最新的 */
+	node = list->tail.prev;
+	for( ; node && node != &list->head; node = node->prev ) {
+		if( ThumbKey_Equal( &((ThumbPending)node->data)->key, key ) ) {
+			item = node->data;
+			item->refs += 1;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	if( !item ) {
+		return -ENOENT;
+	}
+	ret = ThumbDB_ReadBlock( (uchar_t*)item->block, item->size, data );
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	ThumbPending_Delete( item );
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	return ret;
+}
+
+int ThumbDB_Load( ThumbDB tdb, const ThumbKey key, ThumbData data )
+{
+	int ret;
+	ThumbMap map;
+	uint64_t offset;
+	uint32_t size;
+	ThumbIndexEntry entry;
+	const ThumbRecordHeaderRec *head;
+
+	ret = ThumbDB_LoadPending( tdb, key, data );
+	if( ret != -ENOENT ) {
+		return ret;
+	}
 	ASSERT( ThumbDB_Lock( tdb ) == 0 );
-	rc = unqlite_kv_fetch( tdb->db, filepath, -1, NULL, &size );
-	if( rc != UNQLITE_OK ) {
+	entry = ThumbDB_FindSlot( tdb->index, tdb->entries, key );
+	if( entry->offset == 0 || entry->size < sizeof( *head ) ) {
 		ThumbDB_Unlock( tdb );
 		return -1;
 	}
-	block = malloc( (size_t)size );
-	bytes = (uchar_t*)block + sizeof( ThumbDataBlockRec );
-	rc = unqlite_kv_fetch( tdb->db, filepath, -1, block, &size );
+	offset = entry->offset;
+	size = entry->size;
+	map = ThumbDB_RefPackMap( tdb, offset + size );
 	ThumbDB_Unlock( tdb );
-	if( rc != UNQLITE_OK ) {
+	if( !map ) {
 		return -1;
 	}
-	Graph_Init( &data->graph );
-	data->graph.color_type = block->color_type;
-	Graph_Create( &data->graph, block->width, block->height );
-	memcpy( data->graph.bytes, bytes, block->mem_size );
-	data->modify_time = block->modify_time;
-	data->origin_width = block->origin_width;
-	data->origin_height = block->origin_height;
-	free( block );
+	/*
+	 * 索引可能与包文件不一致，记录头中的大小不可信，需要与索引核对。记录
+	 * 也可能只写入了一部分或已损坏，校验和不一致时当作没有找到。
+	 */
+	head = (const ThumbRecordHeaderRec*)(map->base + offset);
+	if( offset + size > map->size ||
+	    head->magic != THUMB_RECORD_MAGIC ||
+	    !ThumbKey_Equal( &head->key, key ) ||
+	    sizeof( *head ) + head->size != size ||
+	    XXH64( head + 1, head->size, 0 ) != head->checksum ) {
+		ret = -1;
+	} else {
+		ret = ThumbDB_ReadBlock( (const uchar_t*)(head + 1),
+					 head->size, data );
+	}
+	ThumbDB_UnrefPackMap( tdb, map );
+	return ret;
+}
+
+/** 编码缩略图，不支持的格式改用无损编码，压缩无效时保存原始数据 */
+static int ThumbDB_Encode( const LCUI_Graph *graph, int *codec,
+			   uchar_t **bytes, size_t *size )
+{
+	int ret = -ENOTSUP;
+	ThumbCodec c = ThumbCodec_Get( thumb_codec.codec );
+
+	*codec = thumb_codec.codec;
+	if( c ) {
+		ret = c->encode( graph, thumb_codec.quality, bytes, size );
+	}
+	if( ret == -ENOTSUP && *codec != THUMB_CODEC_QOI ) {
+		*codec = THUMB_CODEC_QOI;
+		c = ThumbCodec_Get( *codec );
+		ret = c->encode( graph, thumb_codec.quality, bytes, size );
+	}
+	if( ret == 0 && *size < graph->mem_size ) {
+		return 0;
+	}
+	if( ret == 0 ) {
+		free( *bytes );
+	}
+	*codec = THUMB_CODEC_RAW;
+	c = ThumbCodec_Get( *codec );
+	return c->encode( graph, thumb_codec.quality, bytes, size );
+}
+
+static void ThumbDB_CompactThread( void *arg );
+
+/** 无效数据过多时在后台压缩包文件 */
+static void ThumbDB_CheckCompaction( ThumbDB tdb )
+{
+	ThumbIndexHeader index = tdb->index;
+
+	if( tdb->compacting ||
+	    index->dead_size < THUMB_COMPACT_MIN_DEAD_SIZE ||
+	    index->dead_size * 2 < index->pack_size ) {
+		return;
+	}
+	/* 回收上次压缩的线程，它已经退出或即将退出 */
+	if( tdb->has_compactor ) {
+		LCUIThread_Join( tdb->compactor, NULL );
+	}
+	tdb->compacting = TRUE;
+	tdb->has_compactor = TRUE;
+	if( LCUIThread_Create( &tdb->compactor,
+			       ThumbDB_CompactThread, tdb ) != 0 ) {
+		tdb->compacting = FALSE;
+		tdb->has_compactor = FALSE;
+	}
+}
+
+/**
+ * 在包文件末尾追加一条记录，并更新索引
+ * 调用前需要把文件位置移到末尾，写入的内容留在缓冲区中，由调用者统一刷新。
+ */
+static int ThumbDB_Append( ThumbDB tdb, const ThumbKey key,
+			   const void *block, size_t size )
+{
+	ThumbRecordHeaderRec head = { 0 };
+	uint64_t offset = tdb->index->pack_size;
+
+	head.magic = THUMB_RECORD_MAGIC;
+	head.size = (uint32_t)size;
+	head.checksum = XXH64( block, size, 0 );
+	head.key = *key;
+	if( fwrite( &head, sizeof( head ), 1, tdb->pack ) != 1 ||
+	    fwrite( block, size, 1, tdb->pack ) != 1 ) {
+		ThumbDB_TruncateFile( tdb->pack, (int64_t)offset );
+		fseeko( tdb->pack, (int64_t)offset, SEEK_SET );
+		return -1;
+	}
+	if( (tdb->index->count + 1) * 4 > tdb->index->capacity * 3 &&
+	    ThumbDB_GrowIndex( tdb ) != 0 ) {
+		return -1;
+	}
+	tdb->index->pack_size = offset + sizeof( head ) + size;
+	tdb->index->dead_size += ThumbDB_PutEntry( tdb->index, tdb->entries,
+						   key, offset, (uint32_t)
+						   (sizeof( head ) + size) );
+	return 0;
+}
+
+/** 提交一批记录，一次刷新文件缓冲区 */
+static void ThumbDB_Commit( ThumbDB tdb, ThumbPending *items, size_t n )
+{
+	size_t i;
+
+	if( ThumbDB_Lock( tdb ) != 0 ) {
+		return;
+	}
+	if( fseeko( tdb->pack, (int64_t)tdb->index->pack_size,
+		    SEEK_SET ) == 0 ) {
+		/* 扩大索引失败时索引可能已不可用 */
+		for( i = 0; i < n && tdb->index; ++i ) {
+			ThumbDB_Append( tdb, &items[i]->key,
+					items[i]->block, items[i]->size );
+		}
+		fflush( tdb->pack );
+	}
+	if( tdb->index ) {
+		ThumbDB_CheckCompaction( tdb );
+	}
+	ThumbDB_Unlock( tdb );
+}
+
+/** 生成等待中的缩略图金字塔，需要在写入队列的锁内调用 */
+static void ThumbDB_ProcessLevels( ThumbDB tdb )
+{
+	LinkedListNode *node;
+	ThumbLevelsTask task;
+
+	while( tdb->queue.levels.length > 0 ) {
+		node = tdb->queue.levels.head.next;
+		task = node->data;
+		LinkedList_DeleteNode( &tdb->queue.levels, node );
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		ThumbDB_BuildLevels( tdb, &task->fp, &task->data, FALSE );
+		Graph_Free( &task->data.graph );
+		free( task );
+		LCUIMutex_Lock( &tdb->queue.mutex );
+		LCUICond_Broadcast( &tdb->queue.cond );
+	}
+}
+
+/**
+ * 写入线程
+ * 队列中积累了 THUMB_COMMIT_COUNT 条记录，或者等待了 THUMB_COMMIT_INTERVAL
+ * 毫秒后，一次性提交队列中的所有记录。记录写入并更新索引后才从队列中移除，
+ * 在这之前读取操作可以从队列中找到它。缩略图金字塔也由这个线程缩小和编码，
+ * 不占用请求它的线程。
+ */
+static void ThumbDB_WriterThread( void *arg )
+{
+	size_t i, n;
+	ThumbDB tdb = arg;
+	LinkedListNode *node;
+	ThumbPending items[THUMB_QUEUE_MAX_LENGTH];
+
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	while( tdb->queue.active || tdb->queue.list.length > 0 ||
+	       tdb->queue.levels.length > 0 ) {
+		if( tdb->queue.active &&
+		    tdb->queue.levels.length < 1 &&
+		    tdb->queue.list.length < THUMB_COMMIT_COUNT ) {
+			LCUICond_TimedWait( &tdb->queue.cond,
+					    &tdb->queue.mutex,
+					    THUMB_COMMIT_INTERVAL );
+		}
+		ThumbDB_ProcessLevels( tdb );
+		n = 0;
+		for( LinkedList_Each( node, &tdb->queue.list ) ) {
+			if( n >= THUMB_QUEUE_MAX_LENGTH ) {
+				break;
+			}
+			items[n++] = node->data;
+		}
+		if( n == 0 ) {
+			continue;
+		}
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		ThumbDB_Commit( tdb, items, n );
+		LCUIMutex_Lock( &tdb->queue.mutex );
+		for( i = 0; i < n; ++i ) {
+			node = tdb->queue.list.head.next;
+			ThumbPending_Delete( node->data );
+			LinkedList_DeleteNode( &tdb->queue.list, node );
+		}
+		LCUICond_Broadcast( &tdb->queue.cond );
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	LCUIThread_Exit( NULL );
+}
+
+/**
+ * 放入写入队列，由写入线程批量提交，数据块此后归写入队列所有
+ * @param[in] wait 队列已满时是否等待，写入线程自己放入时不能等待
+ */
+static int ThumbDB_Enqueue( ThumbDB tdb, const ThumbKey key,
+			    ThumbDataBlock block, size_t size, LCUI_BOOL wait )
+{
+	ThumbPending item;
+
+	item = NEW( ThumbPendingRec, 1 );
+	if( !item ) {
+		free( block );
+		return -ENOMEM;
+	}
+	item->key = *key;
+	item->refs = 1;
+	item->size = size;
+	item->block = block;
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	while( wait && tdb->queue.active &&
+	       tdb->queue.list.length >= THUMB_QUEUE_MAX_LENGTH ) {
+		LCUICond_Wait( &tdb->queue.cond, &tdb->queue.mutex );
+	}
+	if( wait && !tdb->queue.active ) {
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		ThumbPending_Delete( item );
+		return -1;
+	}
+	LinkedList_Append( &tdb->queue.list, item );
+	if( tdb->queue.list.length >= THUMB_COMMIT_COUNT ) {
+		LCUICond_Signal( &tdb->queue.cond );
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
 	return 0;
 }
 
-int ThumbDB_Save( ThumbDB tdb, const char *filepath, ThumbData data )
+static int ThumbDB_SaveBlock( ThumbDB tdb, const ThumbKey key,
+			      ThumbData data, LCUI_BOOL wait )
 {
-	int rc;
-	uchar_t *buff;
+	int codec;
+	uchar_t *bytes;
+	size_t size, data_size;
 	ThumbDataBlock block;
-	size_t head_size = sizeof( ThumbDataBlockRec );
-	size_t size = head_size + data->graph.mem_size;
-	if( size > THUMB_MAX_SIZE ) {
+
+	if( sizeof( ThumbDataBlockRec ) + data->graph.mem_size >
+	    THUMB_MAX_SIZE ) {
 		return -1;
 	}
-	ASSERT( ThumbDB_Lock( tdb ) == 0 );
+	/* 在锁外编码，不阻塞其它线程读取 */
+	if( ThumbDB_Encode( &data->graph, &codec,
+			    &bytes, &data_size ) != 0 ) {
+		return -1;
+	}
+	size = sizeof( ThumbDataBlockRec ) + data_size;
 	block = malloc( size );
-	buff = (uchar_t*)block + head_size;
+	if( !block ) {
+		free( bytes );
+		return -ENOMEM;
+	}
+	block->magic = THUMB_BLOCK_MAGIC;
+	block->codec = codec;
 	block->width = data->graph.width;
 	block->height = data->graph.height;
-	block->mem_size = data->graph.mem_size;
+	block->data_size = (uint32_t)data_size;
 	block->modify_time = data->modify_time;
 	block->origin_width = data->origin_width;
 	block->origin_height = data->origin_height;
 	block->color_type = data->graph.color_type;
-	memcpy( buff, data->graph.bytes, data->graph.mem_size );
-	rc = unqlite_kv_store( tdb->db, filepath, -1, block, size );
-	if( rc == UNQLITE_OK ) {
-		unqlite_commit( tdb->db );
+	memcpy( (uchar_t*)block + sizeof( ThumbDataBlockRec ),
+		bytes, data_size );
+	free( bytes );
+	return ThumbDB_Enqueue( tdb, key, block, size, wait );
+}
+
+int ThumbDB_Save( ThumbDB tdb, const ThumbKey key, ThumbData data )
+{
+	return ThumbDB_SaveBlock( tdb, key, data, TRUE );
+}
+
+/** 复制数据库中的数据块，包括写入队列中的 */
+static ThumbDataBlock ThumbDB_CopyBlock( ThumbDB tdb, const ThumbKey key,
+					 size_t *size )
+{
+	ThumbMap map;
+	uint64_t offset;
+	uint32_t entry_size;
+	LinkedListNode *node;
+	ThumbIndexEntry entry;
+	ThumbDataBlock block = NULL;
+	LinkedList *list = &tdb->queue.list;
+	const ThumbRecordHeaderRec *head;
+
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	node = list->tail.prev;
+	for( ; node && node != &list->head; node = node->prev ) {
+		ThumbPending item = node->data;
+		if( !ThumbKey_Equal( &item->key, key ) ) {
+			continue;
+		}
+		block = malloc( item->size );
+		if( block ) {
+			memcpy( block, item->block, item->size );
+			*size = item->size;
+		}
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		return block;
 	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	if( ThumbDB_Lock( tdb ) != 0 ) {
+		return NULL;
+	}
+	entry = ThumbDB_FindSlot( tdb->index, tdb->entries, key );
+	offset = entry->offset;
+	entry_size = entry->size;
+	map = offset > 0 ? ThumbDB_RefPackMap( tdb, offset + entry_size ) : NULL;
 	ThumbDB_Unlock( tdb );
-	free( block );
-	return rc == UNQLITE_OK ? 0 : -2;
+	if( !map ) {
+		return NULL;
+	}
+	head = (const ThumbRecordHeaderRec*)(map->base + offset);
+	if( entry_size >= sizeof( *head ) &&
+	    offset + entry_size <= map->size &&
+	    head->magic == THUMB_RECORD_MAGIC &&
+	    ThumbKey_Equal( &head->key, key ) &&
+	    head->size >= sizeof( ThumbDataBlockRec ) &&
+	    sizeof( *head ) + head->size == entry_size &&
+	    XXH64( head + 1, head->size, 0 ) == head->checksum ) {
+		block = malloc( head->size );
+		if( block ) {
+			memcpy( block, head + 1, head->size );
+			*size = head->size;
+		}
+	}
+	ThumbDB_UnrefPackMap( tdb, map );
+	return block;
+}
+
+int ThumbDB_SetModifyTime( ThumbDB tdb, const ThumbKey key,
+			   uint32_t modify_time )
+{
+	size_t size;
+	ThumbDataBlock block;
+
+	block = ThumbDB_CopyBlock( tdb, key, &size );
+	if( !block ) {
+		return -1;
+	}
+	if( block->magic != THUMB_BLOCK_MAGIC ) {
+		free( block );
+		return -1;
+	}
+	/* 只改动记录的修改时间，编码后的数据原样写回 */
+	block->modify_time = modify_time;
+	return ThumbDB_Enqueue( tdb, key, block, size, TRUE );
+}
+
+int ThumbDB_SetLevelsModifyTime( ThumbDB tdb, const FileFingerprint fp,
+				 uint32_t modify_time )
+{
+	int i, ret = 0;
+	ThumbKeyRec key;
+
+	for( i = THUMB_LEVEL_COUNT - 1; i >= 0; --i ) {
+		ThumbKey_Init( &key, fp, thumb_levels[i], thumb_levels[i] );
+		if( ThumbDB_SetModifyTime( tdb, &key, modify_time ) != 0 ) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/** 比较两个槽在包文件中的位置，用于按位置排序 */
+static int CompareEntryOffset( const void *a, const void *b )
+{
+	const ThumbIndexEntryRec *x = a, *y = b;
+	return x->offset < y->offset ? -1 : x->offset > y->offset ? 1 : 0;
+}
+
+/** 从一个文件中复制一段数据到另一个文件 */
+static int CopyFileRange( FILE *src, int64_t offset, int64_t size,
+			  FILE *dst, uchar_t *buffer )
+{
+	size_t n;
+
+	if( fseeko( src, offset, SEEK_SET ) != 0 ) {
+		return -1;
+	}
+	while( size > 0 ) {
+		n = (size_t)min( size, THUMB_COPY_BUFFER_SIZE );
+		if( fread( buffer, n, 1, src ) != 1 ||
+		    fwrite( buffer, n, 1, dst ) != 1 ) {
+			return -1;
+		}
+		size -= n;
+	}
+	return 0;
+}
+
+/** 在按位置排序的槽列表中查找记录被复制到的新位置 */
+static uint64_t FindNewOffset( const ThumbIndexEntryRec *list, size_t n,
+			       const uint64_t *new_offsets, uint64_t offset )
+{
+	size_t low = 0, high = n;
+
+	while( low < high ) {
+		size_t mid = (low + high) / 2;
+		if( list[mid].offset < offset ) {
+			low = mid + 1;
+		} else if( list[mid].offset > offset ) {
+			high = mid;
+		} else {
+			return new_offsets[mid];
+		}
+	}
+	return 0;
+}
+
+/**
+ * 压缩包文件
+ * 先在锁外把有效记录复制到新的包文件中，再在锁内补上复制期间追加的记录，
+ * 生成新的索引并替换文件。替换前索引头中的 clean 为 0，替换过程中崩溃时，
+ * 下次打开会由包文件重建索引。
+ */
+static int ThumbDB_Compact( ThumbDB tdb )
+{
+	FILE *fp = NULL;
+	ThumbMap map;
+	int ret = -1;
+	uint32_t i, n = 0;
+	uint64_t end, offset, tail, *new_offsets = NULL;
+	uchar_t *buffer = NULL;
+	wchar_t *pack_tmp, *index_tmp;
+	ThumbPackHeaderRec head = { 0 };
+	ThumbIndexEntry list = NULL, entries = NULL;
+	ThumbIndexHeaderRec index;
+
+	pack_tmp = ThumbDB_JoinPath( tdb->pack_path, L"", THUMB_TMP_SUFFIX );
+	index_tmp = ThumbDB_JoinPath( tdb->index_path, L"", THUMB_TMP_SUFFIX );
+	buffer = malloc( THUMB_COPY_BUFFER_SIZE );
+	if( !pack_tmp || !index_tmp || !buffer ) {
+		goto exit;
+	}
+	/* 记下当前的有效记录 */
+	if( ThumbDB_Lock( tdb ) != 0 ) {
+		goto exit;
+	}
+	end = tdb->index->pack_size;
+	list = malloc( sizeof( ThumbIndexEntryRec ) * tdb->index->count );
+	new_offsets = malloc( sizeof( uint64_t ) * tdb->index->count );
+	map = list && new_offsets ? ThumbDB_RefPackMap( tdb, end ) : NULL;
+	for( i = 0; map && i < tdb->index->capacity; ++i ) {
+		if( tdb->entries[i].offset != 0 ) {
+			list[n++] = tdb->entries[i];
+		}
+	}
+	ThumbDB_Unlock( tdb );
+	if( !map ) {
+		goto exit;
+	}
+	qsort( list, n, sizeof( ThumbIndexEntryRec ), CompareEntryOffset );
+	fp = wfopen( pack_tmp, "w+b" );
+	memcpy( head.magic, THUMB_PACK_MAGIC, sizeof( head.magic ) );
+	head.version = THUMB_PACK_VERSION;
+	if( !fp || fwrite( &head, sizeof( head ), 1, fp ) != 1 ) {
+		ThumbDB_UnrefPackMap( tdb, map );
+		goto exit;
+	}
+	offset = sizeof( head );
+	for( i = 0; i < n; ++i ) {
+		if( fwrite( map->base + list[i].offset,
+			    list[i].size, 1, fp ) != 1 ) {
+			break;
+		}
+		new_offsets[i] = offset;
+		offset += list[i].size;
+	}
+	ThumbDB_UnrefPackMap( tdb, map );
+	if( i < n ) {
+		goto exit;
+	}
+	tail = offset;
+	/* 补上复制期间追加的记录，并替换文件 */
+	if( ThumbDB_Lock( tdb ) != 0 ) {
+		goto exit;
+	}
+	fflush( tdb->pack );
+	if( CopyFileRange( tdb->pack, (int64_t)end,
+			   (int64_t)(tdb->index->pack_size - end),
+			   fp, buffer ) != 0 ||
+	    ThumbDB_SyncFile( fp ) != 0 ) {
+		ThumbDB_Unlock( tdb );
+		goto exit;
+	}
+	index = *tdb->index;
+	index.count = 0;
+	index.dead_size = 0;
+	index.clean = 1;
+	entries = calloc( index.capacity, sizeof( ThumbIndexEntryRec ) );
+	for( i = 0; entries && i < tdb->index->capacity; ++i ) {
+		ThumbIndexEntry e = &tdb->entries[i];
+		if( e->offset == 0 ) {
+			continue;
+		}
+		if( e->offset >= end ) {
+			offset = e->offset - end + tail;
+		} else {
+			offset = FindNewOffset( list, n, new_offsets,
+						e->offset );
+		}
+		ThumbDB_PutEntry( &index, entries, &e->key, offset, e->size );
+	}
+	index.pack_size = (uint64_t)ftello( fp );
+	if( !entries || ThumbDB_CreateIndexFile( index_tmp, index.capacity,
+						 &index, entries ) != 0 ) {
+		ThumbDB_Unlock( tdb );
+		goto exit;
+	}
+	fclose( fp );
+	fp = NULL;
+	/* 等待其它线程释放对旧文件的映射 */
+	tdb->swapping = TRUE;
+	ThumbDB_WaitMaps( tdb );
+	ThumbDB_CloseFiles( tdb );
+	if( wrename( pack_tmp, tdb->pack_path ) == 0 ) {
+		wrename( index_tmp, tdb->index_path );
+		ret = 0;
+	}
+	if( ThumbDB_OpenFiles( tdb ) != 0 ) {
+		tdb->closed = TRUE;
+	}
+	tdb->swapping = FALSE;
+	LCUICond_Broadcast( &tdb->cond );
+	ThumbDB_Unlock( tdb );
+
+exit:
+	if( fp ) {
+		fclose( fp );
+		wremove( pack_tmp );
+	}
+	free( entries );
+	free( list );
+	free( new_offsets );
+	free( buffer );
+	free( pack_tmp );
+	free( index_tmp );
+	return ret;
+}
+
+static void ThumbDB_CompactThread( void *arg )
+{
+	ThumbDB tdb = arg;
+
+	if( ThumbDB_Compact( tdb ) != 0 ) {
+		LOG( "[thumbdb] compaction failed\n" );
+	}
+	LCUIMutex_Lock( &tdb->mutex );
+	tdb->compacting = FALSE;
+	LCUICond_Broadcast( &tdb->cond );
+	LCUIMutex_Unlock( &tdb->mutex );
+	LCUIThread_Exit( NULL );
+}
+
+int64_t ThumbDB_GetSize( ThumbDB tdb )
+{
+	int64_t size;
+
+	ASSERT( ThumbDB_Lock( tdb ) == 0 );
+	size = (int64_t)tdb->index->pack_size + tdb->index_map.size;
+	ThumbDB_Unlock( tdb );
+	return size;
+}
+
+/**
+ * 判断缩略图能否满足尺寸要求
+ * 已经是原图大小的，或者需要放大的比例在一成以内的，都视为满足要求。
+ */
+static LCUI_BOOL ThumbData_Fits( ThumbData data, int width, int height )
+{
+	const LCUI_Graph *graph = &data->graph;
+
+	if( width > 0 && graph->width * 10 < width * 9 &&
+	    (uint32_t)graph->width < data->origin_width ) {
+		return FALSE;
+	}
+	if( height > 0 && graph->height * 10 < height * 9 &&
+	    (uint32_t)graph->height < data->origin_height ) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/** 读取数据块头部中记录的尺寸，不解码数据，包括写入队列中的 */
+static int ThumbDB_LoadSize( ThumbDB tdb, const ThumbKey key,
+			     ThumbData data )
+{
+	ThumbMap map;
+	uint64_t offset;
+	uint32_t size;
+	LinkedListNode *node;
+	ThumbIndexEntry entry;
+	ThumbDataBlock block = NULL;
+	LinkedList *list = &tdb->queue.list;
+	const ThumbRecordHeaderRec *head;
+
+	Graph_Init( &data->graph );
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	node = list->tail.prev;
+	for( ; node && node != &list->head; node = node->prev ) {
+		ThumbPending item = node->data;
+		if( ThumbKey_Equal( &item->key, key ) ) {
+			block = item->block;
+			data->graph.width = block->width;
+			data->graph.height = block->height;
+			data->origin_width = block->origin_width;
+			data->origin_height = block->origin_height;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	if( block ) {
+		return 0;
+	}
+	ASSERT( ThumbDB_Lock( tdb ) == 0 );
+	entry = ThumbDB_FindSlot( tdb->index, tdb->entries, key );
+	offset = entry->offset;
+	size = entry->size;
+	map = offset > 0 ? ThumbDB_RefPackMap( tdb, offset + size ) : NULL;
+	ThumbDB_Unlock( tdb );
+	if( !map ) {
+		return -1;
+	}
+	head = (const ThumbRecordHeaderRec*)(map->base + offset);
+	if( size < sizeof( *head ) + sizeof( ThumbDataBlockRec ) ||
+	    offset + size > map->size ||
+	    head->magic != THUMB_RECORD_MAGIC ||
+	    !ThumbKey_Equal( &head->key, key ) ) {
+		ThumbDB_UnrefPackMap( tdb, map );
+		return -1;
+	}
+	block = (ThumbDataBlock)(head + 1);
+	data->graph.width = block->width;
+	data->graph.height = block->height;
+	data->origin_width = block->origin_width;
+	data->origin_height = block->origin_height;
+	ThumbDB_UnrefPackMap( tdb, map );
+	return block->magic == THUMB_BLOCK_MAGIC ? 0 : -1;
+}
+
+int ThumbDB_LoadLevel( ThumbDB tdb, const FileFingerprint fp,
+		       int width, int height, ThumbData data )
+{
+	int i, ret = -ENOENT;
+	ThumbKeyRec key;
+	ThumbDataRec level;
+	int size = max( width, height );
+
+	/* 从边长不小于要求的最小一级开始找 */
+	for( i = 0; i < THUMB_LEVEL_COUNT - 1; ++i ) {
+		if( thumb_levels[i] * 10 >= size * 9 ) {
+			break;
+		}
+	}
+	/*
+	 * 只限定了高度时，横向的图片需要更大的一级，先根据数据块头部记录的尺寸
+	 * 选出合适的一级再解码，以免解码了不合要求的一级
+	 */
+	for( ; i < THUMB_LEVEL_COUNT; ++i ) {
+		ThumbKey_Init( &key, fp, thumb_levels[i], thumb_levels[i] );
+		if( ThumbDB_LoadSize( tdb, &key, &level ) != 0 ) {
+			continue;
+		}
+		if( !ThumbData_Fits( &level, width, height ) ) {
+			ret = -ERANGE;
+			continue;
+		}
+		if( ThumbDB_Load( tdb, &key, &level ) != 0 ) {
+			continue;
+		}
+		*data = level;
+		if( (width > 0 && level.graph.width > width) ||
+		    (height > 0 && level.graph.height > height) ) {
+			Graph_Init( &data->graph );
+			if( ImageScaler_Zoom( &level.graph, &data->graph, TRUE,
+					      width, height ) == 0 ) {
+				Graph_Free( &level.graph );
+			} else {
+				data->graph = level.graph;
+			}
+		}
+		return 0;
+	}
+	return ret;
+}
+
+LCUI_BOOL ThumbDB_LevelsFit( int origin_width, int origin_height,
+			     int width, int height )
+{
+	double scale = 1.0;
+	ThumbDataRec data;
+
+	if( origin_width <= 0 || origin_height <= 0 ) {
+		return TRUE;
+	}
+	/* 最大一级是按原图比例缩小到 THUMB_LEVEL_MAX_SIZE 以内的 */
+	scale = min( scale, 1.0 * THUMB_LEVEL_MAX_SIZE / origin_width );
+	scale = min( scale, 1.0 * THUMB_LEVEL_MAX_SIZE / origin_height );
+	Graph_Init( &data.graph );
+	data.graph.width = max( 1, (int)(origin_width * scale) );
+	data.graph.height = max( 1, (int)(origin_height * scale) );
+	data.origin_width = origin_width;
+	data.origin_height = origin_height;
+	return ThumbData_Fits( &data, width, height );
+}
+
+/** 判断数据库中是否有指定键的缩略图，包括写入队列中的 */
+static LCUI_BOOL ThumbDB_Has( ThumbDB tdb, const ThumbKey key )
+{
+	LCUI_BOOL found = FALSE;
+	LinkedListNode *node;
+
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	for( LinkedList_Each( node, &tdb->queue.list ) ) {
+		if( ThumbKey_Equal( &((ThumbPending)node->data)->key, key ) ) {
+			found = TRUE;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	if( found ) {
+		return TRUE;
+	}
+	if( ThumbDB_Lock( tdb ) != 0 ) {
+		return FALSE;
+	}
+	found = ThumbDB_FindSlot( tdb->index, tdb->entries, key )->offset > 0;
+	ThumbDB_Unlock( tdb );
+	return found;
+}
+
+LCUI_BOOL ThumbDB_HasLevels( ThumbDB tdb, const FileFingerprint fp )
+{
+	ThumbKeyRec key;
+	ThumbLevelsTask task;
+	LinkedListNode *node;
+	LCUI_BOOL found = FALSE;
+
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	for( LinkedList_Each( node, &tdb->queue.levels ) ) {
+		task = node->data;
+		if( task->fp.size == fp->size && task->fp.hash == fp->hash ) {
+			found = TRUE;
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	if( found ) {
+		return TRUE;
+	}
+	/* 最小一级是最后保存的，有它说明整个金字塔都已保存 */
+	ThumbKey_Init( &key, fp, thumb_levels[0], thumb_levels[0] );
+	return ThumbDB_Has( tdb, &key );
+}
+
+static int ThumbDB_BuildLevels( ThumbDB tdb, const FileFingerprint fp,
+				ThumbData data, LCUI_BOOL wait )
+{
+	int i, size, ret = 0;
+	ThumbKeyRec key;
+	LCUI_Graph graph;
+	ThumbDataRec level = *data;
+
+	/* 从大到小生成，每一级由上一级缩小得到 */
+	for( i = THUMB_LEVEL_COUNT - 1; i >= 0; --i ) {
+		size = thumb_levels[i];
+		if( level.graph.width > size || level.graph.height > size ) {
+			Graph_Init( &graph );
+			if( ImageScaler_Zoom( &level.graph, &graph, TRUE,
+					      size, size ) != 0 ) {
+				ret = -1;
+				break;
+			}
+			if( level.graph.bytes != data->graph.bytes ) {
+				Graph_Free( &level.graph );
+			}
+			level.graph = graph;
+		}
+		ThumbKey_Init( &key, fp, size, size );
+		if( ThumbDB_SaveBlock( tdb, &key, &level, wait ) != 0 ) {
+			ret = -1;
+		}
+	}
+	if( level.graph.bytes != data->graph.bytes ) {
+		Graph_Free( &level.graph );
+	}
+	return ret;
+}
+
+int ThumbDB_SaveLevels( ThumbDB tdb, const FileFingerprint fp,
+			ThumbData data )
+{
+	return ThumbDB_BuildLevels( tdb, fp, data, TRUE );
+}
+
+int ThumbDB_SaveLevelsAsync( ThumbDB tdb, const FileFingerprint fp,
+			     ThumbData data )
+{
+	ThumbLevelsTask task;
+
+	task = NEW( ThumbLevelsTaskRec, 1 );
+	if( !task ) {
+		return -ENOMEM;
+	}
+	task->fp = *fp;
+	task->data = *data;
+	Graph_Init( &task->data.graph );
+	if( Graph_Copy( &task->data.graph, &data->graph ) != 0 ) {
+		free( task );
+		return -ENOMEM;
+	}
+	LCUIMutex_Lock( &tdb->queue.mutex );
+	while( tdb->queue.active &&
+	       tdb->queue.levels.length >= THUMB_LEVELS_MAX_LENGTH ) {
+		LCUICond_Wait( &tdb->queue.cond, &tdb->queue.mutex );
+	}
+	if( !tdb->queue.active ) {
+		LCUIMutex_Unlock( &tdb->queue.mutex );
+		Graph_Free( &task->data.graph );
+		free( task );
+		return -1;
+	}
+	LinkedList_Append( &tdb->queue.levels, task );
+	/* 等待队列空位的线程也在等这个条件变量，需要全部唤醒 */
+	LCUICond_Broadcast( &tdb->queue.cond );
+	LCUIMutex_Unlock( &tdb->queue.mutex );
+	return 0;
 }
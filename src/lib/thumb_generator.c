@@ -0,0 +1,511 @@
+﻿/* ***************************************************************************
+ * thumb_generator.c -- background thumbnail generation.
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * thumb_generator.c -- 在空闲时预先生成缩略图。
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#define LCFINDER_THUMB_GENERATOR_C
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include <LCUI/thread.h>
+#include "build.h"
+#include "common.h"
+#include "file_search.h"
+#include "file_storage.h"
+#include "thumb_db.h"
+#include "thumb_generator.h"
+
+/** 进度文件名 */
+#define THUMB_GENERATOR_FILE		L"thumbs.gen"
+/** 进度文件的标识，即 "LCTG" */
+#define THUMB_GENERATOR_MAGIC		0x4754434C
+/** 每次从数据库中取出多少个文件记录 */
+#define THUMB_GENERATOR_BATCH_SIZE	64
+/** 每处理多少个文件保存一次进度 */
+#define THUMB_GENERATOR_SAVE_INTERVAL	32
+/** 每生成一个缩略图后停顿多久（毫秒），以免长时间占满处理器和磁盘 */
+#define THUMB_GENERATOR_INTERVAL	50
+
+/** 保存在进度文件中的记录 */
+typedef struct ThumbGeneratorRecordRec_ {
+	uint32_t magic;
+	uint32_t finished;	/**< 是否已处理完全部文件 */
+	uint64_t count;		/**< 已处理的文件数量 */
+	uint64_t total;		/**< 文件总数 */
+} ThumbGeneratorRecordRec;
+
+static struct ThumbGeneratorModule {
+	LCUI_BOOL inited;
+	LCUI_BOOL active;		/**< 生成线程是否需要继续运行 */
+	LCUI_BOOL running;		/**< 生成线程是否已创建 */
+	LCUI_BOOL finished;		/**< 是否已处理完全部文件 */
+	LCUI_Thread thread;
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;
+	ThumbDB *db;			/**< 缩略图数据库 */
+	int storage;			/**< 文件服务连接 */
+	wchar_t *path;			/**< 进度文件路径 */
+	DB_Dir *dirs;			/**< 需要处理的源文件夹 */
+	DB_DirRec *dir_recs;		/**< 源文件夹记录的副本 */
+	size_t n_dirs;
+	int64_t active_time;		/**< 用户最近一次操作的时间 */
+	ThumbGeneratorStatusRec status;
+	struct {
+		LCUI_BOOL waiting;	/**< 是否正在等待响应 */
+		uintptr_t seq;		/**< 请求序号，用于识别过时的响应 */
+		int ret;
+		size_t size;		/**< 文件大小 */
+		ThumbDataRec data;
+	} request;
+} self;
+
+static void ThumbGenerator_LoadState( void )
+{
+	FILE *fp;
+	ThumbGeneratorRecordRec rec;
+
+	self.finished = FALSE;
+	self.status.count = 0;
+	self.status.total = 0;
+	fp = wfopen( self.path, "rb" );
+	if( !fp ) {
+		return;
+	}
+	if( fread( &rec, sizeof( rec ), 1, fp ) == 1 &&
+	    rec.magic == THUMB_GENERATOR_MAGIC ) {
+		self.finished = rec.finished ? TRUE : FALSE;
+		self.status.count = (size_t)rec.count;
+		self.status.total = (size_t)rec.total;
+	}
+	fclose( fp );
+}
+
+/** 保存进度，需要在锁内调用 */
+static int ThumbGenerator_SaveState( void )
+{
+	FILE *fp;
+	ThumbGeneratorRecordRec rec;
+
+	rec.magic = THUMB_GENERATOR_MAGIC;
+	rec.finished = self.finished ? 1 : 0;
+	rec.count = self.status.count;
+	rec.total = self.status.total;
+	fp = wfopen( self.path, "wb" );
+	if( !fp ) {
+		return -1;
+	}
+	if( fwrite( &rec, sizeof( rec ), 1, fp ) != 1 ) {
+		fclose( fp );
+		return -1;
+	}
+	fclose( fp );
+	return 0;
+}
+
+static void ThumbGenerator_InitTerms( DB_QueryTerms terms )
+{
+	memset( terms, 0, sizeof( DB_QueryTermsRec ) );
+	terms->dirs = self.dirs;
+	terms->n_dirs = self.n_dirs;
+	terms->create_time = DESC;
+}
+
+static size_t ThumbGenerator_CountFiles( void )
+{
+	int total;
+	DB_Query query;
+	DB_QueryTermsRec terms;
+
+	ThumbGenerator_InitTerms( &terms );
+	query = DB_NewQuery( &terms );
+	total = DBQuery_GetTotalFiles( query );
+	DB_DeleteQuery( query );
+	return total > 0 ? total : 0;
+}
+
+/** 按时间线的顺序，从 offset 处开始取出一批文件记录 */
+static int ThumbGenerator_FetchFiles( DB_File *files, size_t offset )
+{
+	int n = 0;
+	DB_File file;
+	DB_Query query;
+	DB_QueryTermsRec terms;
+
+	ThumbGenerator_InitTerms( &terms );
+	terms.offset = (int)offset;
+	terms.limit = THUMB_GENERATOR_BATCH_SIZE;
+	query = DB_NewQuery( &terms );
+	while( n < THUMB_GENERATOR_BATCH_SIZE ) {
+		file = DBQuery_FetchFile( query );
+		if( !file ) {
+			break;
+		}
+		files[n++] = file;
+	}
+	DB_DeleteQuery( query );
+	return n;
+}
+
+static void OnGetThumbnail( FileStatus *status, LCUI_Graph *thumb, void *data )
+{
+	LCUIMutex_Lock( &self.mutex );
+	/* 等待已被放弃，缩略图由文件服务客户端释放 */
+	if( !self.request.waiting || (uintptr_t)data != self.request.seq ) {
+		LCUIMutex_Unlock( &self.mutex );
+		return;
+	}
+	if( status && status->image && thumb ) {
+		self.request.ret = 0;
+		self.request.size = status->size;
+		self.request.data.origin_width = status->image->width;
+		self.request.data.origin_height = status->image->height;
+		self.request.data.modify_time = (uint32_t)status->mtime;
+		self.request.data.graph = *thumb;
+		Graph_Init( thumb );
+	} else {
+		self.request.ret = -1;
+	}
+	self.request.waiting = FALSE;
+	LCUICond_Broadcast( &self.cond );
+	LCUIMutex_Unlock( &self.mutex );
+}
+
+/** 向文件服务请求缩略图，并等待响应 */
+static int ThumbGenerator_Request( const wchar_t *wpath,
+				   ThumbData data, size_t *size )
+{
+	int id, ret = -1;
+
+	LCUIMutex_Lock( &self.mutex );
+	self.request.seq += 1;
+	self.request.waiting = TRUE;
+	/* 在锁内发出请求，以免响应先于请求序号的更新到达 */
+	id = FileStorage_GetThumbnail( self.storage, wpath,
+				       THUMB_LEVEL_MAX_SIZE,
+				       THUMB_LEVEL_MAX_SIZE, OnGetThumbnail,
+				       (void*)self.request.seq );
+	if( id < 0 ) {
+		self.request.waiting = FALSE;
+		LCUIMutex_Unlock( &self.mutex );
+		return -1;
+	}
+	while( self.request.waiting && self.active ) {
+		LCUICond_Wait( &self.cond, &self.mutex );
+	}
+	if( self.request.waiting ) {
+		FileStorage_Cancel( self.storage, id );
+		LCUICond_TimedWait( &self.cond, &self.mutex, 1000 );
+	}
+	if( self.request.waiting ) {
+		self.request.waiting = FALSE;
+	} else if( self.request.ret == 0 ) {
+		*data = self.request.data;
+		*size = self.request.size;
+		ret = 0;
+	}
+	LCUIMutex_Unlock( &self.mutex );
+	return ret;
+}
+
+/**
+ * 为文件生成缩略图金字塔
+ * @returns 生成了缩略图时返回 1，已有缩略图时返回 0，失败时返回 -1
+ */
+static int ThumbGenerator_Process( DB_File file )
+{
+	int ret = -1;
+	size_t size;
+	ThumbDB db = *self.db;
+	wchar_t *wpath;
+	ThumbDataRec data;
+	FileFingerprintRec fp;
+
+	if( !db ) {
+		return -1;
+	}
+	wpath = DecodeUTF8( file->path );
+	if( !wpath ) {
+		return -1;
+	}
+	if( DB_GetFileFingerprint( file->path, &fp.size, &fp.hash ) != 0 ||
+	    fp.size < 0 ) {
+		if( wgetfilefingerprint( wpath, &fp ) != 0 ) {
+			goto exit;
+		}
+	}
+	if( ThumbDB_HasLevels( db, &fp ) ) {
+		ret = 0;
+		goto exit;
+	}
+	if( ThumbGenerator_Request( wpath, &data, &size ) != 0 ) {
+		goto exit;
+	}
+	/*
+	 * 文件大小或修改时间与数据库记录不一致时，数据库中的文件指纹已经过时，
+	 * 需要重新计算，否则大小不变的修改会把新的缩略图存到旧的内容键下
+	 */
+	if( (fp.size != (int64_t)size ||
+	     data.modify_time != (uint32_t)file->modify_time) &&
+	    wgetfilefingerprint( wpath, &fp ) != 0 ) {
+		Graph_Free( &data.graph );
+		goto exit;
+	}
+	if( ThumbDB_SaveLevels( db, &fp, &data ) == 0 ) {
+		ret = 1;
+	}
+	Graph_Free( &data.graph );
+
+exit:
+	free( wpath );
+	return ret;
+}
+
+static void ThumbGenerator_Thread( void *arg )
+{
+	int ret, i = 0, n = 0;
+	int64_t idle;
+	size_t offset, total;
+	DB_File files[THUMB_GENERATOR_BATCH_SIZE];
+
+	/* 图片在文件服务的空闲工作线程中读取，这里还要计算指纹、缩放和编码 */
+	setthreadbackground();
+	total = ThumbGenerator_CountFiles();
+	LCUIMutex_Lock( &self.mutex );
+	self.status.total = total;
+	while( self.active ) {
+		/* 用户操作后的一段时间内暂停，把资源让给前台 */
+		idle = LCUI_GetTimeDelta( self.active_time );
+		if( idle < THUMB_GENERATOR_IDLE_TIME ) {
+			self.status.state = THUMB_GENERATOR_PAUSED;
+			LCUICond_TimedWait( &self.cond, &self.mutex, (unsigned)
+					    (THUMB_GENERATOR_IDLE_TIME - idle) );
+			continue;
+		}
+		self.status.state = THUMB_GENERATOR_RUNNING;
+		if( i >= n ) {
+			offset = self.status.count;
+			LCUIMutex_Unlock( &self.mutex );
+			n = ThumbGenerator_FetchFiles( files, offset );
+			LCUIMutex_Lock( &self.mutex );
+			i = 0;
+			if( n <= 0 ) {
+				self.finished = TRUE;
+				self.status.state = THUMB_GENERATOR_FINISHED;
+				break;
+			}
+		}
+		LCUIMutex_Unlock( &self.mutex );
+		ret = ThumbGenerator_Process( files[i] );
+		DBFile_Release( files[i++] );
+		LCUIMutex_Lock( &self.mutex );
+		self.status.count += 1;
+		if( self.status.count > self.status.total ) {
+			self.status.total = self.status.count;
+		}
+		if( ret > 0 ) {
+			self.status.generated += 1;
+		}
+		if( self.status.count % THUMB_GENERATOR_SAVE_INTERVAL == 0 ) {
+			ThumbGenerator_SaveState();
+		}
+		if( ret > 0 && self.active ) {
+			LCUICond_TimedWait( &self.cond, &self.mutex,
+					    THUMB_GENERATOR_INTERVAL );
+		}
+	}
+	for( ; i < n; ++i ) {
+		DBFile_Release( files[i] );
+	}
+	if( !self.finished ) {
+		self.status.state = THUMB_GENERATOR_STOPPED;
+	}
+	ThumbGenerator_SaveState();
+	LCUIMutex_Unlock( &self.mutex );
+	LCUIThread_Exit( NULL );
+}
+
+int ThumbGenerator_Init( ThumbDB *db, int storage, const wchar_t *dirpath )
+{
+	size_t len;
+
+	if( self.inited ) {
+		return 0;
+	}
+	len = wcslen( dirpath ) + wcslen( THUMB_GENERATOR_FILE ) + 2;
+	self.path = malloc( len * sizeof( wchar_t ) );
+	if( !self.path ) {
+		return -ENOMEM;
+	}
+	wpathjoin( self.path, dirpath, THUMB_GENERATOR_FILE );
+	self.db = db;
+	self.storage = storage;
+	self.dirs = NULL;
+	self.dir_recs = NULL;
+	self.n_dirs = 0;
+	self.active = FALSE;
+	self.running = FALSE;
+	self.request.seq = 0;
+	self.request.waiting = FALSE;
+	self.active_time = 0;
+	self.status.state = THUMB_GENERATOR_STOPPED;
+	self.status.generated = 0;
+	LCUIMutex_Init( &self.mutex );
+	LCUICond_Init( &self.cond );
+	ThumbGenerator_LoadState();
+	if( self.finished ) {
+		self.status.state = THUMB_GENERATOR_FINISHED;
+	}
+	self.inited = TRUE;
+	return 0;
+}
+
+static int ThumbGenerator_SetDirs( DB_Dir *dirs, size_t n_dirs )
+{
+	size_t i;
+
+	free( self.dirs );
+	free( self.dir_recs );
+	self.n_dirs = 0;
+	self.dirs = malloc( (n_dirs + 1) * sizeof( DB_Dir ) );
+	self.dir_recs = malloc( (n_dirs + 1) * sizeof( DB_DirRec ) );
+	if( !self.dirs || !self.dir_recs ) {
+		return -ENOMEM;
+	}
+	/* 查询时只用到标识号，不复制路径等数据 */
+	for( i = 0; i < n_dirs; ++i ) {
+		memset( &self.dir_recs[i], 0, sizeof( DB_DirRec ) );
+		self.dir_recs[i].id = dirs[i]->id;
+		self.dirs[i] = &self.dir_recs[i];
+	}
+	self.n_dirs = n_dirs;
+	return 0;
+}
+
+void ThumbGenerator_Start( DB_Dir *dirs, size_t n_dirs, LCUI_BOOL restart )
+{
+	if( !self.inited ) {
+		return;
+	}
+	ThumbGenerator_Stop( FALSE );
+	LCUIMutex_Lock( &self.mutex );
+	if( restart ) {
+		self.finished = FALSE;
+		self.status.count = 0;
+		self.status.generated = 0;
+	}
+	/* 没有源文件夹时不能查询，否则会处理私人空间中的文件 */
+	if( self.finished || n_dirs < 1 ||
+	    ThumbGenerator_SetDirs( dirs, n_dirs ) != 0 ) {
+		LCUIMutex_Unlock( &self.mutex );
+		return;
+	}
+	self.active = TRUE;
+	self.running = TRUE;
+	self.status.state = THUMB_GENERATOR_RUNNING;
+	if( LCUIThread_Create( &self.thread, ThumbGenerator_Thread,
+			       NULL ) != 0 ) {
+		self.active = FALSE;
+		self.running = FALSE;
+		self.status.state = THUMB_GENERATOR_STOPPED;
+	}
+	LCUIMutex_Unlock( &self.mutex );
+}
+
+void ThumbGenerator_Stop( LCUI_BOOL reset )
+{
+	if( !self.inited ) {
+		return;
+	}
+	LCUIMutex_Lock( &self.mutex );
+	self.active = FALSE;
+	LCUICond_Broadcast( &self.cond );
+	LCUIMutex_Unlock( &self.mutex );
+	if( self.running ) {
+		LCUIThread_Join( self.thread, NULL );
+		self.running = FALSE;
+	}
+	if( reset ) {
+		LCUIMutex_Lock( &self.mutex );
+		self.finished = FALSE;
+		self.status.count = 0;
+		self.status.generated = 0;
+		self.status.state = THUMB_GENERATOR_STOPPED;
+		ThumbGenerator_SaveState();
+		LCUIMutex_Unlock( &self.mutex );
+	}
+}
+
+void ThumbGenerator_Touch( void )
+{
+	if( !self.inited ) {
+		return;
+	}
+	LCUIMutex_Lock( &self.mutex );
+	self.active_time = LCUI_GetTime();
+	LCUIMutex_Unlock( &self.mutex );
+}
+
+void ThumbGenerator_GetStatus( ThumbGeneratorStatus status )
+{
+	if( !self.inited ) {
+		memset( status, 0, sizeof( ThumbGeneratorStatusRec ) );
+		return;
+	}
+	LCUIMutex_Lock( &self.mutex );
+	*status = self.status;
+	LCUIMutex_Unlock( &self.mutex );
+}
+
+void ThumbGenerator_Exit( void )
+{
+	if( !self.inited ) {
+		return;
+	}
+	ThumbGenerator_Stop( FALSE );
+	LCUICond_Destroy( &self.cond );
+	LCUIMutex_Destroy( &self.mutex );
+	free( self.dirs );
+	free( self.dir_recs );
+	free( self.path );
+	self.dirs = NULL;
+	self.dir_recs = NULL;
+	self.path = NULL;
+	self.inited = FALSE;
+}
@@ -0,0 +1,126 @@
+﻿/* ***************************************************************************
+ * xxhash.c -- xxHash, a fast non-cryptographic hash algorithm
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * xxhash.c -- xxHash，一个快速的非加密哈希算法
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t read64( const uint8_t *p )
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read32( const uint8_t *p )
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t XXH64_Round( uint64_t acc, uint64_t input )
+{
+	acc += input * PRIME64_2;
+	acc = rotl64( acc, 31 );
+	return acc * PRIME64_1;
+}
+
+static uint64_t XXH64_MergeRound( uint64_t acc, uint64_t val )
+{
+	acc ^= XXH64_Round( 0, val );
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t XXH64( const void *input, size_t len, uint64_t seed )
+{
+	uint64_t h64;
+	const uint8_t *p = input;
+	const uint8_t *end = p + len;
+
+	if( len >= 32 ) {
+		const uint8_t *limit = end - 32;
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+		do {
+			v1 = XXH64_Round( v1, read64( p ) );
+			v2 = XXH64_Round( v2, read64( p + 8 ) );
+			v3 = XXH64_Round( v3, read64( p + 16 ) );
+			v4 = XXH64_Round( v4, read64( p + 24 ) );
+			p += 32;
+		} while( p <= limit );
+		h64 = rotl64( v1, 1 ) + rotl64( v2, 7 ) +
+			rotl64( v3, 12 ) + rotl64( v4, 18 );
+		h64 = XXH64_MergeRound( h64, v1 );
+		h64 = XXH64_MergeRound( h64, v2 );
+		h64 = XXH64_MergeRound( h64, v3 );
+		h64 = XXH64_MergeRound( h64, v4 );
+	} else {
+		h64 = seed + PRIME64_5;
+	}
+	h64 += (uint64_t)len;
+	while( p + 8 <= end ) {
+		h64 ^= XXH64_Round( 0, read64( p ) );
+		h64 = rotl64( h64, 27 ) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if( p + 4 <= end ) {
+		h64 ^= (uint64_t)read32( p ) * PRIME64_1;
+		h64 = rotl64( h64, 23 ) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while( p < end ) {
+		h64 ^= (*p) * PRIME64_5;
+		h64 = rotl64( h64, 11 ) * PRIME64_1;
+		p++;
+	}
+	h64 ^= h64 >> 33;
+	h64 *= PRIME64_2;
+	h64 ^= h64 >> 29;
+	h64 *= PRIME64_3;
+	h64 ^= h64 >> 32;
+	return h64;
+}
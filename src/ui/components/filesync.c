@@ -40,6 +40,7 @@
 #include <LCUI/gui/widget.h>
 #include <LCUI/gui/widget/textview.h>
 #include "textview_i18n.h"
+#include "thumb_generator.h"
 #include "ui.h"
 
 #define KEY_TITLE_SCANING	"filesync.title.syncing"
@@ -47,6 +48,9 @@
 #define KEY_TEXT_SCANING	"filesync.text.scaning"
 #define KEY_TEXT_SAVING		"filesync.text.saving"
 #define KEY_TEXT_FINISHED	"filesync.text.finished"
+#define KEY_TITLE_THUMBS	"filesync.title.thumbs"
+#define KEY_TEXT_THUMBS		"filesync.text.thumbs"
+#define KEY_TEXT_THUMBS_PAUSED	"filesync.text.thumbs_paused"
 
 /** 当前文件同步功能所需的数据 */
 static struct SyncContextRec_ {
@@ -57,11 +61,19 @@ static struct SyncContextRec_ {
 	LCUI_Thread thread;		/**< 用于进行文件同步的线程 */
 	int timer;			/**< 用于动态更新提示框内容的定时器 */
 	int cached_state;		/**< 当前缓存的同步状态 */
+	int thumbs_timer;		/**< 用于更新缩略图生成进度的定时器 */
+	ThumbGeneratorStatusRec thumbs;	/**< 缩略图生成进度 */
 } self = { 0 };
 
 static void RenderStatusText( wchar_t *buf, const wchar_t *text, void *data )
 {
 	size_t count, total;
+	if( self.thumbs_timer ) {
+		count = self.thumbs.count;
+		total = self.thumbs.total;
+		swprintf( buf, TXTFMT_BUF_MAX_LEN, text, count, total );
+		return;
+	}
 	switch( self.cached_state ) {
 	case STATE_SAVING:
 		count = self.status.synced_files;
@@ -107,12 +119,49 @@ static void OnUpdateStats( void *arg )
 	}
 }
 
+static void StopUpdateThumbStats( void )
+{
+	if( self.thumbs_timer ) {
+		LCUITimer_Free( self.thumbs_timer );
+		self.thumbs_timer = 0;
+	}
+}
+
+/** 更新缩略图生成进度，生成结束后隐藏提示框 */
+static void OnUpdateThumbStats( void *arg )
+{
+	LCUI_Widget alert = self.text->parent;
+	ThumbGenerator_GetStatus( &self.thumbs );
+	switch( self.thumbs.state ) {
+	case THUMB_GENERATOR_RUNNING:
+		TextViewI18n_SetKey( self.text, KEY_TEXT_THUMBS );
+		break;
+	case THUMB_GENERATOR_PAUSED:
+		TextViewI18n_SetKey( self.text, KEY_TEXT_THUMBS_PAUSED );
+		break;
+	default:
+		StopUpdateThumbStats();
+		Widget_AddClass( alert, "hide" );
+		break;
+	}
+}
+
 static void OnHideTip( void *arg )
 {
 	LCUI_Widget alert = self.text->parent;
 	if( self.is_syncing ) {
 		return;
 	}
+	/* 还在生成缩略图的话，改为显示生成进度 */
+	ThumbGenerator_GetStatus( &self.thumbs );
+	if( self.thumbs.state == THUMB_GENERATOR_RUNNING ||
+	    self.thumbs.state == THUMB_GENERATOR_PAUSED ) {
+		self.thumbs_timer = LCUITimer_Set( 1000, OnUpdateThumbStats,
+						   NULL, TRUE );
+		TextViewI18n_SetKey( self.title, KEY_TITLE_THUMBS );
+		OnUpdateThumbStats( NULL );
+		return;
+	}
 	Widget_AddClass( alert, "hide" );
 }
 
@@ -125,7 +174,7 @@ static void OnFinishSyncFiles( void *data )
 	LCUITimer_Set( 3000, OnHideTip, NULL, FALSE );
 	self.is_syncing = FALSE;
 	self.timer = 0;
-	LCFinder_TriggerEvent( EVENT_SYNC_DONE, NULL );
+	LCFinder_TriggerEvent( EVENT_SYNC_DONE, &self.status );
 }
 
 static void OnStartSyncFiles( void *privdata, void *data )
@@ -134,6 +183,7 @@ static void OnStartSyncFiles( void *privdata, void *data )
 	if( self.is_syncing ) {
 		return;
 	}
+	StopUpdateThumbStats();
 	OnUpdateStats( NULL );
 	self.is_syncing = TRUE;
 	self.timer = LCUITimer_Set( 200, OnUpdateStats, NULL, TRUE );
@@ -142,8 +192,22 @@ static void OnStartSyncFiles( void *privdata, void *data )
 	Widget_RemoveClass( alert, "hide" );
 }
 
+/** 用户操作时暂停生成缩略图 */
+static void OnUserActivity( LCUI_SysEvent e, void *arg )
+{
+	ThumbGenerator_Touch();
+}
+
 void UI_InitFileSyncTip( void )
 {
+	int i;
+	int events[] = {
+		LCUI_KEYDOWN, LCUI_MOUSEDOWN, LCUI_MOUSEMOVE,
+		LCUI_MOUSEWHEEL, LCUI_TOUCH
+	};
+	for( i = 0; i < (int)(sizeof( events ) / sizeof( int )); ++i ) {
+		LCUI_BindEvent( events[i], OnUserActivity, NULL, NULL );
+	}
 	self.status.data = NULL;
 	self.status.callback = OnFinishSyncFiles;
 	self.text = LCUIWidget_GetById( ID_TXT_FILE_SYNC_STATS );
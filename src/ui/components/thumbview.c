@@ -35,11 +35,13 @@
  * ****************************************************************************/
 
 #include <math.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "finder.h"
 #include "file_storage.h"
+#include "image_scaler.h"
 #include <LCUI/timer.h>
 #include <LCUI/display.h>
 #include <LCUI/graph.h>
@@ -47,7 +49,12 @@
 #include <LCUI/gui/widget/textview.h>
 #include "thumbview.h"
 
-#define THUMB_TASK_MAX		32
+#ifdef _WIN32
+#define strdup _strdup
+#endif
+
+/** 缩略图加载任务队列的最大长度，需要能容纳一整屏的缩略图 */
+#define THUMB_TASK_MAX		128
 #define SCROLLLOADING_DELAY	500
 #define LAYOUT_DELAY		1000
 #define ANIMATION_DELAY		750
@@ -60,8 +67,9 @@
 #define FOLDER_MARGIN_RIGHT	10
 #define FOLDER_CLASS		"file-list-item-folder"
 #define PICTURE_CLASS		"file-list-item-picture"
-#define DIR_COVER_THUMB		"__dir_cover_thumb__"
 #define THUMB_MAX_WIDTH		240
+/** 从缩略图数据库载入缩略图的线程数量 */
+#define THUMBVIEW_DB_THREADS	2
 
 /** 滚动加载功能的相关数据 */
 typedef struct ScrollLoadingRec_ {
@@ -122,13 +130,18 @@ typedef void( *ThumbLoaderCallback )(ThumbLoader);
 typedef struct ThumbLoaderRec_ {
 	LCUI_BOOL active;		/**< 是否处于活动状态 */
 	ThumbDB db;			/**< 缩略图缓存数据库 */
+	FileFingerprintRec fp;		/**< 文件指纹，用于在数据库中查找缩略图 */
+	LCUI_BOOL has_fp;		/**< 是否已获取到文件指纹 */
+	LCUI_BOOL exact;		/**< 是否需要单独生成指定尺寸的缩略图 */
+	int width, height;		/**< 缩略图的最大宽度和高度 */
 	ThumbView view;			/**< 所属缩略图视图 */
 	LCUI_Widget target;		/**< 需要缩略图的部件 */
 	LCUI_Mutex mutex;		/**< 互斥锁 */
 	LCUI_Cond cond;			/**< 条件变量 */
-	char path[PATH_LEN];		/**< 图片文件路径，相对于源文件夹 */
 	char fullpath[PATH_LEN];	/**< 图片文件的完整路径 */
 	wchar_t *wfullpath;		/**< 图片文件路径（宽字符版） */
+	int request;			/**< 正在进行的文件请求的标识号 */
+	FileStatus status;		/**< 批量获取到的文件状态，交给数据库载入线程使用 */
 	void *data;			/**< 传给回调函数的附加参数 */
 	ThumbLoaderCallback callback;	/**< 回调函数 */
 } ThumbLoaderRec;
@@ -143,22 +156,25 @@ enum ThumbViewTaskState {
 /** 任务 */
 typedef struct ThumbViewTaskRec_ {
 	int state;
-	union {
-		ThumbLoader loader;
-		void *data;
-	};
 } ThumbViewTaskRec, *ThumbViewTask;
 
 typedef struct ThumbViewRec_ {
 	int storage;				/**< 文件存储服务的连接标识符 */
-	Dict **dbs;				/**< 缩略图数据库字典，以目录路径进行索引 */
+	ThumbDB *db;				/**< 缩略图数据库 */
 	ThumbCache cache;			/**< 缩略图缓存 */
 	ThumbLinker linker;			/**< 缩略图链接器 */
 	LinkedList files;			/**< 当前视图下的文件列表 */
 	LinkedList thumb_tasks;			/**< 缩略图加载任务队列 */
+	Dict *statuses;				/**< 批量获取到的文件状态，以文件路径进行索引 */
+	int status_request;			/**< 正在进行的批量获取文件状态请求的标识号 */
 	LCUI_Cond tasks_cond;			/**< 任务队列条件变量 */
 	LCUI_Mutex tasks_mutex;			/**< 任务队列互斥锁 */
+	LinkedList db_loads;			/**< 等待从数据库载入缩略图的加载器 */
+	LCUI_Cond db_cond;			/**< 数据库载入队列条件变量，与任务队列共用互斥锁 */
+	LCUI_Thread db_threads[THUMBVIEW_DB_THREADS];	/**< 数据库载入线程 */
 	ThumbViewTaskRec tasks[TASK_TOTAL];	/**< 当前任务 */
+	size_t n_loaders;			/**< 正在运行的缩略图加载器数量 */
+	size_t max_loaders;			/**< 最多同时运行多少个缩略图加载器 */
 	LCUI_Mutex mutex;			/**< 互斥锁 */
 	LCUI_Thread thread;			/**< 任务处理线程 */
 	LCUI_BOOL is_loading;			/**< 是否处于载入中状态 */
@@ -169,6 +185,13 @@ typedef struct ThumbViewRec_ {
 	void (*onlayout)(LCUI_Widget);		/**< 回调函数，当布局开始时调用 */
 } ThumbViewRec;
 
+/** 批量获取文件状态的任务 */
+typedef struct ThumbViewStatusTaskRec_ {
+	ThumbView view;		/**< 所属缩略图视图 */
+	size_t count;		/**< 文件数量 */
+	char **paths;		/**< 文件路径列表 */
+} ThumbViewStatusTaskRec, *ThumbViewStatusTask;
+
 /** 缩略图列表项的数据 */
 typedef struct ThumbViewItemRec_ {
 	char *path;					/**< 路径 */
@@ -493,6 +516,8 @@ static void ThumbLoader_OnDone( ThumbLoader loader,
 	ThumbLoader_OnError( loader );
 }
 
+static void ThumbLoader_Request( ThumbLoader loader );
+
 static void OnGetThumbnail( FileStatus *status,
 			    LCUI_Graph *thumb, void *data )
 {
@@ -509,19 +534,115 @@ static void OnGetThumbnail( FileStatus *status,
 		ThumbLoader_OnError( loader );
 		return;
 	}
+	/* 原图太宽或太高，金字塔用不上，改为直接生成指定尺寸的缩略图 */
+	if( !loader->exact &&
+	    !ThumbDB_LevelsFit( status->image->width, status->image->height,
+				loader->width, loader->height ) ) {
+		loader->exact = TRUE;
+		ThumbLoader_Request( loader );
+		return;
+	}
 	tdata.origin_width = status->image->width;
 	tdata.origin_height = status->image->height;
 	tdata.modify_time = (uint_t)status->mtime;
 	tdata.graph = *thumb;
-	ThumbDB_Save( loader->db, loader->path, &tdata );
+	if( loader->has_fp && loader->exact ) {
+		ThumbKeyRec key;
+		ThumbKey_Init( &key, &loader->fp,
+			       loader->width, loader->height );
+		ThumbDB_Save( loader->db, &key, &tdata );
+	} else if( loader->has_fp ) {
+		/* 这里是文件客户端的线程，缩小和编码交给数据库的写入线程 */
+		ThumbDB_SaveLevelsAsync( loader->db, &loader->fp, &tdata );
+	}
+	/* 金字塔的最大一级比需要的尺寸大，缩小后再显示 */
+	if( (loader->width > 0 && thumb->width > loader->width) ||
+	    (loader->height > 0 && thumb->height > loader->height) ) {
+		Graph_Init( &tdata.graph );
+		if( ImageScaler_Zoom( thumb, &tdata.graph, TRUE, loader->width,
+				      loader->height ) != 0 ) {
+			tdata.graph = *thumb;
+		} else {
+			Graph_Free( thumb );
+		}
+	}
 	ThumbLoader_OnDone( loader, &tdata, status );
 	/** 重置数据，避免被释放 */
 	Graph_Init( thumb );
 }
 
+/**
+ * 获取文件指纹
+ * 优先使用数据库中记录的文件指纹，文件大小不一致或 refresh 为 TRUE 时，说明
+ * 记录可能已经过时，改为读取文件重新计算。
+ */
+static int ThumbLoader_GetFingerprint( ThumbLoader loader, FileStatus *status,
+				       LCUI_BOOL refresh )
+{
+	FileFingerprint fp = &loader->fp;
+
+	loader->has_fp = FALSE;
+	if( refresh || DB_GetFileFingerprint( loader->fullpath, &fp->size,
+					      &fp->hash ) != 0 ||
+	    fp->size != (int64_t)status->size ) {
+		if( wgetfilefingerprint( loader->wfullpath, fp ) != 0 ) {
+			return -1;
+		}
+	}
+	loader->has_fp = TRUE;
+	return 0;
+}
+
+/** 从数据库中载入缩略图，优先使用缩略图金字塔 */
+static int ThumbLoader_LoadFromDB( ThumbLoader loader, ThumbData data )
+{
+	int ret = -ERANGE;
+	ThumbKeyRec key;
+
+	if( !loader->exact ) {
+		ret = ThumbDB_LoadLevel( loader->db, &loader->fp,
+					 loader->width, loader->height, data );
+	}
+	/* 金字塔的尺寸不够，例如很宽的全景图，改用单独生成的缩略图 */
+	if( ret == -ERANGE ) {
+		loader->exact = TRUE;
+		ThumbKey_Init( &key, &loader->fp,
+			       loader->width, loader->height );
+		ret = ThumbDB_Load( loader->db, &key, data );
+	}
+	return ret;
+}
+
+/** 请求生成缩略图 */
+static void ThumbLoader_Request( ThumbLoader loader )
+{
+	int width, height;
+
+	/* 一次生成金字塔的最大一级，其它尺寸的缩略图都可以由它得到 */
+	if( loader->exact ) {
+		width = loader->width;
+		height = loader->height;
+	} else {
+		width = height = THUMB_LEVEL_MAX_SIZE;
+	}
+	/* 在锁内记录请求标识号，以免响应先于赋值到达 */
+	LCUIMutex_Lock( &loader->mutex );
+	if( !loader->active || !loader->target ) {
+		LCUIMutex_Unlock( &loader->mutex );
+		ThumbLoader_Callback( loader );
+		return;
+	}
+	loader->request = FileStorage_GetThumbnail( loader->view->storage,
+						    loader->wfullpath,
+						    width, height,
+						    OnGetThumbnail, loader );
+	LCUIMutex_Unlock( &loader->mutex );
+}
+
 static void ThumbLoader_Load( ThumbLoader loader, FileStatus *status )
 {
-	int ret;
+	int ret = -1;
+	int width = 0, height = 0;
 	ThumbDataRec tdata;
 	ThumbViewItem item;
 	LCUIMutex_Lock( &loader->mutex );
@@ -530,26 +651,59 @@ static void ThumbLoader_Load( ThumbLoader loader, FileStatus *status )
 		ThumbLoader_Callback( loader );
 		return;
 	}
-	ret = ThumbDB_Load( loader->db, loader->path, &tdata );
 	item = Widget_GetData( loader->target, self.item );
+	if( item->is_dir ) {
+		loader->width = FOLDER_MAX_WIDTH;
+		loader->height = 0;
+	} else {
+		loader->width = 0;
+		loader->height = THUMB_MAX_WIDTH;
+		width = item->file->width;
+		height = item->file->height;
+	}
+	if( status && status->image ) {
+		width = status->image->width;
+		height = status->image->height;
+	}
+	/* 已知原图尺寸时，可以提前知道金字塔能否满足要求 */
+	loader->exact = !ThumbDB_LevelsFit( width, height, loader->width,
+					    loader->height );
+	loader->db = *loader->view->db;
 	LCUIMutex_Unlock( &loader->mutex );
+	/* 计算指纹和解码都比较耗时，不占用锁，由 ThumbLoader_OnDone() 在锁内发布结果 */
+	if( loader->db && status &&
+	    ThumbLoader_GetFingerprint( loader, status, FALSE ) == 0 ) {
+		ret = ThumbLoader_LoadFromDB( loader, &tdata );
+	}
 	if( ret == 0 ) {
-		if( status && tdata.modify_time == status->mtime ) {
+		/* 修改时间变了，但内容可能没变，按重新计算的指纹再确认一次 */
+		if( tdata.modify_time != status->mtime ) {
+			uint64_t hash = loader->fp.hash;
+			ThumbKeyRec key;
+			ThumbLoader_GetFingerprint( loader, status, TRUE );
+			if( !loader->has_fp || hash != loader->fp.hash ) {
+				Graph_Free( &tdata.graph );
+				ret = -1;
+			} else if( loader->exact ) {
+				/* 更新记录的修改时间，下次不必再确认 */
+				tdata.modify_time = (uint_t)status->mtime;
+				ThumbKey_Init( &key, &loader->fp,
+					       loader->width, loader->height );
+				ThumbDB_SetModifyTime( loader->db, &key,
+						       tdata.modify_time );
+			} else {
+				tdata.modify_time = (uint_t)status->mtime;
+				ThumbDB_SetLevelsModifyTime( loader->db,
+							     &loader->fp,
+							     tdata.modify_time );
+			}
+		}
+		if( ret == 0 ) {
 			ThumbLoader_OnDone( loader, &tdata, status );
 			return;
 		}
 	}
-	if( item->is_dir ) {
-		FileStorage_GetThumbnail( loader->view->storage,
-					  loader->wfullpath,
-					  FOLDER_MAX_WIDTH, 0,
-					  OnGetThumbnail, loader );
-		return;
-	}
-	FileStorage_GetThumbnail( loader->view->storage,
-				  loader->wfullpath,
-				  0, THUMB_MAX_WIDTH,
-				  OnGetThumbnail, loader );
+	ThumbLoader_Request( loader );
 }
 
 static void OnGetFileStatus( FileStatus *status, void *data )
@@ -574,6 +728,7 @@ static ThumbLoader ThumbLoader_Create( ThumbView view, LCUI_Widget target )
 	loader->view = view;
 	loader->data = NULL;
 	loader->active = TRUE;
+	loader->request = 0;
 	loader->target = target;
 	loader->callback = NULL;
 	LCUICond_Init( &loader->cond );
@@ -590,25 +745,73 @@ static void ThumbLoader_SetCallback( ThumbLoader loader,
 	loader->data = data;
 }
 
+/** 取出批量获取到的文件状态，取出后视图不再保留它 */
+static int ThumbView_TakeFileStatus( ThumbView view, const char *path,
+				     FileStatusItem *status )
+{
+	int ret = -1;
+	FileStatusItem *data;
+	LCUIMutex_Lock( &view->tasks_mutex );
+	data = Dict_FetchValue( view->statuses, path );
+	if( data ) {
+		*status = *data;
+		status->file.image = NULL;
+		Dict_Delete( view->statuses, path );
+		/* 状态为 0 表示批量获取失败 */
+		ret = status->status > 0 ? 0 : -1;
+	}
+	LCUIMutex_Unlock( &view->tasks_mutex );
+	return ret;
+}
+
+/**
+ * 将加载器交给数据库载入线程
+ * 任务处理线程在视图的锁内启动加载器，不能在那里读取数据库和解码缩略图。
+ */
+static void ThumbView_QueueDBLoad( ThumbView view, ThumbLoader loader,
+				   const FileStatus *status )
+{
+	loader->status = *status;
+	LCUIMutex_Lock( &view->tasks_mutex );
+	LinkedList_Append( &view->db_loads, loader );
+	LCUICond_Signal( &view->db_cond );
+	LCUIMutex_Unlock( &view->tasks_mutex );
+}
+
+/** 数据库载入线程，视图停止运行后仍会处理完队列中剩余的加载器 */
+static void ThumbView_DBThread( void *arg )
+{
+	ThumbView view = arg;
+	ThumbLoader loader;
+	LinkedListNode *node;
+
+	LCUIMutex_Lock( &view->tasks_mutex );
+	while( 1 ) {
+		node = LinkedList_GetNode( &view->db_loads, 0 );
+		if( !node ) {
+			if( !view->is_running ) {
+				break;
+			}
+			LCUICond_Wait( &view->db_cond, &view->tasks_mutex );
+			continue;
+		}
+		loader = node->data;
+		LinkedList_DeleteNode( &view->db_loads, node );
+		LCUIMutex_Unlock( &view->tasks_mutex );
+		ThumbLoader_Load( loader, &loader->status );
+		LCUIMutex_Lock( &view->tasks_mutex );
+	}
+	LCUIMutex_Unlock( &view->tasks_mutex );
+	LCUIThread_Exit( NULL );
+}
+
 /** 载入缩略图 */
 static void ThumbLoader_Start( ThumbLoader loader )
 {
-	size_t len;
-	DB_Dir dir;
 	ThumbViewItem item;
+	FileStatusItem status;
 	ThumbView view = loader->view;
 	item = Widget_GetData( loader->target, self.item );
-	dir = LCFinder_GetSourceDir( item->path );
-	if( !dir ) {
-		ThumbLoader_OnError( loader );
-		return;
-	}
-	loader->db = Dict_FetchValue( *view->dbs, dir->path );
-	if( !loader->db ) {
-		ThumbLoader_OnError( loader );
-		return;
-	}
-	len = strlen( dir->path );
 	if( item->is_dir ) {
 		pathjoin( loader->fullpath, item->path, "" );
 		if( GetDirThumbFilePath( loader->fullpath, 
@@ -616,21 +819,25 @@ static void ThumbLoader_Start( ThumbLoader loader )
 			ThumbLoader_OnError( loader );
 			return;
 		}
-		if( item->path[len] == PATH_SEP ) {
-			len += 1;
-		}
-		pathjoin( loader->path, item->path + len, DIR_COVER_THUMB );
 	} else {
 		pathjoin( loader->fullpath, item->path, "" );
-		if( item->path[len] == PATH_SEP ) {
-			len += 1;
-		}
-		pathjoin( loader->path, item->path + len , "" );
 	}
 	loader->wfullpath = DecodeUTF8( loader->fullpath );
-	FileStorage_GetStatus( loader->view->storage,
-			       loader->wfullpath, FALSE,
-			       OnGetFileStatus, loader );
+	/* 文件状态已经随可见区域内的其它文件一起获取过了，不必再单独请求 */
+	if( !item->is_dir &&
+	    ThumbView_TakeFileStatus( view, item->path, &status ) == 0 ) {
+		if( status.status == RESPONSE_STATUS_OK ) {
+			ThumbView_QueueDBLoad( view, loader, &status.file );
+		} else {
+			ThumbLoader_OnError( loader );
+		}
+		return;
+	}
+	LCUIMutex_Lock( &loader->mutex );
+	loader->request = FileStorage_GetStatus( loader->view->storage,
+						 loader->wfullpath, FALSE,
+						 OnGetFileStatus, loader );
+	LCUIMutex_Unlock( &loader->mutex );
 }
 
 static void ThumbLoader_Stop( ThumbLoader loader )
@@ -638,23 +845,39 @@ static void ThumbLoader_Stop( ThumbLoader loader )
 	LCUIMutex_Lock( &loader->mutex );
 	loader->active = FALSE;
 	loader->target = NULL;
+	/* 取消正在进行的请求，让文件服务尽快处理其它缩略图 */
+	FileStorage_Cancel( loader->view->storage, loader->request );
 	LCUIMutex_Unlock( &loader->mutex );
 }
 
-static void ThumbView_OnThumbLoadDone( ThumbLoader loader )
+/**
+ * 更新加载缩略图的任务状态
+ * 队列中有任务且还有空闲的加载器时才需要处理，需要在任务队列的锁内调用。
+ */
+static void ThumbView_UpdateLoadState( ThumbView view )
 {
-	ThumbView view = loader->view;
 	ThumbViewTask task = &view->tasks[TASK_LOAD_THUMB];
-	LCUIMutex_Lock( &view->tasks_mutex );
-	if( loader->view->thumb_tasks.length > 0 ) {
+	if( view->status_request > 0 ) {
+		task->state = TASK_STATE_RUNNING;
+	} else if( view->thumb_tasks.length > 0 &&
+		   view->n_loaders < view->max_loaders ) {
 		task->state = TASK_STATE_READY;
+	} else if( view->thumb_tasks.length > 0 || view->n_loaders > 0 ) {
+		task->state = TASK_STATE_RUNNING;
 	} else {
 		task->state = TASK_STATE_FINISHED;
 	}
+}
+
+static void ThumbView_OnThumbLoadDone( ThumbLoader loader )
+{
+	ThumbView view = loader->view;
+	LCUIMutex_Lock( &view->tasks_mutex );
+	view->n_loaders -= 1;
+	ThumbView_UpdateLoadState( view );
 	ThumbLoader_Destroy( loader );
 	LCUICond_Signal( &view->tasks_cond );
 	LCUIMutex_Unlock( &view->tasks_mutex );
-	task->loader = NULL;
 }
 
 /** 执行加载缩略图的任务 */
@@ -677,8 +900,10 @@ static void ThumbView_ExecLoadThumb( LCUI_Widget w, LCUI_Widget target )
 		return;
 	}
 	ThumbLoader_SetCallback( loader, ThumbView_OnThumbLoadDone, NULL );
-	view->tasks[TASK_LOAD_THUMB].state = TASK_STATE_RUNNING;
-	view->tasks[TASK_LOAD_THUMB].loader = loader;
+	/* 加载器可能在启动时就出错并结束，需要先计数 */
+	LCUIMutex_Lock( &view->tasks_mutex );
+	view->n_loaders += 1;
+	LCUIMutex_Unlock( &view->tasks_mutex );
 	ThumbLoader_Start( loader );
 }
 
@@ -723,6 +948,9 @@ void ThumbView_Empty( LCUI_Widget w )
 	view->layout.current = NULL;
 	view->layout.folder_count = 0;
 	LinkedList_Clear( &view->thumb_tasks, NULL );
+	FileStorage_Cancel( view->storage, view->status_request );
+	view->status_request = 0;
+	Dict_Empty( view->statuses );
 	LinkedList_Clear( &view->layout.row, NULL );
 	for( LinkedList_Each( node, &view->files ) ) {
 		ThumbCache_Unlink( view->cache, view->linker, node->data );
@@ -1073,7 +1301,7 @@ static void OnScrollLoad( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 		target = node->data;
 	}
 	LinkedList_Insert( &data->view->thumb_tasks, 0, w );
-	data->view->tasks[TASK_LOAD_THUMB].state = TASK_STATE_READY;
+	ThumbView_UpdateLoadState( data->view );
 	/* 通知任务线程处理该任务 */
 	LCUICond_Signal( &data->view->tasks_cond );
 	LCUIMutex_Unlock( &data->view->tasks_mutex );
@@ -1189,10 +1417,36 @@ void ThumbView_SetCache( LCUI_Widget w, ThumbCache cache )
 	view->cache = cache;
 }
 
+/**
+ * 按加载器数量放宽连接上的请求数量限制
+ * 每个加载器同时只有一个请求，另外还有一个批量获取文件状态的请求，限制得比
+ * 这少的话，多出的加载器只能空等。
+ */
+static void ThumbView_UpdateMaxRequests( ThumbView view )
+{
+	if( view->storage > 0 ) {
+		FileStorage_SetMaxRequests( view->storage,
+					    max( view->max_loaders + 1,
+						 FILE_CLIENT_MAX_REQUESTS ) );
+	}
+}
+
+void ThumbView_SetMaxLoaders( LCUI_Widget w, size_t n )
+{
+	ThumbView view = Widget_GetData( w, self.main );
+	LCUIMutex_Lock( &view->tasks_mutex );
+	view->max_loaders = max( n, 1 );
+	ThumbView_UpdateMaxRequests( view );
+	ThumbView_UpdateLoadState( view );
+	LCUICond_Signal( &view->tasks_cond );
+	LCUIMutex_Unlock( &view->tasks_mutex );
+}
+
 void ThumbView_SetStorage( LCUI_Widget w, int storage )
 {
 	ThumbView view = Widget_GetData( w, self.main );
 	view->storage = storage;
+	ThumbView_UpdateMaxRequests( view );
 }
 
 static int OnCompareTaskTarget( void *data, const void *keydata )
@@ -1206,6 +1460,99 @@ static int OnCompareTaskTarget( void *data, const void *keydata )
 	}
 }
 
+static void ThumbViewStatusTask_Destroy( ThumbViewStatusTask task )
+{
+	size_t i;
+	for( i = 0; i < task->count; ++i ) {
+		free( task->paths[i] );
+	}
+	free( task->paths );
+	free( task );
+}
+
+static void OnGetFileStatusList( FileStatusItem *items,
+				 size_t count, void *data )
+{
+	size_t i;
+	FileStatusItem *status;
+	ThumbViewStatusTask task = data;
+	ThumbView view = task->view;
+	LCUIMutex_Lock( &view->tasks_mutex );
+	/* 视图被清空时请求会被取消，这些结果已经不需要了 */
+	for( i = 0; view->status_request > 0 && i < task->count; ++i ) {
+		if( Dict_FetchValue( view->statuses, task->paths[i] ) ) {
+			continue;
+		}
+		/* 获取失败时状态为 0，加载器会改为单独获取 */
+		status = NEW( FileStatusItem, 1 );
+		if( items ) {
+			*status = items[i];
+			status->file.image = NULL;
+		}
+		Dict_Add( view->statuses, task->paths[i], status );
+	}
+	view->status_request = 0;
+	ThumbView_UpdateLoadState( view );
+	LCUICond_Signal( &view->tasks_cond );
+	LCUIMutex_Unlock( &view->tasks_mutex );
+	ThumbViewStatusTask_Destroy( task );
+}
+
+/**
+ * 批量获取待加载缩略图的文件的状态
+ * 用一次请求验证整个可见区域内的文件，避免每个缩略图都单独请求一次。调用前需
+ * 要锁定任务队列，已有状态的文件和文件夹会被忽略，没有需要获取的文件时返回 -1
+ */
+static int ThumbView_LoadFileStatus( ThumbView view )
+{
+	size_t i;
+	wchar_t **paths;
+	ThumbViewItem item;
+	LinkedListNode *node;
+	ThumbViewStatusTask task;
+
+	/* 上一批还在获取中，等它的结果到达后再继续 */
+	if( view->status_request > 0 ) {
+		return 0;
+	}
+
+	task = NEW( ThumbViewStatusTaskRec, 1 );
+	task->view = view;
+	task->paths = NEW( char*, view->thumb_tasks.length + 1 );
+	for( LinkedList_Each( node, &view->thumb_tasks ) ) {
+		item = Widget_GetData( node->data, self.item );
+		if( !item || item->is_dir ||
+		    Dict_FetchValue( view->statuses, item->path ) ||
+		    ThumbCache_Get( view->cache, item->path ) ) {
+			continue;
+		}
+		task->paths[task->count++] = strdup( item->path );
+	}
+	if( task->count < 1 ) {
+		ThumbViewStatusTask_Destroy( task );
+		return -1;
+	}
+	paths = NEW( wchar_t*, task->count );
+	for( i = 0; i < task->count; ++i ) {
+		paths[i] = DecodeUTF8( task->paths[i] );
+	}
+	view->status_request = FileStorage_GetStatusList( view->storage,
+							  paths, task->count,
+							  FALSE,
+							  OnGetFileStatusList,
+							  task );
+	for( i = 0; i < task->count; ++i ) {
+		free( paths[i] );
+	}
+	free( paths );
+	if( view->status_request < 0 ) {
+		view->status_request = 0;
+		ThumbViewStatusTask_Destroy( task );
+		return -1;
+	}
+	return 0;
+}
+
 static void ThumbView_ExecTask( LCUI_Widget w, int task )
 {
 	LCUI_Widget target;
@@ -1214,16 +1561,26 @@ static void ThumbView_ExecTask( LCUI_Widget w, int task )
 	switch( task ) {
 	case TASK_LOAD_THUMB:
 		LCUIMutex_Lock( &view->tasks_mutex );
-		node = LinkedList_GetNode( &view->thumb_tasks, 0 );
-		if( !node ) {
+		/* 先获取队列中各个文件的状态，收到结果后再加载缩略图 */
+		if( view->thumb_tasks.length > 0 ) {
+			ThumbView_LoadFileStatus( view );
+		}
+		/* 同时运行多个加载器，让文件服务能够并行解码 */
+		while( view->status_request == 0 &&
+		       view->n_loaders < view->max_loaders ) {
+			node = LinkedList_GetNode( &view->thumb_tasks, 0 );
+			if( !node ) {
+				break;
+			}
+			target = node->data;
+			LinkedList_Unlink( &view->thumb_tasks, node );
 			LCUIMutex_Unlock( &view->tasks_mutex );
-			break;
+			ThumbView_ExecLoadThumb( w, target );
+			LinkedListNode_Delete( node );
+			LCUIMutex_Lock( &view->tasks_mutex );
 		}
-		target = node->data;
-		LinkedList_Unlink( &view->thumb_tasks, node );
+		ThumbView_UpdateLoadState( view );
 		LCUIMutex_Unlock( &view->tasks_mutex );
-		ThumbView_ExecLoadThumb( w, target );
-		LinkedListNode_Delete( node );
 		break;
 	case TASK_LAYOUT:
 		ThumbView_ExecUpdateLayout( w );
@@ -1269,6 +1626,19 @@ static void ThumbView_TaskThread( void *arg )
 			LCUICond_TimedWait( &view->tasks_cond, 
 					    &view->tasks_mutex, 500 );
 			LCUIMutex_Unlock( &view->tasks_mutex );
+		} else {
+			/* 只剩正在运行的任务时，等到有任务完成再继续 */
+			LCUIMutex_Lock( &view->tasks_mutex );
+			for( i = 0; i < TASK_TOTAL; ++i ) {
+				if( view->tasks[i].state == TASK_STATE_READY ) {
+					break;
+				}
+			}
+			if( i == TASK_TOTAL ) {
+				LCUICond_TimedWait( &view->tasks_cond,
+						    &view->tasks_mutex, 500 );
+			}
+			LCUIMutex_Unlock( &view->tasks_mutex );
 		}
 		/* 检查自己及父级部件是否可见 */
 		for( parent = w; parent; parent->parent ) {
@@ -1356,11 +1726,17 @@ static void ThumbView_OnReady( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 	Widget_BindEvent( w->parent, "resize", OnResize, w, NULL );
 }
 
+static void OnDeleteFileStatus( void *privdata, void *data )
+{
+	free( data );
+}
+
 static void ThumbView_OnInit( LCUI_Widget w )
 {
+	int i;
 	const size_t data_size = sizeof( ThumbViewRec );
 	ThumbView view = Widget_AddData( w, self.main, data_size );
-	view->dbs = &finder.thumb_dbs;
+	view->db = &finder.thumb_db;
 	view->is_loading = FALSE;
 	view->is_running = TRUE;
 	view->onlayout = NULL;
@@ -1382,21 +1758,32 @@ static void ThumbView_OnInit( LCUI_Widget w )
 	view->animation.is_runing = FALSE;
 	view->animation.opacity_delta = 1.0 / (ANIMATION_DURATION / 2 / 20);
 	memset( view->tasks, 0, sizeof( view->tasks) );
+	view->n_loaders = 0;
+	view->max_loaders = getcpucount();
 	LCUICond_Init( &view->tasks_cond );
 	LCUIMutex_Init( &view->tasks_mutex );
 	LCUIMutex_Init( &view->mutex );
 	LinkedList_Init( &view->files );
 	LinkedList_Init( &view->thumb_tasks );
+	LinkedList_Init( &view->db_loads );
+	LCUICond_Init( &view->db_cond );
+	view->statuses = StrDict_Create( NULL, OnDeleteFileStatus );
+	view->status_request = 0;
 	LinkedList_Init( &view->layout.row );
 	LCUIMutex_Init( &view->layout.row_mutex );
 	view->scrollload = ScrollLoading_New( w );
 	Widget_BindEvent( w, "ready", ThumbView_OnReady, NULL, NULL );
 	Widget_BindEvent( w, "remove", ThumbView_OnRemove, NULL, NULL );
 	LCUIThread_Create( &view->thread, ThumbView_TaskThread, w );
+	for( i = 0; i < THUMBVIEW_DB_THREADS; ++i ) {
+		LCUIThread_Create( &view->db_threads[i],
+				   ThumbView_DBThread, view );
+	}
 }
 
 static void ThumbView_OnDestroy( LCUI_Widget w )
 {
+	int i;
 	ThumbView view = Widget_GetData( w, self.main );
 	ThumbView_Lock( w );
 	ThumbView_Empty( w );
@@ -1407,6 +1794,13 @@ static void ThumbView_OnDestroy( LCUI_Widget w )
 	LCUICond_Signal( &view->tasks_cond );
 	LCUIMutex_Unlock( &view->tasks_mutex );
 	LCUIThread_Join( view->thread, NULL );
+	LCUIMutex_Lock( &view->tasks_mutex );
+	LCUICond_Broadcast( &view->db_cond );
+	LCUIMutex_Unlock( &view->tasks_mutex );
+	for( i = 0; i < THUMBVIEW_DB_THREADS; ++i ) {
+		LCUIThread_Join( view->db_threads[i], NULL );
+	}
+	Dict_Release( view->statuses );
 }
 
 void LCUIWidget_AddThumbView( void )
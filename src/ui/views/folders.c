@@ -169,6 +169,7 @@ static void FileScanner_OnGetDirs( FileStatus *status,
 	size_t len, dirpath_len;
 	FileScanner scanner = data;
 	FileEntry file_entry;
+	FileDirEntry entry;
 
 	LCUIMutex_Lock( &scanner->mutex_scan );
 	if( !status || !stream ) {
@@ -179,26 +180,16 @@ static void FileScanner_OnGetDirs( FileStatus *status,
 	}
 	dirpath = EncodeUTF8( scanner->dirpath );
 	dirpath_len = strlen( dirpath );
-	while( 1 ) {
-		char *p, buf[PATH_LEN];
-		p = FileStream_ReadLine( stream, buf, PATH_LEN );
-		if( !p ) {
-			break;
-		}
-		if( buf[0] != 'd' ) {
-			continue;
-		}
-		len = strlen( buf );
-		if( len < 2 ) {
+	while( FileStream_ReadDirEntry( stream, &entry ) ) {
+		if( entry.type != FILE_TYPE_DIRECTORY ) {
 			continue;
 		}
-		buf[len - 1] = 0;
 		file_entry = NEW( FileEntryRec, 1 );
 		file_entry->is_dir = TRUE;
 		file_entry->file = NULL;
-		len = len + dirpath_len;
+		len = dirpath_len + entry.name_len + 2;
 		file_entry->path = malloc( sizeof( char ) * len );
-		pathjoin( file_entry->path, dirpath, buf + 1 );
+		pathjoin( file_entry->path, dirpath, entry.name );
 		LCUIMutex_Lock( &scanner->mutex );
 		LinkedList_Append( &scanner->files, file_entry );
 		scanner->files_count += 1;
@@ -41,6 +41,7 @@
 #include "finder.h"
 #include "ui.h"
 #include "file_storage.h"
+#include "image_scaler.h"
 #include <LCUI/timer.h>
 #include <LCUI/display.h>
 #include <LCUI/cursor.h>
@@ -87,13 +88,18 @@ typedef struct PcitureRec_ {
 	wchar_t *file_for_load;		/**< 当前需加载的图片的路径  */
 	LCUI_BOOL is_loading;		/**< 是否正在载入图片 */
 	LCUI_BOOL is_valid;		/**< 图片内容是否有效 */
+	LCUI_BOOL is_canceled;		/**< 正在进行的加载是否已被取消 */
 	LCUI_Graph *data;		/**< 当前已经加载的图片数据 */
+	LCUI_Graph *rendition;		/**< 缩小到当前显示尺寸的图片，按最小比例显示时代替原图呈现 */
+	LCUI_Graph *shown;		/**< 当前作为背景呈现的图像 */
 	LCUI_Widget view;		/**< 视图，用于呈现该图片 */
 	LCUI_Mutex mutex;		/**< 互斥锁，用于异步加载 */
 	LCUI_Cond cond;			/**< 条件变量，用于异步加载 */
 	double scale;			/**< 图片缩放比例 */
 	double min_scale;		/**< 图片最小缩放比例 */
 	int timer;			/**< 定时器，用于延迟显示“载入中...”提示框 */
+	int storage;			/**< 加载图片所用的文件服务连接 */
+	int request;			/**< 加载图片的请求的标识号 */
 } PictureRec, *Picture;
 
 /** 文件索引记录 */
@@ -285,6 +291,11 @@ static void TaskForSetWidgetBackground( void *arg1, void *arg2 )
 	Widget_UpdateStyle( w, FALSE );
 }
 
+static void TaskForDeleteGraph( void *arg1, void *arg2 )
+{
+	Graph_Delete( arg1 );
+}
+
 static void TaskForHideTipEmpty( void *arg1, void *arg2 )
 {
 	Widget_RemoveClass( this_view.tip_empty, "hide" );
@@ -363,6 +374,7 @@ static void UpdateResetSizeButton( void )
 
 static void SetPictureView( Picture pic )
 {
+	pic->shown = pic->data;
 	LCUI_PostSimpleTask( TaskForSetWidgetBackground,
 			     pic->view, pic->data );
 }
@@ -371,10 +383,60 @@ static void ClearPictureView( Picture pic )
 {
 	LCUI_PostSimpleTask( TaskForResetWidgetBackground,
 			     pic->view, pic->data );
+	/* 背景图像在任务中移除，缩小的图像需要在那之后才能释放 */
+	if( pic->rendition ) {
+		LCUI_PostSimpleTask( TaskForDeleteGraph, pic->rendition, NULL );
+		pic->rendition = NULL;
+	}
 	pic->is_valid = FALSE;
+	pic->shown = NULL;
 	pic->data = NULL;
 }
 
+/**
+ * 更新图片的呈现内容
+ * 图片缩小到适合窗口的尺寸显示时，背景改用预先缩小好的图像，绘制时不必再
+ * 缩放原图，画质也更好；放大查看时仍然使用原图。
+ */
+static void UpdatePictureRendition( Picture pic )
+{
+	int width, height;
+	LCUI_Graph *image = pic->data, *old = NULL;
+
+	if( !pic->is_valid || !image || !Graph_IsValid( image ) ) {
+		return;
+	}
+	if( pic->scale <= pic->min_scale && pic->scale < 1.0 ) {
+		width = roundi( pic->data->width * pic->scale );
+		height = roundi( pic->data->height * pic->scale );
+		if( pic->rendition && (pic->rendition->width != width ||
+				       pic->rendition->height != height) ) {
+			old = pic->rendition;
+			pic->rendition = NULL;
+		}
+		if( !pic->rendition ) {
+			pic->rendition = Graph_New();
+			if( ImageScaler_Zoom( pic->data, pic->rendition, FALSE,
+					      width, height ) != 0 ) {
+				Graph_Delete( pic->rendition );
+				pic->rendition = NULL;
+			}
+		}
+		if( pic->rendition ) {
+			image = pic->rendition;
+		}
+	}
+	if( image != pic->shown ) {
+		pic->shown = image;
+		LCUI_PostSimpleTask( TaskForSetWidgetBackground,
+				     pic->view, image );
+	}
+	/* 任务按顺序执行，旧的图像在换上新的背景之后才释放 */
+	if( old ) {
+		LCUI_PostSimpleTask( TaskForDeleteGraph, old, NULL );
+	}
+}
+
 static int OpenPrevPicture( void )
 {
 	Picture pic;
@@ -647,6 +709,7 @@ static void DirectSetPictureScale( Picture pic, double scale )
 	SetStyle( sheet, key_background_size_height, height, px );
 	Widget_UpdateStyle( pic->view, FALSE );
 	UpdatePicturePosition( pic );
+	UpdatePictureRendition( pic );
 	if( pic == this_view.picture ) {
 		UpdateZoomButtons();
 		UpdateSwitchButtons();
@@ -1034,11 +1097,15 @@ static Picture CreatePicture( void )
 {
 	ASSIGN( pic, Picture );
 	pic->timer = 0;
+	pic->request = 0;
 	pic->file = NULL;
 	pic->is_valid = FALSE;
 	pic->is_loading = FALSE;
+	pic->is_canceled = FALSE;
 	pic->file_for_load = NULL;
 	pic->data = Graph_New();
+	pic->rendition = NULL;
+	pic->shown = NULL;
 	pic->view = LCUIWidget_New( "picture" );
 	pic->min_scale = pic->scale = 1.0;
 	Widget_Append( this_view.view_pictures, pic->view );
@@ -1061,6 +1128,10 @@ static void DeletePicture( Picture pic )
 		Graph_Delete( pic->data );
 		pic->data = NULL;
 	}
+	if( pic->rendition ) {
+		Graph_Delete( pic->rendition );
+		pic->rendition = NULL;
+	}
 	if( pic->file_for_load ) {
 		free( pic->file_for_load );
 		pic->file_for_load = NULL;
@@ -1085,6 +1156,16 @@ static void SetPicture( Picture pic, const wchar_t *file )
 		free( pic->file_for_load );
 		pic->file_for_load = NULL;
 	}
+	/* 正在加载的图片已经不需要了，取消加载 */
+	LCUIMutex_Lock( &pic->mutex );
+	if( pic->is_loading && pic->file && 
+	    (!file || wcscmp( pic->file, file ) != 0) ) {
+		FileStorage_Cancel( pic->storage, pic->request );
+		pic->is_canceled = TRUE;
+		free( pic->file );
+		pic->file = NULL;
+	}
+	LCUIMutex_Unlock( &pic->mutex );
 	if( file ) {
 		len = wcslen( file ) + 1;
 		pic->file_for_load = malloc( sizeof( wchar_t ) * len );
@@ -1176,19 +1257,33 @@ static int LoadPictureAsync( Picture pic )
 	pic->file = wpath;
 	pic->is_valid = FALSE;
 	pic->is_loading = TRUE;
+	/* 预加载的图片走另一个连接，以较低的优先级加载 */
+	if( pic != this_view.picture ) {
+		storage = finder.storage_for_preload;
+	}
 	/* 异步请求加载图像内容 */
-	FileStorage_GetImage( storage, pic->file, OnPictureLoadDone, 
-			      OnPictureProgress, pic );
+	LCUIMutex_Lock( &pic->mutex );
+	pic->storage = storage;
+	pic->is_canceled = FALSE;
+	pic->request = FileStorage_GetImage( storage, pic->file,
+					     OnPictureLoadDone, 
+					     OnPictureProgress, pic );
+	LCUIMutex_Unlock( &pic->mutex );
 	return 0;
 }
 
 /** 等待图片加载完成 */
 static void WaitPictureLoadDone( Picture pic )
 {
+	LCUI_BOOL canceled;
+
 	LCUIMutex_Lock( &pic->mutex );
 	while( pic->is_loading && this_view.is_working ) {
 		LCUICond_TimedWait( &pic->cond, &pic->mutex, 1000 );
 	}
+	/* 被取消的加载没有结果，不能当作图片不受支持 */
+	canceled = pic->is_canceled;
+	pic->is_canceled = FALSE;
 	LCUIMutex_Unlock( &pic->mutex );
 	if( !this_view.is_working ) {
 		return;
@@ -1205,7 +1300,7 @@ static void WaitPictureLoadDone( Picture pic )
 		}
 		if( pic->is_valid ) {
 			Widget_Hide( this_view.tip_unsupport );
-		} else {
+		} else if( !canceled ) {
 			Widget_Show( this_view.tip_unsupport );
 		}
 		UpdateResetSizeButton();
@@ -1282,36 +1377,27 @@ static void OnBtnResetClick( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 	SetPictureScale( this_view.picture, scale );
 }
 
-static void OnOpenDir( FileStatus *status, FileStream *stream, void *data )
+static void OnOpenDir( FileStatus *status, FileStream stream, void *data )
 {
-	size_t len;
 	int i = 0, pos = -1;
-	char buf[PATH_LEN + 2];
+	FileDirEntry entry;
 	FileScanner fs = &this_view.scanner;
 
 	if( !status || status->type != FILE_TYPE_DIRECTORY || !stream ) {
 		return;
 	}
 	while( fs->is_running ) {
-		char *p;
 		FileIndex fidx;
 
-		buf[0] = 0;
-		p = FileStream_ReadLine( stream, buf, PATH_LEN + 2 );
-		if( p == NULL ) {
+		if( !FileStream_ReadDirEntry( stream, &entry ) ) {
 			break;
 		}
 		/* 忽略文件夹 */
-		if( buf[0] == 'd' ) {
-			continue;
-		}
-		len = strlen( buf );
-		if( len < 2 ) {
+		if( entry.type == FILE_TYPE_DIRECTORY ) {
 			continue;
 		}
-		buf[len - 1] = 0;
 		fidx = NEW( FileIndexRec, 1 );
-		fidx->name = DecodeUTF8( buf + 1 );
+		fidx->name = DecodeUTF8( entry.name );
 		fidx->node.data = fidx;
 		LinkedList_AppendNode( &fs->files, &fidx->node );
 		if( wcscmp( fidx->name, fs->file ) == 0 && !fs->iterator ) {
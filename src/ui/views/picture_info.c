@@ -323,7 +323,7 @@ void UI_SetPictureInfoView( const char *filepath )
 	int i, n;
 	DB_Tag *tags;
 	wchar_t *path, *dirpath;
-	int storage = finder.storage;
+	int storage = finder.storage_for_image;
 
 	path = DecodeUTF8( filepath );
 	dirpath = wgetdirname( path );
@@ -0,0 +1,219 @@
+﻿/* ***************************************************************************
+ * test_scaler.c -- image scaler kernel tests
+ *
+ * Copyright (C) 2017 by Liu Chao <lc-soft@live.cn>
+ *
+ * This file is part of the LC-Finder project, and may only be used, modified,
+ * and distributed under the terms of the GPLv2.
+ *
+ * By continuing to use, modify, or distribute this file you indicate that you
+ * have read the license and understand and accept it fully.
+ *
+ * The LC-Finder project is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+ *
+ * You should have received a copy of the GPLv2 along with this file. It is
+ * usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+/* ****************************************************************************
+ * test_scaler.c -- 图像缩放实现的测试
+ *
+ * 版权所有 (C) 2017 归属于 刘超 <lc-soft@live.cn>
+ *
+ * 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+ * 发布。
+ *
+ * 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+ *
+ * LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+ * 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+ *
+ * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+ * 没有，请查看：<http://www.gnu.org/licenses/>.
+ * ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/graph.h>
+#include "build.h"
+#include "image_scaler.h"
+
+#define TEST_RANDOM 0
+
+/** 测试用例 */
+typedef struct TestCaseRec_ {
+	int color_type;
+	int width;			/**< 源图像宽度 */
+	int height;			/**< 源图像高度 */
+	int dst_width;			/**< 目标宽度，不保持宽高比 */
+	int dst_height;			/**< 目标高度，不保持宽高比 */
+	/**
+	 * 图像内容，为 TEST_RANDOM 时使用随机内容，否则按棋盘格交替填充
+	 * value 和 value - 1，使每个区域的平均值正好在两个整数之间，用于
+	 * 检查舍入是否与整数除法一致
+	 */
+	int value;
+} TestCaseRec, *TestCase;
+
+static const char *test_kernels[] = { "sse2", "avx2" };
+
+static const TestCaseRec test_cases[] = {
+	/* 普通的缩小 */
+	{ COLOR_TYPE_ARGB, 640, 480, 160, 120, TEST_RANDOM },
+	{ COLOR_TYPE_RGB, 640, 480, 160, 120, TEST_RANDOM },
+	/* 奇数宽度，累加时有不足一组 SIMD 宽度的剩余部分 */
+	{ COLOR_TYPE_ARGB, 1, 33, 1, 3, TEST_RANDOM },
+	{ COLOR_TYPE_ARGB, 3, 17, 1, 2, TEST_RANDOM },
+	{ COLOR_TYPE_ARGB, 7, 9, 3, 4, TEST_RANDOM },
+	{ COLOR_TYPE_ARGB, 33, 31, 5, 7, TEST_RANDOM },
+	{ COLOR_TYPE_ARGB, 1023, 767, 97, 61, TEST_RANDOM },
+	{ COLOR_TYPE_RGB, 17, 9, 3, 4, TEST_RANDOM },
+	{ COLOR_TYPE_RGB, 1021, 763, 101, 59, TEST_RANDOM },
+	/* 很大的缩小倍数，每个区域的样本数量超过 SSE2 倒数的精度范围 */
+	{ COLOR_TYPE_ARGB, 2000, 1500, 5, 3, TEST_RANDOM },
+	{ COLOR_TYPE_RGB, 3001, 1001, 7, 3, TEST_RANDOM },
+	/* 平均值在两个整数之间，162 x 162 的区域曾因倒数误差得到 225 */
+	{ COLOR_TYPE_ARGB, 648, 324, 4, 2, 226 },
+	{ COLOR_TYPE_ARGB, 696, 348, 4, 2, 151 },
+	{ COLOR_TYPE_ARGB, 128, 128, 4, 4, 128 },
+	{ COLOR_TYPE_ARGB, 2002, 998, 7, 3, 97 }
+};
+
+static int CreateImage( LCUI_Graph *graph, TestCase tc )
+{
+	int x, y;
+	size_t i;
+	uchar_t *p;
+
+	Graph_Init( graph );
+	graph->color_type = tc->color_type;
+	if( Graph_Create( graph, tc->width, tc->height ) != 0 ) {
+		return -1;
+	}
+	if( tc->value == TEST_RANDOM ) {
+		for( i = 0; i < graph->mem_size; ++i ) {
+			graph->bytes[i] = (uchar_t)(rand() & 0xff);
+		}
+		return 0;
+	}
+	for( y = 0; y < tc->height; ++y ) {
+		p = graph->bytes + (size_t)y * graph->bytes_per_row;
+		for( x = 0; x < tc->width; ++x ) {
+			for( i = 0; i < graph->bytes_per_pixel; ++i, ++p ) {
+				*p = (uchar_t)(tc->value - ((x + y) & 1));
+			}
+		}
+	}
+	return 0;
+}
+
+static int Zoom( const char *kernel, const LCUI_Graph *src, LCUI_Graph *dst,
+		 TestCase tc )
+{
+	Graph_Init( dst );
+	if( ImageScaler_SetKernel( kernel ) != 0 ) {
+		return 1;
+	}
+	if( ImageScaler_Zoom( src, dst, FALSE, tc->dst_width,
+			      tc->dst_height ) != 0 ) {
+		return -1;
+	}
+	return 0;
+}
+
+/** 与普通实现的结果逐字节对比 */
+static int CheckResult( const char *kernel, TestCase tc,
+			const LCUI_Graph *result, const LCUI_Graph *expected )
+{
+	size_t i;
+
+	if( result->width != expected->width ||
+	    result->height != expected->height ||
+	    result->mem_size != expected->mem_size ) {
+		printf( "FAIL %s %dx%d -> %dx%d: size %ux%u, expected %ux%u\n",
+			kernel, tc->width, tc->height, tc->dst_width,
+			tc->dst_height, result->width, result->height,
+			expected->width, expected->height );
+		return -1;
+	}
+	for( i = 0; i < result->mem_size; ++i ) {
+		if( result->bytes[i] != expected->bytes[i] ) {
+			printf( "FAIL %s %dx%d -> %dx%d: byte %lu is %d, "
+				"expected %d\n", kernel, tc->width, tc->height,
+				tc->dst_width, tc->dst_height,
+				(unsigned long)i, result->bytes[i],
+				expected->bytes[i] );
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int RunTest( TestCase tc )
+{
+	size_t k;
+	int ret, failed = 0;
+	LCUI_Graph src, dst, expected;
+
+	if( CreateImage( &src, tc ) != 0 ) {
+		printf( "FAIL cannot create %dx%d image\n", tc->width,
+			tc->height );
+		return -1;
+	}
+	if( Zoom( "scalar", &src, &expected, tc ) != 0 ) {
+		printf( "FAIL scalar %dx%d -> %dx%d: zoom failed\n",
+			tc->width, tc->height, tc->dst_width, tc->dst_height );
+		Graph_Free( &src );
+		return -1;
+	}
+	for( k = 0; k < sizeof( test_kernels ) / sizeof( test_kernels[0] );
+	     ++k ) {
+		ret = Zoom( test_kernels[k], &src, &dst, tc );
+		if( ret > 0 ) {
+			continue;
+		}
+		if( ret < 0 ) {
+			printf( "FAIL %s %dx%d -> %dx%d: zoom failed\n",
+				test_kernels[k], tc->width, tc->height,
+				tc->dst_width, tc->dst_height );
+			failed = -1;
+		} else if( CheckResult( test_kernels[k], tc,
+					&dst, &expected ) != 0 ) {
+			failed = -1;
+		}
+		Graph_Free( &dst );
+	}
+	ImageScaler_SetKernel( NULL );
+	Graph_Free( &expected );
+	Graph_Free( &src );
+	return failed;
+}
+
+int main( void )
+{
+	size_t i, k;
+	int failed = 0;
+	size_t n = sizeof( test_cases ) / sizeof( test_cases[0] );
+
+	srand( 20170101 );
+	for( k = 0; k < sizeof( test_kernels ) / sizeof( test_kernels[0] );
+	     ++k ) {
+		if( ImageScaler_SetKernel( test_kernels[k] ) != 0 ) {
+			printf( "skip %s: not supported by this CPU\n",
+				test_kernels[k] );
+		}
+	}
+	ImageScaler_SetKernel( NULL );
+	for( i = 0; i < n; ++i ) {
+		if( RunTest( (TestCase)&test_cases[i] ) != 0 ) {
+			failed += 1;
+		}
+	}
+	printf( "%lu cases, %d failed\n", (unsigned long)n, failed );
+	return failed > 0 ? 1 : 0;
+}
@@ -4,6 +4,8 @@ set_warnings("all")
 set_config_h("include/config.h")
 add_cfuncs("3rdparty", "sqlite3", "sqlite3.h", "sqlite3_open")
 add_includedirs("include", ".repos/LCUI/include")
+add_defines("USE_LIBJPEG", "USE_LIBPNG")
+add_links("jpeg", "png")
 add_ldflags(".repos/LCUI/src/.libs/libLCUI.a")
 add_ldflags("-L.repos/LCUI/src/.libs")
 add_ldflags("$(shell pkg-config .repos/LCUI/lcui.pc --static --libs-only-l)")
@@ -22,3 +24,19 @@ target("lcfinder")
     set_kind("binary")
     add_files("src/**.c")
 
+
+target("bench_sync")
+    set_kind("binary")
+    set_default(false)
+    add_defines("LCFINDER_NO_MAIN")
+    add_files("src/**.c", "bench/bench_sync.c")
+
+target("bench_scaler")
+    set_kind("binary")
+    set_default(false)
+    add_files("src/lib/image_scaler.c", "bench/bench_scaler.c")
+
+target("test_scaler")
+    set_kind("binary")
+    set_default(false)
+    add_files("src/lib/image_scaler.c", "test/test_scaler.c")